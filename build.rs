@@ -1,16 +1,47 @@
 // cxx-async/build.rs
 
+use std::env;
+
+// Where to find a dependency, overridable from the environment, e.g.
+// `CPPCORO_DIR=/opt/cppcoro cargo run --release -- bench` on Linux.
+fn dir(var: &str, default: &str) -> String {
+    println!("cargo:rerun-if-env-changed={}", var);
+    env::var(var).unwrap_or_else(|_| default.to_owned())
+}
+
 fn main() {
     // FIXME(pcwalton): Find cppcoro and libunifex better?
-    println!("cargo:rustc-link-search=../../cppcoro/build/darwin_x64_clang12.0.5_debug/lib");
-    println!("cargo:rustc-link-search=../../libunifex/build/source");
-    println!("cargo:rustc-link-search=/usr/local/Cellar/folly/2021.09.06.00/lib");
-    println!("cargo:rustc-link-search=/usr/local/Cellar/glog/0.5.0/lib");
+    let cppcoro_dir = dir("CPPCORO_DIR", "../../cppcoro");
+    let cppcoro_lib_dir = dir(
+        "CPPCORO_LIB_DIR",
+        &format!("{}/build/darwin_x64_clang12.0.5_debug/lib", cppcoro_dir),
+    );
+    let libunifex_dir = dir("LIBUNIFEX_DIR", "../../libunifex");
+    let folly_lib_dir = dir("FOLLY_LIB_DIR", "/usr/local/Cellar/folly/2021.09.06.00/lib");
+    let glog_lib_dir = dir("GLOG_LIB_DIR", "/usr/local/Cellar/glog/0.5.0/lib");
+
+    println!("cargo:rustc-link-search={}", cppcoro_lib_dir);
+    println!("cargo:rustc-link-search={}/build/source", libunifex_dir);
+    println!("cargo:rustc-link-search={}", folly_lib_dir);
+    println!("cargo:rustc-link-search={}", glog_lib_dir);
     println!("cargo:rustc-link-lib=cppcoro");
     println!("cargo:rustc-link-lib=unifex");
     println!("cargo:rustc-link-lib=glog");
     println!("cargo:rustc-link-lib=folly");
-    cxx_build::bridge("src/main.rs")
+    let mut build = cxx_build::bridge("src/main.rs");
+    if env::var_os("CARGO_FEATURE_COUNTERS").is_some() {
+        build.define("CXX_ASYNC_COUNTERS", None);
+    }
+    if env::var_os("CARGO_FEATURE_TRACING").is_some() {
+        build.define("CXX_ASYNC_TRACING", None);
+    }
+    // The default folly is Homebrew's, which needs the shim.
+    if env::var_os("CARGO_FEATURE_FOLLY_RESUME_SHIM").is_some()
+        || env::var_os("FOLLY_LIB_DIR").is_none()
+    {
+        build.define("CXX_ASYNC_FOLLY_RESUME_SHIM", None);
+    }
+    build
         .file("src/cxx_async.cpp")
         .file("src/example_common.cpp")
         .file("src/cppcoro_example.cpp")
@@ -19,8 +50,8 @@ fn main() {
         .flag_if_supported("-std=gnu++2a")
         .flag_if_supported("-fcoroutines-ts")
         .include("include")
-        .include("../../cppcoro/include")
-        .include("../../libunifex/include")
-        .include("../../libunifex/build/include")
+        .include(format!("{}/include", cppcoro_dir))
+        .include(format!("{}/include", libunifex_dir))
+        .include(format!("{}/build/include", libunifex_dir))
         .compile("cxx-async");
 }
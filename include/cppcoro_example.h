@@ -6,16 +6,45 @@
 #include "cxx_async.h"
 #include "rust/cxx.h"
 
-#define EXAMPLE_SPLIT_LIMIT     32
-#define EXAMPLE_ARRAY_SIZE      16384
-
+struct RustFutureF64;
+struct RustLazyF64;
+struct RustMpscSenderF64;
 struct RustOneshotReceiverF64;
+struct RustOneshotReceiverPod;
 struct RustOneshotReceiverString;
+struct RustStreamReceiverF64;
 
 rust::Box<RustOneshotReceiverF64> cppcoro_dot_product();
+rust::Box<RustLazyF64> cppcoro_dot_product_lazy();
+double cppcoro_time_dot_product(size_t count, uint32_t threads, size_t grain,
+                                uint32_t iterations);
 void cppcoro_call_rust_dot_product();
+void cppcoro_call_rust_dot_product_on_pool();
+void cppcoro_call_rust_dot_product_on_cppcoro_pool();
 rust::Box<RustOneshotReceiverF64> cppcoro_not_product();
+rust::Box<RustLazyF64> cppcoro_not_product_lazy();
 void cppcoro_call_rust_not_product();
-rust::Box<RustOneshotReceiverString> cppcoro_ping_pong(int i);
+void cppcoro_call_rust_dot_product_inline();
+void cppcoro_call_rust_not_product_inline();
+rust::Box<RustOneshotReceiverString> cppcoro_ping_pong(int i, int depth);
+rust::Box<RustStreamReceiverF64> cppcoro_dot_product_chunks();
+void cppcoro_call_rust_dot_product_chunks();
+rust::Box<RustOneshotReceiverF64> cppcoro_sum_until_cancelled();
+void cppcoro_cancel_rust_pending_forever();
+void cppcoro_call_rust_pending_forever_with_deadline();
+rust::Box<RustOneshotReceiverF64> cppcoro_ready_value();
+rust::Box<RustOneshotReceiverF64> cppcoro_pending_value();
+rust::Box<RustLazyF64> cppcoro_ready_value_lazy();
+rust::Box<RustLazyF64> cppcoro_pending_value_lazy();
+double cppcoro_await_rust(int32_t kind);
+double cppcoro_await_rust_inline(int32_t kind);
+double cppcoro_await_rust_with_deadline(int32_t kind);
+double cppcoro_await_rust_at_priority(int32_t kind, uint8_t priority);
+double cppcoro_await_rust_concurrently(int32_t kind, int32_t count);
+double cppcoro_join_rust(int32_t kind, int32_t count);
+double cppcoro_when_all_rust(int32_t kind, int32_t count);
+void cppcoro_produce_mpsc(rust::Box<RustMpscSenderF64> sender,
+                          int32_t producers, int32_t items);
+rust::Box<RustOneshotReceiverPod> cppcoro_pod_midpoint();
 
 #endif
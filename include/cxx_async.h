@@ -4,24 +4,212 @@
 #define CXX_ASYNC_CXX_ASYNC_H
 
 #include "rust/cxx.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <exception>
 #include <experimental/coroutine>
+#include <functional>
+#include <memory>
+#include <new>
 #include <optional>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
 #include <unifex/await_transform.hpp>
+#include <unifex/get_stop_token.hpp>
+#include <unifex/inplace_stop_token.hpp>
 
-void rust_resume_cxx_coroutine(uint8_t *coroutine_address);
-void rust_destroy_cxx_coroutine(uint8_t *coroutine_address);
+#ifdef CXX_ASYNC_COUNTERS
+#include <typeinfo>
+#endif
+
+struct BridgeCounters;
+
+void rust_wake_cxx_coroutine(uint8_t *wake_target);
+void rust_start_lazy_cxx_coroutine(uint8_t *header);
+void rust_destroy_lazy_cxx_coroutine(uint8_t *header);
+void rust_construct_cxx_async_error(uint8_t *storage, int32_t code,
+                                    rust::Str message,
+                                    rust::String owned_message,
+                                    uint8_t *exception);
+rust::Str rust_cxx_exception_what(const size_t &exception);
+void rust_drop_cxx_exception(uint8_t *exception);
+void rust_retain_cxx_stop_state(uint8_t *stop_state);
+void rust_release_cxx_stop_state(uint8_t *stop_state);
+void rust_request_cxx_stop(uint8_t *stop_state);
+void rust_expire_cxx_timer(uint8_t *target);
+rust::Vec<BridgeCounters> cxx_bridge_counters();
+
+// Error codes that the bridge assigns. Applications pick their own codes for
+// everything else. Keep in sync with `ERROR_*` in main.rs.
+constexpr int32_t RUST_ERROR_UNSPECIFIED = 0;
+constexpr int32_t RUST_ERROR_CXX_EXCEPTION = -1;
+constexpr int32_t RUST_ERROR_CANCELLED = -2;
+constexpr int32_t RUST_ERROR_TIMED_OUT = -3;
+constexpr int32_t RUST_ERROR_LAYOUT_MISMATCH = -4;
+
+// Rust moves a `std::exception_ptr` by copying its bits and zeroing the source,
+// which holds for libstdc++'s and libc++'s, a single pointer that's null when
+// empty. See `CxxException` in main.rs.
+static_assert(sizeof(std::exception_ptr) == sizeof(size_t));
+
+// An error crossing the bridge: a code, a message, and, for errors that started
+// as C++ exceptions, the exception itself, so that awaiting the error from C++
+// rethrows the original. Messages are either string literals or Rust strings
+// handed over whole, so errors cross without allocating.
+class RustError {
+  int32_t m_code;
+  rust::Str m_message;
+  rust::String m_owned_message;
+  std::exception_ptr m_exception;
+
+  // For errors from Rust, whose borrowed messages are `&'static str`s.
+  RustError(int32_t code, rust::Str message, rust::String &&owned_message,
+            std::exception_ptr &&exception) noexcept
+      : m_code(code), m_message(message),
+        m_owned_message(std::move(owned_message)),
+        m_exception(std::move(exception)) {}
+  friend void rust_construct_cxx_async_error(uint8_t *storage, int32_t code,
+                                             rust::Str message,
+                                             rust::String owned_message,
+                                             uint8_t *exception);
+
+public:
+  // Only string literals are borrowed; any other message has to be handed over
+  // as a `rust::String`.
+  template <size_t N>
+  RustError(int32_t code, const char (&message)[N]) noexcept
+      : m_code(code), m_message(message, N - 1) {}
+  RustError(int32_t code, rust::String message) noexcept
+      : m_code(code), m_owned_message(std::move(message)) {}
+  explicit RustError(std::exception_ptr exception,
+                     int32_t code = RUST_ERROR_CXX_EXCEPTION) noexcept
+      : m_code(code), m_exception(std::move(exception)) {}
+
+  int32_t code() const noexcept { return m_code; }
+  // The message, or, for a C++ exception, its `what()`.
+  rust::Str message() const;
+  const std::exception_ptr &exception() const noexcept { return m_exception; }
 
-// Forward declare a libunifex interoperability class so that we can friend it.
-template <typename Channel, typename UnifexReceiver> class RustOperation;
+  // Throws the carried exception as it was, or else a `RustAsyncError`.
+  [[noreturn]] void raise() &&;
+  // Like `raise`, but returns the exception rather than throwing it.
+  std::exception_ptr to_exception_ptr() &&;
+
+  // Calls a Rust sender's `send` or `fail` with `(code, message, exception)`.
+  // Rust moves the exception out.
+  template <typename Send> decltype(auto) send_to_rust(Send &&send) noexcept;
+};
 
 class RustAsyncError : public std::exception {
-  std::string m_what;
+  RustError m_error;
+  // `what()` needs a NUL-terminated copy of the message, made on first use.
+  mutable std::string m_what;
+
+public:
+  explicit RustAsyncError(RustError &&error) noexcept
+      : m_error(std::move(error)) {}
+
+  const RustError &error() const noexcept { return m_error; }
+  int32_t code() const noexcept { return m_error.code(); }
+  const char *what() const noexcept override;
+};
+
+[[noreturn]] inline void RustError::raise() && {
+  if (m_exception)
+    std::rethrow_exception(m_exception);
+  throw RustAsyncError(std::move(*this));
+}
+
+inline std::exception_ptr RustError::to_exception_ptr() && {
+  if (m_exception)
+    return m_exception;
+  return std::make_exception_ptr(RustAsyncError(std::move(*this)));
+}
+
+template <typename Send>
+decltype(auto) RustError::send_to_rust(Send &&send) noexcept {
+  // Rust can only borrow static messages, so an owned one travels inside an
+  // exception. That allocates, but only errors that came from Rust and are
+  // being passed back have one.
+  if (!m_owned_message.empty() && !m_exception)
+    m_exception = std::make_exception_ptr(RustAsyncError(RustError(*this)));
+  return send(m_code, m_message,
+              m_exception ? reinterpret_cast<uint8_t *>(&m_exception)
+                          : nullptr);
+}
+
+// Thrown when awaiting a Rust receiver whose sender was dropped without
+// sending, which is how cancellation shows up.
+class RustAsyncCancelled : public std::exception {
+public:
+  const char *what() const noexcept { return "Cancelled (sender dropped)"; }
+};
+
+// A stop source shared between a C++ coroutine that returns a Rust receiver and
+// the Rust waker that requests a stop once that receiver is dropped or
+// cancelled. It's reference counted because the waker may outlive the
+// coroutine.
+class RustStopState {
+  std::atomic<size_t> m_ref_count;
+  unifex::inplace_stop_source m_source;
 
 public:
-  RustAsyncError(std::string &&what) : m_what(std::move(what)) {}
+  RustStopState() : m_ref_count(1), m_source() {}
+  RustStopState(const RustStopState &) = delete;
+  void operator=(const RustStopState &) = delete;
+
+  void retain() noexcept { m_ref_count.fetch_add(1, std::memory_order_relaxed); }
+  void release() noexcept {
+    if (m_ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete this;
+  }
+
+  void request_stop() noexcept { m_source.request_stop(); }
+  unifex::inplace_stop_token get_token() noexcept {
+    return m_source.get_token();
+  }
+};
+
+// `co_await rust_current_stop_token()` in a coroutine that returns a Rust
+// receiver yields a `unifex::inplace_stop_token` that's stopped once Rust drops
+// or cancels the receiver. libunifex senders awaited in the coroutine see the
+// same token through `unifex::get_stop_token`.
+struct RustCurrentStopToken {};
+inline RustCurrentStopToken rust_current_stop_token() noexcept { return {}; }
 
-  const char *what() const noexcept { return m_what.c_str(); }
+// How urgently to run something queued on the shared pool or resumed through a
+// `RustRunQueue`. Keep in sync with `Priority` in pool.rs.
+enum class RustPriority : uint8_t {
+  High = 0,
+  Normal = 1,
+  Low = 2,
+};
+constexpr size_t RUST_PRIORITY_LEVELS = 3;
+
+// `co_await rust_set_priority(RustPriority::High)` in a coroutine that returns
+// a Rust receiver gives the coroutine's later awaits of Rust that priority,
+// which a `RustRunQueue` they resume through honours. The default is `Normal`.
+struct RustSetPriority {
+  RustPriority priority;
+};
+inline RustSetPriority rust_set_priority(RustPriority priority) noexcept {
+  return {priority};
+}
+
+template <typename T> class RustReadyAwaiter {
+  T m_value;
+
+public:
+  RustReadyAwaiter(T &&value) : m_value(std::move(value)) {}
+  bool await_ready() const noexcept { return true; }
+  void await_suspend(std::experimental::coroutine_handle<void>) noexcept {}
+  T await_resume() { return std::move(m_value); }
 };
 
 // Given a channel type, fetches the receiver type.
@@ -44,9 +232,9 @@ using RustOneshotChannelFor =
 // This extracts the type of the `value` parameter from the `send` method using
 // the technique described here: https://stackoverflow.com/a/28033314
 template <typename Fn> struct RustOneshotGetResultTypeFromSendFn;
-template <typename Sender, typename TheResult, typename TheError>
-struct RustOneshotGetResultTypeFromSendFn<void (Sender::*)(const TheResult *,
-                                                           TheError) noexcept> {
+template <typename Sender, typename TheResult, typename TheMessage>
+struct RustOneshotGetResultTypeFromSendFn<uint8_t *(Sender::*)(
+    const TheResult *, int32_t, TheMessage, uint8_t *) noexcept> {
   typedef TheResult Result;
 };
 
@@ -56,6 +244,36 @@ using RustOneshotResultFor = typename RustOneshotGetResultTypeFromSendFn<
 
 template <typename Channel> struct RustOneshotChannelTraits {};
 
+// Streams use the same channel/sender/receiver layout as oneshots, so the
+// helpers above work for them too.
+template <typename Channel>
+using RustStreamReceiverFor = RustOneshotReceiverFor<Channel>;
+template <typename Channel>
+using RustStreamSenderFor = RustOneshotSenderFor<Channel>;
+template <typename Receiver>
+using RustStreamChannelFor = RustOneshotChannelFor<Receiver>;
+
+// Given a stream channel type, fetches the item type, in the same way as
+// `RustOneshotResultFor`.
+template <typename Fn> struct RustStreamGetItemTypeFromSendFn;
+template <typename Sender, typename TheItem>
+struct RustStreamGetItemTypeFromSendFn<int32_t (Sender::*)(
+    const TheItem *, uint8_t *) noexcept> {
+  typedef TheItem Item;
+};
+
+template <typename Channel>
+using RustStreamItemFor = typename RustStreamGetItemTypeFromSendFn<
+    decltype(&RustStreamSenderFor<Channel>::send)>::Item;
+
+// Stream senders have a `close` method; oneshot senders don't.
+template <typename Channel, typename = void>
+struct RustIsStreamChannel : std::false_type {};
+template <typename Channel>
+struct RustIsStreamChannel<
+    Channel, std::void_t<decltype(&RustStreamSenderFor<Channel>::close)>>
+    : std::true_type {};
+
 template<typename T>
 union ManuallyDrop {
   T m_value;
@@ -69,143 +287,1808 @@ void forget(T &&value) {
   ManuallyDrop manually_drop(std::move(value));
 }
 
-template <typename Channel> class RustOneshotAwaiter {
-  template <typename AnotherChannel, typename UnifexReceiver>
-  friend class RustOperation;
+// The values that the Rust `recv` methods return.
+enum class RustRecvResult : uint8_t {
+  Pending = 0,
+  Ready = 1,
+  Error = 2,
+  Done = 3,
+  Cancelled = 4,
+};
 
-  typedef RustOneshotReceiverFor<Channel> Receiver;
-  typedef RustOneshotResultFor<Channel> Result;
+// The values that the Rust `send` methods of streams and MPSC channels return.
+enum class RustSendResult : int32_t {
+  Pending = 0,
+  Ready = 1,
+  Closed = 2,
+};
+
+// What the C++ side of the bridge counts, per channel type, when built with
+// `CXX_ASYNC_COUNTERS` (that is, `--features counters`). The Rust side counts
+// the rest; `rust_bridge_counters()` returns both. See counters.rs.
+enum class RustCounter : uint8_t {
+  // Awaits of Rust receivers and streams, and how many didn't suspend.
+  Awaits,
+  ReadyAwaits,
+  // Resumptions after Rust woke us, and the total nanoseconds between the
+  // wake and the resumption.
+  Wakes,
+  WakeToResumeNs,
+  // Coroutine frames destroyed without running to completion.
+  DestroyedUnresumed,
+  // Coroutine frames allocated.
+  Allocations,
+  Count,
+};
+
+// For counting things that don't belong to any one channel type.
+struct RustAnyChannel {};
+
+#ifdef CXX_ASYNC_COUNTERS
+
+// One thread's counters for one channel type. Only the owning thread writes
+// them, so a plain load and store is enough; `cxx_bridge_counters()` reads
+// them from other threads.
+class RustThreadCounters {
+  friend rust::Vec<BridgeCounters> cxx_bridge_counters();
+
+  std::atomic<uint64_t> m_values[static_cast<size_t>(RustCounter::Count)];
+  const std::type_info &m_channel;
+  RustThreadCounters *m_next;
+
+public:
+  // Registers and retires the counters with `cxx_bridge_counters()`.
+  explicit RustThreadCounters(const std::type_info &channel);
+  ~RustThreadCounters();
+  RustThreadCounters(const RustThreadCounters &) = delete;
+  void operator=(const RustThreadCounters &) = delete;
+
+  void add(RustCounter counter, uint64_t amount) noexcept {
+    std::atomic<uint64_t> &value = m_values[static_cast<size_t>(counter)];
+    value.store(value.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+  }
+};
+
+template <typename Channel>
+inline void rust_count(RustCounter counter, uint64_t amount = 1) noexcept {
+  thread_local RustThreadCounters counters(typeid(Channel));
+  counters.add(counter, amount);
+}
+
+inline uint64_t rust_counter_clock() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+#else
+
+template <typename Channel>
+inline void rust_count(RustCounter, uint64_t = 1) noexcept {}
+
+#endif
+
+// Frames for the bridge's coroutines come from per-thread free lists of
+// recently freed frames of the same size class, since they're short-lived and
+// their sizes repeat. A frame may be freed on a different thread than the one
+// that allocated it. See cxx_async.cpp.
+void *rust_allocate_frame(size_t size);
+void rust_deallocate_frame(void *frame, size_t size) noexcept;
+
+// Gives a promise type's coroutine frames pooled allocation, or, if the
+// coroutine's first parameters are `std::allocator_arg_t, const Allocator &`,
+// allocation from that allocator. Either way, a trailer after the frame records
+// how to free it.
+template <typename Channel> class RustFrameAllocation {
+  typedef void (*Deallocate)(void *frame, size_t size) noexcept;
+  typedef std::max_align_t Block;
+
+  static size_t trailer_offset(size_t size) noexcept {
+    return (size + alignof(Deallocate) - 1) & ~(alignof(Deallocate) - 1);
+  }
+  static Deallocate &trailer(void *frame, size_t size) noexcept {
+    return *reinterpret_cast<Deallocate *>(static_cast<char *>(frame) +
+                                           trailer_offset(size));
+  }
+
+  static void deallocate_pooled(void *frame, size_t size) noexcept {
+    rust_deallocate_frame(frame, trailer_offset(size) + sizeof(Deallocate));
+  }
+
+  // Frames from a caller's allocator keep a copy of it after the trailer.
+  template <typename Allocator>
+  static size_t allocator_offset(size_t size) noexcept {
+    return (trailer_offset(size) + sizeof(Deallocate) + alignof(Allocator) -
+            1) &
+           ~(alignof(Allocator) - 1);
+  }
+  template <typename Allocator> static size_t block_count(size_t size) noexcept {
+    return (allocator_offset<Allocator>(size) + sizeof(Allocator) +
+            sizeof(Block) - 1) /
+           sizeof(Block);
+  }
+  template <typename Allocator> static Allocator *stored(void *frame,
+                                                         size_t size) noexcept {
+    return reinterpret_cast<Allocator *>(static_cast<char *>(frame) +
+                                         allocator_offset<Allocator>(size));
+  }
+
+  template <typename Allocator>
+  static void deallocate_with(void *frame, size_t size) noexcept {
+    Allocator allocator(std::move(*stored<Allocator>(frame, size)));
+    stored<Allocator>(frame, size)->~Allocator();
+    std::allocator_traits<Allocator>::deallocate(
+        allocator, static_cast<Block *>(frame), block_count<Allocator>(size));
+  }
+
+public:
+  static void *operator new(size_t size) {
+    rust_count<Channel>(RustCounter::Allocations);
+    void *frame =
+        rust_allocate_frame(trailer_offset(size) + sizeof(Deallocate));
+    trailer(frame, size) = deallocate_pooled;
+    return frame;
+  }
+
+  template <typename Allocator, typename... Args>
+  static void *operator new(size_t size, std::allocator_arg_t,
+                            const Allocator &allocator, const Args &...) {
+    typedef typename std::allocator_traits<
+        Allocator>::template rebind_alloc<Block>
+        BlockAllocator;
+    rust_count<Channel>(RustCounter::Allocations);
+    BlockAllocator block_allocator(allocator);
+    void *frame = std::allocator_traits<BlockAllocator>::allocate(
+        block_allocator, block_count<BlockAllocator>(size));
+    trailer(frame, size) = deallocate_with<BlockAllocator>;
+    new (stored<BlockAllocator>(frame, size))
+        BlockAllocator(std::move(block_allocator));
+    return frame;
+  }
+
+  static void operator delete(void *frame, size_t size) noexcept {
+    trailer(frame, size)(frame, size);
+  }
+};
 
-  enum class RecvResult {
-    Pending = 0,
-    Ready = 1,
-    Error = 2,
+// A fire-and-forget coroutine, for driving awaits from plain code.
+class RustDetachedTask {
+public:
+  class promise_type : public RustFrameAllocation<RustAnyChannel> {
+  public:
+    RustDetachedTask get_return_object() noexcept { return {}; }
+    std::experimental::suspend_never initial_suspend() const noexcept {
+      return {};
+    }
+    std::experimental::suspend_never final_suspend() const noexcept {
+      return {};
+    }
+    void unhandled_exception() noexcept {
+      // Callers catch exceptions themselves.
+      std::terminate();
+    }
+    void return_void() noexcept {}
   };
+};
 
-  rust::Box<Receiver> m_receiver;
-  std::optional<Result> m_result;
-  std::optional<RustAsyncError> m_error;
-
-  // Tries to receive a value. If a value is ready, this method places it in
-  // `m_result` and returns true. If no value is ready, this method returns
-  // false.
-  //
-  // If `next` is supplied, this method ensures that it will be called when a
-  // value becomes ready. If the value is available right now, then this method
-  // calls `next` immediately.
-  RecvResult try_recv(
-      std::optional<std::experimental::coroutine_handle<void>> next =
-          std::optional<std::experimental::coroutine_handle<void>>()) noexcept {
-    uint8_t *coroutine_address = nullptr;
-    if (next)
-      coroutine_address = reinterpret_cast<uint8_t *>(next->address());
-
-    ManuallyDrop<Result> maybe_result;
-    std::string error;
-    auto ready = static_cast<RecvResult>(
-        m_receiver->recv(&maybe_result.m_value, error, coroutine_address));
-    switch (ready) {
-    case RecvResult::Ready:
-      m_result = std::move(maybe_result.m_value);
-      maybe_result.m_value.~Result();
-      if (next)
-        (*next)();
-      break;
-    case RecvResult::Error:
-      m_error = RustAsyncError(std::move(error));
-      if (next)
-        (*next)();
-      break;
-    case RecvResult::Pending:
-      break;
+class RustExecutor;
+
+// What a Rust waker wakes: a suspended coroutine, plus where to resume it.
+// Awaiters embed one of these and hand Rust its address in place of the
+// coroutine's. A target is good for one wake.
+class RustWakeTarget {
+  friend class RustRunQueue;
+
+  std::experimental::coroutine_handle<void> m_coroutine;
+  union {
+    // Where to resume, or null to resume inline on the waking Rust thread.
+    RustExecutor *m_executor;
+    // Once the target is queued on a `RustRunQueue`, the entry queued before
+    // it. The executor isn't needed anymore by then.
+    RustWakeTarget *m_next;
+  };
+  RustPriority m_priority;
+#ifdef CXX_ASYNC_COUNTERS
+  // When Rust woke us, or zero if it hasn't.
+  uint64_t m_woken_at = 0;
+#endif
+
+public:
+  RustWakeTarget() noexcept
+      : m_coroutine(), m_executor(nullptr), m_priority(RustPriority::Normal) {}
+
+  void set_executor(RustExecutor *executor) noexcept { m_executor = executor; }
+  void set_priority(RustPriority priority) noexcept { m_priority = priority; }
+
+  // Returns what to pass to Rust in order to wake `coroutine`.
+  uint8_t *prepare(std::experimental::coroutine_handle<void> coroutine) noexcept {
+    m_coroutine = coroutine;
+    return reinterpret_cast<uint8_t *>(this);
+  }
+
+  std::experimental::coroutine_handle<void> coroutine() const noexcept {
+    return m_coroutine;
+  }
+
+  inline void wake() noexcept;
+  inline std::experimental::coroutine_handle<void> transfer() noexcept;
+  void resume() noexcept { m_coroutine.resume(); }
+
+  // Called once the coroutine is running again, to count the wakeup.
+  template <typename Channel> void count_resume() noexcept {
+#ifdef CXX_ASYNC_COUNTERS
+    if (m_woken_at) {
+      rust_count<Channel>(RustCounter::Wakes);
+      rust_count<Channel>(RustCounter::WakeToResumeNs,
+                          rust_counter_clock() - m_woken_at);
+      m_woken_at = 0;
     }
-    return ready;
+#endif
   }
+};
 
+// Somewhere that coroutines woken by Rust can resume, so that a Rust thread
+// pool worker doesn't end up running the rest of the C++ coroutine. An
+// executor must call `resume()` on every target it's given, exactly once.
+class RustExecutor {
 public:
-  RustOneshotAwaiter(rust::Box<Receiver> &&receiver)
-      : m_receiver(std::move(receiver)), m_result() {}
+  virtual ~RustExecutor() = default;
+  virtual void execute(RustWakeTarget *target) noexcept = 0;
+};
 
-  bool await_ready() noexcept {
-    if (m_result || m_error)
-      return true;
-    RecvResult ready = try_recv();
-    return ready == RecvResult::Ready || ready == RecvResult::Error;
+void RustWakeTarget::wake() noexcept {
+#ifdef CXX_ASYNC_COUNTERS
+  m_woken_at = rust_counter_clock();
+#endif
+  if (m_executor)
+    m_executor->execute(this);
+  else
+    m_coroutine.resume();
+}
+
+// Like `wake`, but for symmetric transfer: returns the coroutine to resume
+// next, rather than resuming it from inside this call.
+std::experimental::coroutine_handle<void> RustWakeTarget::transfer() noexcept {
+#ifdef CXX_ASYNC_COUNTERS
+  m_woken_at = rust_counter_clock();
+#endif
+  if (!m_executor)
+    return m_coroutine;
+  m_executor->execute(this);
+  return std::experimental::noop_coroutine();
+}
+
+// A lock-free multi-producer queue of coroutines woken by Rust, with a list for
+// each priority. The first push into an empty list calls `post` with that
+// list's priority, which should arrange for `drain()` to run on the executor of
+// choice, ahead of lower priorities if the executor can; that drain then
+// resumes everything queued in the meantime, so a burst of wakeups costs one
+// trip through the executor. Since every drain takes every list, a low-priority
+// coroutine waits for at most one drain of any priority. Targets are linked
+// intrusively, so queueing never allocates. The queue must outlive every await
+// that uses it.
+class RustRunQueue : public RustExecutor {
+  std::atomic<RustWakeTarget *> m_heads[RUST_PRIORITY_LEVELS];
+  std::function<void(RustRunQueue &, RustPriority)> m_post;
+
+  // Resumes a batch taken from a list, oldest first.
+  static size_t resume_all(RustWakeTarget *batch) noexcept {
+    RustWakeTarget *oldest = nullptr;
+    while (batch) {
+      RustWakeTarget *next = batch->m_next;
+      batch->m_next = oldest;
+      oldest = batch;
+      batch = next;
+    }
+
+    size_t count = 0;
+    while (oldest) {
+      // Resuming may destroy the target, so step past it first.
+      RustWakeTarget *next = oldest->m_next;
+      oldest->resume();
+      oldest = next;
+      count++;
+    }
+    return count;
   }
 
-  void await_suspend(std::experimental::coroutine_handle<void> next) {
-    // FIXME(pcwalton): This can cause a SEGV!
-    try_recv(std::optional(std::move(next)));
+public:
+  explicit RustRunQueue(
+      std::function<void(RustRunQueue &, RustPriority)> post)
+      : m_post(std::move(post)) {
+    for (std::atomic<RustWakeTarget *> &head : m_heads)
+      head.store(nullptr, std::memory_order_relaxed);
   }
+  RustRunQueue(const RustRunQueue &) = delete;
+  void operator=(const RustRunQueue &) = delete;
 
-  Result await_resume() {
-    // One of these will be present if `await_ready` returned true.
-    if (m_result)
-      return *std::move(m_result);
-    if (m_error)
-      throw *std::move(m_error);
-
-    switch (try_recv()) {
-    case RecvResult::Ready:
-      return *std::move(m_result);
-    case RecvResult::Error:
-      throw *std::move(m_error);
-    case RecvResult::Pending:
+  void execute(RustWakeTarget *target) noexcept override {
+    // Once it's queued, a drain elsewhere may resume and destroy the target.
+    RustPriority priority = target->m_priority;
+    std::atomic<RustWakeTarget *> &list = m_heads[size_t(priority)];
+    RustWakeTarget *head = list.load(std::memory_order_relaxed);
+    do {
+      target->m_next = head;
+    } while (!list.compare_exchange_weak(head, target,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed));
+    if (!head)
+      m_post(*this, priority);
+  }
+
+  // Resumes everything queued so far, the highest priority first, and returns
+  // how many coroutines that was. Concurrent drains each take a separate batch.
+  size_t drain() noexcept {
+    RustWakeTarget *batches[RUST_PRIORITY_LEVELS];
+    for (size_t level = 0; level < RUST_PRIORITY_LEVELS; level++)
+      batches[level] =
+          m_heads[level].exchange(nullptr, std::memory_order_acquire);
+
+    size_t count = 0;
+    for (RustWakeTarget *batch : batches)
+      count += resume_all(batch);
+    return count;
+  }
+};
+
+// Work for the pool that Rust shares with C++ (see pool.rs). Embed one of these
+// in whatever should run there and pass it to `rust_pool_submit()`; a worker
+// then calls `run`, once per submission, taking higher priorities first. The
+// job must stay alive until then.
+class RustPoolJob {
+  void (*m_run)(RustPoolJob *job) noexcept;
+
+public:
+  explicit RustPoolJob(void (*run)(RustPoolJob *job) noexcept) noexcept
+      : m_run(run) {}
+  void run() noexcept { m_run(this); }
+};
+
+void rust_pool_submit(RustPoolJob *job,
+                      RustPriority priority = RustPriority::Normal) noexcept;
+
+// A scheduler for the shared pool: `co_await scheduler.schedule()` moves the
+// coroutine onto a pool worker, which is what cppcoro's `schedule_on` and
+// `resume_on` expect of a scheduler.
+class RustPoolScheduler {
+  RustPriority m_priority;
+
+  class ScheduleAwaiter : private RustPoolJob {
+    std::experimental::coroutine_handle<void> m_coroutine;
+    RustPriority m_priority;
+
+    static void resume(RustPoolJob *job) noexcept {
+      static_cast<ScheduleAwaiter *>(job)->m_coroutine.resume();
+    }
+
+  public:
+    explicit ScheduleAwaiter(RustPriority priority) noexcept
+        : RustPoolJob(resume), m_coroutine(), m_priority(priority) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::experimental::coroutine_handle<void> coroutine) noexcept {
+      m_coroutine = coroutine;
+      rust_pool_submit(this, m_priority);
+    }
+    void await_resume() const noexcept {}
+  };
+
+public:
+  explicit RustPoolScheduler(
+      RustPriority priority = RustPriority::Normal) noexcept
+      : m_priority(priority) {}
+  ScheduleAwaiter schedule() const noexcept {
+    return ScheduleAwaiter(m_priority);
+  }
+};
+
+// A run queue that resumes coroutines woken by Rust on the shared pool, a batch
+// per pool job, queued at the priority of the wakeup that posted it.
+class RustPoolRunQueue : public RustRunQueue, private RustPoolJob {
+  static void drain_job(RustPoolJob *job) noexcept {
+    static_cast<RustPoolRunQueue *>(job)->drain();
+  }
+
+public:
+  RustPoolRunQueue()
+      : RustRunQueue([this](RustRunQueue &, RustPriority priority) {
+          rust_pool_submit(this, priority);
+        }),
+        RustPoolJob(drain_job) {}
+};
+
+// Resumes coroutines woken by Rust on the shared pool.
+RustExecutor &rust_pool_executor();
+
+// Somewhere that Rust can spawn futures: pass its address to Rust's
+// `CxxSpawner::new` (see pool.rs), and `CxxAsync::via` runs futures here. It
+// must outlive every future spawned on it.
+class RustTaskExecutor {
+public:
+  virtual ~RustTaskExecutor() = default;
+  // Must arrange for `run(task)` to be called, once.
+  virtual void post(uint8_t *task) noexcept = 0;
+  static void run(uint8_t *task) noexcept;
+};
+
+// A value, or the error that Rust reported instead, for awaiting Rust without
+// exceptions; see `rust_try`.
+template <typename T> class RustExpected {
+  std::variant<T, RustError> m_outcome;
+
+public:
+  RustExpected(T &&value) : m_outcome(std::in_place_index<0>, std::move(value)) {}
+  RustExpected(RustError &&error) noexcept
+      : m_outcome(std::in_place_index<1>, std::move(error)) {}
+
+  bool has_value() const noexcept { return m_outcome.index() == 0; }
+  explicit operator bool() const noexcept { return has_value(); }
+
+  T &operator*() noexcept { return *std::get_if<0>(&m_outcome); }
+  T *operator->() noexcept { return std::get_if<0>(&m_outcome); }
+  // Returns the value, or throws as awaiting the receiver would have. Throwing
+  // moves the error out rather than copying it, so `error()` is empty after.
+  T &value() {
+    if (!has_value())
+      std::move(*std::get_if<1>(&m_outcome)).raise();
+    return **this;
+  }
+  const RustError &error() const noexcept {
+    return *std::get_if<1>(&m_outcome);
+  }
+};
+
+// Storage that a Rust `recv` call writes its outcome into directly: either the
+// value or the error, tagged by the result. Nothing is live while the result is
+// pending.
+template <typename T> class RustRecvSlot {
+  union {
+    T m_value;
+    RustError m_error;
+  };
+  RustRecvResult m_state;
+
+public:
+  RustRecvSlot() noexcept : m_state(RustRecvResult::Pending) {}
+
+  RustRecvSlot(RustRecvSlot &&other) noexcept(
+      std::is_nothrow_move_constructible_v<T>)
+      : m_state(other.m_state) {
+    switch (m_state) {
+    case RustRecvResult::Ready:
+      new (&m_value) T(std::move(other.m_value));
+      break;
+    case RustRecvResult::Error:
+      new (&m_error) RustError(std::move(other.m_error));
+      break;
+    default:
+      break;
+    }
+  }
+
+  ~RustRecvSlot() {
+    switch (m_state) {
+    case RustRecvResult::Ready:
+      m_value.~T();
+      break;
+    case RustRecvResult::Error:
+      m_error.~RustError();
+      break;
+    default:
       break;
     }
-    std::terminate();
+  }
+
+  RustRecvResult state() const noexcept { return m_state; }
+
+  // Polls `receiver`. If a waker was registered (that is, the result is
+  // pending), this doesn't touch the slot afterward, since the coroutine may
+  // already be running on another thread.
+  template <typename Receiver>
+  RustRecvResult recv(Receiver &receiver, uint8_t *wake_target) noexcept {
+    auto result = static_cast<RustRecvResult>(receiver.recv(
+        &m_value, reinterpret_cast<uint8_t *>(&m_error), wake_target));
+    if (result != RustRecvResult::Pending)
+      m_state = result;
+    return result;
+  }
+
+  // Moves the value out, or throws the error. The result must be ready, an
+  // error, or cancelled.
+  T take() {
+    if (m_state == RustRecvResult::Error)
+      std::move(m_error).raise();
+    if (m_state == RustRecvResult::Cancelled)
+      throw RustAsyncCancelled();
+    return std::move(m_value);
+  }
+
+  // Moves the error out, without throwing it. The result must be an error.
+  RustError take_error() noexcept { return std::move(m_error); }
+
+  // Like `take`, but returns errors, and cancellation as `RUST_ERROR_CANCELLED`,
+  // rather than throwing them.
+  RustExpected<T> take_expected() noexcept(
+      std::is_nothrow_move_constructible_v<T>) {
+    if (m_state == RustRecvResult::Error)
+      return RustExpected<T>(std::move(m_error));
+    if (m_state == RustRecvResult::Cancelled)
+      return RustExpected<T>(
+          RustError(RUST_ERROR_CANCELLED, "Cancelled (sender dropped)"));
+    return RustExpected<T>(std::move(m_value));
   }
 };
 
-template <typename Receiver>
-auto inline operator co_await(rust::Box<Receiver> &&receiver) noexcept {
-  return RustOneshotAwaiter<RustOneshotChannelFor<Receiver>>(
-      std::move(receiver));
-}
+template <typename Channel> class RustOneshotAwaiter {
+  typedef RustOneshotReceiverFor<Channel> Receiver;
+  typedef RustOneshotResultFor<Channel> Result;
 
-template <typename Channel> class RustOneshotPromise {
-  Channel m_channel;
+  rust::Box<Receiver> m_receiver;
+  RustRecvSlot<Result> m_slot;
+  RustWakeTarget m_wake_target;
+
+protected:
+  // Returns the slot, once the result is in.
+  RustRecvSlot<Result> &finish() noexcept {
+    m_wake_target.count_resume<Channel>();
+    // The slot is filled in already if `await_ready` returned true.
+    if (m_slot.state() == RustRecvResult::Pending &&
+        try_recv() == RustRecvResult::Pending)
+      std::terminate();
+    return m_slot;
+  }
+
+private:
+  // Tries to receive a value into `m_slot`. If `next` is supplied and the
+  // value isn't ready, Rust wakes `next` once it is.
+  RustRecvResult try_recv(
+      std::optional<std::experimental::coroutine_handle<void>> next =
+          std::optional<std::experimental::coroutine_handle<void>>()) noexcept {
+    uint8_t *wake_target = nullptr;
+    if (next)
+      wake_target = m_wake_target.prepare(*next);
+    return m_slot.recv(*m_receiver, wake_target);
+  }
 
 public:
-  RustOneshotPromise()
-      : m_channel(static_cast<RustOneshotReceiverFor<Channel> *>(nullptr)
-                      ->channel()) {}
+  RustOneshotAwaiter(rust::Box<Receiver> &&receiver)
+      : m_receiver(std::move(receiver)), m_slot(), m_wake_target() {}
 
-  rust::Box<RustOneshotReceiverFor<Channel>> get_return_object() noexcept {
-    return std::move(m_channel.receiver);
+  // Resumes on `executor` rather than inline on the Rust thread that completes
+  // the future. Must be called before the await starts.
+  void resume_via(RustExecutor *executor) noexcept {
+    m_wake_target.set_executor(executor);
   }
 
-  std::experimental::suspend_never initial_suspend() const noexcept {
-    return {};
+  // Puts the wakeup ahead of lower priorities wherever `resume_via` sends it
+  // to a `RustRunQueue`. Must be called before the await starts.
+  void set_priority(RustPriority priority) noexcept {
+    m_wake_target.set_priority(priority);
   }
-  std::experimental::suspend_never final_suspend() const noexcept { return {}; }
 
-  std::experimental::coroutine_handle<> unhandled_done() noexcept { return {}; }
+  // Asks Rust to drop the future that feeds this receiver. The await then most
+  // likely ends with `RustAsyncCancelled`. Unlike the other methods, this may
+  // be called from any thread, for example from a stop callback, as long as
+  // the awaiter is alive.
+  void request_cancel() noexcept { m_receiver->cancel(); }
 
-  void return_value(RustOneshotResultFor<Channel> &&value) {
-    m_channel.sender->send(&value, rust::Str());
-    forget(std::move(value));
+  // The trace span of the receiver's channel; see trace.rs.
+  uint64_t trace_span() const noexcept { return m_receiver->span(); }
+
+  bool await_ready() noexcept {
+    rust_count<Channel>(RustCounter::Awaits);
+    if (m_slot.state() == RustRecvResult::Pending &&
+        try_recv() == RustRecvResult::Pending)
+      return false;
+    rust_count<Channel>(RustCounter::ReadyAwaits);
+    return true;
   }
 
-  void unhandled_exception() noexcept {
-    try {
-      std::rethrow_exception(std::current_exception());
-    } catch (const std::exception &exception) {
-      m_channel.sender->send(nullptr, rust::Str(exception.what()));
-    } catch (...) {
-      m_channel.sender->send(nullptr, rust::Str("Unhandled C++ exception"));
-    }
+  // Returns false, resuming `next` without growing the stack, if the value
+  // turned up since `await_ready`. Otherwise the waker is registered, and Rust
+  // may resume `next` on another thread before this even returns, so this
+  // mustn't touch `this` after `try_recv`.
+  bool await_suspend(std::experimental::coroutine_handle<void> next) noexcept {
+    return try_recv(next) == RustRecvResult::Pending;
   }
 
-  template <typename Value> auto await_transform(Value &&value) noexcept {
-    return unifex::await_transform(*this, (Value &&) value);
+  Result await_resume() { return finish().take(); }
+};
+
+// Awaits a Rust receiver without throwing: errors, including cancellation,
+// come back in the `RustExpected`.
+template <typename Channel>
+class RustOneshotTryAwaiter : public RustOneshotAwaiter<Channel> {
+public:
+  using RustOneshotAwaiter<Channel>::RustOneshotAwaiter;
+
+  RustExpected<RustOneshotResultFor<Channel>> await_resume() noexcept(
+      std::is_nothrow_move_constructible_v<RustOneshotResultFor<Channel>>) {
+    return this->finish().take_expected();
   }
 };
 
-template <typename Receiver, typename... Args>
-struct std::experimental::coroutine_traits<rust::Box<Receiver>, Args...> {
-  typedef decltype(static_cast<Receiver *>(nullptr)->channel()) Channel;
-  using promise_type = RustOneshotPromise<Channel>;
+// Small trivially copyable values of any type, pods, all cross the bridge
+// through one channel type, packed into its `RustPodValue`; see pod.rs. These
+// take the value type as a parameter, since only the generated bridge header
+// names it. The layout tag records only size and alignment, so unpacking as a
+// different type of the same size and alignment, say a `double` as a
+// `uint64_t`, isn't caught.
+template <typename T> constexpr uint32_t rust_pod_layout() noexcept {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "pods must be trivially copyable");
+  static_assert(sizeof(T) <= 2 * sizeof(uint64_t) &&
+                    alignof(T) <= alignof(uint64_t),
+                "pods must fit in two words");
+  // Keep in sync with `CxxPod::LAYOUT` in pod.rs.
+  return uint32_t(sizeof(T) | alignof(T) << 16);
+}
+
+// Whether a pod struct's fields, given as member pointers, fill it with no
+// padding: `static_assert(rust_pod_is_packed(&PodPoint::x, &PodPoint::y))`.
+// `define_pod!` checks the same fields on the Rust side.
+template <typename T, typename... Fields>
+constexpr bool rust_pod_is_packed(Fields T::*...) noexcept {
+  return sizeof(T) == (sizeof(Fields) + ... + 0);
+}
+
+template <typename Value, typename T>
+Value rust_pod_pack(const T &value) noexcept {
+  uint64_t words[2] = {0, 0};
+  std::memcpy(words, &value, sizeof(T));
+  Value packed;
+  packed.lo = words[0];
+  packed.hi = words[1];
+  packed.layout = rust_pod_layout<T>();
+  return packed;
+}
+
+// Throws a `RustAsyncError` with `RUST_ERROR_LAYOUT_MISMATCH` if `packed`
+// wasn't packed from something the size and alignment of a `T`. Copies into raw
+// storage, as `std::bit_cast` would, since `T` needn't be default
+// constructible.
+template <typename T, typename Value> T rust_pod_unpack(const Value &packed) {
+  if (packed.layout != rust_pod_layout<T>())
+    RustError(RUST_ERROR_LAYOUT_MISMATCH, "Pod layout mismatch").raise();
+  uint64_t words[2] = {packed.lo, packed.hi};
+  alignas(T) unsigned char storage[sizeof(T)];
+  std::memcpy(storage, words, sizeof(T));
+  return *std::launder(reinterpret_cast<T *>(storage));
+}
+
+// Pod channels' values have these fields.
+template <typename Value, typename = void>
+struct RustIsPodValue : std::false_type {};
+template <typename Value>
+struct RustIsPodValue<Value,
+                      std::void_t<decltype(std::declval<Value &>().lo),
+                                  decltype(std::declval<Value &>().hi),
+                                  decltype(std::declval<Value &>().layout)>>
+    : std::true_type {};
+
+template <typename T, typename Channel>
+class RustPodAwaiter : public RustOneshotAwaiter<Channel> {
+  static_assert(RustIsPodValue<RustOneshotResultFor<Channel>>::value,
+                "not a pod channel");
+
+public:
+  using RustOneshotAwaiter<Channel>::RustOneshotAwaiter;
+
+  T await_resume() { return rust_pod_unpack<T>(this->finish().take()); }
+};
+
+// Usage: `PodPoint point = co_await rust_pod<PodPoint>(rust_function());`,
+// where `rust_function` returns a pod receiver.
+template <typename T, typename Receiver>
+auto inline rust_pod(rust::Box<Receiver> &&receiver) noexcept {
+  return RustPodAwaiter<T, RustOneshotChannelFor<Receiver>>(
+      std::move(receiver));
+}
+
+// Blocks a plain thread until a Rust waker wakes it, with no coroutine behind
+// it. `park` spins briefly, in case the wake is nearly there, and then sleeps on
+// a futex (elsewhere than Linux, `std::atomic::wait`) that the waker signals
+// directly. See cxx_async.cpp.
+class RustThreadParker : private RustExecutor {
+  std::atomic<uint32_t> m_state;
+  RustWakeTarget m_wake_target;
+
+  void execute(RustWakeTarget *target) noexcept override;
+
+public:
+  RustThreadParker() noexcept;
+  RustThreadParker(const RustThreadParker &) = delete;
+  void operator=(const RustThreadParker &) = delete;
+
+  // Returns what to pass to Rust as the wake target. Good for one wake, which
+  // `park` then waits for.
+  uint8_t *prepare() noexcept;
+  void park() noexcept;
+
+  template <typename Channel> void count_resume() noexcept {
+    m_wake_target.count_resume<Channel>();
+  }
+};
+
+// Usage: `double result = rust_block_on(rust_dot_product());`. Blocks the
+// calling thread until the receiver's result is in, and returns it or throws
+// like `co_await` does. For synchronous callers without a coroutine runtime of
+// their own. Don't call it on a thread that the Rust future needs in order to
+// finish, such as one of the shared pool's.
+template <typename Receiver>
+RustOneshotResultFor<RustOneshotChannelFor<Receiver>>
+rust_block_on(rust::Box<Receiver> receiver) {
+  typedef RustOneshotChannelFor<Receiver> Channel;
+  rust_count<Channel>(RustCounter::Awaits);
+  RustRecvSlot<RustOneshotResultFor<Channel>> slot;
+  if (slot.recv(*receiver, nullptr) != RustRecvResult::Pending) {
+    rust_count<Channel>(RustCounter::ReadyAwaits);
+    return slot.take();
+  }
+  RustThreadParker parker;
+  while (slot.recv(*receiver, parker.prepare()) == RustRecvResult::Pending)
+    parker.park();
+  parker.count_resume<Channel>();
+  return slot.take();
+}
+
+// Given an unspawned Rust future type, fetches the receiver type that spawning
+// it returns, and from that the result type.
+template <typename Future>
+using RustFutureReceiverFor =
+    typename decltype(static_cast<Future *>(nullptr)->spawn())::element_type;
+template <typename Future>
+using RustFutureResultFor =
+    RustOneshotResultFor<RustOneshotChannelFor<RustFutureReceiverFor<Future>>>;
+
+// Awaits an unspawned Rust future (see inline_future.rs) by polling it on the
+// awaiting thread. A future that's ready on the first poll never leaves this
+// thread, and costs no waker. Otherwise its waker brings us back to poll again,
+// on whatever thread woke it, and we resume the coroutine once a poll finds the
+// future done.
+template <typename Future> class RustFutureAwaiter : private RustExecutor {
+  typedef RustFutureResultFor<Future> Result;
+
+  rust::Box<Future> m_future;
+  RustRecvSlot<Result> m_slot;
+  // What the future's waker wakes. It points at the awaiting coroutine, with
+  // us as its executor, so that a wake polls rather than resumes.
+  RustWakeTarget m_poll_target;
+  // The awaiting coroutine, resumed once the future is done.
+  RustWakeTarget m_wake_target;
+
+  // Called on the thread that woke the future. Rust won't wake us again until
+  // this poll returns pending, and then this mustn't touch `this`, since the
+  // next poll may already be running elsewhere.
+  void execute(RustWakeTarget *) noexcept override {
+    uint8_t *poll_target = m_poll_target.prepare(m_wake_target.coroutine());
+    if (m_slot.recv(*m_future, poll_target) != RustRecvResult::Pending)
+      m_wake_target.wake();
+  }
+
+public:
+  explicit RustFutureAwaiter(rust::Box<Future> &&future)
+      : m_future(std::move(future)), m_slot(), m_poll_target(),
+        m_wake_target() {}
+
+  // Resumes on `executor` rather than on the thread whose wake finished the
+  // future. Must be called before the await starts.
+  void resume_via(RustExecutor *executor) noexcept {
+    m_wake_target.set_executor(executor);
+  }
+  void set_priority(RustPriority priority) noexcept {
+    m_wake_target.set_priority(priority);
+  }
+
+  bool await_ready() noexcept {
+    rust_count<Future>(RustCounter::Awaits);
+    if (m_slot.recv(*m_future, nullptr) == RustRecvResult::Pending)
+      return false;
+    rust_count<Future>(RustCounter::ReadyAwaits);
+    return true;
+  }
+
+  // Polls again with a waker. As in `RustOneshotAwaiter::await_suspend`, once
+  // the poll returns pending, the coroutine may resume on another thread before
+  // this returns.
+  bool await_suspend(std::experimental::coroutine_handle<void> next) noexcept {
+    m_wake_target.prepare(next);
+    // Set here rather than on construction, since the awaiter may move.
+    m_poll_target.set_executor(this);
+    return m_slot.recv(*m_future, m_poll_target.prepare(next)) ==
+           RustRecvResult::Pending;
+  }
+
+  Result await_resume() {
+    m_wake_target.count_resume<Future>();
+    return m_slot.take();
+  }
+};
+
+// Unspawned futures have a `spawn` method; receivers don't.
+template <typename Handle, typename = void> struct RustAwaiterForHandle {
+  typedef RustOneshotAwaiter<RustOneshotChannelFor<Handle>> Type;
+};
+template <typename Handle>
+struct RustAwaiterForHandle<Handle, std::void_t<decltype(&Handle::spawn)>> {
+  typedef RustFutureAwaiter<Handle> Type;
+};
+template <typename Handle>
+using RustAwaiterFor = typename RustAwaiterForHandle<Handle>::Type;
+
+template <typename Handle>
+auto inline operator co_await(rust::Box<Handle> &&handle) noexcept {
+  return RustAwaiterFor<Handle>(std::move(handle));
+}
+
+// Usage: `co_await rust_resume_via(run_queue, rust_function())`.
+template <typename Handle>
+auto inline rust_resume_via(RustExecutor &executor,
+                            rust::Box<Handle> &&handle) noexcept {
+  RustAwaiterFor<Handle> awaiter(std::move(handle));
+  awaiter.resume_via(&executor);
+  return awaiter;
+}
+
+// Usage: `co_await rust_resume_via(run_queue, rust_function(),
+// RustPriority::High)`.
+template <typename Handle>
+auto inline rust_resume_via(RustExecutor &executor, rust::Box<Handle> &&handle,
+                            RustPriority priority) noexcept {
+  RustAwaiterFor<Handle> awaiter(std::move(handle));
+  awaiter.resume_via(&executor);
+  awaiter.set_priority(priority);
+  return awaiter;
+}
+
+// Whether an awaiter takes a priority for its wakeup.
+template <typename Awaiter, typename = void>
+struct RustHasPriority : std::false_type {};
+template <typename Awaiter>
+struct RustHasPriority<
+    Awaiter, std::void_t<decltype(std::declval<Awaiter &>().set_priority(
+                 RustPriority::Normal))>> : std::true_type {};
+
+// Runs an unspawned Rust future on the shared pool, in parallel with the
+// caller, instead of polling it when it's awaited. Usage:
+// `auto receiver = rust_spawn(rust_function());`, then later
+// `co_await std::move(receiver);`.
+template <typename Future>
+auto inline rust_spawn(rust::Box<Future> &&future) {
+  return future->spawn();
+}
+
+// Usage: `RustExpected<double> result = co_await rust_try(rust_function());`.
+// Where errors are an ordinary outcome, this keeps them off the exception path,
+// which allocates.
+template <typename Receiver>
+auto inline rust_try(rust::Box<Receiver> &&receiver) noexcept {
+  return RustOneshotTryAwaiter<RustOneshotChannelFor<Receiver>>(
+      std::move(receiver));
+}
+
+// Resumes inline on the Rust thread that completes the future, even where the
+// framework would otherwise resume on the awaiting coroutine's executor. This
+// saves a trip through the executor, but the rest of the coroutine then runs
+// on a Rust thread.
+template <typename Handle>
+auto inline rust_resume_inline(rust::Box<Handle> &&handle) noexcept {
+  return RustAwaiterFor<Handle>(std::move(handle));
+}
+
+// Something for a timer on the shared timer wheel (see timer.rs) to expire.
+class RustTimerTarget {
+public:
+  virtual ~RustTimerTarget() = default;
+  // Called on the timer thread.
+  virtual void expire() noexcept = 0;
+};
+
+// Arms a timer that calls `target->expire()` once `timeout` has passed, unless
+// it's disarmed first. Both are O(1). Returns the timer, which is never zero.
+uint64_t rust_arm_timer(std::chrono::nanoseconds timeout,
+                        RustTimerTarget *target) noexcept;
+// Returns true if the timer hadn't fired. If it's firing, waits for `expire()`
+// to return first, unless `expire()` is what's disarming it.
+bool rust_disarm_timer(uint64_t timer) noexcept;
+
+// Awaits a Rust receiver until a deadline. If the deadline passes first, the
+// timer cancels the receiver, which drops the Rust future behind it, and the
+// await throws a `RustAsyncError` with `RUST_ERROR_TIMED_OUT`, unless the
+// result beat the cancellation. A result that's already there when the await
+// starts costs no timer.
+template <typename Channel>
+class RustDeadlineAwaiter : public RustOneshotAwaiter<Channel>,
+                            private RustTimerTarget {
+  typedef RustOneshotReceiverFor<Channel> Receiver;
+  typedef RustOneshotResultFor<Channel> Result;
+
+  std::chrono::steady_clock::time_point m_deadline;
+  uint64_t m_timer;
+  std::atomic<bool> m_expired;
+
+  void expire() noexcept override {
+    m_expired.store(true, std::memory_order_release);
+    this->request_cancel();
+  }
+
+  void disarm() noexcept {
+    if (m_timer != 0) {
+      rust_disarm_timer(m_timer);
+      m_timer = 0;
+    }
+  }
+
+public:
+  RustDeadlineAwaiter(rust::Box<Receiver> &&receiver,
+                      std::chrono::steady_clock::time_point deadline)
+      : RustOneshotAwaiter<Channel>(std::move(receiver)), m_deadline(deadline),
+        m_timer(0), m_expired(false) {}
+  // Only before the await starts.
+  RustDeadlineAwaiter(RustDeadlineAwaiter &&other) noexcept
+      : RustOneshotAwaiter<Channel>(std::move(other)),
+        m_deadline(other.m_deadline), m_timer(0), m_expired(false) {}
+  // The coroutine may be destroyed mid-await.
+  ~RustDeadlineAwaiter() { disarm(); }
+
+  // The timer is armed before the waker is registered, since once it is, the
+  // coroutine may resume and destroy us before this returns.
+  bool await_suspend(std::experimental::coroutine_handle<void> next) noexcept {
+    auto left = m_deadline - std::chrono::steady_clock::now();
+    m_timer = rust_arm_timer(
+        std::max(left, std::chrono::steady_clock::duration::zero()), this);
+    if (RustOneshotAwaiter<Channel>::await_suspend(next))
+      return true;
+    disarm();
+    return false;
+  }
+
+  Result await_resume() {
+    disarm();
+    RustRecvSlot<Result> &slot = this->finish();
+    if (slot.state() == RustRecvResult::Cancelled &&
+        m_expired.load(std::memory_order_acquire))
+      RustError(RUST_ERROR_TIMED_OUT, "Timed out").raise();
+    return slot.take();
+  }
+};
+
+// Usage: `co_await rust_deadline(std::chrono::milliseconds(50),
+// rust_function())`, or with a `std::chrono::steady_clock::time_point`.
+template <typename Receiver>
+auto inline rust_deadline(std::chrono::steady_clock::time_point deadline,
+                          rust::Box<Receiver> &&receiver) noexcept {
+  return RustDeadlineAwaiter<RustOneshotChannelFor<Receiver>>(
+      std::move(receiver), deadline);
+}
+
+template <typename Rep, typename Period, typename Receiver>
+auto inline rust_deadline(std::chrono::duration<Rep, Period> timeout,
+                          rust::Box<Receiver> &&receiver) noexcept {
+  return rust_deadline(
+      std::chrono::steady_clock::now() +
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              timeout),
+      std::move(receiver));
+}
+
+// Awaits a whole batch of Rust receivers at once, resuming the awaiting
+// coroutine once, when the last of them finishes, with their results in order.
+// Each receiver's waker counts down a shared counter instead of resuming
+// anything, so the batch costs one resumption rather than one per receiver.
+//
+// If a receiver fails, the await throws its error once the batch is done. With
+// `fail_fast`, the first failure also cancels the rest (see `request_cancel`),
+// so the batch finishes as soon as they've all dropped their futures.
+template <typename Channel> class RustJoinAwaiter : private RustExecutor {
+  typedef RustOneshotReceiverFor<Channel> Receiver;
+  typedef RustOneshotResultFor<Channel> Result;
+
+  std::vector<rust::Box<Receiver>> m_receivers;
+  std::vector<RustRecvSlot<Result>> m_slots;
+  // Rust wakes these, one per receiver. They all point at the awaiting
+  // coroutine, with us as their executor.
+  std::vector<RustWakeTarget> m_wake_targets;
+  // The awaiting coroutine, resumed once `m_remaining` reaches zero.
+  RustWakeTarget m_wake_target;
+  std::atomic<size_t> m_remaining;
+  std::atomic<bool> m_failed;
+  bool m_fail_fast;
+
+  // Called on the Rust thread that finished receiver `target`. Nothing else
+  // touches that receiver's slot while the coroutine is suspended.
+  void execute(RustWakeTarget *target) noexcept override {
+    size_t index = target - m_wake_targets.data();
+    finish(m_slots[index].recv(*m_receivers[index], nullptr));
+  }
+
+  void finish(RustRecvResult result) noexcept {
+    if (result == RustRecvResult::Error && m_fail_fast &&
+        !m_failed.exchange(true, std::memory_order_relaxed)) {
+      for (rust::Box<Receiver> &receiver : m_receivers)
+        receiver->cancel();
+    }
+    if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      m_wake_target.wake();
+  }
+
+public:
+  RustJoinAwaiter(std::vector<rust::Box<Receiver>> &&receivers, bool fail_fast)
+      : m_receivers(std::move(receivers)), m_slots(m_receivers.size()),
+        m_wake_targets(m_receivers.size()), m_wake_target(), m_remaining(0),
+        m_failed(false), m_fail_fast(fail_fast) {}
+  RustJoinAwaiter(const RustJoinAwaiter &) = delete;
+  void operator=(const RustJoinAwaiter &) = delete;
+
+  // Resumes on `executor` rather than inline on the Rust thread that finishes
+  // the last receiver. Must be called before the await starts.
+  void resume_via(RustExecutor *executor) noexcept {
+    m_wake_target.set_executor(executor);
+  }
+  void set_priority(RustPriority priority) noexcept {
+    m_wake_target.set_priority(priority);
+  }
+
+  // Picks up everything that's already finished, without registering wakers.
+  bool await_ready() noexcept {
+    rust_count<Channel>(RustCounter::Awaits, m_receivers.size());
+    size_t ready = 0;
+    for (size_t i = 0; i < m_receivers.size(); i++) {
+      if (m_slots[i].recv(*m_receivers[i], nullptr) != RustRecvResult::Pending)
+        ready++;
+    }
+    rust_count<Channel>(RustCounter::ReadyAwaits, ready);
+    return ready == m_receivers.size();
+  }
+
+  // Registers a waker with every receiver that's still pending. We hold one
+  // extra count while doing so, so that no wake can resume the coroutine
+  // before we're done here. Returns false if everything finished meanwhile.
+  bool await_suspend(std::experimental::coroutine_handle<void> next) noexcept {
+    m_wake_target.prepare(next);
+    m_remaining.store(m_receivers.size() + 1, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < m_receivers.size(); i++) {
+      RustRecvResult result = m_slots[i].state();
+      if (result == RustRecvResult::Pending) {
+        m_wake_targets[i].set_executor(this);
+        result = m_slots[i].recv(*m_receivers[i], m_wake_targets[i].prepare(next));
+        if (result == RustRecvResult::Pending)
+          continue;
+      }
+      finish(result);
+    }
+
+    return m_remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+  }
+
+  // Throws the first error, if any receiver failed, and otherwise returns the
+  // results in the order of the receivers.
+  std::vector<Result> await_resume() {
+    m_wake_target.count_resume<Channel>();
+    for (RustRecvSlot<Result> &slot : m_slots) {
+      if (slot.state() == RustRecvResult::Error)
+        slot.take();
+    }
+
+    std::vector<Result> results;
+    results.reserve(m_slots.size());
+    for (RustRecvSlot<Result> &slot : m_slots)
+      results.push_back(slot.take());
+    return results;
+  }
+};
+
+// Usage: `std::vector<double> results = co_await rust_join_all(receivers);`,
+// where `receivers` is any range of `rust::Box`es of the same receiver type.
+// The receivers are moved out of the range.
+template <typename Range>
+auto inline rust_join_all(Range &&receivers, bool fail_fast = false) {
+  typedef typename std::decay_t<decltype(*std::begin(receivers))>::element_type
+      Receiver;
+  std::vector<rust::Box<Receiver>> batch;
+  for (auto &receiver : receivers)
+    batch.push_back(std::move(receiver));
+  return RustJoinAwaiter<RustOneshotChannelFor<Receiver>>(std::move(batch),
+                                                           fail_fast);
+}
+
+template <typename Receiver>
+auto inline rust_join_all(std::vector<rust::Box<Receiver>> &&receivers,
+                          bool fail_fast = false) {
+  return RustJoinAwaiter<RustOneshotChannelFor<Receiver>>(std::move(receivers),
+                                                           fail_fast);
+}
+
+// Awaits the next item of a Rust stream. Resumes with the item, or with
+// `std::nullopt` once the stream has ended; throws if the stream failed.
+template <typename Channel> class RustStreamNextAwaiter {
+  typedef RustStreamReceiverFor<Channel> Receiver;
+  typedef RustStreamItemFor<Channel> Item;
+
+  Receiver &m_receiver;
+  RustRecvSlot<Item> m_slot;
+  RustWakeTarget m_wake_target;
+
+public:
+  RustStreamNextAwaiter(Receiver &receiver, RustExecutor *executor = nullptr)
+      : m_receiver(receiver), m_slot(), m_wake_target() {
+    m_wake_target.set_executor(executor);
+  }
+
+  bool await_ready() noexcept {
+    rust_count<Channel>(RustCounter::Awaits);
+    if (m_slot.recv(m_receiver, nullptr) == RustRecvResult::Pending)
+      return false;
+    rust_count<Channel>(RustCounter::ReadyAwaits);
+    return true;
+  }
+
+  bool await_suspend(std::experimental::coroutine_handle<void> next) noexcept {
+    return m_slot.recv(m_receiver, m_wake_target.prepare(next)) ==
+           RustRecvResult::Pending;
+  }
+
+  std::optional<Item> await_resume() {
+    m_wake_target.count_resume<Channel>();
+    // If we suspended, we were woken because something is ready now.
+    if (m_slot.state() == RustRecvResult::Pending &&
+        m_slot.recv(m_receiver, nullptr) == RustRecvResult::Pending)
+      std::terminate();
+    if (m_slot.state() == RustRecvResult::Done)
+      return std::nullopt;
+    return m_slot.take();
+  }
+};
+
+// Usage: `while (auto item = co_await rust_stream_next(receiver)) { ... }`
+template <typename Receiver>
+auto inline rust_stream_next(rust::Box<Receiver> &receiver) noexcept {
+  return RustStreamNextAwaiter<RustStreamChannelFor<Receiver>>(*receiver);
+}
+
+// Like the above, but resumes on `executor` when the item arrives later.
+template <typename Receiver>
+auto inline rust_stream_next(rust::Box<Receiver> &receiver,
+                             RustExecutor &executor) noexcept {
+  return RustStreamNextAwaiter<RustStreamChannelFor<Receiver>>(*receiver,
+                                                               &executor);
+}
+
+// Given an MPSC sender type, fetches the item type, in the same way as
+// `RustOneshotResultFor`.
+template <typename Fn> struct RustMpscGetItemTypeFromSendFn;
+template <typename Sender, typename TheItem>
+struct RustMpscGetItemTypeFromSendFn<int32_t (Sender::*)(
+    TheItem *, int32_t *, uint8_t *) noexcept> {
+  typedef TheItem Item;
+};
+
+template <typename Sender>
+using RustMpscItemFor =
+    typename RustMpscGetItemTypeFromSendFn<decltype(&Sender::send)>::Item;
+
+// Sends an item into a Rust MPSC channel (see mpsc.rs), one of many producers'
+// worth. While the channel is full, the item waits with Rust and the producer
+// suspends. The consumer moves waiting items into the channel as it makes room,
+// oldest first, and only then resumes their producers, so a resumed producer
+// never has to try again. The await returns false, dropping the item, if the
+// receiver has gone away.
+template <typename Sender> class RustMpscSendAwaiter {
+  typedef RustMpscItemFor<Sender> Item;
+
+  Sender &m_sender;
+  ManuallyDrop<Item> m_item;
+  // Written by Rust before it resumes us, if the item had to wait.
+  int32_t m_result;
+  // Whether Rust may have the item parked: from the time we offer to wait
+  // until we resume.
+  bool m_parked;
+  RustWakeTarget m_wake_target;
+
+  // Rust takes ownership of the item if this returns `Ready`, or, if it
+  // returns `Pending` with a wake target, once it writes `Ready` to `m_result`.
+  RustSendResult send(uint8_t *wake_target) noexcept {
+    return static_cast<RustSendResult>(
+        m_sender.send(&m_item.m_value, &m_result, wake_target));
+  }
+
+public:
+  RustMpscSendAwaiter(Sender &sender, Item &&item)
+      : m_sender(sender), m_item(std::move(item)),
+        m_result(static_cast<int32_t>(RustSendResult::Pending)),
+        m_parked(false), m_wake_target() {}
+
+  // Only valid before the await starts.
+  RustMpscSendAwaiter(RustMpscSendAwaiter &&other)
+      : m_sender(other.m_sender), m_item(std::move(other.m_item.m_value)),
+        m_result(other.m_result), m_parked(false), m_wake_target() {}
+  void operator=(const RustMpscSendAwaiter &) = delete;
+
+  // If the coroutine is destroyed mid-await, takes the item back so that Rust
+  // doesn't let it in later, unless Rust already has. Rust is then on its way
+  // to resume us, which destroying the coroutine races with, as for any await.
+  ~RustMpscSendAwaiter() {
+    if (m_parked)
+      m_result = m_sender.cancel_send(&m_item.m_value, &m_result);
+    if (static_cast<RustSendResult>(m_result) != RustSendResult::Ready)
+      m_item.m_value.~Item();
+  }
+
+  // Resumes on `executor` rather than inline on the consumer's thread, which
+  // would otherwise go on to run the rest of the producer. Must be called
+  // before the await starts.
+  void resume_via(RustExecutor *executor) noexcept {
+    m_wake_target.set_executor(executor);
+  }
+  void set_priority(RustPriority priority) noexcept {
+    m_wake_target.set_priority(priority);
+  }
+
+  bool await_ready() noexcept {
+    RustSendResult result = send(nullptr);
+    if (result == RustSendResult::Pending)
+      return false;
+    m_result = static_cast<int32_t>(result);
+    return true;
+  }
+
+  // Once the item is waiting, Rust may fill in `m_result` and resume `next` on
+  // another thread before this even returns, so this mustn't touch `this`
+  // after that.
+  bool await_suspend(std::experimental::coroutine_handle<void> next) noexcept {
+    m_parked = true;
+    RustSendResult result = send(m_wake_target.prepare(next));
+    if (result == RustSendResult::Pending)
+      return true;
+    m_parked = false;
+    m_result = static_cast<int32_t>(result);
+    return false;
+  }
+
+  bool await_resume() noexcept {
+    m_parked = false;
+    m_wake_target.count_resume<Sender>();
+    return static_cast<RustSendResult>(m_result) == RustSendResult::Ready;
+  }
+};
+
+// Usage: `bool sent = co_await rust_send(*sender, item);`, where `sender` is a
+// `rust::Box` of an MPSC sender. Give each producer its own sender, from
+// `sender->clone_sender()`.
+template <typename Sender>
+RustMpscSendAwaiter<Sender> rust_send(Sender &sender,
+                                      RustMpscItemFor<Sender> item) {
+  return RustMpscSendAwaiter<Sender>(sender, std::move(item));
+}
+
+// The events that the bridge traces when built with `CXX_ASYNC_TRACING` (that
+// is, `--features tracing`). Keep in sync with `Event` in trace.rs.
+enum class RustTraceEvent : uint8_t {
+  Created = 0,
+  Resumed = 1,
+  Suspended = 2,
+  Woken = 3,
+  Completed = 4,
+};
+
+#ifdef CXX_ASYNC_TRACING
+
+// Records an event in this thread's trace ring buffer.
+void rust_trace(RustTraceEvent event, uint64_t span, uint64_t related) noexcept;
+// Makes `span` the one running on this thread, returning the one that was.
+uint64_t rust_trace_enter(uint64_t span) noexcept;
+
+// Finds what `co_await` would end up awaiting, the way the compiler does.
+template <typename Awaitable, typename = void>
+struct RustHasMemberCoAwait : std::false_type {};
+template <typename Awaitable>
+struct RustHasMemberCoAwait<
+    Awaitable,
+    std::void_t<decltype(std::declval<Awaitable>().operator co_await())>>
+    : std::true_type {};
+template <typename Awaitable, typename = void>
+struct RustHasFreeCoAwait : std::false_type {};
+template <typename Awaitable>
+struct RustHasFreeCoAwait<
+    Awaitable,
+    std::void_t<decltype(operator co_await(std::declval<Awaitable>()))>>
+    : std::true_type {};
+
+template <typename Awaitable>
+decltype(auto) rust_get_awaiter(Awaitable &&awaitable) {
+  if constexpr (RustHasMemberCoAwait<Awaitable>::value)
+    return static_cast<Awaitable &&>(awaitable).operator co_await();
+  else if constexpr (RustHasFreeCoAwait<Awaitable>::value)
+    return operator co_await(static_cast<Awaitable &&>(awaitable));
+  else
+    return static_cast<Awaitable &&>(awaitable);
+}
+
+// Awaiters of Rust channels know their channel's span.
+template <typename Awaiter, typename = void> struct RustTraceSpanOf {
+  static uint64_t get(const Awaiter &) noexcept { return 0; }
+};
+template <typename Awaiter>
+struct RustTraceSpanOf<
+    Awaiter, std::void_t<decltype(std::declval<const Awaiter &>().trace_span())>> {
+  static uint64_t get(const Awaiter &awaiter) noexcept {
+    return awaiter.trace_span();
+  }
+};
+
+// A coroutine's trace span. Each slice runs from `enter` to `leave`, and puts
+// back whatever span was running on the thread before it.
+class RustTraceSlice {
+  uint64_t m_span;
+  uint64_t m_outer;
+
+public:
+  template <typename Receiver>
+  explicit RustTraceSlice(const Receiver &receiver) noexcept
+      : m_span(receiver.span()), m_outer(0) {}
+
+  void enter(uint64_t woken_by) noexcept {
+    m_outer = rust_trace_enter(m_span);
+    rust_trace(RustTraceEvent::Resumed, m_span, woken_by);
+  }
+
+  void leave(uint64_t awaiting) noexcept {
+    rust_trace(RustTraceEvent::Suspended, m_span, awaiting);
+    rust_trace_enter(m_outer);
+  }
+
+  template <typename Awaitable> auto traced(Awaitable &&awaitable);
+};
+
+// Wraps every await in a traced coroutine, so that each suspension ends the
+// coroutine's current slice and each resumption starts a new one.
+template <typename Awaitable> class RustTracedAwaiter {
+  typedef decltype(rust_get_awaiter(std::declval<Awaitable>())) Awaiter;
+
+  Awaitable m_awaitable;
+  // May refer to `m_awaitable`.
+  Awaiter m_awaiter;
+  RustTraceSlice *m_slice;
+  // The channel that we're suspended on, if we know it.
+  uint64_t m_awaiting;
+  bool m_suspended;
+
+public:
+  template <typename Value>
+  RustTracedAwaiter(Value &&awaitable, RustTraceSlice *slice)
+      : m_awaitable(static_cast<Value &&>(awaitable)),
+        m_awaiter(rust_get_awaiter(std::move(m_awaitable))), m_slice(slice),
+        m_awaiting(0), m_suspended(false) {}
+
+  bool await_ready() { return m_awaiter.await_ready(); }
+
+  // Ends the slice first: once the inner awaiter has suspended us, we may be
+  // resumed, and even destroyed, on another thread at any moment.
+  template <typename Promise>
+  auto await_suspend(std::experimental::coroutine_handle<Promise> next) {
+    m_awaiting =
+        RustTraceSpanOf<std::remove_reference_t<Awaiter>>::get(m_awaiter);
+    m_suspended = true;
+    m_slice->leave(m_awaiting);
+    return m_awaiter.await_suspend(next);
+  }
+
+  decltype(auto) await_resume() {
+    if (m_suspended)
+      m_slice->enter(m_awaiting);
+    return m_awaiter.await_resume();
+  }
+};
+
+template <typename Awaitable>
+auto RustTraceSlice::traced(Awaitable &&awaitable) {
+  return RustTracedAwaiter<std::decay_t<Awaitable>>(
+      static_cast<Awaitable &&>(awaitable), this);
+}
+
+#else
+
+class RustTraceSlice {
+public:
+  template <typename Receiver>
+  explicit RustTraceSlice(const Receiver &) noexcept {}
+  void enter(uint64_t) noexcept {}
+  void leave(uint64_t) noexcept {}
+  template <typename Awaitable> Awaitable &&traced(Awaitable &&awaitable) {
+    return static_cast<Awaitable &&>(awaitable);
+  }
+};
+
+#endif
+
+template <typename Channel>
+class RustOneshotPromise : public RustFrameAllocation<Channel> {
+  Channel m_channel;
+  // Created the first time someone asks for the stop token.
+  RustStopState *m_stop_state;
+  // The C++ coroutine waiting for our result, if sending it found one. We
+  // resume it from `final_suspend`, by symmetric transfer.
+  RustWakeTarget *m_waiter;
+  // Given to the wake targets of the coroutine's awaits of Rust; see
+  // `rust_set_priority`.
+  RustPriority m_priority;
+  // Runs under the channel's trace span when tracing.
+  [[no_unique_address]] RustTraceSlice m_trace;
+
+  // Destroys the finished coroutine, then transfers control to the waiter, so
+  // that a chain of C++ coroutines awaiting one another through Rust channels
+  // completes in constant stack space.
+  class FinalAwaiter {
+  public:
+    bool await_ready() const noexcept { return false; }
+    std::experimental::coroutine_handle<void> await_suspend(
+        std::experimental::coroutine_handle<RustOneshotPromise> self) noexcept {
+      RustWakeTarget *waiter = self.promise().m_waiter;
+      self.promise().m_trace.leave(0);
+      self.destroy();
+      return waiter ? waiter->transfer() : std::experimental::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+
+public:
+  RustOneshotPromise()
+      : m_channel(static_cast<RustOneshotReceiverFor<Channel> *>(nullptr)
+                      ->channel()),
+        m_stop_state(nullptr), m_waiter(nullptr),
+        m_priority(RustPriority::Normal), m_trace(*m_channel.receiver) {
+    m_trace.enter(0);
+  }
+  RustOneshotPromise(const RustOneshotPromise &) = delete;
+  void operator=(const RustOneshotPromise &) = delete;
+
+  ~RustOneshotPromise() {
+    if (m_stop_state)
+      m_stop_state->release();
+  }
+
+  unifex::inplace_stop_token get_stop_token() noexcept {
+    if (!m_stop_state) {
+      m_stop_state = new RustStopState;
+      if (m_channel.sender->watch_cancel(
+              reinterpret_cast<uint8_t *>(m_stop_state)))
+        m_stop_state->request_stop();
+    }
+    return m_stop_state->get_token();
+  }
+
+  friend unifex::inplace_stop_token
+  tag_invoke(unifex::tag_t<unifex::get_stop_token>,
+             const RustOneshotPromise &promise) noexcept {
+    return const_cast<RustOneshotPromise &>(promise).get_stop_token();
+  }
+
+  rust::Box<RustOneshotReceiverFor<Channel>> get_return_object() noexcept {
+    return std::move(m_channel.receiver);
+  }
+
+  std::experimental::suspend_never initial_suspend() const noexcept {
+    return {};
+  }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+
+  // A libunifex sender that we awaited completed with done. Treat that as
+  // cancellation: destroying the coroutine drops our sender, so the Rust side
+  // gets `Canceled`.
+  std::experimental::coroutine_handle<> unhandled_done() noexcept {
+    rust_count<Channel>(RustCounter::DestroyedUnresumed);
+    m_trace.leave(0);
+    std::experimental::coroutine_handle<RustOneshotPromise>::from_promise(*this)
+        .destroy();
+    return std::experimental::noop_coroutine();
+  }
+
+  void return_value(RustOneshotResultFor<Channel> &&value) {
+    m_waiter = reinterpret_cast<RustWakeTarget *>(
+        m_channel.sender->send(&value, 0, rust::Str(), nullptr));
+    forget(std::move(value));
+  }
+
+  // In a coroutine that returns a pod receiver, `co_return value` packs any
+  // pod.
+  template <typename T, typename Result = RustOneshotResultFor<Channel>,
+            typename = std::enable_if_t<
+                RustIsPodValue<Result>::value &&
+                !std::is_same_v<T, Result> && !std::is_same_v<T, RustError>>>
+  void return_value(const T &value) {
+    return_value(rust_pod_pack<Result>(value));
+  }
+
+  // `co_return RustError(code, "message")` fails without throwing.
+  void return_value(RustError &&error) noexcept {
+    m_waiter = reinterpret_cast<RustWakeTarget *>(error.send_to_rust(
+        [this](int32_t code, rust::Str message, uint8_t *exception) {
+          return m_channel.sender->send(nullptr, code, message, exception);
+        }));
+  }
+
+  // Sends the exception itself, so that C++ awaiting it gets it back intact.
+  void unhandled_exception() noexcept {
+    return_value(RustError(std::current_exception()));
+  }
+
+  RustReadyAwaiter<unifex::inplace_stop_token>
+  await_transform(RustCurrentStopToken) noexcept {
+    return get_stop_token();
+  }
+
+  std::experimental::suspend_never
+  await_transform(RustSetPriority set) noexcept {
+    m_priority = set.priority;
+    return {};
+  }
+
+  template <typename Handle>
+  auto await_transform(rust::Box<Handle> &&handle) noexcept {
+    RustAwaiterFor<Handle> awaiter(std::move(handle));
+    awaiter.set_priority(m_priority);
+    return m_trace.traced(std::move(awaiter));
+  }
+
+  // Awaiters of Rust take the coroutine's priority, overriding any they were
+  // given.
+  template <typename Value> auto await_transform(Value &&value) noexcept {
+    if constexpr (RustHasPriority<std::remove_reference_t<Value>>::value)
+      value.set_priority(m_priority);
+    return m_trace.traced(unifex::await_transform(*this, (Value &&) value));
+  }
+};
+
+// The promise for C++ coroutines that return a Rust stream. Each `co_yield`
+// pushes an item into the stream's ring buffer, suspending while the buffer is
+// full. If the Rust side drops the stream, the coroutine is destroyed at its
+// next `co_yield`.
+template <typename Channel>
+class RustStreamPromise : public RustFrameAllocation<Channel> {
+  typedef RustStreamItemFor<Channel> Item;
+
+  Channel m_channel;
+
+  class YieldAwaiter {
+    RustStreamPromise &m_promise;
+    ManuallyDrop<Item> m_item;
+    bool m_sent;
+    // The producer resumes inline on the consumer's thread once there's room.
+    RustWakeTarget m_wake_target;
+
+    // Rust takes ownership of the item only if this returns `Ready`.
+    RustSendResult try_send(uint8_t *wake_target) noexcept {
+      return static_cast<RustSendResult>(
+          m_promise.m_channel.sender->send(&m_item.m_value, wake_target));
+    }
+
+  public:
+    YieldAwaiter(RustStreamPromise &promise, Item &&item)
+        : m_promise(promise), m_item(std::move(item)), m_sent(false),
+          m_wake_target() {}
+    YieldAwaiter(const YieldAwaiter &) = delete;
+    void operator=(const YieldAwaiter &) = delete;
+
+    ~YieldAwaiter() {
+      if (!m_sent)
+        m_item.m_value.~Item();
+    }
+
+    bool await_ready() noexcept {
+      m_sent = try_send(nullptr) == RustSendResult::Ready;
+      return m_sent;
+    }
+
+    bool await_suspend(std::experimental::coroutine_handle<void> next) noexcept {
+      switch (try_send(m_wake_target.prepare(next))) {
+      case RustSendResult::Ready:
+        m_sent = true;
+        return false;
+      case RustSendResult::Pending:
+        // The Rust side resumes us once there's room. Don't touch `this`.
+        return true;
+      case RustSendResult::Closed:
+        // Nobody is listening anymore. Dropping our sender marks the stream
+        // as cancelled.
+        rust_count<Channel>(RustCounter::DestroyedUnresumed);
+        next.destroy();
+        return true;
+      }
+      std::terminate();
+    }
+
+    void await_resume() noexcept {
+      m_wake_target.count_resume<Channel>();
+      if (m_sent)
+        return;
+      // We were woken because there's room now (or the receiver went away,
+      // in which case the item is dropped with us).
+      m_sent = try_send(nullptr) == RustSendResult::Ready;
+    }
+  };
+
+public:
+  RustStreamPromise()
+      : m_channel(static_cast<RustStreamReceiverFor<Channel> *>(nullptr)
+                      ->channel()) {}
+
+  rust::Box<RustStreamReceiverFor<Channel>> get_return_object() noexcept {
+    return std::move(m_channel.receiver);
+  }
+
+  std::experimental::suspend_never initial_suspend() const noexcept {
+    return {};
+  }
+  std::experimental::suspend_never final_suspend() const noexcept { return {}; }
+
+  // See `RustOneshotPromise::unhandled_done`.
+  std::experimental::coroutine_handle<> unhandled_done() noexcept {
+    rust_count<Channel>(RustCounter::DestroyedUnresumed);
+    std::experimental::coroutine_handle<RustStreamPromise>::from_promise(*this)
+        .destroy();
+    return std::experimental::noop_coroutine();
+  }
+
+  YieldAwaiter yield_value(Item &&item) noexcept {
+    return YieldAwaiter(*this, std::move(item));
+  }
+  YieldAwaiter yield_value(const Item &item) { return yield_value(Item(item)); }
+
+  void return_void() noexcept { m_channel.sender->close(); }
+
+  void unhandled_exception() noexcept {
+    RustError(std::current_exception())
+        .send_to_rust([this](int32_t code, rust::Str message,
+                             uint8_t *exception) {
+          m_channel.sender->fail(code, message, exception);
+        });
+  }
+
+  template <typename Value> auto await_transform(Value &&value) noexcept {
+    return unifex::await_transform(*this, (Value &&) value);
+  }
+};
+
+// Rust keeps a lazy coroutine's state, its waker and the coroutine's outcome
+// at the start of the promise, in this much room; see `LazyState` in lazy.rs.
+constexpr size_t RUST_LAZY_STATE_WORDS = 8;
+
+// What the `rust::Box` of a lazy coroutine points to.
+struct RustLazyHeader {
+  size_t m_rust_state[RUST_LAZY_STATE_WORDS];
+  std::experimental::coroutine_handle<void> m_coroutine;
+};
+
+// Given a lazy type, fetches the result type, from `complete` in the same way
+// as `RustOneshotResultFor` does from `send`.
+template <typename Lazy>
+using RustLazyResultFor = typename RustOneshotGetResultTypeFromSendFn<
+    decltype(&Lazy::complete)>::Result;
+
+// The promise for C++ coroutines that return a `RustLazy*`. These start
+// suspended, and the Rust future that they return starts them on its first
+// poll, on the polling thread. There's no channel: the coroutine leaves its
+// outcome here and wakes the Rust task, if it's waiting, from its final suspend
+// point, and Rust moves the value out and then destroys the coroutine. So a
+// coroutine that Rust awaits as soon as it calls it costs one allocation, its
+// frame, and finishing without suspending costs no wakeup at all.
+template <typename Lazy>
+class RustLazyPromise : public RustFrameAllocation<Lazy> {
+  typedef RustLazyResultFor<Lazy> Result;
+
+  RustLazyHeader m_header;
+  // What the coroutine returned. The value is Rust's once we've completed.
+  ManuallyDrop<Result> m_value;
+  bool m_returned;
+  // Whether Rust started the coroutine, for counting those that it destroys
+  // without starting.
+  bool m_started;
+  std::optional<RustError> m_error;
+
+  // Hands the outcome to Rust, which may destroy the coroutine from then on,
+  // even before this returns. Returns the waiter to transfer to, if any.
+  static std::experimental::coroutine_handle<void>
+  complete(RustLazyPromise &promise) noexcept {
+    Lazy &lazy = *reinterpret_cast<Lazy *>(&promise.m_header);
+    uint8_t *waiter;
+    if (promise.m_returned) {
+      waiter = lazy.complete(&promise.m_value.m_value, 0, rust::Str(), nullptr);
+    } else {
+      // Without a value or an error, a libunifex sender completed with done,
+      // which Rust sees as cancellation.
+      if (!promise.m_error)
+        promise.m_error.emplace(RUST_ERROR_CANCELLED, "");
+      waiter = promise.m_error->send_to_rust(
+          [&lazy](int32_t code, rust::Str message, uint8_t *exception) {
+            return lazy.complete(nullptr, code, message, exception);
+          });
+    }
+    return waiter ? reinterpret_cast<RustWakeTarget *>(waiter)->transfer()
+                  : std::experimental::noop_coroutine();
+  }
+
+  class InitialAwaiter : public std::experimental::suspend_always {
+    RustLazyPromise &m_promise;
+
+  public:
+    explicit InitialAwaiter(RustLazyPromise &promise) : m_promise(promise) {}
+    void await_resume() const noexcept { m_promise.m_started = true; }
+  };
+
+  class FinalAwaiter {
+  public:
+    bool await_ready() const noexcept { return false; }
+    std::experimental::coroutine_handle<void> await_suspend(
+        std::experimental::coroutine_handle<RustLazyPromise> self) noexcept {
+      return complete(self.promise());
+    }
+    void await_resume() const noexcept {}
+  };
+
+public:
+  RustLazyPromise()
+      : m_header(), m_value(), m_returned(false), m_started(false), m_error() {
+    m_header.m_coroutine =
+        std::experimental::coroutine_handle<RustLazyPromise>::from_promise(
+            *this);
+  }
+  RustLazyPromise(const RustLazyPromise &) = delete;
+  void operator=(const RustLazyPromise &) = delete;
+
+  ~RustLazyPromise() {
+    if (!m_started)
+      rust_count<Lazy>(RustCounter::DestroyedUnresumed);
+  }
+
+  rust::Box<Lazy> get_return_object() noexcept {
+    return rust::Box<Lazy>::from_raw(reinterpret_cast<Lazy *>(&m_header));
+  }
+
+  InitialAwaiter initial_suspend() noexcept { return InitialAwaiter(*this); }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+
+  // The coroutine stays suspended where it is until Rust destroys it.
+  std::experimental::coroutine_handle<> unhandled_done() noexcept {
+    return complete(*this);
+  }
+
+  void return_value(Result &&value) {
+    new (&m_value.m_value) Result(std::move(value));
+    m_returned = true;
+  }
+
+  void return_value(RustError &&error) noexcept {
+    m_error.emplace(std::move(error));
+  }
+
+  void unhandled_exception() noexcept {
+    m_error.emplace(std::current_exception());
+  }
+
+  template <typename Value> auto await_transform(Value &&value) noexcept {
+    return unifex::await_transform(*this, (Value &&) value);
+  }
+};
+
+template <typename Channel>
+using RustPromiseFor =
+    std::conditional_t<RustIsStreamChannel<Channel>::value,
+                       RustStreamPromise<Channel>, RustOneshotPromise<Channel>>;
+
+// Lazy types have a `complete` method; receivers have a `channel` method.
+template <typename Handle, typename = void> struct RustPromiseForHandle {
+  typedef RustPromiseFor<RustOneshotChannelFor<Handle>> Type;
+};
+template <typename Handle>
+struct RustPromiseForHandle<Handle,
+                            std::void_t<decltype(&Handle::complete)>> {
+  typedef RustLazyPromise<Handle> Type;
+};
+
+template <typename Handle, typename... Args>
+struct std::experimental::coroutine_traits<rust::Box<Handle>, Args...> {
+  using promise_type = typename RustPromiseForHandle<Handle>::Type;
 };
 
 #endif
@@ -5,11 +5,135 @@
 
 #include "cxx_async.h"
 #include "rust/cxx.h"
+#include <cppcoro/async_generator.hpp>
 #include <cppcoro/awaitable_traits.hpp>
+#include <cppcoro/cancellation_registration.hpp>
+#include <cppcoro/cancellation_source.hpp>
+#include <cppcoro/cancellation_token.hpp>
+#include <cppcoro/operation_cancelled.hpp>
+#include <cppcoro/static_thread_pool.hpp>
+#include <optional>
+#include <unifex/inplace_stop_token.hpp>
+
+template <typename Handle>
+struct cppcoro::awaitable_traits<rust::Box<Handle> &&> {
+  typedef decltype(std::declval<RustAwaiterFor<Handle> &>().await_resume())
+      await_result_t;
+};
+
+// A cppcoro cancellation token that's cancelled when a stop is requested on a
+// unifex stop token, usually `co_await rust_current_stop_token()`.
+class RustCppcoroCancellation {
+  struct Callback {
+    cppcoro::cancellation_source m_source;
+    void operator()() noexcept { m_source.request_cancellation(); }
+  };
+
+  cppcoro::cancellation_source m_source;
+  unifex::inplace_stop_callback<Callback> m_callback;
+
+public:
+  explicit RustCppcoroCancellation(unifex::inplace_stop_token stop_token)
+      : m_source(), m_callback(stop_token, Callback{m_source}) {}
+
+  cppcoro::cancellation_token token() const noexcept {
+    return m_source.token();
+  }
+};
+
+// Awaits a Rust receiver, asking Rust to drop the future behind it if `token`
+// is cancelled first, in which case this throws `cppcoro::operation_cancelled`.
+template <typename Channel> class RustCppcoroCancellableAwaiter {
+  RustOneshotAwaiter<Channel> m_awaiter;
+  cppcoro::cancellation_token m_token;
+  std::optional<cppcoro::cancellation_registration> m_registration;
+
+public:
+  RustCppcoroCancellableAwaiter(
+      rust::Box<RustOneshotReceiverFor<Channel>> &&receiver,
+      cppcoro::cancellation_token token, RustExecutor *executor)
+      : m_awaiter(std::move(receiver)), m_token(std::move(token)),
+        m_registration() {
+    m_awaiter.resume_via(executor);
+  }
+
+  // Only valid before the await starts.
+  RustCppcoroCancellableAwaiter(RustCppcoroCancellableAwaiter &&other)
+      : m_awaiter(std::move(other.m_awaiter)),
+        m_token(std::move(other.m_token)), m_registration() {}
+
+  void set_priority(RustPriority priority) noexcept {
+    m_awaiter.set_priority(priority);
+  }
+
+  bool await_ready() noexcept { return m_awaiter.await_ready(); }
+
+  bool await_suspend(std::experimental::coroutine_handle<void> next) {
+    // Register first: once Rust has the coroutine, it may resume at any time.
+    if (m_token.can_be_cancelled())
+      m_registration.emplace(m_token, [this] { m_awaiter.request_cancel(); });
+    return m_awaiter.await_suspend(next);
+  }
+
+  RustOneshotResultFor<Channel> await_resume() {
+    m_registration.reset();
+    try {
+      return m_awaiter.await_resume();
+    } catch (const RustAsyncCancelled &) {
+      throw cppcoro::operation_cancelled();
+    }
+  }
+};
 
 template <typename Receiver>
-struct cppcoro::awaitable_traits<rust::Box<Receiver> &&> {
-  typedef RustOneshotResultFor<RustOneshotChannelFor<Receiver>> await_result_t;
+RustCppcoroCancellableAwaiter<RustOneshotChannelFor<Receiver>>
+rust_with_cancellation(rust::Box<Receiver> &&receiver,
+                       cppcoro::cancellation_token token,
+                       RustExecutor *executor = nullptr) {
+  return RustCppcoroCancellableAwaiter<RustOneshotChannelFor<Receiver>>(
+      std::move(receiver), std::move(token), executor);
+}
+
+// A run queue that resumes coroutines woken by Rust on a cppcoro thread pool,
+// a batch per pool task. The pool itself is FIFO, so priorities only order each
+// batch.
+class RustCppcoroRunQueue : public RustRunQueue {
+  static RustDetachedTask drain_on(cppcoro::static_thread_pool &thread_pool,
+                                   RustRunQueue &queue) {
+    co_await thread_pool.schedule();
+    queue.drain();
+  }
+
+public:
+  explicit RustCppcoroRunQueue(cppcoro::static_thread_pool &thread_pool)
+      : RustRunQueue([&thread_pool](RustRunQueue &queue, RustPriority) {
+          drain_on(thread_pool, queue);
+        }) {}
+};
+
+// Lets Rust spawn futures onto a cppcoro thread pool, through a `CxxSpawner`.
+class RustCppcoroTaskExecutor : public RustTaskExecutor {
+  cppcoro::static_thread_pool &m_thread_pool;
+
+  static RustDetachedTask run_on(cppcoro::static_thread_pool &thread_pool,
+                                 uint8_t *task) {
+    co_await thread_pool.schedule();
+    RustTaskExecutor::run(task);
+  }
+
+public:
+  explicit RustCppcoroTaskExecutor(cppcoro::static_thread_pool &thread_pool)
+      : m_thread_pool(thread_pool) {}
+
+  void post(uint8_t *task) noexcept override { run_on(m_thread_pool, task); }
 };
 
+// Wraps a Rust stream in a cppcoro async generator, for use with `for co_await`.
+template <typename Receiver>
+cppcoro::async_generator<RustStreamItemFor<RustStreamChannelFor<Receiver>>>
+rust_stream_to_cppcoro_generator(rust::Box<Receiver> receiver) {
+  while (auto item = co_await rust_stream_next(receiver))
+    co_yield std::move(*item);
+}
+
 #endif
@@ -0,0 +1,270 @@
+// cxx-async/include/cxx_async_folly.h
+
+#ifndef CXX_ASYNC_CXX_ASYNC_FOLLY_H
+#define CXX_ASYNC_CXX_ASYNC_FOLLY_H
+
+#include "cxx_async.h"
+#include "rust/cxx.h"
+#include <folly/CancellationToken.h>
+#include <folly/Executor.h>
+#include <folly/OperationCancelled.h>
+#include <folly/experimental/coro/AsyncGenerator.h>
+#include <folly/futures/Future.h>
+#include <memory>
+#include <optional>
+#include <unifex/inplace_stop_token.hpp>
+
+// A folly cancellation token that's cancelled when a stop is requested on a
+// unifex stop token, usually `co_await rust_current_stop_token()`.
+class RustFollyCancellation {
+  struct Callback {
+    folly::CancellationSource m_source;
+    void operator()() noexcept { m_source.requestCancellation(); }
+  };
+
+  folly::CancellationSource m_source;
+  unifex::inplace_stop_callback<Callback> m_callback;
+
+public:
+  explicit RustFollyCancellation(unifex::inplace_stop_token stop_token)
+      : m_source(), m_callback(stop_token, Callback{m_source}) {}
+
+  folly::CancellationToken token() const noexcept {
+    return m_source.getToken();
+  }
+};
+
+// Resumes coroutines woken by Rust on a folly executor.
+class RustFollyExecutor : public RustExecutor {
+  folly::Executor::KeepAlive<> m_executor;
+
+public:
+  explicit RustFollyExecutor(folly::Executor::KeepAlive<> executor)
+      : m_executor(std::move(executor)) {}
+
+  void execute(RustWakeTarget *target) noexcept override {
+    // We may be destroyed as soon as the coroutine resumes, possibly before
+    // `add` returns, so keep the executor alive ourselves.
+    folly::Executor::KeepAlive<> executor = m_executor.copy();
+    executor->add([target] { target->resume(); });
+  }
+};
+
+// A folly executor for the pool that Rust shares with C++. It lives forever,
+// so it doesn't count keep-alives.
+class RustPoolFollyExecutor : public folly::Executor {
+  class FuncJob : private RustPoolJob {
+    folly::Func m_func;
+
+    static void run(RustPoolJob *job) noexcept {
+      FuncJob *self = static_cast<FuncJob *>(job);
+      // Like folly's own executors, don't let a throwing function take the
+      // worker down with it.
+      try {
+        self->m_func();
+      } catch (...) {
+      }
+      delete self;
+    }
+
+  public:
+    explicit FuncJob(folly::Func func)
+        : RustPoolJob(run), m_func(std::move(func)) {}
+    void submit() noexcept { rust_pool_submit(this); }
+  };
+
+public:
+  void add(folly::Func func) override {
+    (new FuncJob(std::move(func)))->submit();
+  }
+};
+
+inline folly::Executor::KeepAlive<> rust_pool_folly_executor() {
+  static RustPoolFollyExecutor executor;
+  return folly::getKeepAliveToken(executor);
+}
+
+// Lets Rust spawn futures onto a folly executor, through a `CxxSpawner`.
+class RustFollyTaskExecutor : public RustTaskExecutor {
+  folly::Executor::KeepAlive<> m_executor;
+
+public:
+  explicit RustFollyTaskExecutor(folly::Executor::KeepAlive<> executor)
+      : m_executor(std::move(executor)) {}
+
+  void post(uint8_t *task) noexcept override {
+    m_executor->add([task] { RustTaskExecutor::run(task); });
+  }
+};
+
+// Awaits a Rust receiver, asking Rust to drop the future behind it if `token`
+// is cancelled first, in which case this throws `folly::OperationCancelled`.
+template <typename Channel> class RustFollyCancellableAwaiter {
+  RustOneshotAwaiter<Channel> m_awaiter;
+  folly::CancellationToken m_token;
+  std::optional<folly::CancellationCallback> m_callback;
+  std::optional<RustFollyExecutor> m_executor;
+
+public:
+  RustFollyCancellableAwaiter(
+      rust::Box<RustOneshotReceiverFor<Channel>> &&receiver,
+      folly::CancellationToken token)
+      : m_awaiter(std::move(receiver)), m_token(std::move(token)),
+        m_callback(), m_executor() {}
+
+  // Only valid before the await starts.
+  RustFollyCancellableAwaiter(RustFollyCancellableAwaiter &&other)
+      : m_awaiter(std::move(other.m_awaiter)),
+        m_token(std::move(other.m_token)), m_callback(),
+        m_executor(std::move(other.m_executor)) {}
+
+  // Resumes on `executor` once Rust completes the future. Only valid before the
+  // await starts.
+  void resume_via(folly::Executor::KeepAlive<> executor) {
+    m_executor.emplace(std::move(executor));
+  }
+
+  bool await_ready() noexcept { return m_awaiter.await_ready(); }
+
+  bool await_suspend(std::experimental::coroutine_handle<void> next) {
+    // We don't move anymore, so the executor's address is stable now.
+    if (m_executor)
+      m_awaiter.resume_via(&*m_executor);
+    // Register first: once Rust has the coroutine, it may resume at any time.
+    if (m_token.canBeCancelled())
+      m_callback.emplace(m_token, [this] { m_awaiter.request_cancel(); });
+    return m_awaiter.await_suspend(next);
+  }
+
+  RustOneshotResultFor<Channel> await_resume() {
+    m_callback.reset();
+    try {
+      return m_awaiter.await_resume();
+    } catch (const RustAsyncCancelled &) {
+      throw folly::OperationCancelled();
+    }
+  }
+};
+
+// Found by argument-dependent lookup when a folly task awaits a Rust receiver,
+// so that the receiver sees the task's cancellation token.
+template <typename Receiver>
+RustFollyCancellableAwaiter<RustOneshotChannelFor<Receiver>>
+co_withCancellation(const folly::CancellationToken &token,
+                    rust::Box<Receiver> &&receiver) {
+  return RustFollyCancellableAwaiter<RustOneshotChannelFor<Receiver>>(
+      std::move(receiver), token);
+}
+
+// Found by argument-dependent lookup when a folly task awaits a Rust receiver
+// (after `co_withCancellation` above). Folly would otherwise resume the task
+// inline and then hop onto its executor; this goes straight to the executor.
+template <typename Channel>
+RustFollyCancellableAwaiter<Channel>
+co_viaIfAsync(folly::Executor::KeepAlive<> executor,
+              RustFollyCancellableAwaiter<Channel> &&awaiter) {
+  awaiter.resume_via(std::move(executor));
+  return std::move(awaiter);
+}
+
+// Feeds a Rust receiver's result to a `folly::Promise`: the operation itself is
+// what the Rust waker wakes, so the result goes straight from the Rust thread
+// into the promise, with no coroutine or blocking in between. Continuations run
+// wherever the future's consumer puts them with `via`. Interrupting the future
+// asks Rust to drop the future behind the receiver.
+template <typename Channel>
+class RustFollyPromiseOperation : private RustExecutor {
+  typedef RustOneshotReceiverFor<Channel> Receiver;
+  typedef RustOneshotResultFor<Channel> Result;
+
+  rust::Box<Receiver> m_receiver;
+  RustRecvSlot<Result> m_slot;
+  RustWakeTarget m_wake_target;
+  folly::Promise<Result> m_promise;
+  // Keeps us alive while Rust has the wake target.
+  std::shared_ptr<RustFollyPromiseOperation> m_self;
+
+  // Called on the Rust thread that woke us.
+  void execute(RustWakeTarget *) noexcept override { complete(); }
+
+  void complete() noexcept {
+    std::shared_ptr<RustFollyPromiseOperation> self = std::move(m_self);
+    m_wake_target.count_resume<Channel>();
+    // If we waited, we were woken because the result is in now.
+    if (m_slot.state() == RustRecvResult::Pending &&
+        m_slot.recv(*m_receiver, nullptr) == RustRecvResult::Pending)
+      std::terminate();
+
+    switch (m_slot.state()) {
+    case RustRecvResult::Ready:
+      m_promise.setTry(folly::makeTryWith([this] { return m_slot.take(); }));
+      break;
+    case RustRecvResult::Error:
+      m_promise.setException(folly::exception_wrapper(
+          m_slot.take_error().to_exception_ptr()));
+      break;
+    default:
+      m_promise.setException(folly::OperationCancelled());
+      break;
+    }
+  }
+
+public:
+  explicit RustFollyPromiseOperation(rust::Box<Receiver> &&receiver)
+      : m_receiver(std::move(receiver)), m_slot(), m_wake_target(),
+        m_promise(), m_self() {
+    m_wake_target.set_executor(this);
+  }
+
+  static folly::SemiFuture<Result> start(rust::Box<Receiver> &&receiver) {
+    auto operation =
+        std::make_shared<RustFollyPromiseOperation>(std::move(receiver));
+    folly::SemiFuture<Result> future = operation->m_promise.getSemiFuture();
+
+    rust_count<Channel>(RustCounter::Awaits);
+    if (operation->m_slot.recv(*operation->m_receiver, nullptr) !=
+        RustRecvResult::Pending) {
+      rust_count<Channel>(RustCounter::ReadyAwaits);
+      operation->complete();
+      return future;
+    }
+
+    // Only a weak reference, since the promise owns the handler.
+    std::weak_ptr<RustFollyPromiseOperation> weak = operation;
+    operation->m_promise.setInterruptHandler(
+        [weak](const folly::exception_wrapper &) {
+          if (auto operation = weak.lock())
+            operation->m_receiver->cancel();
+        });
+
+    // Rust may complete us on another thread as soon as it has the wake
+    // target, so the reference has to be in place first.
+    RustFollyPromiseOperation &self = *operation;
+    self.m_self = std::move(operation);
+    if (self.m_slot.recv(*self.m_receiver,
+                         self.m_wake_target.prepare(
+                             std::experimental::coroutine_handle<void>())) !=
+        RustRecvResult::Pending)
+      self.complete();
+    return future;
+  }
+};
+
+// Usage: `folly::SemiFuture<double> future = rust_to_semi_future(receiver);`.
+// For `folly::collectAll`, `collectAny` and the rest of folly's futures.
+template <typename Receiver>
+folly::SemiFuture<RustOneshotResultFor<RustOneshotChannelFor<Receiver>>>
+rust_to_semi_future(rust::Box<Receiver> receiver) {
+  return RustFollyPromiseOperation<RustOneshotChannelFor<Receiver>>::start(
+      std::move(receiver));
+}
+
+// Wraps a Rust stream in a Folly async generator.
+template <typename Receiver>
+folly::coro::AsyncGenerator<RustStreamItemFor<RustStreamChannelFor<Receiver>> &&>
+rust_stream_to_folly_generator(rust::Box<Receiver> receiver) {
+  while (auto item = co_await rust_stream_next(receiver))
+    co_yield std::move(*item);
+}
+
+#endif
@@ -4,53 +4,248 @@
 #define CXX_ASYNC_CXX_ASYNC_LIBUNIFEX_H
 
 #include "cxx_async.h"
+#include <exception>
+#include <type_traits>
+#include <optional>
+#include <unifex/get_stop_token.hpp>
+#include <unifex/just.hpp>
+#include <unifex/scheduler_concepts.hpp>
+#include <unifex/stop_token_concepts.hpp>
+#include <unifex/stream_concepts.hpp>
+#include <unifex/submit.hpp>
+#include <unifex/tag_invoke.hpp>
 
-template <typename Channel, typename UnifexReceiver> class RustOperation {
-  typedef RustOneshotReceiverFor<Channel> RustReceiver;
-  typedef RustOneshotResultFor<Channel> Result;
+// Resumes coroutines woken by Rust on a libunifex scheduler.
+template <typename Scheduler>
+class RustUnifexSchedulerExecutor : public RustExecutor {
+  template <typename F> struct RunReceiver {
+    F m_f;
+
+    void set_value() noexcept { m_f(); }
+    // If the scheduler won't run us, run here rather than never.
+    void set_done() noexcept { m_f(); }
+    template <typename Error> void set_error(Error &&) noexcept { m_f(); }
+  };
+
+  Scheduler m_scheduler;
+
+public:
+  explicit RustUnifexSchedulerExecutor(Scheduler &&scheduler)
+      : m_scheduler(std::move(scheduler)) {}
+
+  // Calls `f()` on the scheduler.
+  template <typename F> void run(F &&f) noexcept {
+    unifex::submit(unifex::schedule(m_scheduler),
+                   RunReceiver<std::decay_t<F>>{std::forward<F>(f)});
+  }
+
+  void execute(RustWakeTarget *target) noexcept override {
+    run([target]() noexcept { target->resume(); });
+  }
+};
+
+// A libunifex scheduler for the pool that Rust shares with C++.
+class RustPoolUnifexScheduler {
+public:
+  // Public, since `connect` is found outside the class.
+  template <typename UnifexReceiver> class Operation : private RustPoolJob {
+    UnifexReceiver m_receiver;
+
+    static void run(RustPoolJob *job) noexcept {
+      Operation *self = static_cast<Operation *>(job);
+      if (unifex::get_stop_token(self->m_receiver).stop_requested())
+        unifex::set_done(std::move(self->m_receiver));
+      else
+        unifex::set_value(std::move(self->m_receiver));
+    }
+
+    Operation(const Operation &) = delete;
+    void operator=(const Operation &) = delete;
 
-  class Task {
   public:
-    class promise_type {
-    public:
-      Task get_return_object() noexcept { return {}; }
-      std::experimental::suspend_never initial_suspend() const noexcept {
-        return {};
-      }
-      std::experimental::suspend_never final_suspend() const noexcept {
-        return {};
-      }
-      void unhandled_exception() noexcept {
-        // Should never be called, since we catch exceptions in `make_task()` below.
-        std::terminate();
-      }
-      void return_void() noexcept {}
-    };
+    template <typename Receiver>
+    explicit Operation(Receiver &&receiver)
+        : RustPoolJob(run), m_receiver(std::forward<Receiver>(receiver)) {}
+    void start() noexcept { rust_pool_submit(this); }
   };
 
-  Task make_task() noexcept {
-    try {
-      unifex::set_value(std::move(m_unifex_receiver),
-                        co_await std::move(m_rust_receiver));
-    } catch (...) {
-      unifex::set_error(std::move(m_unifex_receiver), std::current_exception());
+  class ScheduleSender {
+  public:
+    template <template <typename...> class Variant,
+              template <typename...> class Tuple>
+    using value_types = Variant<Tuple<>>;
+    template <template <typename...> class Variant>
+    using error_types = Variant<>;
+    static constexpr bool sends_done = true;
+
+    template <typename UnifexReceiver>
+    friend Operation<std::decay_t<UnifexReceiver>>
+    tag_invoke(unifex::tag_t<unifex::connect>, ScheduleSender,
+               UnifexReceiver &&receiver) {
+      return Operation<std::decay_t<UnifexReceiver>>(
+          std::forward<UnifexReceiver>(receiver));
+    }
+  };
+
+  ScheduleSender schedule() const noexcept { return {}; }
+
+  friend bool operator==(RustPoolUnifexScheduler,
+                         RustPoolUnifexScheduler) noexcept {
+    return true;
+  }
+  friend bool operator!=(RustPoolUnifexScheduler,
+                         RustPoolUnifexScheduler) noexcept {
+    return false;
+  }
+};
+
+// Lets Rust spawn futures onto a libunifex scheduler, through a `CxxSpawner`.
+template <typename Scheduler>
+class RustUnifexTaskExecutor : public RustTaskExecutor {
+  struct RunReceiver {
+    uint8_t *m_task;
+
+    void set_value() noexcept { RustTaskExecutor::run(m_task); }
+    // If the scheduler won't run the task, run it here rather than never.
+    void set_done() noexcept { RustTaskExecutor::run(m_task); }
+    template <typename Error> void set_error(Error &&) noexcept {
+      RustTaskExecutor::run(m_task);
     }
-    co_return;
+  };
+
+  Scheduler m_scheduler;
+
+public:
+  explicit RustUnifexTaskExecutor(Scheduler &&scheduler)
+      : m_scheduler(std::move(scheduler)) {}
+
+  void post(uint8_t *task) noexcept override {
+    unifex::submit(unifex::schedule(m_scheduler), RunReceiver{task});
+  }
+};
+
+// Where an operation resumes once Rust completes it: on the receiver's
+// scheduler if it has one, and otherwise inline.
+template <typename UnifexReceiver, typename = void>
+class RustUnifexReceiverExecutor {
+public:
+  explicit RustUnifexReceiverExecutor(const UnifexReceiver &) noexcept {}
+  RustExecutor *get() noexcept { return nullptr; }
+  template <typename F> void run(F &&f) noexcept { f(); }
+};
+
+template <typename UnifexReceiver>
+class RustUnifexReceiverExecutor<
+    UnifexReceiver,
+    std::enable_if_t<unifex::is_callable_v<unifex::tag_t<unifex::get_scheduler>,
+                                           const UnifexReceiver &>>> {
+  RustUnifexSchedulerExecutor<unifex::remove_cvref_t<unifex::callable_result_t<
+      unifex::tag_t<unifex::get_scheduler>, const UnifexReceiver &>>>
+      m_executor;
+
+public:
+  explicit RustUnifexReceiverExecutor(const UnifexReceiver &receiver)
+      : m_executor(unifex::get_scheduler(receiver)) {}
+  RustExecutor *get() noexcept { return &m_executor; }
+  template <typename F> void run(F &&f) noexcept {
+    m_executor.run(std::forward<F>(f));
   }
+};
+
+// A libunifex operation state over a Rust receiver. Starting it polls once;
+// if the result isn't in yet, the operation itself is what the Rust waker
+// wakes, and it completes the unifex receiver from there, on the receiver's
+// scheduler if it has one. There's no coroutine in between.
+template <typename Channel, typename UnifexReceiver>
+class RustOperation : private RustExecutor {
+  typedef RustOneshotReceiverFor<Channel> RustReceiver;
+  typedef RustOneshotResultFor<Channel> Result;
+
+  struct CancelCallback {
+    RustReceiver *m_rust_receiver;
+    void operator()() noexcept { m_rust_receiver->cancel(); }
+  };
+
+  typedef typename unifex::stop_token_type_t<
+      UnifexReceiver>::template callback_type<CancelCallback>
+      StopCallback;
 
   RustOperation(const RustOperation &) = delete;
   void operator=(const RustOperation &) = delete;
 
   rust::Box<RustReceiver> m_rust_receiver;
   UnifexReceiver m_unifex_receiver;
+  RustUnifexReceiverExecutor<UnifexReceiver> m_executor;
+  RustRecvSlot<Result> m_slot;
+  RustWakeTarget m_wake_target;
+  std::optional<StopCallback> m_stop_callback;
+
+  // Called on the Rust thread that woke us.
+  void execute(RustWakeTarget *) noexcept override {
+    m_executor.run([this]() noexcept { complete(); });
+  }
+
+  void complete() noexcept {
+    m_wake_target.count_resume<Channel>();
+    // If we waited, we were woken because the result is in now.
+    if (m_slot.state() == RustRecvResult::Pending &&
+        m_slot.recv(*m_rust_receiver, nullptr) == RustRecvResult::Pending)
+      std::terminate();
+    // The callback has to go away before we complete, since that may destroy
+    // us.
+    m_stop_callback.reset();
+
+    switch (m_slot.state()) {
+    case RustRecvResult::Ready:
+      try {
+        unifex::set_value(std::move(m_unifex_receiver), m_slot.take());
+      } catch (...) {
+        unifex::set_error(std::move(m_unifex_receiver),
+                          std::current_exception());
+      }
+      break;
+    case RustRecvResult::Error:
+      unifex::set_error(std::move(m_unifex_receiver),
+                        m_slot.take_error().to_exception_ptr());
+      break;
+    default:
+      // A stop request asks Rust to drop the future, which shows up here as
+      // cancellation, and we report it as done.
+      unifex::set_done(std::move(m_unifex_receiver));
+      break;
+    }
+  }
 
 public:
-  void start() noexcept { make_task(); }
+  // Once a waker is registered, Rust may complete us on another thread before
+  // this even returns, so this mustn't touch `this` after that.
+  void start() noexcept {
+    rust_count<Channel>(RustCounter::Awaits);
+    if (m_slot.recv(*m_rust_receiver, nullptr) != RustRecvResult::Pending) {
+      rust_count<Channel>(RustCounter::ReadyAwaits);
+      complete();
+      return;
+    }
+
+    auto stop_token = unifex::get_stop_token(m_unifex_receiver);
+    if (stop_token.stop_possible())
+      m_stop_callback.emplace(std::move(stop_token),
+                              CancelCallback{&*m_rust_receiver});
+    if (m_slot.recv(*m_rust_receiver,
+                    m_wake_target.prepare(
+                        std::experimental::coroutine_handle<void>())) !=
+        RustRecvResult::Pending)
+      complete();
+  }
 
   RustOperation(rust::Box<RustReceiver> &&rust_receiver,
                 UnifexReceiver &&unifex_receiver)
       : m_rust_receiver(std::move(rust_receiver)),
-        m_unifex_receiver(std::move(unifex_receiver)) {}
+        m_unifex_receiver(std::move(unifex_receiver)),
+        m_executor(m_unifex_receiver), m_slot(), m_wake_target(),
+        m_stop_callback() {
+    m_wake_target.set_executor(this);
+  }
 };
 
 template <typename Receiver, typename UnifexReceiver>
@@ -67,10 +262,133 @@ template <typename Receiver> struct unifex::sender_traits<rust::Box<Receiver>> {
             template <typename...> class Tuple>
   using value_types =
       Variant<Tuple<RustOneshotResultFor<RustOneshotChannelFor<Receiver>>>>;
-  template <template <typename...> class Variant> using error_types = Variant<>;
+  template <template <typename...> class Variant>
+  using error_types = Variant<std::exception_ptr>;
   static constexpr bool sends_done = true;
 };
 
+// Receives the next item of a Rust stream, completing with `set_done` at the
+// end of the stream. Like `RustOperation`, without a coroutine.
+template <typename Channel, typename UnifexReceiver>
+class RustStreamNextOperation : private RustExecutor {
+  typedef RustStreamReceiverFor<Channel> RustReceiver;
+  typedef RustStreamItemFor<Channel> Item;
+
+  RustStreamNextOperation(const RustStreamNextOperation &) = delete;
+  void operator=(const RustStreamNextOperation &) = delete;
+
+  rust::Box<RustReceiver> &m_rust_receiver;
+  UnifexReceiver m_unifex_receiver;
+  RustUnifexReceiverExecutor<UnifexReceiver> m_executor;
+  RustRecvSlot<Item> m_slot;
+  RustWakeTarget m_wake_target;
+
+  void execute(RustWakeTarget *) noexcept override {
+    m_executor.run([this]() noexcept { complete(); });
+  }
+
+  void complete() noexcept {
+    m_wake_target.count_resume<Channel>();
+    if (m_slot.state() == RustRecvResult::Pending &&
+        m_slot.recv(*m_rust_receiver, nullptr) == RustRecvResult::Pending)
+      std::terminate();
+
+    switch (m_slot.state()) {
+    case RustRecvResult::Ready:
+      try {
+        unifex::set_value(std::move(m_unifex_receiver), m_slot.take());
+      } catch (...) {
+        unifex::set_error(std::move(m_unifex_receiver),
+                          std::current_exception());
+      }
+      break;
+    case RustRecvResult::Error:
+      unifex::set_error(std::move(m_unifex_receiver),
+                        m_slot.take_error().to_exception_ptr());
+      break;
+    default:
+      unifex::set_done(std::move(m_unifex_receiver));
+      break;
+    }
+  }
+
+public:
+  void start() noexcept {
+    rust_count<Channel>(RustCounter::Awaits);
+    if (m_slot.recv(*m_rust_receiver, nullptr) != RustRecvResult::Pending) {
+      rust_count<Channel>(RustCounter::ReadyAwaits);
+      complete();
+      return;
+    }
+    if (m_slot.recv(*m_rust_receiver,
+                    m_wake_target.prepare(
+                        std::experimental::coroutine_handle<void>())) !=
+        RustRecvResult::Pending)
+      complete();
+  }
+
+  RustStreamNextOperation(rust::Box<RustReceiver> &rust_receiver,
+                          UnifexReceiver &&unifex_receiver)
+      : m_rust_receiver(rust_receiver),
+        m_unifex_receiver(std::move(unifex_receiver)),
+        m_executor(m_unifex_receiver), m_slot(), m_wake_target() {
+    m_wake_target.set_executor(this);
+  }
+};
+
+template <typename Channel> class RustStreamNextSender {
+  typedef RustStreamReceiverFor<Channel> RustReceiver;
+
+  rust::Box<RustReceiver> &m_rust_receiver;
+
+public:
+  template <template <typename...> class Variant,
+            template <typename...> class Tuple>
+  using value_types = Variant<Tuple<RustStreamItemFor<Channel>>>;
+  template <template <typename...> class Variant>
+  using error_types = Variant<std::exception_ptr>;
+  static constexpr bool sends_done = true;
+
+  explicit RustStreamNextSender(rust::Box<RustReceiver> &rust_receiver)
+      : m_rust_receiver(rust_receiver) {}
+
+  template <typename UnifexReceiver>
+  friend RustStreamNextOperation<Channel, std::decay_t<UnifexReceiver>>
+  tag_invoke(unifex::tag_t<unifex::connect>, RustStreamNextSender &&sender,
+             UnifexReceiver &&unifex_receiver) {
+    return RustStreamNextOperation<Channel, std::decay_t<UnifexReceiver>>(
+        sender.m_rust_receiver, std::move(unifex_receiver));
+  }
+};
+
+// A libunifex stream over a Rust stream.
+template <typename Channel> class RustUnifexStream {
+  typedef RustStreamReceiverFor<Channel> RustReceiver;
+
+  rust::Box<RustReceiver> m_rust_receiver;
+
+public:
+  explicit RustUnifexStream(rust::Box<RustReceiver> &&rust_receiver)
+      : m_rust_receiver(std::move(rust_receiver)) {}
+
+  friend RustStreamNextSender<Channel> tag_invoke(unifex::tag_t<unifex::next>,
+                                                  RustUnifexStream &stream) {
+    return RustStreamNextSender<Channel>(stream.m_rust_receiver);
+  }
+
+  // Dropping the receiver is all the cleanup there is, and that happens when
+  // the stream is destroyed.
+  friend auto tag_invoke(unifex::tag_t<unifex::cleanup>, RustUnifexStream &) {
+    return unifex::just();
+  }
+};
+
+template <typename Receiver>
+RustUnifexStream<RustStreamChannelFor<Receiver>>
+rust_stream_to_unifex_stream(rust::Box<Receiver> &&receiver) {
+  return RustUnifexStream<RustStreamChannelFor<Receiver>>(std::move(receiver));
+}
+
 
 #endif
 
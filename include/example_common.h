@@ -3,7 +3,20 @@
 #ifndef CXX_ASYNC_EXAMPLE_COMMON_H
 #define CXX_ASYNC_EXAMPLE_COMMON_H
 
+#include "rust/cxx.h"
+#include <chrono>
 #include <cstdint>
+#include <memory>
+#include <vector>
+
+#define EXAMPLE_SPLIT_LIMIT     32
+#define EXAMPLE_ARRAY_SIZE      16384
+
+// How `dot_product_grain()` sizes the leaves of a split dot product.
+#define DOT_PRODUCT_WORK_PER_FORK           16
+#define DOT_PRODUCT_MAX_GRAIN               (1 << 20)
+#define DOT_PRODUCT_CALIBRATION_ELEMENTS    (1 << 14)
+#define DOT_PRODUCT_CALIBRATION_FORKS       1024
 
 class Xorshift {
 private:
@@ -15,4 +28,82 @@ public:
     uint32_t next();
 };
 
+// Counts the example coroutine frames that are alive, so that the cancellation
+// tests can check that cancelled coroutines really are destroyed.
+class LiveFrameGuard {
+private:
+    LiveFrameGuard(LiveFrameGuard &) = delete;
+    void operator=(LiveFrameGuard) = delete;
+public:
+    LiveFrameGuard();
+    ~LiveFrameGuard();
+};
+
+// Runs `f` and returns how long it took, in nanoseconds.
+template <typename F> double time_ns(F &&f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+// Nanoseconds since `start`, for timing work that's awaited rather than run.
+inline double elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+// Frames live at once in `time_frame_allocations()`.
+#define FRAME_BATCH             64
+
+// What `rust_bench_value()` returns. Keep in sync with bench.rs.
+#define BENCH_VALUE_READY       0
+#define BENCH_VALUE_PENDING     1
+#define BENCH_VALUE_ERROR       2
+#define BENCH_VALUE_READY_ERROR 3
+#define BENCH_VALUE_CODED_ERROR 4
+
+// The code of the coded errors in the benchmarks. Keep in sync with bench.rs.
+#define BENCH_ERROR_CODE        42
+
+struct RustOneshotReceiverF64;
+struct RustOneshotReceiverVecU8;
+struct RustOneshotReceiverVecF64;
+struct RustOneshotReceiverCxxVectorU8;
+struct RustOneshotReceiverCxxVectorF64;
+
+double dot_product_kernel(const double *a, const double *b, size_t count);
+double cxx_dot_product_kernel(rust::Slice<const double> a,
+                              rust::Slice<const double> b);
+rust::String dot_product_kernel_name();
+size_t dot_product_grain(double fork_overhead_ns);
+void print_awaiter_sizes();
+double time_frame_allocations(size_t size, uint32_t threads, uint32_t count,
+                              bool pooled);
+int32_t live_cxx_frames();
+void cxx_count_allocations(bool enabled);
+uint64_t cxx_allocation_count();
+std::vector<rust::Box<RustOneshotReceiverF64>> rust_bench_values(int32_t kind,
+                                                                 int32_t count);
+int32_t cxx_await_rust_error(int32_t kind, bool throwing);
+void cxx_await_rust_then(rust::Box<RustOneshotReceiverF64> receiver,
+                         rust::Fn<void(double)> done);
+double cxx_block_on_rust(int32_t kind);
+void cxx_call_rust_dot_product_blocking();
+rust::Box<RustOneshotReceiverF64> cxx_bench_error(bool exception);
+rust::Box<RustOneshotReceiverF64> cxx_pong(int32_t i);
+rust::Box<RustOneshotReceiverF64> cxx_ping_pong_loop(int32_t iterations);
+rust::Box<RustOneshotReceiverF64>
+cxx_chain_link(rust::Box<RustOneshotReceiverF64> inner);
+std::unique_ptr<std::vector<uint8_t>> cxx_make_vector_u8(size_t len);
+rust::Box<RustOneshotReceiverVecU8>
+cxx_echo_vec_u8(rust::Box<RustOneshotReceiverVecU8> inner);
+rust::Box<RustOneshotReceiverCxxVectorU8>
+cxx_echo_vector_u8(rust::Box<RustOneshotReceiverCxxVectorU8> inner);
+rust::Box<RustOneshotReceiverCxxVectorF64> cxx_random_vector_f64(size_t len);
+rust::Box<RustOneshotReceiverF64>
+cxx_sum_vec_f64(rust::Box<RustOneshotReceiverVecF64> values);
+
 #endif
\ No newline at end of file
@@ -6,15 +6,35 @@
 #include "cxx_async.h"
 #include "rust/cxx.h"
 
-#define EXAMPLE_SPLIT_LIMIT     32
-#define EXAMPLE_ARRAY_SIZE      16384
-
+struct RustFutureF64;
+struct RustLazyF64;
 struct RustOneshotReceiverF64;
+struct RustOneshotReceiverString;
+struct RustStreamReceiverF64;
 
 rust::Box<RustOneshotReceiverF64> folly_dot_product();
+rust::Box<RustLazyF64> folly_dot_product_lazy();
+double folly_time_dot_product(size_t count, uint32_t threads, size_t grain,
+                              uint32_t iterations);
 void folly_call_rust_dot_product();
+void folly_collect_rust_dot_products();
 rust::Box<RustOneshotReceiverF64> folly_not_product();
+rust::Box<RustLazyF64> folly_not_product_lazy();
 void folly_call_rust_not_product();
-rust::Box<RustOneshotReceiverString> folly_ping_pong(int i);
+void folly_call_rust_dot_product_inline();
+void folly_call_rust_not_product_inline();
+rust::Box<RustOneshotReceiverString> folly_ping_pong(int i, int depth);
+void folly_call_rust_dot_product_chunks();
+rust::Box<RustOneshotReceiverF64> folly_sum_until_cancelled();
+void folly_cancel_rust_pending_forever();
+rust::Box<RustOneshotReceiverF64> folly_ready_value();
+rust::Box<RustOneshotReceiverF64> folly_pending_value();
+rust::Box<RustLazyF64> folly_ready_value_lazy();
+rust::Box<RustLazyF64> folly_pending_value_lazy();
+double folly_await_rust(int32_t kind);
+double folly_await_rust_inline(int32_t kind);
+double folly_await_rust_concurrently(int32_t kind, int32_t count);
+double folly_join_rust(int32_t kind, int32_t count);
+double folly_when_all_rust(int32_t kind, int32_t count);
 
 #endif
@@ -6,15 +6,25 @@
 #include "cxx_async.h"
 #include "rust/cxx.h"
 
-#define EXAMPLE_SPLIT_LIMIT     32
-#define EXAMPLE_ARRAY_SIZE      16384
-
 struct RustOneshotReceiverF64;
+struct RustOneshotReceiverString;
+struct RustStreamReceiverF64;
 
 rust::Box<RustOneshotReceiverF64> libunifex_dot_product();
+double libunifex_time_dot_product(size_t count, uint32_t threads, size_t grain,
+                                  uint32_t iterations);
 void libunifex_call_rust_dot_product_with_coro();
 void libunifex_call_rust_dot_product_directly();
 rust::Box<RustOneshotReceiverF64> libunifex_not_product();
 void libunifex_call_rust_not_product();
+rust::Box<RustOneshotReceiverString> libunifex_ping_pong(int i, int depth);
+void libunifex_call_rust_dot_product_chunks();
+rust::Box<RustOneshotReceiverF64> libunifex_sum_until_cancelled();
+void libunifex_cancel_rust_pending_forever();
+rust::Box<RustOneshotReceiverF64> libunifex_ready_value();
+rust::Box<RustOneshotReceiverF64> libunifex_pending_value();
+double libunifex_await_rust(int32_t kind);
+double libunifex_await_rust_concurrently(int32_t kind, int32_t count);
+double libunifex_join_rust(int32_t kind, int32_t count);
 
 #endif
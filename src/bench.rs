@@ -0,0 +1,1133 @@
+// cxx-async/src/bench.rs
+//
+// Benchmarks for the bridge. Run with `cargo run --release -- bench [options] [filter]`:
+//
+//     --json             Print one JSON object per benchmark instead of a table.
+//     --iterations N     Calls per benchmark (default 10000 for those that time each call, and
+//                        1000000 for the tight loops).
+//     --depth N          Crossings per ping-pong round trip (default 8).
+//     --concurrency N    Bridged futures in flight per throughput batch (default 4096).
+//     --fan-out N        Rust futures that C++ joins at once (default 10000).
+//     filter             Only run benchmarks whose names contain this string.
+//
+// Allocations are counted on both sides of the bridge, Rust's through the global allocator below and
+// C++'s through the replacement `operator new` in example_common.cpp, while a `CountAllocations` is
+// alive. With the `counters` feature, the oneshot benchmarks also count their
+// atomic read-modify-writes.
+
+use crate::counters;
+use crate::ffi::{PodPoint, RustPodValue};
+use crate::mpsc;
+use crate::oneshot;
+use crate::pod;
+use crate::pool::Priority;
+use crate::timer;
+use crate::{dot_product_inner, THREAD_POOL};
+use crate::{ready, CxxAsync, CxxAsyncException, CxxAsyncStream, CxxReceiver};
+use crate::{RustMpscReceiverF64, RustStreamReceiverF64, DOT_PRODUCT_GRAIN, SPLIT_LIMIT};
+use crate::{RustOneshotReceiverCxxVectorU8, RustOneshotReceiverF64, RustOneshotReceiverVecU8};
+use futures::executor;
+use futures::future::{self, join_all, poll_fn};
+use futures::task::{noop_waker, SpawnExt};
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+use std::future::Future;
+use std::hint;
+use std::iter;
+use std::pin::Pin;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::task::{Context, Poll};
+use std::thread;
+use std::time::{Duration, Instant};
+
+// Iterations of the tight loops in `Bench::measure` and the like, unless `--iterations` says
+// otherwise.
+const LOOP_ITERATIONS: usize = 1_000_000;
+const STREAM_ITEMS: usize = 100_000;
+// Atomic read-modify-writes per round trip through a futures-channel 0.3 oneshot, which can't count
+// its own: the `Arc` clone in `channel`, a `try_lock` of the value slot in `send` and another in
+// `try_recv` or the completing poll, `try_lock`s of both wakers' slots as each end drops, and each
+// end's `Arc` release. A receiver that has to wait takes one more `try_lock` to register its waker.
+const FUTURES_ONESHOT_ATOMICS_READY: u64 = 9;
+const FUTURES_ONESHOT_ATOMICS_PENDING: u64 = 10;
+// Coroutine frame sizes for `bench_frame_allocation`.
+const FRAME_SIZES: [usize; 3] = [128, 512, 2048];
+
+// Vector lengths for the dot product benchmarks: the examples' own, and well past it. Each
+// benchmark runs about `DOT_PRODUCT_ELEMENTS` elements through in all.
+const DOT_PRODUCT_SIZES: [(usize, &str); 3] = [(16384, "16K"), (1 << 20, "1M"), (16 << 20, "16M")];
+const DOT_PRODUCT_ELEMENTS: usize = 1 << 26;
+// Leaf sizes: what the examples used to split down to, and zero for the calibrated grain.
+const DOT_PRODUCT_GRAINS: [(usize, &str); 2] = [(SPLIT_LIMIT, "32"), (0, "auto")];
+
+// What `rust_bench_value` returns. Keep in sync with `BENCH_VALUE_*` in example_common.h.
+pub const BENCH_VALUE_READY: i32 = 0;
+pub const BENCH_VALUE_PENDING: i32 = 1;
+pub const BENCH_VALUE_ERROR: i32 = 2;
+pub const BENCH_VALUE_READY_ERROR: i32 = 3;
+pub const BENCH_VALUE_CODED_ERROR: i32 = 4;
+
+// The code of the coded errors in the benchmarks. Keep in sync with example_common.h.
+pub const BENCH_ERROR_CODE: i32 = 42;
+
+// Counts heap allocations made through Rust's allocator so that benchmarks can report
+// allocations per operation. Outside of a `CountAllocations`, it costs one relaxed load. Inside, each
+// thread counts in a slot of its own with a plain load and store, and `allocation_count` adds up the
+// slots.
+struct CountingAllocator;
+
+// Threads past the first `ALLOCATION_SLOTS - 1` share the last slot, and add to it atomically.
+const ALLOCATION_SLOTS: usize = 256;
+
+#[repr(align(64))]
+struct AllocationSlot(AtomicUsize);
+
+const EMPTY_ALLOCATION_SLOT: AllocationSlot = AllocationSlot(AtomicUsize::new(0));
+static ALLOCATIONS: [AllocationSlot; ALLOCATION_SLOTS] = [EMPTY_ALLOCATION_SLOT; ALLOCATION_SLOTS];
+static NEXT_ALLOCATION_SLOT: AtomicUsize = AtomicUsize::new(0);
+// Live `CountAllocations`.
+static ALLOCATION_COUNTING: AtomicUsize = AtomicUsize::new(0);
+
+thread_local! {
+    // This thread's index into `ALLOCATIONS`, or `usize::MAX` if it hasn't counted anything yet.
+    static ALLOCATION_SLOT: Cell<usize> = const { Cell::new(usize::MAX) };
+}
+
+fn count_allocation() {
+    if ALLOCATION_COUNTING.load(Ordering::Relaxed) == 0 {
+        return;
+    }
+    let _ = ALLOCATION_SLOT.try_with(|slot| {
+        if slot.get() == usize::MAX {
+            let index = NEXT_ALLOCATION_SLOT.fetch_add(1, Ordering::Relaxed);
+            slot.set(index.min(ALLOCATION_SLOTS - 1));
+        }
+        let count = &ALLOCATIONS[slot.get()].0;
+        if slot.get() == ALLOCATION_SLOTS - 1 {
+            count.fetch_add(1, Ordering::Relaxed);
+        } else {
+            count.store(count.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+        }
+    });
+}
+
+#[global_allocator]
+static GLOBAL_ALLOCATOR: CountingAllocator = CountingAllocator;
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        count_allocation();
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        count_allocation();
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+// Has both sides count their allocations, for as long as it's alive.
+pub struct CountAllocations(());
+
+impl CountAllocations {
+    pub fn new() -> CountAllocations {
+        ALLOCATION_COUNTING.fetch_add(1, Ordering::Relaxed);
+        crate::ffi::cxx_count_allocations(true);
+        CountAllocations(())
+    }
+}
+
+impl Drop for CountAllocations {
+    fn drop(&mut self) {
+        crate::ffi::cxx_count_allocations(false);
+        ALLOCATION_COUNTING.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+// Heap allocations on both sides made while a `CountAllocations` was alive.
+pub fn allocation_count() -> usize {
+    let rust: usize = ALLOCATIONS
+        .iter()
+        .map(|slot| slot.0.load(Ordering::Relaxed))
+        .sum();
+    rust + crate::ffi::cxx_allocation_count() as usize
+}
+
+struct Measurement {
+    name: String,
+    ops: usize,
+    elapsed: Duration,
+    allocations: usize,
+    // Atomic read-modify-writes, for benchmarks that count them.
+    atomics: Option<u64>,
+    // Nanoseconds per operation, sorted, for benchmarks that time each operation separately.
+    latencies: Option<Vec<u64>>,
+    // The payload that each operation moves, for benchmarks that move buffers.
+    bytes_per_op: usize,
+}
+
+// Where a benchmark's count of atomic read-modify-writes comes from, if it has one.
+#[derive(Clone, Copy)]
+enum Atomics {
+    Uncounted,
+    // What `counters::count_atomic` counts on this thread, with the `counters` feature.
+    Counted,
+    // A known number per operation, for code that can't count its own.
+    PerOp(u64),
+}
+
+impl Measurement {
+    fn percentile(&self, fraction: f64) -> Option<u64> {
+        self.latencies.as_ref().map(|latencies| {
+            let index = ((latencies.len() as f64 * fraction) as usize).min(latencies.len() - 1);
+            latencies[index]
+        })
+    }
+}
+
+struct Bench {
+    json: bool,
+    filter: Option<String>,
+    // For benchmarks that time each operation, or that are costly per operation.
+    iterations: usize,
+    // For the cheap benchmarks that run in a tight loop.
+    loop_iterations: usize,
+    depth: i32,
+    concurrency: usize,
+    fan_out: usize,
+}
+
+impl Bench {
+    fn from_args(args: &[String]) -> Bench {
+        let mut bench = Bench {
+            json: false,
+            filter: None,
+            iterations: 10_000,
+            loop_iterations: LOOP_ITERATIONS,
+            depth: 8,
+            concurrency: 4096,
+            fan_out: 10_000,
+        };
+        let mut args = args.iter();
+        while let Some(arg) = args.next() {
+            let mut value = || {
+                args.next()
+                    .and_then(|value| value.parse().ok())
+                    .unwrap_or_else(|| panic!("{} needs a number", arg))
+            };
+            match arg.as_str() {
+                "--json" => bench.json = true,
+                "--iterations" => {
+                    bench.iterations = value();
+                    bench.loop_iterations = bench.iterations;
+                }
+                "--depth" => bench.depth = value() as i32,
+                "--concurrency" => bench.concurrency = value(),
+                "--fan-out" => bench.fan_out = value(),
+                _ => bench.filter = Some(arg.clone()),
+            }
+        }
+        bench
+    }
+
+    fn enabled(&self, name: &str) -> bool {
+        self.filter
+            .as_ref()
+            .map_or(true, |filter| name.contains(filter.as_str()))
+    }
+
+    fn report(&self, measurement: Measurement) {
+        let ns_per_op = measurement.elapsed.as_nanos() as f64 / measurement.ops as f64;
+        let allocs_per_op = measurement.allocations as f64 / measurement.ops as f64;
+        let atomics_per_op = measurement
+            .atomics
+            .map(|atomics| atomics as f64 / measurement.ops as f64);
+        let (p50, p99, p999) = (
+            measurement.percentile(0.5),
+            measurement.percentile(0.99),
+            measurement.percentile(0.999),
+        );
+
+        let bytes_per_sec = match measurement.bytes_per_op {
+            0 => None,
+            bytes => Some((bytes as f64 * 1e9 / ns_per_op) as u64),
+        };
+
+        if self.json {
+            let field = |value: Option<u64>| value.map_or("null".to_owned(), |v| v.to_string());
+            println!(
+                "{{\"name\":\"{}\",\"ops\":{},\"ns_per_op\":{:.1},\"ops_per_sec\":{:.0},\
+                 \"allocs_per_op\":{:.2},\"atomics_per_op\":{},\"p50_ns\":{},\"p99_ns\":{},\
+                 \"p999_ns\":{},\"bytes_per_sec\":{}}}",
+                measurement.name,
+                measurement.ops,
+                ns_per_op,
+                1e9 / ns_per_op,
+                allocs_per_op,
+                atomics_per_op.map_or("null".to_owned(), |v| format!("{:.2}", v)),
+                field(p50),
+                field(p99),
+                field(p999),
+                field(bytes_per_sec)
+            );
+            return;
+        }
+
+        let field = |value: Option<u64>| value.map_or("-".to_owned(), |v| v.to_string());
+        let throughput = bytes_per_sec.map_or(String::new(), |bytes| {
+            format!("   {:.1} GB/s", bytes as f64 / 1e9)
+        });
+        let atomics = atomics_per_op.map_or("-".to_owned(), |atomics| format!("{:.2}", atomics));
+        println!(
+            "{:<48} {:>9.1} ns/op {:>6.2} allocs/op {:>6} atomics/op   \
+             p50 {:>8} p99 {:>8} p999 {:>8}{}",
+            measurement.name,
+            ns_per_op,
+            allocs_per_op,
+            atomics,
+            field(p50),
+            field(p99),
+            field(p999),
+            throughput
+        );
+    }
+
+    fn measure<F>(&self, name: &str, mut f: F)
+    where
+        F: FnMut(),
+    {
+        self.measure_ops(name, self.loop_iterations, || {
+            for _ in 0..self.loop_iterations {
+                f();
+            }
+        });
+    }
+
+    // Like `measure`, also reporting atomic read-modify-writes per call, as `atomics` says.
+    fn measure_atomics<F>(&self, name: &str, atomics: Atomics, mut f: F)
+    where
+        F: FnMut(),
+    {
+        self.measure_ops_with(name, self.loop_iterations, atomics, || {
+            for _ in 0..self.loop_iterations {
+                f();
+            }
+        });
+    }
+
+    // Runs `f` once and reports its cost divided over the `ops` operations that it performs.
+    fn measure_ops<F>(&self, name: &str, ops: usize, f: F)
+    where
+        F: FnOnce(),
+    {
+        self.measure_ops_with(name, ops, Atomics::Uncounted, f)
+    }
+
+    fn measure_ops_with<F>(&self, name: &str, ops: usize, atomics: Atomics, f: F)
+    where
+        F: FnOnce(),
+    {
+        if !self.enabled(name) {
+            return;
+        }
+        let start_atomics = counters::thread_atomics();
+        let start_allocations = allocation_count();
+        let start = Instant::now();
+        f();
+        let elapsed = start.elapsed();
+        let allocations = allocation_count() - start_allocations;
+        let atomics = match atomics {
+            Atomics::Uncounted => None,
+            Atomics::Counted => counters::thread_atomics()
+                .zip(start_atomics)
+                .map(|(end, start)| end - start),
+            Atomics::PerOp(per_op) => Some(per_op * ops as u64),
+        };
+        self.report(Measurement {
+            name: name.to_owned(),
+            ops,
+            elapsed,
+            allocations,
+            atomics,
+            latencies: None,
+            bytes_per_op: 0,
+        });
+    }
+
+    // Times each of `self.iterations` calls to `f` separately, after a short warmup.
+    fn measure_latency<F>(&self, name: &str, f: F)
+    where
+        F: FnMut(),
+    {
+        self.measure_latency_with(name, self.iterations, 0, f)
+    }
+
+    // Like `measure_latency`, with a given number of iterations, each moving `bytes_per_op`.
+    fn measure_latency_with<F>(&self, name: &str, iterations: usize, bytes_per_op: usize, mut f: F)
+    where
+        F: FnMut(),
+    {
+        if !self.enabled(name) {
+            return;
+        }
+        for _ in 0..iterations / 10 {
+            f();
+        }
+
+        let mut latencies = Vec::with_capacity(iterations);
+        let start_allocations = allocation_count();
+        let start = Instant::now();
+        for _ in 0..iterations {
+            let op_start = Instant::now();
+            f();
+            latencies.push(op_start.elapsed().as_nanos() as u64);
+        }
+        let elapsed = start.elapsed();
+        let allocations = allocation_count() - start_allocations;
+        latencies.sort_unstable();
+        self.report(Measurement {
+            name: name.to_owned(),
+            ops: iterations,
+            elapsed,
+            allocations,
+            atomics: None,
+            latencies: Some(latencies),
+            bytes_per_op,
+        });
+    }
+}
+
+// Compares the channel that `define_oneshot!` used to build (a `futures::channel::oneshot` plus a
+// `Box` for each end) against `oneshot`.
+fn bench_oneshot_round_trip(bench: &Bench) {
+    let waker = noop_waker();
+
+    let (futures_ready, futures_pending) = (
+        Atomics::PerOp(FUTURES_ONESHOT_ATOMICS_READY),
+        Atomics::PerOp(FUTURES_ONESHOT_ATOMICS_PENDING),
+    );
+    bench.measure_atomics(
+        "core/futures oneshot + 2 boxes, ready",
+        futures_ready,
+        || {
+            let (sender, receiver) = futures::channel::oneshot::channel();
+            let (sender, mut receiver) = (Box::new(sender), Box::new(receiver));
+            sender.send(Ok::<f64, CxxAsyncException>(1.0)).unwrap();
+            hint::black_box(receiver.try_recv().unwrap());
+        },
+    );
+    bench.measure_atomics(
+        "core/futures oneshot + 2 boxes, pending",
+        futures_pending,
+        || {
+            let (sender, receiver) = futures::channel::oneshot::channel();
+            let (sender, mut receiver) = (Box::new(sender), Box::new(receiver));
+            let mut context = Context::from_waker(&waker);
+            assert!(futures::FutureExt::poll_unpin(&mut *receiver, &mut context).is_pending());
+            sender.send(Ok::<f64, CxxAsyncException>(1.0)).unwrap();
+            assert!(futures::FutureExt::poll_unpin(&mut *receiver, &mut context).is_ready());
+        },
+    );
+
+    bench.measure_atomics("core/oneshot, ready", Atomics::Counted, || {
+        let (mut sender, mut receiver) = oneshot::channel::<f64>();
+        sender.send(Ok(1.0));
+        drop(sender);
+        hint::black_box(receiver.try_recv().unwrap().unwrap().unwrap());
+    });
+    bench.measure_atomics("core/oneshot, pending", Atomics::Counted, || {
+        let (mut sender, mut receiver) = oneshot::channel::<f64>();
+        let mut context = Context::from_waker(&waker);
+        assert!(receiver.poll_recv(&mut context).is_pending());
+        sender.send(Ok(1.0));
+        drop(sender);
+        assert!(receiver.poll_recv(&mut context).is_ready());
+    });
+
+    // A 16-byte struct through the shared pod channel, packing and unpacking included.
+    bench.measure_atomics("core/oneshot pod, ready", Atomics::Counted, || {
+        let (mut sender, mut receiver) = oneshot::channel::<RustPodValue>();
+        sender.send(Ok(pod::pack(PodPoint { x: 1.0, y: 2.0 })));
+        drop(sender);
+        let value = receiver.try_recv().unwrap().unwrap().unwrap();
+        hint::black_box(pod::unpack::<PodPoint>(value).unwrap());
+    });
+}
+
+// A C++ coroutine awaits a pending channel, registering its waker, and Rust then completes it,
+// resuming the coroutine inline. Counts the allocations that this costs, which should be none.
+fn bench_cxx_waker_allocations(bench: &Bench) {
+    fn done(value: f64) {
+        hint::black_box(value);
+    }
+
+    let name = "core/C++ coroutine waker, await + wake";
+    if !bench.enabled(name) {
+        return;
+    }
+    let (mut elapsed, mut waker_allocations) = (Duration::default(), 0);
+    for _ in 0..bench.loop_iterations {
+        let (mut sender, receiver) = oneshot::channel::<f64>();
+        let receiver = RustOneshotReceiverF64::from_receiver(receiver);
+        let start_allocations = allocation_count();
+        let start = Instant::now();
+        crate::ffi::cxx_await_rust_then(receiver, done);
+        sender.send(Ok(1.0));
+        elapsed += start.elapsed();
+        waker_allocations += allocation_count() - start_allocations;
+        drop(sender);
+    }
+    bench.report(Measurement {
+        name: name.to_owned(),
+        ops: bench.loop_iterations,
+        elapsed,
+        allocations: waker_allocations,
+        atomics: None,
+        latencies: None,
+        bytes_per_op: 0,
+    });
+}
+
+// Compares where C++ coroutine frames come from: the per-thread frame pool that the bridge's
+// promises use, and the heap, which they used before. Sizes are those of small and large bridged
+// coroutines, on one thread and on one per CPU.
+fn bench_frame_allocation(bench: &Bench) {
+    let max_threads = thread::available_parallelism().map_or(1, |threads| threads.get());
+    let mut thread_counts = vec![1];
+    if max_threads > 1 {
+        thread_counts.push(max_threads);
+    }
+    for threads in thread_counts {
+        for &size in &FRAME_SIZES {
+            for &(pooled, source) in &[(false, "heap"), (true, "pooled")] {
+                let name = format!(
+                    "core/coroutine frames/{}/threads={}/size={}",
+                    source, threads, size
+                );
+                if !bench.enabled(&name) {
+                    continue;
+                }
+                let start_allocations = allocation_count();
+                let elapsed_ns = crate::ffi::time_frame_allocations(
+                    size,
+                    threads as u32,
+                    bench.loop_iterations as u32,
+                    pooled,
+                );
+                bench.report(Measurement {
+                    name,
+                    ops: bench.loop_iterations * threads,
+                    elapsed: Duration::from_nanos(elapsed_ns as u64),
+                    allocations: allocation_count() - start_allocations,
+                    atomics: None,
+                    latencies: None,
+                    bytes_per_op: 0,
+                });
+            }
+        }
+    }
+}
+
+// Measures errors crossing the bridge. The "message" and "exception" rows take the path that every
+// error used to: a message allocated on the Rust side, or a C++ exception whose `what()` Rust
+// copies out, then thrown in C++. The "code" rows send a code and a static message instead, and
+// `rust_try` awaits without throwing, so that path shouldn't allocate beyond the channel.
+fn bench_error_path(bench: &Bench) {
+    let rust_to_cxx = [
+        ("message, throw", BENCH_VALUE_READY_ERROR, true),
+        ("code, throw", BENCH_VALUE_CODED_ERROR, true),
+        ("code, rust_try", BENCH_VALUE_CODED_ERROR, false),
+    ];
+    for &(path, kind, throwing) in &rust_to_cxx {
+        let name = format!("core/error/rust_to_cxx/{}", path);
+        bench.measure_latency(&name, || {
+            hint::black_box(crate::ffi::cxx_await_rust_error(kind, throwing));
+        });
+    }
+
+    bench.measure_latency("core/error/cxx_to_rust/exception + what()", || {
+        let error = executor::block_on(crate::ffi::cxx_bench_error(true))
+            .unwrap()
+            .unwrap_err();
+        hint::black_box(error.what().len());
+    });
+    bench.measure_latency("core/error/cxx_to_rust/exception", || {
+        let error = executor::block_on(crate::ffi::cxx_bench_error(true))
+            .unwrap()
+            .unwrap_err();
+        hint::black_box(error.code());
+    });
+    bench.measure_latency("core/error/cxx_to_rust/code", || {
+        let error = executor::block_on(crate::ffi::cxx_bench_error(false))
+            .unwrap()
+            .unwrap_err();
+        assert_eq!(error.code(), BENCH_ERROR_CODE);
+    });
+}
+
+// Delivers `STREAM_ITEMS` values from the thread pool, first with a oneshot (and a spawned task)
+// per value, and then through one stream channel drained a batch at a time.
+fn bench_stream_throughput(bench: &Bench) {
+    bench.measure_ops("core/oneshot per item, thread pool", STREAM_ITEMS, || {
+        for i in 0..STREAM_ITEMS {
+            let receiver: Box<RustOneshotReceiverF64> =
+                async move { Ok(i as f64) }.via(&*THREAD_POOL);
+            hint::black_box(executor::block_on(receiver).unwrap().unwrap());
+        }
+    });
+
+    bench.measure_ops(
+        "core/stream, batched receive, thread pool",
+        STREAM_ITEMS,
+        || {
+            let items = (0..STREAM_ITEMS).map(|i| Ok(i as f64));
+            let mut receiver: Box<RustStreamReceiverF64> =
+                futures::stream::iter(items).via_stream(&*THREAD_POOL);
+            let mut batch = Vec::with_capacity(crate::stream::DEFAULT_CAPACITY);
+            let received = executor::block_on(async {
+                let mut received = 0;
+                while let Some(result) =
+                    poll_fn(|context| receiver.poll_recv_many(context, &mut batch)).await
+                {
+                    received += result.unwrap();
+                    hint::black_box(&batch);
+                    batch.clear();
+                }
+                received
+            });
+            assert_eq!(received, STREAM_ITEMS);
+        },
+    );
+}
+
+// Sends `STREAM_ITEMS` values from C++ producers, each a coroutine on a cppcoro pool thread of its
+// own, into one MPSC channel that a Rust thread drains a batch at a time.
+fn bench_mpsc_throughput(bench: &Bench) {
+    for &producers in &[1, 4, 16, 64] {
+        let name = format!("core/mpsc, {} C++ producers, batched receive", producers);
+        let items = STREAM_ITEMS / producers;
+        bench.measure_ops(&name, items * producers, || {
+            let (sender, mut receiver) = RustMpscReceiverF64::channel(mpsc::DEFAULT_CAPACITY);
+            let consumer = thread::spawn(move || {
+                let mut batch = Vec::with_capacity(mpsc::DEFAULT_CAPACITY);
+                executor::block_on(async {
+                    let mut received = 0;
+                    while let Some(count) =
+                        poll_fn(|context| receiver.poll_recv_many(context, &mut batch)).await
+                    {
+                        received += count;
+                        hint::black_box(&batch);
+                        batch.clear();
+                    }
+                    received
+                })
+            });
+            crate::ffi::cppcoro_produce_mpsc(sender, producers as i32, items as i32);
+            assert_eq!(consumer.join().unwrap(), items * producers);
+        });
+    }
+}
+
+// Moves a buffer of each size from Rust to C++ and back, either a Rust `Vec` (which C++ sees as a
+// `rust::Vec`) or a C++ `std::vector` (which Rust sees as a `CxxVector`). Only ownership crosses
+// the bridge, so the cost shouldn't depend on the size; copying the buffer once is there to
+// compare.
+fn bench_buffers(bench: &Bench) {
+    for &(size, label) in &[(1 << 10, "1KB"), (1 << 20, "1MB"), (100 << 20, "100MB")] {
+        let mut vec = Some(vec![0u8; size]);
+        let name = format!("buffer/rust_vec_round_trip/size={}", label);
+        bench.measure_latency_with(&name, bench.iterations, size, || {
+            let receiver = ready::<RustOneshotReceiverVecU8>(vec.take().unwrap());
+            let echoed = executor::block_on(crate::ffi::cxx_echo_vec_u8(receiver));
+            vec = Some(echoed.unwrap().unwrap());
+        });
+
+        let mut vector = Some(crate::ffi::cxx_make_vector_u8(size));
+        let name = format!("buffer/cxx_vector_round_trip/size={}", label);
+        bench.measure_latency_with(&name, bench.iterations, size, || {
+            let receiver = ready::<RustOneshotReceiverCxxVectorU8>(vector.take().unwrap());
+            let echoed = executor::block_on(crate::ffi::cxx_echo_vector_u8(receiver));
+            vector = Some(echoed.unwrap().unwrap());
+        });
+
+        // Don't copy much more than a gigabyte in all.
+        let iterations = bench.iterations.min((1 << 30) / size).max(10);
+        let vec = vec.unwrap();
+        let name = format!("buffer/copy/size={}", label);
+        bench.measure_latency_with(&name, iterations, size, || {
+            hint::black_box(vec.to_vec());
+        });
+    }
+}
+
+fn dot_product_iterations(size: usize) -> usize {
+    (DOT_PRODUCT_ELEMENTS / size).max(4)
+}
+
+// Measures the shared dot product kernel against a plain loop, and the Rust dot product, whose
+// `join!`ed halves all run on one thread.
+fn bench_dot_product_kernel(bench: &Bench) {
+    let kernel = crate::ffi::dot_product_kernel_name();
+    for &(size, label) in &DOT_PRODUCT_SIZES {
+        let (a, b) = (vec![1.0; size], vec![2.0; size]);
+        let iterations = dot_product_iterations(size);
+
+        let name = format!("dot_product/kernel={}/size={}", kernel, label);
+        bench.measure_latency_with(&name, iterations, size * 16, || {
+            hint::black_box(crate::ffi::cxx_dot_product_kernel(&a, &b));
+        });
+        let name = format!("dot_product/kernel=loop/size={}", label);
+        bench.measure_latency_with(&name, iterations, size * 16, || {
+            hint::black_box(a.iter().zip(b.iter()).map(|(&a, &b)| a * b).sum::<f64>());
+        });
+
+        for &(grain, grain_label) in &DOT_PRODUCT_GRAINS {
+            let grain = if grain == 0 {
+                *DOT_PRODUCT_GRAIN
+            } else {
+                grain
+            };
+            let name = format!("rust/dot_product/size={}/grain={}", label, grain_label);
+            bench.measure_latency_with(&name, iterations, size * 16, || {
+                hint::black_box(executor::block_on(dot_product_inner(&a, &b, grain)));
+            });
+        }
+    }
+}
+
+// Measures a runtime's dot product on its own thread pools of each size from one thread up to one
+// per CPU, and on the shared pool, splitting down to each of `DOT_PRODUCT_GRAINS`.
+fn bench_dot_product_scaling(bench: &Bench, runtime: &Runtime) {
+    let max_threads = thread::available_parallelism().map_or(1, |threads| threads.get());
+    // Zero threads means the shared pool.
+    let thread_counts = iter::successors(Some(1), |&threads| Some(threads * 2))
+        .take_while(|&threads| threads < max_threads)
+        .chain(iter::once(max_threads))
+        .map(|threads| (threads, threads.to_string()))
+        .chain(iter::once((0, "shared".to_owned())));
+    for (threads, threads_label) in thread_counts {
+        for &(size, size_label) in &DOT_PRODUCT_SIZES {
+            for &(grain, grain_label) in &DOT_PRODUCT_GRAINS {
+                let name = format!(
+                    "{}/dot_product/threads={}/size={}/grain={}",
+                    runtime.name, threads_label, size_label, grain_label
+                );
+                if !bench.enabled(&name) {
+                    continue;
+                }
+                // C++ times the dot products alone, but the allocations include the pool's.
+                let iterations = dot_product_iterations(size);
+                let start_allocations = allocation_count();
+                let elapsed_ns =
+                    (runtime.time_dot_product)(size, threads as u32, grain, iterations as u32);
+                bench.report(Measurement {
+                    name,
+                    ops: iterations,
+                    elapsed: Duration::from_nanos(elapsed_ns as u64),
+                    allocations: allocation_count() - start_allocations,
+                    atomics: None,
+                    latencies: None,
+                    bytes_per_op: size * 16,
+                });
+            }
+        }
+    }
+}
+
+// Measures C++ fanning out to `bench.fan_out` Rust futures and awaiting them all: one at a time,
+// with `rust_join_all`, and with the runtime's `when_all`.
+fn bench_fan_out(bench: &Bench, runtime: &Runtime) {
+    let count = bench.fan_out as i32;
+    let mut fan_outs = vec![
+        ("sequential", runtime.await_rust_concurrently),
+        ("join", runtime.join_rust),
+    ];
+    if let Some(when_all_rust) = runtime.when_all_rust {
+        fan_outs.push(("when_all", when_all_rust));
+    }
+    for (how, fan_out) in fan_outs {
+        let name = format!("{}/fan_out/{}={}", runtime.name, how, count);
+        bench.measure_ops(&name, bench.fan_out, || {
+            hint::black_box(fan_out(BENCH_VALUE_PENDING, count));
+        });
+    }
+}
+
+// The C++ entry points that each runtime provides for benchmarking.
+struct Runtime {
+    name: &'static str,
+    // C++ coroutines for Rust to await: completed before returning, completed on the shared
+    // pool, and failed.
+    ready_value: fn() -> Box<RustOneshotReceiverF64>,
+    pending_value: fn() -> Box<RustOneshotReceiverF64>,
+    not_product: fn() -> Box<RustOneshotReceiverF64>,
+    // The same ready and pending values from lazily started coroutines, where the runtime's
+    // examples have them.
+    lazy_values: Option<[fn() -> Box<crate::RustLazyF64>; 2]>,
+    // Blocks on the runtime awaiting `rust_bench_value(kind)`, or `count` of them at once.
+    await_rust: fn(i32) -> f64,
+    // The same, polling `rust_bench_value_inline(kind)` itself, where the runtime's examples do.
+    await_rust_inline: Option<fn(i32) -> f64>,
+    await_rust_concurrently: fn(i32, i32) -> f64,
+    // Awaits `count` of them with `rust_join_all`, or with the runtime's own `when_all`, if it
+    // has one that takes a range.
+    join_rust: fn(i32, i32) -> f64,
+    when_all_rust: Option<fn(i32, i32) -> f64>,
+    // Times `iterations` dot products of `count` elements on a pool of `threads`, or on the
+    // shared pool if that's zero, in nanoseconds.
+    time_dot_product: fn(usize, u32, usize, u32) -> f64,
+    ping_pong: fn(i32, i32) -> Box<crate::RustOneshotReceiverString>,
+}
+
+static RUNTIMES: [Runtime; 3] = [
+    Runtime {
+        name: "cppcoro",
+        ready_value: crate::ffi::cppcoro_ready_value,
+        pending_value: crate::ffi::cppcoro_pending_value,
+        not_product: crate::ffi::cppcoro_not_product,
+        lazy_values: Some([
+            crate::ffi::cppcoro_ready_value_lazy,
+            crate::ffi::cppcoro_pending_value_lazy,
+        ]),
+        await_rust: crate::ffi::cppcoro_await_rust,
+        await_rust_inline: Some(crate::ffi::cppcoro_await_rust_inline),
+        await_rust_concurrently: crate::ffi::cppcoro_await_rust_concurrently,
+        join_rust: crate::ffi::cppcoro_join_rust,
+        time_dot_product: crate::ffi::cppcoro_time_dot_product,
+        when_all_rust: Some(crate::ffi::cppcoro_when_all_rust),
+        ping_pong: crate::ffi::cppcoro_ping_pong,
+    },
+    Runtime {
+        name: "libunifex",
+        ready_value: crate::ffi::libunifex_ready_value,
+        pending_value: crate::ffi::libunifex_pending_value,
+        not_product: crate::ffi::libunifex_not_product,
+        lazy_values: None,
+        await_rust: crate::ffi::libunifex_await_rust,
+        await_rust_inline: None,
+        await_rust_concurrently: crate::ffi::libunifex_await_rust_concurrently,
+        join_rust: crate::ffi::libunifex_join_rust,
+        time_dot_product: crate::ffi::libunifex_time_dot_product,
+        when_all_rust: None,
+        ping_pong: crate::ffi::libunifex_ping_pong,
+    },
+    Runtime {
+        name: "folly",
+        ready_value: crate::ffi::folly_ready_value,
+        pending_value: crate::ffi::folly_pending_value,
+        not_product: crate::ffi::folly_not_product,
+        lazy_values: Some([
+            crate::ffi::folly_ready_value_lazy,
+            crate::ffi::folly_pending_value_lazy,
+        ]),
+        await_rust: crate::ffi::folly_await_rust,
+        await_rust_inline: Some(crate::ffi::folly_await_rust_inline),
+        await_rust_concurrently: crate::ffi::folly_await_rust_concurrently,
+        join_rust: crate::ffi::folly_join_rust,
+        time_dot_product: crate::ffi::folly_time_dot_product,
+        when_all_rust: Some(crate::ffi::folly_when_all_rust),
+        ping_pong: crate::ffi::folly_ping_pong,
+    },
+];
+
+// Measures crossing the bridge in each direction with a single call at a time, on both the ready
+// and the pending path, and with an error. Rust awaits C++ both through a channel and, where
+// there's one, through a lazily started coroutine. C++ likewise awaits Rust both through a
+// channel fed by a spawned future and, where it can, by polling an unspawned future itself.
+fn bench_crossing_latency(bench: &Bench, runtime: &Runtime) {
+    let rust_awaits_cxx = [
+        ("ready", runtime.ready_value),
+        ("pending", runtime.pending_value),
+    ];
+    for &(path, cxx_function) in &rust_awaits_cxx {
+        let name = format!("{}/rust_awaits_cxx/{}", runtime.name, path);
+        bench.measure_latency(&name, || {
+            hint::black_box(executor::block_on(cxx_function()).unwrap().unwrap());
+        });
+    }
+    if let Some([ready_value, pending_value]) = runtime.lazy_values {
+        for &(path, cxx_function) in &[("ready", ready_value), ("pending", pending_value)] {
+            let name = format!("{}/rust_awaits_cxx/lazy {}", runtime.name, path);
+            bench.measure_latency(&name, || {
+                hint::black_box(executor::block_on(cxx_function()).unwrap().unwrap());
+            });
+        }
+    }
+    let name = format!("{}/rust_awaits_cxx/error", runtime.name);
+    bench.measure_latency(&name, || {
+        assert!(executor::block_on((runtime.not_product)())
+            .unwrap()
+            .is_err());
+    });
+
+    let cxx_awaits_rust = [
+        ("ready", BENCH_VALUE_READY),
+        ("pending", BENCH_VALUE_PENDING),
+        ("error", BENCH_VALUE_ERROR),
+        ("coded error", BENCH_VALUE_CODED_ERROR),
+    ];
+    for &(path, kind) in &cxx_awaits_rust {
+        let name = format!("{}/cxx_awaits_rust/{}", runtime.name, path);
+        bench.measure_latency(&name, || {
+            hint::black_box((runtime.await_rust)(kind));
+        });
+    }
+    if let Some(await_rust_inline) = runtime.await_rust_inline {
+        for &(path, kind) in &cxx_awaits_rust {
+            let name = format!("{}/cxx_awaits_rust/inline {}", runtime.name, path);
+            bench.measure_latency(&name, || {
+                hint::black_box(await_rust_inline(kind));
+            });
+        }
+    }
+}
+
+// Blocks a plain C++ thread on a Rust future finishing on the thread pool, with `rust_block_on` and
+// with each runtime's own blocking wait, which wraps the await in a coroutine and an event. Nearly
+// all of the time is the wake and the blocked thread coming back.
+fn bench_block_on(bench: &Bench) {
+    let ways: [(&str, fn(i32) -> f64); 4] = [
+        ("rust_block_on", crate::ffi::cxx_block_on_rust),
+        ("cppcoro sync_wait", crate::ffi::cppcoro_await_rust),
+        ("libunifex sync_wait", crate::ffi::libunifex_await_rust),
+        ("folly blockingWait", crate::ffi::folly_await_rust),
+    ];
+    for &(way, block_on) in &ways {
+        let name = format!("block_on/pending/{}", way);
+        bench.measure_latency(&name, || {
+            hint::black_box(block_on(BENCH_VALUE_PENDING));
+        });
+    }
+}
+
+// Keeps every pool worker busy with low-priority batch work, in slices of `BATCH_SLICE` between
+// yields, until dropped.
+struct BatchLoad(Arc<AtomicBool>);
+
+const BATCH_SLICE: Duration = Duration::from_micros(50);
+
+impl BatchLoad {
+    fn start() -> BatchLoad {
+        let stop = Arc::new(AtomicBool::new(false));
+        let spawner = THREAD_POOL.at(Priority::Low);
+        for _ in 0..2 * THREAD_POOL.threads() {
+            let stop = stop.clone();
+            spawner
+                .spawn(async move {
+                    while !stop.load(Ordering::Relaxed) {
+                        let start = Instant::now();
+                        while start.elapsed() < BATCH_SLICE {
+                            hint::spin_loop();
+                        }
+                        let mut yielded = false;
+                        poll_fn(|context| {
+                            if yielded {
+                                return Poll::Ready(());
+                            }
+                            yielded = true;
+                            context.waker().wake_by_ref();
+                            Poll::Pending
+                        })
+                        .await;
+                    }
+                })
+                .unwrap();
+        }
+        BatchLoad(stop)
+    }
+}
+
+impl Drop for BatchLoad {
+    fn drop(&mut self) {
+        self.0.store(true, Ordering::Relaxed);
+    }
+}
+
+// Measures short calls at each priority while batch work saturates the pool: Rust futures spawned
+// with `THREAD_POOL.at`, and C++ coroutines that resume on the pool after awaiting Rust. The p99 of
+// `high` should stay near the idle latency, and `low`, queued behind the batch, shouldn't.
+fn bench_priorities(bench: &Bench) {
+    let priorities = [
+        ("high", Priority::High),
+        ("normal", Priority::Normal),
+        ("low", Priority::Low),
+    ];
+    let any_enabled = priorities.iter().any(|&(class, _)| {
+        bench.enabled(&format!("priority/batch load/rust spawn/{}", class))
+            || bench.enabled(&format!("priority/batch load/cppcoro resume/{}", class))
+    });
+    if !any_enabled {
+        return;
+    }
+    let _load = BatchLoad::start();
+
+    for &(class, priority) in &priorities {
+        let name = format!("priority/batch load/rust spawn/{}", class);
+        let spawner = THREAD_POOL.at(priority);
+        bench.measure_latency(&name, || {
+            let receiver: Box<RustOneshotReceiverF64> = async move { Ok(1.0) }.via(&spawner);
+            hint::black_box(executor::block_on(receiver).unwrap().unwrap());
+        });
+    }
+    for &(class, priority) in &priorities {
+        let name = format!("priority/batch load/cppcoro resume/{}", class);
+        bench.measure_latency(&name, || {
+            hint::black_box(crate::ffi::cppcoro_await_rust_at_priority(
+                BENCH_VALUE_PENDING,
+                priority as u8,
+            ));
+        });
+    }
+}
+
+// Measures what a deadline adds to an await that beats it, in each direction, and arming and
+// disarming a timer with many others armed.
+fn bench_deadlines(bench: &Bench) {
+    let name = "timer/arm + disarm";
+    if bench.enabled(name) {
+        let waker = noop_waker();
+        let mut others: Vec<_> = (0..bench.concurrency)
+            .map(|i| {
+                let timeout = Duration::from_millis(1000 + i as u64);
+                timer::with_timeout(future::pending::<()>(), timeout)
+            })
+            .collect();
+        for timeout in &mut others {
+            assert!(Pin::new(timeout)
+                .poll(&mut Context::from_waker(&waker))
+                .is_pending());
+        }
+        bench.measure_latency(name, || {
+            let mut timeout = timer::with_timeout(future::pending::<()>(), Duration::from_secs(10));
+            let poll = Pin::new(&mut timeout).poll(&mut Context::from_waker(&waker));
+            assert!(hint::black_box(poll).is_pending());
+        });
+    }
+
+    // The same from several threads at once, which arm on wheels of their own.
+    for &threads in &[2, 4, 8] {
+        let name = format!("timer/arm + disarm, {} threads", threads);
+        let iterations = bench.iterations * 10;
+        bench.measure_ops(&name, threads * iterations, || {
+            let handles: Vec<_> = (0..threads)
+                .map(|_| {
+                    thread::spawn(move || {
+                        let waker = noop_waker();
+                        for _ in 0..iterations {
+                            let mut timeout = timer::with_timeout(
+                                future::pending::<()>(),
+                                Duration::from_secs(10),
+                            );
+                            let poll =
+                                Pin::new(&mut timeout).poll(&mut Context::from_waker(&waker));
+                            assert!(hint::black_box(poll).is_pending());
+                        }
+                    })
+                })
+                .collect();
+            for handle in handles {
+                handle.join().unwrap();
+            }
+        });
+    }
+
+    let name = "cppcoro/rust_awaits_cxx/pending with deadline";
+    bench.measure_latency(name, || {
+        let receiver = crate::ffi::cppcoro_pending_value();
+        let result = executor::block_on(timer::with_timeout(receiver, Duration::from_secs(10)));
+        hint::black_box(result.unwrap().unwrap().unwrap());
+    });
+    for &(path, kind) in &[
+        ("ready", BENCH_VALUE_READY),
+        ("pending", BENCH_VALUE_PENDING),
+    ] {
+        let name = format!("cppcoro/cxx_awaits_rust/{} with deadline", path);
+        bench.measure_latency(&name, || {
+            hint::black_box(crate::ffi::cppcoro_await_rust_with_deadline(kind));
+        });
+    }
+}
+
+// Measures a chain of `bench.depth` alternating Rust and C++ awaits.
+fn bench_ping_pong(bench: &Bench, runtime: &Runtime) {
+    let name = format!("{}/ping_pong/depth={}", runtime.name, bench.depth);
+    bench.measure_latency(&name, || {
+        hint::black_box(
+            executor::block_on((runtime.ping_pong)(0, bench.depth))
+                .unwrap()
+                .unwrap(),
+        );
+    });
+}
+
+// Measures throughput with `bench.concurrency` bridged futures in flight at once, in each
+// direction.
+fn bench_concurrent_throughput(bench: &Bench, runtime: &Runtime) {
+    let batches = (bench.iterations / bench.concurrency).max(1);
+    let ops = batches * bench.concurrency;
+
+    let name = format!(
+        "{}/rust_awaits_cxx/concurrent={}",
+        runtime.name, bench.concurrency
+    );
+    bench.measure_ops(&name, ops, || {
+        for _ in 0..batches {
+            let receivers: Vec<_> = (0..bench.concurrency)
+                .map(|_| (runtime.pending_value)())
+                .collect();
+            for result in executor::block_on(join_all(receivers)) {
+                hint::black_box(result.unwrap().unwrap());
+            }
+        }
+    });
+
+    let name = format!(
+        "{}/cxx_awaits_rust/concurrent={}",
+        runtime.name, bench.concurrency
+    );
+    bench.measure_ops(&name, ops, || {
+        for _ in 0..batches {
+            hint::black_box((runtime.await_rust_concurrently)(
+                BENCH_VALUE_PENDING,
+                bench.concurrency as i32,
+            ));
+        }
+    });
+}
+
+pub fn run(args: &[String]) {
+    let bench = Bench::from_args(args);
+    let _counting = CountAllocations::new();
+    if !bench.json {
+        crate::ffi::print_awaiter_sizes();
+    }
+
+    bench_oneshot_round_trip(&bench);
+    bench_cxx_waker_allocations(&bench);
+    bench_frame_allocation(&bench);
+    bench_error_path(&bench);
+    bench_stream_throughput(&bench);
+    bench_mpsc_throughput(&bench);
+    bench_block_on(&bench);
+    bench_buffers(&bench);
+    bench_dot_product_kernel(&bench);
+    bench_deadlines(&bench);
+    bench_priorities(&bench);
+
+    for runtime in &RUNTIMES {
+        bench_crossing_latency(&bench, runtime);
+        bench_ping_pong(&bench, runtime);
+        bench_concurrent_throughput(&bench, runtime);
+        bench_fan_out(&bench, runtime);
+        bench_dot_product_scaling(&bench, runtime);
+    }
+
+    if cfg!(feature = "counters") && !bench.json {
+        crate::counters::print_snapshot();
+    }
+}
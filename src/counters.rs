@@ -0,0 +1,232 @@
+// cxx-async/src/counters.rs
+//
+// Optional counters for what the bridge does, broken down by channel type. Build with
+// `--features counters` to turn them on; without it, `count` compiles to nothing.
+//
+// Each thread bumps its own counters with plain relaxed stores, so counting costs no atomic
+// read-modify-writes or shared cache lines. `snapshot` adds up every thread's counters, plus the
+// ones that the C++ side keeps the same way (see `RustThreadCounters` in cxx_async.h), and is
+// callable from C++ as `rust_bridge_counters()`.
+
+use std::sync::atomic::AtomicUsize;
+
+// What the Rust side counts. The C++ side counts the rest of the fields of `BridgeCounters`.
+#[derive(Clone, Copy, Debug)]
+pub enum Counter {
+    // Channels created, and the heap allocations that they took.
+    Channels,
+    Allocations,
+    // Calls to `recv` from C++, and how many of those found nothing ready.
+    Polls,
+    PendingPolls,
+    // Errors received by C++, whether thrown or returned by `rust_try`.
+    ErrorsToCxx,
+    // C++ exceptions sent to Rust.
+    ExceptionsToRust,
+    // Receives that found the sender dropped without sending.
+    Cancellations,
+}
+
+#[cfg(feature = "counters")]
+const COUNTER_COUNT: usize = Counter::Cancellations as usize + 1;
+#[cfg(feature = "counters")]
+const MAX_CHANNEL_TYPES: usize = 16;
+
+// A channel type to break counters down by. `define_oneshot!` and `define_stream!` make one for
+// each channel, named like the C++ type so that both sides' counters line up.
+#[cfg_attr(not(feature = "counters"), allow(dead_code))]
+pub struct ChannelType {
+    name: &'static str,
+    // One more than the index into each thread's counters, or zero if not assigned yet.
+    index: AtomicUsize,
+}
+
+impl ChannelType {
+    pub const fn new(name: &'static str) -> Self {
+        Self {
+            name,
+            index: AtomicUsize::new(0),
+        }
+    }
+}
+
+#[cfg(not(feature = "counters"))]
+#[inline(always)]
+pub fn count(_: &'static ChannelType, _: Counter, _: u64) {}
+
+#[cfg(not(feature = "counters"))]
+pub fn snapshot() -> Vec<crate::ffi::BridgeCounters> {
+    vec![]
+}
+
+// Counts an atomic read-modify-write of a oneshot's state word, for the benchmarks' atomics per
+// operation. The count is per thread, like the rest, so `thread_atomics` sees only this thread's.
+#[cfg(not(feature = "counters"))]
+#[inline(always)]
+pub fn count_atomic() {}
+
+#[cfg(not(feature = "counters"))]
+pub fn thread_atomics() -> Option<u64> {
+    None
+}
+
+#[cfg(feature = "counters")]
+pub use self::enabled::{count, count_atomic, snapshot, thread_atomics};
+
+#[cfg(feature = "counters")]
+mod enabled {
+    use super::{ChannelType, Counter, COUNTER_COUNT, MAX_CHANNEL_TYPES};
+    use crate::ffi::{self, BridgeCounters};
+    use once_cell::sync::Lazy;
+    use std::cell::Cell;
+    use std::sync::atomic::{AtomicU64, Ordering};
+    use std::sync::{Arc, Mutex};
+
+    type Values = [AtomicU64];
+
+    struct Registry {
+        channel_types: Vec<&'static str>,
+        live: Vec<Arc<Values>>,
+        // What threads that have exited counted.
+        retired: Vec<u64>,
+    }
+
+    static REGISTRY: Lazy<Mutex<Registry>> = Lazy::new(|| {
+        Mutex::new(Registry {
+            channel_types: vec![],
+            live: vec![],
+            retired: vec![0; COUNTER_COUNT * MAX_CHANNEL_TYPES],
+        })
+    });
+
+    // Registers this thread's counters on first use and retires them when the thread exits.
+    struct ThreadCounters(Arc<Values>);
+
+    impl ThreadCounters {
+        fn new() -> Self {
+            let values: Arc<Values> = (0..COUNTER_COUNT * MAX_CHANNEL_TYPES)
+                .map(|_| AtomicU64::new(0))
+                .collect();
+            REGISTRY.lock().unwrap().live.push(values.clone());
+            ThreadCounters(values)
+        }
+    }
+
+    impl Drop for ThreadCounters {
+        fn drop(&mut self) {
+            let mut registry = REGISTRY.lock().unwrap();
+            for (retired, value) in registry.retired.iter_mut().zip(self.0.iter()) {
+                *retired += value.load(Ordering::Relaxed);
+            }
+            registry.live.retain(|values| !Arc::ptr_eq(values, &self.0));
+        }
+    }
+
+    thread_local! {
+        static THREAD_COUNTERS: ThreadCounters = ThreadCounters::new();
+        static THREAD_ATOMICS: Cell<u64> = const { Cell::new(0) };
+    }
+
+    impl ChannelType {
+        fn index(&'static self) -> usize {
+            match self.index.load(Ordering::Acquire) {
+                0 => self.register(),
+                index => index - 1,
+            }
+        }
+
+        #[cold]
+        fn register(&'static self) -> usize {
+            let mut registry = REGISTRY.lock().unwrap();
+            let index = self.index.load(Ordering::Acquire);
+            if index != 0 {
+                return index - 1;
+            }
+            let index = registry.channel_types.len();
+            assert!(index < MAX_CHANNEL_TYPES, "too many channel types to count");
+            registry.channel_types.push(self.name);
+            self.index.store(index + 1, Ordering::Release);
+            index
+        }
+    }
+
+    #[inline]
+    pub fn count(channel_type: &'static ChannelType, counter: Counter, amount: u64) {
+        let slot = channel_type.index() * COUNTER_COUNT + counter as usize;
+        // Only this thread writes its counters, so a separate load and store is enough.
+        let _ = THREAD_COUNTERS.try_with(|counters| {
+            let value = &counters.0[slot];
+            value.store(value.load(Ordering::Relaxed) + amount, Ordering::Relaxed);
+        });
+    }
+
+    #[inline]
+    pub fn count_atomic() {
+        THREAD_ATOMICS.with(|atomics| atomics.set(atomics.get() + 1));
+    }
+
+    pub fn thread_atomics() -> Option<u64> {
+        Some(THREAD_ATOMICS.with(Cell::get))
+    }
+
+    pub fn snapshot() -> Vec<BridgeCounters> {
+        let mut snapshot = ffi::cxx_bridge_counters();
+
+        let registry = REGISTRY.lock().unwrap();
+        let mut totals = registry.retired.clone();
+        for values in &registry.live {
+            for (total, value) in totals.iter_mut().zip(values.iter()) {
+                *total += value.load(Ordering::Relaxed);
+            }
+        }
+
+        for (index, &name) in registry.channel_types.iter().enumerate() {
+            let values = &totals[index * COUNTER_COUNT..(index + 1) * COUNTER_COUNT];
+            let counters = match snapshot
+                .iter()
+                .position(|counters| counters.channel == name)
+            {
+                Some(position) => &mut snapshot[position],
+                None => {
+                    snapshot.push(BridgeCounters {
+                        channel: name.to_owned(),
+                        ..BridgeCounters::default()
+                    });
+                    snapshot.last_mut().unwrap()
+                }
+            };
+            counters.channels += values[Counter::Channels as usize];
+            counters.allocations += values[Counter::Allocations as usize];
+            counters.polls += values[Counter::Polls as usize];
+            counters.pending_polls += values[Counter::PendingPolls as usize];
+            counters.errors_to_cxx += values[Counter::ErrorsToCxx as usize];
+            counters.exceptions_to_rust += values[Counter::ExceptionsToRust as usize];
+            counters.cancellations += values[Counter::Cancellations as usize];
+        }
+        snapshot
+    }
+}
+
+// Prints a snapshot, with the ratios worth watching.
+pub fn print_snapshot() {
+    for counters in snapshot() {
+        let per = |numerator: u64, denominator: u64| numerator as f64 / denominator.max(1) as f64;
+        println!(
+            "{}: {} channels, {:.2} allocs/channel, {} awaits ({:.1}% ready, {:.2} polls/await), \
+             {} wakes ({:.0} ns wake-to-resume), {} errors to C++, {} exceptions to Rust, \
+             {} cancellations, {} destroyed unresumed",
+            counters.channel,
+            counters.channels,
+            per(counters.allocations, counters.channels),
+            counters.awaits,
+            per(counters.ready_awaits * 100, counters.awaits),
+            per(counters.polls, counters.awaits),
+            counters.wakes,
+            per(counters.wake_to_resume_ns, counters.wakes),
+            counters.errors_to_cxx,
+            counters.exceptions_to_rust,
+            counters.cancellations,
+            counters.destroyed_unresumed
+        );
+    }
+}
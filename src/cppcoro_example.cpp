@@ -5,8 +5,12 @@
 #include "cxx_async_cppcoro.h"
 #include "example_common.h"
 #include "rust/cxx.h"
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cppcoro/async_generator.hpp>
+#include <cppcoro/cancellation_source.hpp>
+#include <cppcoro/operation_cancelled.hpp>
 #include <cppcoro/schedule_on.hpp>
 #include <cppcoro/static_thread_pool.hpp>
 #include <cppcoro/sync_wait.hpp>
@@ -17,7 +21,9 @@
 #include <experimental/coroutine>
 #include <future>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <numeric>
 #include <optional>
 #include <random>
 #include <stdexcept>
@@ -27,27 +33,61 @@
 
 template <> struct RustOneshotChannelTraits<RustOneshotChannelF64> {};
 
-static cppcoro::task<double>
-dot_product_inner(cppcoro::static_thread_pool &thread_pool, double a[],
-                  double b[], size_t count) {
-  if (count > EXAMPLE_SPLIT_LIMIT) {
+// Runs on any scheduler that cppcoro's `schedule_on` accepts: a cppcoro thread
+// pool, or the pool that Rust shares with us.
+template <typename Scheduler>
+static cppcoro::task<double> dot_product_inner(Scheduler &scheduler, double a[],
+                                               double b[], size_t count,
+                                               size_t grain) {
+  if (count > grain) {
     size_t half_count = count / 2;
     auto [first, second] = co_await cppcoro::when_all(
-        cppcoro::schedule_on(thread_pool,
-                             dot_product_inner(thread_pool, a, b, half_count)),
-        dot_product_inner(thread_pool, a + half_count, b + half_count,
-                          count - half_count));
+        cppcoro::schedule_on(scheduler, dot_product_inner(scheduler, a, b,
+                                                          half_count, grain)),
+        dot_product_inner(scheduler, a + half_count, b + half_count,
+                          count - half_count, grain));
     co_return first + second;
   }
 
-  double sum = 0.0;
-  for (size_t i = 0; i < count; i++)
-    sum += a[i] * b[i];
-  co_return sum;
+  co_return dot_product_kernel(a, b, count);
 }
 
-static cppcoro::task<double>
-dot_product_on(cppcoro::static_thread_pool &thread_pool) {
+template <typename Scheduler>
+static cppcoro::task<> calibration_fork(Scheduler &scheduler) {
+  co_await scheduler.schedule();
+}
+
+template <typename Scheduler>
+static cppcoro::task<> calibration_forks(Scheduler &scheduler) {
+  for (size_t i = 0; i < DOT_PRODUCT_CALIBRATION_FORKS; i++)
+    co_await calibration_fork(scheduler);
+}
+
+// What a fork in `dot_product_inner` costs: a task, and a hop onto the pool.
+template <typename Scheduler>
+static cppcoro::task<double> fork_overhead_ns(Scheduler &scheduler) {
+  auto start = std::chrono::steady_clock::now();
+  co_await calibration_forks(scheduler);
+  co_return elapsed_ns(start) / DOT_PRODUCT_CALIBRATION_FORKS;
+}
+
+// The grain for the shared pool, calibrated by the first dot product to need
+// it. This awaits the calibration rather than blocking on it, since a lazy dot
+// product may first run on a pool worker, which blocking would tie up. Dot
+// products that start at the same time may each calibrate, which is harmless.
+static cppcoro::task<size_t> pool_grain(RustPoolScheduler &scheduler) {
+  static std::atomic<size_t> grain(0);
+  size_t calibrated = grain.load(std::memory_order_relaxed);
+  if (calibrated == 0) {
+    calibrated = dot_product_grain(co_await fork_overhead_ns(scheduler));
+    grain.store(calibrated, std::memory_order_relaxed);
+  }
+  co_return calibrated;
+}
+
+template <typename Scheduler>
+static cppcoro::task<double> dot_product_on(Scheduler &scheduler,
+                                            size_t grain) {
   Xorshift rand;
   std::vector<double> array_a, array_b;
   for (size_t i = 0; i < EXAMPLE_ARRAY_SIZE; i++) {
@@ -55,14 +95,52 @@ dot_product_on(cppcoro::static_thread_pool &thread_pool) {
     array_b.push_back((double)rand.next());
   }
 
-  co_return co_await dot_product_inner(thread_pool, &array_a[0], &array_b[0],
-                                       array_a.size());
+  co_return co_await dot_product_inner(scheduler, &array_a[0], &array_b[0],
+                                       array_a.size(), grain);
 }
 
 rust::Box<RustOneshotReceiverF64> cppcoro_dot_product() {
-  static cppcoro::static_thread_pool thread_pool;
-  co_return co_await cppcoro::schedule_on(thread_pool,
-                                          dot_product_on(thread_pool));
+  static RustPoolScheduler scheduler;
+  size_t grain = co_await pool_grain(scheduler);
+  co_return co_await cppcoro::schedule_on(scheduler,
+                                          dot_product_on(scheduler, grain));
+}
+
+// Like the above, but doesn't start until Rust polls it, and hands its result
+// straight to the Rust future.
+rust::Box<RustLazyF64> cppcoro_dot_product_lazy() {
+  static RustPoolScheduler scheduler;
+  size_t grain = co_await pool_grain(scheduler);
+  co_return co_await cppcoro::schedule_on(scheduler,
+                                          dot_product_on(scheduler, grain));
+}
+
+template <typename Scheduler>
+static double time_dot_product_on(Scheduler &scheduler, size_t count,
+                                  size_t grain, uint32_t iterations) {
+  if (grain == 0)
+    grain = dot_product_grain(cppcoro::sync_wait(fork_overhead_ns(scheduler)));
+  std::vector<double> array_a(count, 1.0), array_b(count, 2.0);
+  return time_ns([&]() {
+    for (uint32_t i = 0; i < iterations; i++)
+      cppcoro::sync_wait(cppcoro::schedule_on(
+          scheduler, dot_product_inner(scheduler, &array_a[0], &array_b[0],
+                                       count, grain)));
+  });
+}
+
+// Times `iterations` dot products of `count` elements on a cppcoro pool of
+// `threads`, or on the shared pool if that's zero, splitting down to `grain`
+// elements, or to a calibrated grain if that's zero. For the scaling benchmark
+// in bench.rs.
+double cppcoro_time_dot_product(size_t count, uint32_t threads, size_t grain,
+                                uint32_t iterations) {
+  if (threads == 0) {
+    RustPoolScheduler scheduler;
+    return time_dot_product_on(scheduler, count, grain, iterations);
+  }
+  cppcoro::static_thread_pool thread_pool(threads);
+  return time_dot_product_on(thread_pool, count, grain, iterations);
 }
 
 void cppcoro_call_rust_dot_product() {
@@ -71,12 +149,40 @@ void cppcoro_call_rust_dot_product() {
   std::cout << result << std::endl;
 }
 
+static cppcoro::task<double> rust_dot_product_on_pool() {
+  co_return co_await rust_resume_via(rust_pool_executor(), rust_dot_product());
+}
+
+// Like the above, but the awaiting coroutine resumes through a run queue on the
+// shared pool rather than inline in the Rust task that finishes the product.
+void cppcoro_call_rust_dot_product_on_pool() {
+  double result = cppcoro::sync_wait(rust_dot_product_on_pool());
+  std::cout << result << std::endl;
+}
+
+// Runs the Rust dot product on a cppcoro thread pool rather than on the shared
+// pool, through a `CxxSpawner`.
+void cppcoro_call_rust_dot_product_on_cppcoro_pool() {
+  cppcoro::static_thread_pool thread_pool(1);
+  RustCppcoroTaskExecutor executor(thread_pool);
+  double result = cppcoro::sync_wait(
+      rust_dot_product_on(reinterpret_cast<uint8_t *>(
+          static_cast<RustTaskExecutor *>(&executor))));
+  std::cout << result << std::endl;
+}
+
 rust::Box<RustOneshotReceiverF64> cppcoro_not_product() {
   if (true)
     throw std::runtime_error("kaboom");
   co_return 1.0; // just to make this function a coroutine
 }
 
+rust::Box<RustLazyF64> cppcoro_not_product_lazy() {
+  if (true)
+    throw std::runtime_error("kaboom");
+  co_return 1.0; // just to make this function a coroutine
+}
+
 void cppcoro_call_rust_not_product() {
   try {
     rust::Box<RustOneshotReceiverF64> oneshot_receiver = rust_not_product();
@@ -87,9 +193,256 @@ void cppcoro_call_rust_not_product() {
   }
 }
 
+// Polls the Rust future on this thread rather than awaiting a spawned task.
+// Then asks for the same product spawned onto the pool, to run in parallel.
+void cppcoro_call_rust_dot_product_inline() {
+  double result = cppcoro::sync_wait(rust_dot_product_inline());
+  std::cout << result << std::endl;
+
+  rust::Box<RustOneshotReceiverF64> spawned =
+      rust_spawn(rust_dot_product_inline());
+  result = cppcoro::sync_wait(std::move(spawned));
+  std::cout << result << std::endl;
+}
+
+void cppcoro_call_rust_not_product_inline() {
+  try {
+    double result = cppcoro::sync_wait(rust_not_product_inline());
+    std::cout << result << std::endl;
+  } catch (const std::exception &error) {
+    std::cout << error.what() << std::endl;
+  }
+}
+
 rust::Box<RustOneshotReceiverString>
-cppcoro_ping_pong(int i) {
-  std::string string(co_await rust_cppcoro_ping_pong(i + 1));
+cppcoro_ping_pong(int i, int depth) {
+  std::string string(co_await rust_cppcoro_ping_pong(i + 1, depth));
   string += "pong ";
   co_return std::move(string);
 }
+
+// Yields the dot product of each `EXAMPLE_SPLIT_LIMIT`-sized chunk of the
+// arrays.
+rust::Box<RustStreamReceiverF64> cppcoro_dot_product_chunks() {
+  co_await RustPoolScheduler().schedule();
+
+  Xorshift rand;
+  std::vector<double> array_a, array_b;
+  for (size_t i = 0; i < EXAMPLE_ARRAY_SIZE; i++) {
+    array_a.push_back((double)rand.next());
+    array_b.push_back((double)rand.next());
+  }
+
+  for (size_t start = 0; start < array_a.size(); start += EXAMPLE_SPLIT_LIMIT)
+    co_yield dot_product_kernel(&array_a[start], &array_b[start],
+                                EXAMPLE_SPLIT_LIMIT);
+}
+
+static cppcoro::task<double> sum_rust_dot_product_chunks() {
+  auto chunks = rust_stream_to_cppcoro_generator(rust_dot_product_chunks());
+  double sum = 0.0;
+  for (auto it = co_await chunks.begin(); it != chunks.end(); co_await ++it)
+    sum += *it;
+  co_return sum;
+}
+
+void cppcoro_call_rust_dot_product_chunks() {
+  double result = cppcoro::sync_wait(sum_rust_dot_product_chunks());
+  std::cout << result << std::endl;
+}
+
+// Counts up forever on the shared pool, until Rust drops the receiver.
+rust::Box<RustOneshotReceiverF64> cppcoro_sum_until_cancelled() {
+  LiveFrameGuard guard;
+  RustCppcoroCancellation cancellation(co_await rust_current_stop_token());
+  cppcoro::cancellation_token token = cancellation.token();
+
+  double sum = 0.0;
+  while (true) {
+    co_await RustPoolScheduler().schedule();
+    if (token.is_cancellation_requested())
+      throw cppcoro::operation_cancelled();
+    sum += 1.0;
+  }
+}
+
+void cppcoro_cancel_rust_pending_forever() {
+  cppcoro::cancellation_source source;
+  std::thread canceller([source]() mutable {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    source.request_cancellation();
+  });
+
+  try {
+    double result = cppcoro::sync_wait(
+        rust_with_cancellation(rust_pending_forever(), source.token()));
+    std::cout << result << std::endl;
+  } catch (const cppcoro::operation_cancelled &) {
+    std::cout << "cancelled" << std::endl;
+  }
+  canceller.join();
+}
+
+// Gives up on a Rust future that never finishes once its deadline passes,
+// which drops the future.
+void cppcoro_call_rust_pending_forever_with_deadline() {
+  try {
+    double result = cppcoro::sync_wait(
+        rust_deadline(std::chrono::milliseconds(10), rust_pending_forever()));
+    std::cout << result << std::endl;
+  } catch (const RustAsyncError &error) {
+    std::cout << error.what() << std::endl;
+  }
+}
+
+// The C++ half of the cross-runtime benchmarks in bench.rs.
+
+rust::Box<RustOneshotReceiverF64> cppcoro_ready_value() { co_return 1.0; }
+
+rust::Box<RustOneshotReceiverF64> cppcoro_pending_value() {
+  co_await RustPoolScheduler().schedule();
+  co_return 1.0;
+}
+
+rust::Box<RustLazyF64> cppcoro_ready_value_lazy() { co_return 1.0; }
+
+rust::Box<RustLazyF64> cppcoro_pending_value_lazy() {
+  co_await RustPoolScheduler().schedule();
+  co_return 1.0;
+}
+
+// Returns NaN if the Rust future fails.
+double cppcoro_await_rust(int32_t kind) {
+  try {
+    return cppcoro::sync_wait(rust_bench_value(kind));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+// Like `cppcoro_await_rust`, but with a deadline too far off to pass, to
+// measure what the timer costs.
+double cppcoro_await_rust_with_deadline(int32_t kind) {
+  try {
+    return cppcoro::sync_wait(
+        rust_deadline(std::chrono::seconds(10), rust_bench_value(kind)));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static rust::Box<RustOneshotReceiverF64>
+await_rust_at_priority(int32_t kind, RustPriority priority) {
+  co_await rust_set_priority(priority);
+  co_return co_await rust_resume_via(rust_pool_executor(),
+                                     rust_bench_value(kind));
+}
+
+// Like `cppcoro_await_rust`, but resuming on the shared pool at `priority`.
+double cppcoro_await_rust_at_priority(int32_t kind, uint8_t priority) {
+  try {
+    return cppcoro::sync_wait(
+        await_rust_at_priority(kind, static_cast<RustPriority>(priority)));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+double cppcoro_await_rust_inline(int32_t kind) {
+  try {
+    return cppcoro::sync_wait(rust_bench_value_inline(kind));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static cppcoro::task<double> await_rust_concurrently(int32_t kind,
+                                                     int32_t count) {
+  std::vector<rust::Box<RustOneshotReceiverF64>> receivers =
+      rust_bench_values(kind, count);
+
+  double sum = 0.0;
+  for (rust::Box<RustOneshotReceiverF64> &receiver : receivers)
+    sum += co_await std::move(receiver);
+  co_return sum;
+}
+
+// Starts `count` Rust futures before awaiting any of them.
+double cppcoro_await_rust_concurrently(int32_t kind, int32_t count) {
+  try {
+    return cppcoro::sync_wait(await_rust_concurrently(kind, count));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static cppcoro::task<double> join_rust(int32_t kind, int32_t count) {
+  std::vector<double> results =
+      co_await rust_join_all(rust_bench_values(kind, count));
+  co_return std::accumulate(results.begin(), results.end(), 0.0);
+}
+
+// Like `cppcoro_await_rust_concurrently`, but with one await for the lot.
+double cppcoro_join_rust(int32_t kind, int32_t count) {
+  try {
+    return cppcoro::sync_wait(join_rust(kind, count));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static cppcoro::task<double> when_all_rust(int32_t kind, int32_t count) {
+  std::vector<double> results =
+      co_await cppcoro::when_all(rust_bench_values(kind, count));
+  co_return std::accumulate(results.begin(), results.end(), 0.0);
+}
+
+// Like `cppcoro_join_rust`, but through `cppcoro::when_all`.
+double cppcoro_when_all_rust(int32_t kind, int32_t count) {
+  try {
+    return cppcoro::sync_wait(when_all_rust(kind, count));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static cppcoro::task<> produce_mpsc(cppcoro::static_thread_pool &thread_pool,
+                                    RustRunQueue &run_queue,
+                                    rust::Box<RustMpscSenderF64> sender,
+                                    int32_t items) {
+  co_await thread_pool.schedule();
+  for (int32_t i = 0; i < items; i++) {
+    auto send = rust_send(*sender, double(i));
+    send.resume_via(&run_queue);
+    if (!co_await send)
+      break;
+  }
+}
+
+// Sends `0..items` from each of `producers` coroutines on a pool of their own,
+// and drops `sender` once they're done, ending the stream.
+void cppcoro_produce_mpsc(rust::Box<RustMpscSenderF64> sender,
+                          int32_t producers, int32_t items) {
+  // The pool has to go first, so that no thread is still draining the run
+  // queue when it goes.
+  std::unique_ptr<RustCppcoroRunQueue> run_queue;
+  cppcoro::static_thread_pool thread_pool(producers);
+  run_queue = std::make_unique<RustCppcoroRunQueue>(thread_pool);
+
+  std::vector<cppcoro::task<>> tasks;
+  for (int32_t i = 0; i < producers; i++)
+    tasks.push_back(produce_mpsc(thread_pool, *run_queue,
+                                 sender->clone_sender(), items));
+  cppcoro::sync_wait(cppcoro::when_all(std::move(tasks)));
+}
+
+// Awaits two pods from Rust and returns another, all through the one pod
+// channel type. See pod.rs.
+static_assert(rust_pod_is_packed(&PodPoint::x, &PodPoint::y),
+              "PodPoint has padding");
+
+rust::Box<RustOneshotReceiverPod> cppcoro_pod_midpoint() {
+  PodPoint a = co_await rust_pod<PodPoint>(rust_pod_point(1.0, 2.0));
+  PodPoint b = co_await rust_pod<PodPoint>(rust_pod_point(3.0, 6.0));
+  co_return PodPoint{(a.x + b.x) / 2, (a.y + b.y) / 2};
+}
@@ -1,14 +1,408 @@
+#include "cxx-async/src/main.rs.h"
 #include "cxx_async.h"
 #include <cstdint>
+#include <new>
+#include <string>
 
-void rust_resume_cxx_coroutine(uint8_t *coroutine_address) {
-    std::experimental::coroutine_handle<void>::from_address(
-        static_cast<void *>(coroutine_address)).resume();
+#ifdef __linux__
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef CXX_ASYNC_COUNTERS
+#include <array>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <mutex>
+#include <typeindex>
+#include <unordered_map>
+#endif
+
+// Coroutine frame pooling for `RustFrameAllocation`. Sizes are rounded up to
+// size classes, and each thread keeps a free list per class. Threads that free
+// more frames than they allocate, such as a consumer resuming coroutines that
+// another thread started, keep only `FRAME_CACHE_DEPTH` frames per class and
+// hand the rest back to the heap. Bigger frames aren't pooled.
+#define FRAME_SIZE_CLASS_BYTES  64
+#define FRAME_SIZE_CLASSES      64
+#define FRAME_CACHE_DEPTH       64
+
+// How many times `RustThreadParker::park` checks for a wake before sleeping: a
+// few microseconds' worth, about what a futex round trip costs.
+#define PARK_SPINS              128
+
+// `RustThreadParker` states.
+#define PARK_EMPTY              0
+#define PARK_PARKED             1
+#define PARK_NOTIFIED           2
+
+namespace {
+
+struct FreeFrame {
+    FreeFrame *next;
+};
+
+// Trivially destructible, so that frames freed by other thread-local
+// destructors after `FrameCacheReaper` has run still find it.
+struct FrameCache {
+    FreeFrame *free[FRAME_SIZE_CLASSES];
+    uint32_t depth[FRAME_SIZE_CLASSES];
+    bool registered;
+    bool retired;
+};
+
+thread_local FrameCache t_frame_cache;
+
+// Empties the thread's cache when it exits. From then on its frames go
+// straight to the heap.
+struct FrameCacheReaper {
+    ~FrameCacheReaper() {
+        FrameCache &cache = t_frame_cache;
+        cache.retired = true;
+        for (size_t size_class = 0; size_class < FRAME_SIZE_CLASSES;
+             size_class++) {
+            while (FreeFrame *frame = cache.free[size_class]) {
+                cache.free[size_class] = frame->next;
+                ::operator delete(frame);
+            }
+            cache.depth[size_class] = 0;
+        }
+    }
+};
+
+thread_local FrameCacheReaper t_frame_cache_reaper;
+
+size_t frame_size_class(size_t size) {
+    return (size + FRAME_SIZE_CLASS_BYTES - 1) / FRAME_SIZE_CLASS_BYTES - 1;
+}
+
+} // namespace
+
+void *rust_allocate_frame(size_t size) {
+    size_t size_class = frame_size_class(size);
+    if (size_class < FRAME_SIZE_CLASSES) {
+        FrameCache &cache = t_frame_cache;
+        if (FreeFrame *frame = cache.free[size_class]) {
+            cache.free[size_class] = frame->next;
+            cache.depth[size_class]--;
+            return frame;
+        }
+        return ::operator new((size_class + 1) * FRAME_SIZE_CLASS_BYTES);
+    }
+    return ::operator new(size);
+}
+
+void rust_deallocate_frame(void *frame, size_t size) noexcept {
+    size_t size_class = frame_size_class(size);
+    if (size_class < FRAME_SIZE_CLASSES) {
+        FrameCache &cache = t_frame_cache;
+        if (!cache.registered) {
+            // Touching the reaper registers its destructor.
+            cache.registered = true;
+            (void)&t_frame_cache_reaper;
+        }
+        if (!cache.retired && cache.depth[size_class] < FRAME_CACHE_DEPTH) {
+            FreeFrame *free_frame = new (frame) FreeFrame{cache.free[size_class]};
+            cache.free[size_class] = free_frame;
+            cache.depth[size_class]++;
+            return;
+        }
+    }
+    ::operator delete(frame);
+}
+
+// Called by Rust wakers. Resumes the coroutine inline or on its executor.
+void rust_wake_cxx_coroutine(uint8_t *wake_target) {
+    reinterpret_cast<RustWakeTarget *>(wake_target)->wake();
+}
+
+static void spin_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+RustThreadParker::RustThreadParker() noexcept
+    : m_state(PARK_EMPTY), m_wake_target() {
+    m_wake_target.set_executor(this);
+}
+
+uint8_t *RustThreadParker::prepare() noexcept {
+    m_state.store(PARK_EMPTY, std::memory_order_relaxed);
+    // There's no coroutine to resume; waking runs `execute` instead.
+    return m_wake_target.prepare(std::experimental::coroutine_handle<void>());
+}
+
+void RustThreadParker::park() noexcept {
+    for (int spin = 0; spin < PARK_SPINS; spin++) {
+        if (m_state.load(std::memory_order_acquire) == PARK_NOTIFIED)
+            return;
+        spin_pause();
+    }
+    uint32_t state = PARK_EMPTY;
+    if (!m_state.compare_exchange_strong(state, PARK_PARKED,
+                                         std::memory_order_acquire))
+        return;
+    while (m_state.load(std::memory_order_acquire) == PARK_PARKED) {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_state),
+                FUTEX_WAIT_PRIVATE, PARK_PARKED, nullptr, nullptr, 0);
+#else
+        m_state.wait(PARK_PARKED, std::memory_order_acquire);
+#endif
+    }
+}
+
+// Called on the waking thread. The parked thread may return and free us as
+// soon as it sees `PARK_NOTIFIED`, so the futex wake may land on a dead address,
+// which at worst wakes some other futex spuriously.
+void RustThreadParker::execute(RustWakeTarget *) noexcept {
+    if (m_state.exchange(PARK_NOTIFIED, std::memory_order_acq_rel) !=
+        PARK_PARKED)
+        return;
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_state),
+            FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    m_state.notify_one();
+#endif
+}
+
+// Called by a lazy Rust future on its first poll. See lazy.rs.
+void rust_start_lazy_cxx_coroutine(uint8_t *header) {
+    reinterpret_cast<RustLazyHeader *>(header)->m_coroutine.resume();
+}
+
+// Called once a lazy Rust future is done with its coroutine, which is
+// suspended either before starting or at its final suspend point.
+void rust_destroy_lazy_cxx_coroutine(uint8_t *header) {
+    reinterpret_cast<RustLazyHeader *>(header)->m_coroutine.destroy();
+}
+
+// Called by Rust `recv` methods to fill in a `RustRecvSlot`'s error, moving the
+// exception, if any, out of Rust.
+void rust_construct_cxx_async_error(uint8_t *storage, int32_t code,
+                                    rust::Str message,
+                                    rust::String owned_message,
+                                    uint8_t *exception) {
+    std::exception_ptr carried;
+    if (exception != nullptr)
+        carried = std::move(*reinterpret_cast<std::exception_ptr *>(exception));
+    new (storage) RustError(code, message, std::move(owned_message),
+                            std::move(carried));
+}
+
+static rust::Str exception_message(const std::exception_ptr &exception) {
+    try {
+        std::rethrow_exception(exception);
+    } catch (const RustAsyncError &error) {
+        return error.error().message();
+    } catch (const std::exception &error) {
+        return rust::Str(error.what());
+    } catch (...) {
+        return rust::Str("Unhandled C++ exception");
+    }
+}
+
+// Called by `CxxException::what` in Rust.
+rust::Str rust_cxx_exception_what(const size_t &exception) {
+    return exception_message(
+        reinterpret_cast<const std::exception_ptr &>(exception));
+}
+
+void rust_drop_cxx_exception(uint8_t *exception) {
+    reinterpret_cast<std::exception_ptr *>(exception)->~exception_ptr();
+}
+
+rust::Str RustError::message() const {
+    if (m_exception)
+        return exception_message(m_exception);
+    if (!m_owned_message.empty())
+        return rust::Str(m_owned_message.data(), m_owned_message.size());
+    return m_message;
 }
 
-void rust_destroy_cxx_coroutine(uint8_t *coroutine_address) {
-    if (coroutine_address != nullptr) {
-        std::experimental::coroutine_handle<void>::from_address(
-            static_cast<void *>(coroutine_address)).destroy();
+const char *RustAsyncError::what() const noexcept {
+    if (m_what.empty()) {
+        try {
+            rust::Str message = m_error.message();
+            m_what.assign(message.data(), message.size());
+        } catch (...) {
+            return "Rust async error";
+        }
     }
+    return m_what.c_str();
 }
+
+void rust_retain_cxx_stop_state(uint8_t *stop_state) {
+    reinterpret_cast<RustStopState *>(stop_state)->retain();
+}
+
+void rust_release_cxx_stop_state(uint8_t *stop_state) {
+    reinterpret_cast<RustStopState *>(stop_state)->release();
+}
+
+void rust_request_cxx_stop(uint8_t *stop_state) {
+    reinterpret_cast<RustStopState *>(stop_state)->request_stop();
+}
+
+void rust_pool_submit(RustPoolJob *job, RustPriority priority) noexcept {
+    rust_pool_post(reinterpret_cast<uint8_t *>(job),
+                   static_cast<uint8_t>(priority));
+}
+
+uint64_t rust_arm_timer(std::chrono::nanoseconds timeout,
+                        RustTimerTarget *target) noexcept {
+    return rust_arm_cxx_timer(static_cast<uint64_t>(timeout.count()),
+                              reinterpret_cast<uint8_t *>(target));
+}
+
+bool rust_disarm_timer(uint64_t timer) noexcept {
+    return rust_disarm_cxx_timer(timer);
+}
+
+#ifdef CXX_ASYNC_TRACING
+
+void rust_trace(RustTraceEvent event, uint64_t span, uint64_t related) noexcept {
+    rust_record_cxx_trace_event(static_cast<uint8_t>(event), span, related);
+}
+
+uint64_t rust_trace_enter(uint64_t span) noexcept {
+    return rust_swap_cxx_trace_span(span);
+}
+
+#endif
+
+// Called on the timer thread when a timer that C++ armed expires.
+void rust_expire_cxx_timer(uint8_t *target) {
+    reinterpret_cast<RustTimerTarget *>(target)->expire();
+}
+
+// Called by the shared pool's workers to run a job that C++ submitted.
+void rust_run_cxx_pool_job(uint8_t *job) {
+    reinterpret_cast<RustPoolJob *>(job)->run();
+}
+
+RustExecutor &rust_pool_executor() {
+    static RustPoolRunQueue run_queue;
+    return run_queue;
+}
+
+// Called by `CxxSpawner` to run a Rust task on a C++ executor.
+void rust_post_to_cxx_executor(uint8_t *executor, uint8_t *task) {
+    reinterpret_cast<RustTaskExecutor *>(executor)->post(task);
+}
+
+void RustTaskExecutor::run(uint8_t *task) noexcept { rust_run_spawned_task(task); }
+
+// Called by the shared pool's workers to pin themselves to a core. Only Linux
+// can; elsewhere the worker floats.
+bool rust_pin_thread_to_core(size_t core) {
+#ifdef __linux__
+    if (core >= CPU_SETSIZE)
+        return false;
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core, &cores);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) == 0;
+#else
+    (void)core;
+    return false;
+#endif
+}
+
+#ifdef CXX_ASYNC_COUNTERS
+
+typedef std::array<uint64_t, static_cast<size_t>(RustCounter::Count)>
+    RustCounterValues;
+
+// Every thread's counters, plus the totals of threads that have exited. Leaked,
+// so that threads exiting during static destruction can still retire theirs.
+static std::mutex &counters_mutex() {
+    static std::mutex *mutex = new std::mutex;
+    return *mutex;
+}
+static RustThreadCounters *g_live_counters = nullptr;
+static std::unordered_map<std::type_index, RustCounterValues> &
+retired_counters() {
+    static auto *retired =
+        new std::unordered_map<std::type_index, RustCounterValues>;
+    return *retired;
+}
+
+RustThreadCounters::RustThreadCounters(const std::type_info &channel)
+    : m_values(), m_channel(channel) {
+    std::lock_guard<std::mutex> lock(counters_mutex());
+    m_next = g_live_counters;
+    g_live_counters = this;
+}
+
+RustThreadCounters::~RustThreadCounters() {
+    std::lock_guard<std::mutex> lock(counters_mutex());
+    RustCounterValues &retired = retired_counters()[m_channel];
+    for (size_t i = 0; i < retired.size(); i++)
+        retired[i] += m_values[i].load(std::memory_order_relaxed);
+    for (RustThreadCounters **link = &g_live_counters; *link;
+         link = &(*link)->m_next) {
+        if (*link == this) {
+            *link = m_next;
+            break;
+        }
+    }
+}
+
+// Returns the C++ side's counters, summed over all threads. Rust adds its own
+// in `counters::snapshot`.
+rust::Vec<BridgeCounters> cxx_bridge_counters() {
+    std::unordered_map<std::type_index, RustCounterValues> totals;
+    {
+        std::lock_guard<std::mutex> lock(counters_mutex());
+        totals = retired_counters();
+        for (RustThreadCounters *counters = g_live_counters; counters;
+             counters = counters->m_next) {
+            RustCounterValues &total = totals[counters->m_channel];
+            for (size_t i = 0; i < total.size(); i++)
+                total[i] += counters->m_values[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    rust::Vec<BridgeCounters> snapshot;
+    for (const auto &[channel, values] : totals) {
+        // Name channels the way Rust does, by their unmangled type names.
+        int status;
+        char *name =
+            abi::__cxa_demangle(channel.name(), nullptr, nullptr, &status);
+        BridgeCounters counters{};
+        counters.channel = rust::String(status == 0 ? name : channel.name());
+        std::free(name);
+
+        auto value = [&](RustCounter counter) {
+            return values[static_cast<size_t>(counter)];
+        };
+        counters.awaits = value(RustCounter::Awaits);
+        counters.ready_awaits = value(RustCounter::ReadyAwaits);
+        counters.wakes = value(RustCounter::Wakes);
+        counters.wake_to_resume_ns = value(RustCounter::WakeToResumeNs);
+        counters.destroyed_unresumed = value(RustCounter::DestroyedUnresumed);
+        counters.allocations = value(RustCounter::Allocations);
+        snapshot.push_back(std::move(counters));
+    }
+    return snapshot;
+}
+
+#else
+
+rust::Vec<BridgeCounters> cxx_bridge_counters() {
+    return rust::Vec<BridgeCounters>();
+}
+
+#endif
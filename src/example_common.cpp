@@ -1,7 +1,27 @@
 // cxx-async/src/example_common.cpp
 
+#include "cxx-async/src/main.rs.h"
+#include "cxx_async.h"
 #include "example_common.h"
+#include "rust/cxx.h"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <iomanip>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DOT_PRODUCT_X86
+#endif
 
 uint32_t Xorshift::next() {
     uint32_t x = m_state;
@@ -11,3 +31,373 @@ uint32_t Xorshift::next() {
     m_state = x;
 	return x;
 }
+
+static std::atomic<int32_t> g_live_frames(0);
+
+LiveFrameGuard::LiveFrameGuard() { g_live_frames.fetch_add(1); }
+
+LiveFrameGuard::~LiveFrameGuard() { g_live_frames.fetch_sub(1); }
+
+int32_t live_cxx_frames() { return g_live_frames.load(); }
+
+static std::atomic<uint64_t> g_allocations(0);
+// Scopes that have asked for allocations to be counted. Outside of them, the
+// replacement `operator new` below costs one more load than the default.
+static std::atomic<uint32_t> g_allocation_counting(0);
+
+// Counts C++ heap allocations, so that the benchmarks and tests can report
+// allocations per operation on both sides of the bridge.
+void *operator new(std::size_t size) {
+    if (g_allocation_counting.load(std::memory_order_relaxed))
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+    for (;;) {
+        if (void *ptr = std::malloc(size ? size : 1))
+            return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+void cxx_count_allocations(bool enabled) {
+    if (enabled)
+        g_allocation_counting.fetch_add(1, std::memory_order_relaxed);
+    else
+        g_allocation_counting.fetch_sub(1, std::memory_order_relaxed);
+}
+
+uint64_t cxx_allocation_count() {
+    return g_allocations.load(std::memory_order_relaxed);
+}
+
+// The dot product kernels. `dot_product_kernel()` picks the widest one that the
+// CPU supports the first time it's called. Each keeps several accumulators so
+// that the adds don't wait on one another.
+
+static double dot_product_scalar(const double *a, const double *b,
+                                 size_t count) {
+    double sum = 0.0;
+    for (size_t i = 0; i < count; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+#ifdef DOT_PRODUCT_X86
+
+__attribute__((target("sse2"))) static double
+dot_product_sse2(const double *a, const double *b, size_t count) {
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(a + i),
+                                           _mm_loadu_pd(b + i)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(a + i + 2),
+                                           _mm_loadu_pd(b + i + 2)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1] + dot_product_scalar(a + i, b + i, count - i);
+}
+
+__attribute__((target("avx2,fma"))) static double
+dot_product_avx2(const double *a, const double *b, size_t count) {
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    __m256d sum2 = _mm256_setzero_pd(), sum3 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        sum0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i),
+                               sum0);
+        sum1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4),
+                               _mm256_loadu_pd(b + i + 4), sum1);
+        sum2 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 8),
+                               _mm256_loadu_pd(b + i + 8), sum2);
+        sum3 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 12),
+                               _mm256_loadu_pd(b + i + 12), sum3);
+    }
+    for (; i + 4 <= count; i += 4)
+        sum0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i),
+                               sum0);
+    __m256d sum = _mm256_add_pd(_mm256_add_pd(sum0, sum1),
+                                _mm256_add_pd(sum2, sum3));
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum),
+                              _mm256_extractf128_pd(sum, 1));
+    double lanes[2];
+    _mm_storeu_pd(lanes, half);
+    return lanes[0] + lanes[1] + dot_product_scalar(a + i, b + i, count - i);
+}
+
+__attribute__((target("avx512f"))) static double
+dot_product_avx512(const double *a, const double *b, size_t count) {
+    __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd();
+    __m512d sum2 = _mm512_setzero_pd(), sum3 = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        sum0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i),
+                               sum0);
+        sum1 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8),
+                               _mm512_loadu_pd(b + i + 8), sum1);
+        sum2 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 16),
+                               _mm512_loadu_pd(b + i + 16), sum2);
+        sum3 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 24),
+                               _mm512_loadu_pd(b + i + 24), sum3);
+    }
+    for (; i + 8 <= count; i += 8)
+        sum0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i),
+                               sum0);
+    // Mask off the lanes past the end rather than finishing with scalar code.
+    __mmask8 tail = (__mmask8)((1u << (count - i)) - 1);
+    sum1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(tail, a + i),
+                           _mm512_maskz_loadu_pd(tail, b + i), sum1);
+    return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(sum0, sum1),
+                                              _mm512_add_pd(sum2, sum3)));
+}
+
+#endif
+
+struct DotProductKernel {
+    const char *name;
+    double (*kernel)(const double *a, const double *b, size_t count);
+};
+
+static DotProductKernel select_dot_product_kernel() {
+#ifdef DOT_PRODUCT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return {"avx512", dot_product_avx512};
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return {"avx2", dot_product_avx2};
+    if (__builtin_cpu_supports("sse2"))
+        return {"sse2", dot_product_sse2};
+#endif
+    return {"scalar", dot_product_scalar};
+}
+
+static const DotProductKernel &dot_product_kernel_impl() {
+    static const DotProductKernel kernel = select_dot_product_kernel();
+    return kernel;
+}
+
+double dot_product_kernel(const double *a, const double *b, size_t count) {
+    return dot_product_kernel_impl().kernel(a, b, count);
+}
+
+double cxx_dot_product_kernel(rust::Slice<const double> a,
+                              rust::Slice<const double> b) {
+    return dot_product_kernel(a.data(), b.data(), std::min(a.size(), b.size()));
+}
+
+rust::String dot_product_kernel_name() {
+    return rust::String(dot_product_kernel_impl().name);
+}
+
+// What the kernel costs per element, measured once over vectors that fit in
+// cache. Bigger vectors cost more per element, which only errs toward leaves
+// that are too big rather than too small.
+static double dot_product_ns_per_element() {
+    static const double ns_per_element = []() {
+        std::vector<double> a(DOT_PRODUCT_CALIBRATION_ELEMENTS, 1.0);
+        std::vector<double> b(DOT_PRODUCT_CALIBRATION_ELEMENTS, 2.0);
+        double best = std::numeric_limits<double>::infinity();
+        for (int run = 0; run < 8; run++)
+            best = std::min(best, time_ns([&]() {
+                volatile double sum =
+                    dot_product_kernel(a.data(), b.data(), a.size());
+                (void)sum;
+            }));
+        return std::max(best, 1.0) / DOT_PRODUCT_CALIBRATION_ELEMENTS;
+    }();
+    return ns_per_element;
+}
+
+// Picks the fewest elements that make a leaf's work `DOT_PRODUCT_WORK_PER_FORK`
+// times what forking it cost, so that the overhead stays a small fraction.
+size_t dot_product_grain(double fork_overhead_ns) {
+    double grain = fork_overhead_ns * DOT_PRODUCT_WORK_PER_FORK /
+                   dot_product_ns_per_element();
+    return (size_t)std::clamp(grain, (double)EXAMPLE_SPLIT_LIMIT,
+                              (double)DOT_PRODUCT_MAX_GRAIN);
+}
+
+// How `RustOneshotAwaiter` was laid out before `RustRecvSlot`, for comparison,
+// back when `RustAsyncError` held just a `std::string`.
+struct OldRustAsyncError : public std::exception {
+    std::string m_what;
+};
+
+template <typename Channel> struct OldRustOneshotAwaiter {
+    rust::Box<RustOneshotReceiverFor<Channel>> m_receiver;
+    std::optional<RustOneshotResultFor<Channel>> m_result;
+    std::optional<OldRustAsyncError> m_error;
+};
+
+template <typename Awaiter, typename OldAwaiter>
+static void print_awaiter_size(const char *name) {
+    std::cout << std::left << std::setw(49) << name << std::right
+              << std::setw(4) << sizeof(Awaiter) << " bytes (was "
+              << sizeof(OldAwaiter) << ")" << std::endl;
+}
+
+// Reports how much space awaiting a Rust channel takes up in a coroutine frame.
+void print_awaiter_sizes() {
+    print_awaiter_size<RustOneshotAwaiter<RustOneshotChannelF64>,
+                       OldRustOneshotAwaiter<RustOneshotChannelF64>>(
+        "RustOneshotAwaiter<F64>");
+    print_awaiter_size<RustOneshotAwaiter<RustOneshotChannelString>,
+                       OldRustOneshotAwaiter<RustOneshotChannelString>>(
+        "RustOneshotAwaiter<String>");
+}
+
+// Times `threads` threads each allocating and freeing `count` coroutine frames
+// of `size` bytes, `FRAME_BATCH` live at a time, from the frame pool or, as the
+// bridge's promises did before it, from the heap. Returns the nanoseconds that
+// the slowest thread took.
+double time_frame_allocations(size_t size, uint32_t threads, uint32_t count,
+                              bool pooled) {
+    std::vector<double> elapsed(threads);
+    std::vector<std::thread> workers;
+    for (uint32_t thread = 0; thread < threads; thread++) {
+        workers.emplace_back([&, thread]() {
+            void *frames[FRAME_BATCH];
+            elapsed[thread] = time_ns([&]() {
+                for (uint32_t done = 0; done < count; done += FRAME_BATCH) {
+                    for (void *&frame : frames)
+                        frame = pooled ? rust_allocate_frame(size)
+                                       : ::operator new(size);
+                    for (void *frame : frames) {
+                        if (pooled)
+                            rust_deallocate_frame(frame, size);
+                        else
+                            ::operator delete(frame, size);
+                    }
+                }
+            });
+        });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    return *std::max_element(elapsed.begin(), elapsed.end());
+}
+
+// Starts `count` Rust futures for the benchmarks in bench.rs to await.
+std::vector<rust::Box<RustOneshotReceiverF64>> rust_bench_values(int32_t kind,
+                                                                 int32_t count) {
+    std::vector<rust::Box<RustOneshotReceiverF64>> receivers;
+    receivers.reserve(count);
+    for (int32_t i = 0; i < count; i++)
+        receivers.push_back(rust_bench_value(kind));
+    return receivers;
+}
+
+// Awaits `rust_bench_value(kind)` for one of the kinds that fail right away,
+// through the exception path if `throwing` is set and through `rust_try`
+// otherwise. Returns the error code. For the error path benchmarks in bench.rs.
+int32_t cxx_await_rust_error(int32_t kind, bool throwing) {
+    int32_t code = RUST_ERROR_UNSPECIFIED;
+    bool done = false;
+    [&]() -> RustDetachedTask {
+        if (throwing) {
+            try {
+                co_await rust_bench_value(kind);
+            } catch (const RustAsyncError &error) {
+                code = error.code();
+            }
+        } else {
+            code = (co_await rust_try(rust_bench_value(kind))).error().code();
+        }
+        done = true;
+    }();
+    // The locals above mustn't go away under a suspended await.
+    if (!done)
+        std::terminate();
+    return code;
+}
+
+// Awaits `receiver` on a coroutine that Rust resumes inline, on whichever
+// thread completes it, and then calls `done` with the value.
+void cxx_await_rust_then(rust::Box<RustOneshotReceiverF64> receiver,
+                         rust::Fn<void(double)> done) {
+    [](rust::Box<RustOneshotReceiverF64> receiver,
+       rust::Fn<void(double)> done) -> RustDetachedTask {
+        done(co_await std::move(receiver));
+    }(std::move(receiver), done);
+}
+
+// Blocks on `rust_bench_value(kind)` with `rust_block_on`, no runtime needed.
+// Returns NaN if the Rust future fails. Compared against each runtime's own
+// blocking wait in bench.rs.
+double cxx_block_on_rust(int32_t kind) {
+    try {
+        return rust_block_on(rust_bench_value(kind));
+    } catch (const RustAsyncError &) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+// Calls the Rust dot product from a plain thread.
+void cxx_call_rust_dot_product_blocking() {
+    std::cout << rust_block_on(rust_dot_product()) << std::endl;
+}
+
+// Fails with a C++ exception, or, if `exception` is false, with a coded error.
+rust::Box<RustOneshotReceiverF64> cxx_bench_error(bool exception) {
+    if (exception)
+        throw std::runtime_error("kaboom");
+    co_return RustError(BENCH_ERROR_CODE, "miss");
+}
+
+// The C++ half of the stress tests in stress.rs.
+
+rust::Box<RustOneshotReceiverF64> cxx_pong(int32_t i) { co_return (double)i; }
+
+rust::Box<RustOneshotReceiverF64> cxx_ping_pong_loop(int32_t iterations) {
+    double sum = 0.0;
+    for (int32_t i = 0; i < iterations; i++)
+        sum += co_await rust_pong(i);
+    co_return sum;
+}
+
+rust::Box<RustOneshotReceiverF64>
+cxx_chain_link(rust::Box<RustOneshotReceiverF64> inner) {
+    co_return 1.0 + co_await std::move(inner);
+}
+
+// Buffers cross the bridge by moving ownership: a Rust `Vec` arrives as a
+// `rust::Vec` that frees itself through Rust's allocator, and a
+// `std::unique_ptr<std::vector>` arrives in Rust as a `UniquePtr<CxxVector>`.
+
+std::unique_ptr<std::vector<uint8_t>> cxx_make_vector_u8(size_t len) {
+    return std::make_unique<std::vector<uint8_t>>(len);
+}
+
+rust::Box<RustOneshotReceiverVecU8>
+cxx_echo_vec_u8(rust::Box<RustOneshotReceiverVecU8> inner) {
+    co_return co_await std::move(inner);
+}
+
+rust::Box<RustOneshotReceiverCxxVectorU8>
+cxx_echo_vector_u8(rust::Box<RustOneshotReceiverCxxVectorU8> inner) {
+    co_return co_await std::move(inner);
+}
+
+rust::Box<RustOneshotReceiverCxxVectorF64> cxx_random_vector_f64(size_t len) {
+    Xorshift rand;
+    auto values = std::make_unique<std::vector<double>>();
+    values->reserve(len);
+    for (size_t i = 0; i < len; i++)
+        values->push_back((double)rand.next());
+    co_return std::move(values);
+}
+
+rust::Box<RustOneshotReceiverF64>
+cxx_sum_vec_f64(rust::Box<RustOneshotReceiverVecF64> values) {
+    rust::Vec<double> vec = co_await std::move(values);
+    double sum = 0.0;
+    for (double value : vec)
+        sum += value;
+    co_return sum;
+}
@@ -4,19 +4,35 @@
 
 #include "cxx-async/src/main.rs.h"
 #include "cxx_async.h"
+#include "cxx_async_folly.h"
 #include "example_common.h"
 #include "rust/cxx.h"
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include <folly/CancellationToken.h>
+#include <folly/OperationCancelled.h>
 #include <folly/executors/CPUThreadPoolExecutor.h>
 #include <folly/executors/ManualExecutor.h>
+#include <folly/experimental/coro/AsyncGenerator.h>
 #include <folly/experimental/coro/BlockingWait.h>
 #include <folly/experimental/coro/Collect.h>
 #include <folly/experimental/coro/Coroutine.h>
+#include <folly/experimental/coro/CurrentExecutor.h>
 #include <folly/experimental/coro/Task.h>
+#include <folly/experimental/coro/WithCancellation.h>
+#include <folly/futures/Future.h>
 #include <folly/tracing/AsyncStack.h>
 
-// FIXME(pcwalton): This definition is only needed to make the Folly Homebrew
-// package link, I think. Detect that.
+#ifdef CXX_ASYNC_FOLLY_RESUME_SHIM
+
+// Folly's coroutine headers call this, but folly libraries built without
+// coroutine support, such as Homebrew's, leave it out. build.rs defines
+// this when linking against the default Homebrew folly; build with
+// `--features folly-resume-shim` to link against another one of those.
 namespace folly {
 
 FOLLY_NOINLINE void
@@ -29,18 +45,20 @@ resumeCoroutineWithNewAsyncStackRoot(coro::coroutine_handle<> h,
 
 } // namespace folly
 
+#endif
+
 static folly::coro::Task<double> dot_product_inner(
-    folly::Executor::KeepAlive<folly::CPUThreadPoolExecutor> &thread_pool,
-    double a[], double b[], size_t count) {
-  if (count > EXAMPLE_SPLIT_LIMIT) {
+    folly::Executor::KeepAlive<> &thread_pool,
+    double a[], double b[], size_t count, size_t grain) {
+  if (count > grain) {
     size_t half_count = count / 2;
     folly::Future<double> taskA =
-        dot_product_inner(thread_pool, a, b, half_count)
+        dot_product_inner(thread_pool, a, b, half_count, grain)
             .semi()
             .via(thread_pool);
     folly::Future<double> taskB =
         dot_product_inner(thread_pool, a + half_count, b + half_count,
-                          count - half_count)
+                          count - half_count, grain)
             .semi()
             .via(thread_pool);
     auto [first, second] =
@@ -48,14 +66,43 @@ static folly::coro::Task<double> dot_product_inner(
     co_return *first + *second;
   }
 
-  double sum = 0.0;
-  for (size_t i = 0; i < count; i++)
-    sum += a[i] * b[i];
-  co_return sum;
+  co_return dot_product_kernel(a, b, count);
+}
+
+static folly::coro::Task<void> calibration_fork() { co_return; }
+
+static folly::coro::Task<void> calibration_forks(
+    folly::Executor::KeepAlive<> &thread_pool) {
+  for (size_t i = 0; i < DOT_PRODUCT_CALIBRATION_FORKS; i++)
+    co_await calibration_fork().semi().via(thread_pool);
+}
+
+// What a fork in `dot_product_inner` costs: a task, and a future on the pool.
+static folly::coro::Task<double> fork_overhead_ns(
+    folly::Executor::KeepAlive<> &thread_pool) {
+  auto start = std::chrono::steady_clock::now();
+  co_await calibration_forks(thread_pool);
+  co_return elapsed_ns(start) / DOT_PRODUCT_CALIBRATION_FORKS;
+}
+
+// The grain for the shared pool, calibrated by the first dot product to need
+// it. This awaits the calibration rather than blocking on it, since a lazy dot
+// product may first run on a pool worker, which blocking would tie up. Dot
+// products that start at the same time may each calibrate, which is harmless.
+static folly::coro::Task<size_t> pool_grain(
+    folly::Executor::KeepAlive<> &thread_pool) {
+  static std::atomic<size_t> grain(0);
+  size_t calibrated = grain.load(std::memory_order_relaxed);
+  if (calibrated == 0) {
+    calibrated = dot_product_grain(co_await fork_overhead_ns(thread_pool));
+    grain.store(calibrated, std::memory_order_relaxed);
+  }
+  co_return calibrated;
 }
 
 static folly::coro::Task<double> dot_product_on(
-    folly::Executor::KeepAlive<folly::CPUThreadPoolExecutor> &thread_pool) {
+    folly::Executor::KeepAlive<> &thread_pool,
+    size_t grain) {
   Xorshift rand;
   std::vector<double> array_a, array_b;
   for (size_t i = 0; i < EXAMPLE_ARRAY_SIZE; i++) {
@@ -64,13 +111,56 @@ static folly::coro::Task<double> dot_product_on(
   }
 
   co_return co_await dot_product_inner(thread_pool, &array_a[0], &array_b[0],
-                                       array_a.size());
+                                       array_a.size(), grain);
 }
 
 rust::Box<RustOneshotReceiverF64> folly_dot_product() {
-  static folly::Executor::KeepAlive<folly::CPUThreadPoolExecutor> thread_pool(
-      new folly::CPUThreadPoolExecutor(8));
-  co_return co_await dot_product_on(thread_pool).semi().via(thread_pool);
+  static folly::Executor::KeepAlive<> thread_pool = rust_pool_folly_executor();
+  size_t grain = co_await pool_grain(thread_pool).semi().via(thread_pool);
+  co_return co_await dot_product_on(thread_pool, grain)
+      .semi()
+      .via(thread_pool);
+}
+
+// Like the above, but doesn't start until Rust polls it, and hands its result
+// straight to the Rust future.
+rust::Box<RustLazyF64> folly_dot_product_lazy() {
+  static folly::Executor::KeepAlive<> thread_pool = rust_pool_folly_executor();
+  size_t grain = co_await pool_grain(thread_pool).semi().via(thread_pool);
+  co_return co_await dot_product_on(thread_pool, grain)
+      .semi()
+      .via(thread_pool);
+}
+
+static double time_dot_product_on(folly::Executor::KeepAlive<> &thread_pool,
+                                  size_t count, size_t grain,
+                                  uint32_t iterations) {
+  if (grain == 0)
+    grain = dot_product_grain(
+        folly::coro::blockingWait(fork_overhead_ns(thread_pool)));
+  std::vector<double> array_a(count, 1.0), array_b(count, 2.0);
+  return time_ns([&]() {
+    for (uint32_t i = 0; i < iterations; i++)
+      folly::coro::blockingWait(dot_product_inner(thread_pool, &array_a[0],
+                                                  &array_b[0], count, grain)
+                                    .semi()
+                                    .via(thread_pool));
+  });
+}
+
+// Times `iterations` dot products of `count` elements on a folly pool of
+// `threads`, or on the shared pool if that's zero, splitting down to `grain`
+// elements, or to a calibrated grain if that's zero. For the scaling benchmark
+// in bench.rs.
+double folly_time_dot_product(size_t count, uint32_t threads, size_t grain,
+                              uint32_t iterations) {
+  if (threads == 0) {
+    folly::Executor::KeepAlive<> thread_pool = rust_pool_folly_executor();
+    return time_dot_product_on(thread_pool, count, grain, iterations);
+  }
+  folly::CPUThreadPoolExecutor executor(threads);
+  folly::Executor::KeepAlive<> thread_pool = folly::getKeepAliveToken(executor);
+  return time_dot_product_on(thread_pool, count, grain, iterations);
 }
 
 void folly_call_rust_dot_product() {
@@ -79,12 +169,36 @@ void folly_call_rust_dot_product() {
   std::cout << result << std::endl;
 }
 
+// Runs several Rust dot products at once as folly futures, collecting them all
+// and then taking whichever finishes first.
+void folly_collect_rust_dot_products() {
+  std::vector<folly::SemiFuture<double>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(rust_to_semi_future(rust_dot_product()));
+  std::vector<folly::Try<double>> results =
+      folly::collectAll(std::move(futures)).get();
+  std::cout << results[0].value() << std::endl;
+
+  futures.clear();
+  for (int i = 0; i < 4; i++)
+    futures.push_back(rust_to_semi_future(rust_dot_product()));
+  std::pair<size_t, folly::Try<double>> first =
+      folly::collectAny(std::move(futures)).get();
+  std::cout << first.second.value() << std::endl;
+}
+
 rust::Box<RustOneshotReceiverF64> folly_not_product() {
   if (true)
     throw std::runtime_error("kaboom");
   co_return 1.0; // just to make this function a coroutine
 }
 
+rust::Box<RustLazyF64> folly_not_product_lazy() {
+  if (true)
+    throw std::runtime_error("kaboom");
+  co_return 1.0; // just to make this function a coroutine
+}
+
 void folly_call_rust_not_product() {
   try {
     rust::Box<RustOneshotReceiverF64> oneshot_receiver = rust_not_product();
@@ -95,9 +209,173 @@ void folly_call_rust_not_product() {
   }
 }
 
+// Polls the Rust future on this thread rather than awaiting a spawned task.
+// Then asks for the same product spawned onto the pool, to run in parallel.
+void folly_call_rust_dot_product_inline() {
+  double result = folly::coro::blockingWait(rust_dot_product_inline());
+  std::cout << result << std::endl;
+
+  rust::Box<RustOneshotReceiverF64> spawned =
+      rust_spawn(rust_dot_product_inline());
+  result = folly::coro::blockingWait(std::move(spawned));
+  std::cout << result << std::endl;
+}
+
+void folly_call_rust_not_product_inline() {
+  try {
+    double result = folly::coro::blockingWait(rust_not_product_inline());
+    std::cout << result << std::endl;
+  } catch (const std::exception &error) {
+    std::cout << error.what() << std::endl;
+  }
+}
+
 rust::Box<RustOneshotReceiverString>
-folly_ping_pong(int i) {
-  std::string string(co_await rust_folly_ping_pong(i + 1));
+folly_ping_pong(int i, int depth) {
+  std::string string(co_await rust_folly_ping_pong(i + 1, depth));
   string += "pong ";
   co_return std::move(string);
 }
+
+static folly::coro::Task<double> sum_rust_dot_product_chunks() {
+  auto chunks = rust_stream_to_folly_generator(rust_dot_product_chunks());
+  double sum = 0.0;
+  while (auto item = co_await chunks.next())
+    sum += *item;
+  co_return sum;
+}
+
+void folly_call_rust_dot_product_chunks() {
+  double result = folly::coro::blockingWait(sum_rust_dot_product_chunks());
+  std::cout << result << std::endl;
+}
+
+static folly::coro::Task<double> sum_until_cancelled() {
+  double sum = 0.0;
+  while (true) {
+    co_await folly::coro::co_reschedule_on_current_executor;
+    const folly::CancellationToken &token =
+        co_await folly::coro::co_current_cancellation_token;
+    if (token.isCancellationRequested())
+      throw folly::OperationCancelled();
+    sum += 1.0;
+  }
+}
+
+// Counts up forever on the shared pool, until Rust drops the receiver.
+rust::Box<RustOneshotReceiverF64> folly_sum_until_cancelled() {
+  LiveFrameGuard guard;
+  RustFollyCancellation cancellation(co_await rust_current_stop_token());
+  co_return co_await folly::coro::co_withCancellation(cancellation.token(),
+                                                      sum_until_cancelled())
+      .semi()
+      .via(rust_pool_folly_executor());
+}
+
+static folly::coro::Task<double> await_rust_pending_forever() {
+  // The task's cancellation token reaches the Rust receiver through
+  // `co_withCancellation` in cxx_async_folly.h.
+  co_return co_await rust_pending_forever();
+}
+
+void folly_cancel_rust_pending_forever() {
+  folly::CancellationSource source;
+  std::thread canceller([source] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    source.requestCancellation();
+  });
+
+  try {
+    double result = folly::coro::blockingWait(folly::coro::co_withCancellation(
+        source.getToken(), await_rust_pending_forever()));
+    std::cout << result << std::endl;
+  } catch (const folly::OperationCancelled &) {
+    std::cout << "cancelled" << std::endl;
+  }
+  canceller.join();
+}
+
+// The C++ half of the cross-runtime benchmarks in bench.rs.
+
+rust::Box<RustOneshotReceiverF64> folly_ready_value() { co_return 1.0; }
+
+rust::Box<RustOneshotReceiverF64> folly_pending_value() {
+  co_await folly::makeSemiFuture().via(rust_pool_folly_executor());
+  co_return 1.0;
+}
+
+rust::Box<RustLazyF64> folly_ready_value_lazy() { co_return 1.0; }
+
+rust::Box<RustLazyF64> folly_pending_value_lazy() {
+  co_await folly::makeSemiFuture().via(rust_pool_folly_executor());
+  co_return 1.0;
+}
+
+// Returns NaN if the Rust future fails.
+double folly_await_rust(int32_t kind) {
+  try {
+    return folly::coro::blockingWait(rust_bench_value(kind));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+double folly_await_rust_inline(int32_t kind) {
+  try {
+    return folly::coro::blockingWait(rust_bench_value_inline(kind));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static folly::coro::Task<double> await_rust_concurrently(int32_t kind,
+                                                         int32_t count) {
+  std::vector<rust::Box<RustOneshotReceiverF64>> receivers =
+      rust_bench_values(kind, count);
+
+  double sum = 0.0;
+  for (rust::Box<RustOneshotReceiverF64> &receiver : receivers)
+    sum += co_await std::move(receiver);
+  co_return sum;
+}
+
+// Starts `count` Rust futures before awaiting any of them.
+double folly_await_rust_concurrently(int32_t kind, int32_t count) {
+  try {
+    return folly::coro::blockingWait(await_rust_concurrently(kind, count));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static folly::coro::Task<double> join_rust(int32_t kind, int32_t count) {
+  std::vector<double> results =
+      co_await rust_join_all(rust_bench_values(kind, count));
+  co_return std::accumulate(results.begin(), results.end(), 0.0);
+}
+
+// Like `folly_await_rust_concurrently`, but with one await for the lot.
+double folly_join_rust(int32_t kind, int32_t count) {
+  try {
+    return folly::coro::blockingWait(join_rust(kind, count));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+// Rust receivers are semi-awaitables, so they go to `collectAllRange` as they
+// are, without a task around each.
+static folly::coro::Task<double> when_all_rust(int32_t kind, int32_t count) {
+  std::vector<double> results =
+      co_await folly::coro::collectAllRange(rust_bench_values(kind, count));
+  co_return std::accumulate(results.begin(), results.end(), 0.0);
+}
+
+// Like `folly_join_rust`, but through `folly::coro::collectAllRange`.
+double folly_when_all_rust(int32_t kind, int32_t count) {
+  try {
+    return folly::coro::blockingWait(when_all_rust(kind, count));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
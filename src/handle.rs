@@ -0,0 +1,21 @@
+// cxx-async/src/handle.rs
+//
+// The handles of the channels in oneshot.rs, stream.rs and mpsc.rs, and of the lazy coroutines in
+// lazy.rs, are zero-sized, and their `Box`es point straight at the allocation that they share. A
+// reference to a zero-sized handle has no provenance over the bytes behind it, so going from one
+// to the allocation by a cast would be undefined behavior. Instead, whoever creates the allocation
+// exposes its provenance with `expose`, and the handles pick it back up by address with `shared`.
+// Memory that C++ allocates, like a lazy coroutine's frame, counts as exposed already.
+
+use std::ptr;
+
+// Exposes the provenance of `allocation` for `shared` to find, and returns it.
+pub fn expose<T>(allocation: *mut T) -> *mut T {
+    let _ = allocation.expose_provenance();
+    allocation
+}
+
+// The allocation that a zero-sized handle points at.
+pub fn shared<Handle, T>(handle: *const Handle) -> *mut T {
+    ptr::with_exposed_provenance_mut(handle.addr())
+}
@@ -0,0 +1,155 @@
+// cxx-async/src/inline_future.rs
+//
+// Rust futures that C++ polls itself, on the awaiting thread, rather than awaiting a channel fed by
+// a spawned task. A future that's ready on its first poll never leaves the thread that awaits it.
+// See `RustFutureAwaiter` in cxx_async.h.
+//
+// The waker can't be the free one from `cxx_coroutine_waker`, since an arbitrary future may clone
+// its waker into several places, wake it more than once, or wake it while it's being polled. So
+// it's a reference-counted `FutureWaker`, whose state word makes sure that C++ hears about at most
+// one wake per poll that returned `Pending`: a wake during a poll makes the poller poll again, and
+// once a wake has taken the wake target, later wakes do nothing until the next poll. C++ makes its
+// first poll without a wake target, which needs no waker, so futures that are ready then don't
+// allocate one.
+
+use crate::{ffi, CxxAsyncException};
+use futures::task::{noop_waker_ref, waker_ref, ArcWake};
+use std::cell::UnsafeCell;
+use std::future::Future;
+use std::pin::Pin;
+use std::ptr;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::task::{Context, Poll};
+
+// Nobody is polling the future, and nobody is waiting for a wake.
+const IDLE: usize = 0;
+const POLLING: usize = 1;
+// Woken while polling, so poll again.
+const NOTIFIED: usize = 2;
+// The last poll returned `Pending`, and `wake_target` is waiting for a wake.
+const WAITING: usize = 3;
+// The future is gone.
+const CLOSED: usize = 4;
+
+pub type BoxedFuture<T> = Pin<Box<dyn Future<Output = Result<T, CxxAsyncException>> + Send>>;
+
+struct FutureWaker {
+    state: AtomicUsize,
+    // Only written by the poller, while nothing will read it.
+    wake_target: UnsafeCell<*mut u8>,
+}
+
+unsafe impl Send for FutureWaker {}
+unsafe impl Sync for FutureWaker {}
+
+impl ArcWake for FutureWaker {
+    fn wake_by_ref(arc_self: &Arc<Self>) {
+        let mut state = arc_self.state.load(Ordering::Acquire);
+        loop {
+            let next = match state {
+                WAITING => IDLE,
+                POLLING => NOTIFIED,
+                _ => return,
+            };
+            match arc_self.state.compare_exchange_weak(
+                state,
+                next,
+                Ordering::AcqRel,
+                Ordering::Acquire,
+            ) {
+                Ok(_) if state == WAITING => unsafe {
+                    return ffi::rust_wake_cxx_coroutine(*arc_self.wake_target.get());
+                },
+                Ok(_) => return,
+                Err(current) => state = current,
+            }
+        }
+    }
+}
+
+pub struct InlineFuture<T> {
+    // Gone once it's finished or been spawned.
+    future: Option<BoxedFuture<T>>,
+    waker: Option<Arc<FutureWaker>>,
+}
+
+impl<T> InlineFuture<T> {
+    pub fn new(future: BoxedFuture<T>) -> Self {
+        Self {
+            future: Some(future),
+            waker: None,
+        }
+    }
+
+    // Hands the future over to be spawned instead.
+    pub fn take(&mut self) -> BoxedFuture<T> {
+        self.close();
+        self.future
+            .take()
+            .expect("future already finished or spawned")
+    }
+
+    // Polls the future. If it's pending and `wake_target` isn't null, wakes `wake_target` once
+    // it's worth polling again, which may happen before this returns, on another thread.
+    pub unsafe fn poll_from_cxx(
+        &mut self,
+        wake_target: *mut u8,
+    ) -> Poll<Result<T, CxxAsyncException>> {
+        let future = self
+            .future
+            .as_mut()
+            .expect("future polled after finishing or spawning");
+
+        let result = if wake_target.is_null() {
+            future
+                .as_mut()
+                .poll(&mut Context::from_waker(noop_waker_ref()))
+        } else {
+            let waker = self.waker.get_or_insert_with(|| {
+                Arc::new(FutureWaker {
+                    state: AtomicUsize::new(IDLE),
+                    wake_target: UnsafeCell::new(ptr::null_mut()),
+                })
+            });
+            *waker.wake_target.get() = wake_target;
+            waker.state.store(POLLING, Ordering::Release);
+            loop {
+                if let Poll::Ready(result) = future
+                    .as_mut()
+                    .poll(&mut Context::from_waker(&waker_ref(waker)))
+                {
+                    waker.state.store(IDLE, Ordering::Release);
+                    break Poll::Ready(result);
+                }
+                match waker.state.compare_exchange(
+                    POLLING,
+                    WAITING,
+                    Ordering::AcqRel,
+                    Ordering::Acquire,
+                ) {
+                    Ok(_) => return Poll::Pending,
+                    Err(_) => waker.state.store(POLLING, Ordering::Relaxed),
+                }
+            }
+        };
+
+        if result.is_ready() {
+            self.future = None;
+        }
+        result
+    }
+
+    // Keeps stray wakes from reaching a C++ awaiter that's gone.
+    fn close(&mut self) {
+        if let Some(ref waker) = self.waker {
+            waker.state.store(CLOSED, Ordering::Release);
+        }
+    }
+}
+
+impl<T> Drop for InlineFuture<T> {
+    fn drop(&mut self) {
+        self.close();
+    }
+}
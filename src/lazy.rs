@@ -0,0 +1,267 @@
+// cxx-async/src/lazy.rs
+//
+// Futures that drive a lazily started C++ coroutine directly, with no channel in between.
+//
+// A C++ coroutine that returns one of these (see `RustLazyPromise` in cxx_async.h) starts
+// suspended. The handle is zero-sized, and its `Box` points at the start of the coroutine's
+// promise, where C++ reserves room for a `LazyState`. The first poll starts the coroutine on the
+// polling thread, so a coroutine that finishes without suspending costs neither a wakeup nor an
+// allocation beyond its frame. Otherwise the poll leaves its waker in the state, and the coroutine
+// wakes it from its final suspend point. Either way the outcome stays in the promise, which waits
+// at its final suspend point for us to move the value out and destroy it.
+//
+// Dropping the handle while the coroutine is running doesn't stop it; the coroutine frees itself
+// once it finishes.
+
+use crate::handle;
+use crate::oneshot::OneshotResult;
+use crate::{ffi, CxxAsyncException, ERROR_CANCELLED};
+use futures::channel::oneshot::Canceled;
+use std::cell::UnsafeCell;
+use std::future::Future;
+use std::marker::PhantomData;
+use std::mem::{self, MaybeUninit};
+use std::pin::Pin;
+use std::ptr;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::task::{Context, Poll, Waker};
+
+// Set by us once we've resumed the coroutine for the first time.
+const STARTED: usize = 1 << 0;
+// Set by the coroutine once `outcome` is filled in. It doesn't touch the state after that.
+const DONE: usize = 1 << 1;
+// Set once `waker` holds a waker. Whoever clears it owns the waker, as in oneshot.rs.
+const WAKER_REGISTERED: usize = 1 << 2;
+const TAKEN: usize = 1 << 3;
+// Set once the handle is dropped while the coroutine is still running, so that the coroutine frees
+// itself when it finishes.
+const HANDLE_GONE: usize = 1 << 4;
+// Set by the coroutine instead of `DONE` when it has to take our waker first. It sets `DONE` once
+// it has, and until then we mustn't take the outcome or free the frame.
+const COMPLETING: usize = 1 << 5;
+
+// Keep in sync with `RUST_LAZY_STATE_WORDS` in cxx_async.h, which reserves this much room, zeroed,
+// at the start of the promise.
+const LAZY_STATE_WORDS: usize = 8;
+
+#[repr(C)]
+struct LazyState<T> {
+    state: AtomicUsize,
+    waker: UnsafeCell<MaybeUninit<Waker>>,
+    outcome: UnsafeCell<MaybeUninit<Outcome<T>>>,
+}
+
+// What the coroutine finished with, all still owned by the promise: the value, which becomes ours
+// to move out, or else an error, as for `CxxAsyncException::from_cxx`.
+struct Outcome<T> {
+    value: *mut T,
+    error_code: i32,
+    error_message: &'static str,
+    exception: *mut u8,
+}
+
+const _: () =
+    assert!(mem::size_of::<LazyState<()>>() == LAZY_STATE_WORDS * mem::size_of::<usize>());
+
+pub struct LazyCoroutine<T> {
+    phantom: PhantomData<T>,
+    _cell: UnsafeCell<()>,
+}
+
+const _: () = assert!(mem::size_of::<LazyCoroutine<()>>() == 0);
+
+unsafe impl<T> Send for LazyCoroutine<T> where T: Send {}
+impl<T> Unpin for LazyCoroutine<T> {}
+
+impl<T> LazyCoroutine<T> {
+    fn state(&mut self) -> *const LazyState<T> {
+        handle::shared(self)
+    }
+
+    fn header(&mut self) -> *mut u8 {
+        handle::shared(self)
+    }
+
+    // Called by the coroutine from its final suspend point. Returns our waker, if we're waiting,
+    // for the caller to wake. Once this has set `DONE`, we may destroy the coroutine at any moment,
+    // so the caller mustn't touch its frame afterward; to read our waker out first, this sets
+    // `COMPLETING` in its place until it's done.
+    pub unsafe fn complete(
+        &mut self,
+        value: *mut T,
+        error_code: i32,
+        error_message: &str,
+        exception: *mut u8,
+    ) -> Option<Waker> {
+        let header = self.header();
+        let state = self.state();
+        (*(*state).outcome.get()).as_mut_ptr().write(Outcome {
+            value,
+            error_code,
+            error_message: &*(error_message as *const str),
+            exception,
+        });
+        let mut prev = (*state)
+            .state
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |current| {
+                Some(if current & WAKER_REGISTERED != 0 {
+                    (current | COMPLETING) & !WAKER_REGISTERED
+                } else {
+                    current | DONE
+                })
+            })
+            .unwrap();
+        if prev & WAKER_REGISTERED != 0 {
+            let waker = ptr::read((*(*state).waker.get()).as_ptr());
+            prev = (*state).state.fetch_or(DONE, Ordering::AcqRel);
+            if prev & HANDLE_GONE == 0 {
+                return Some(waker);
+            }
+        }
+        if prev & HANDLE_GONE != 0 {
+            Self::drop_value(state);
+            ffi::rust_destroy_lazy_cxx_coroutine(header);
+        }
+        None
+    }
+
+    unsafe fn drop_value(state: *const LazyState<T>) {
+        let outcome = &*(*(*state).outcome.get()).as_ptr();
+        if !outcome.value.is_null() {
+            ptr::drop_in_place(outcome.value);
+        }
+        // Errors, exception included, stay in the promise until we take them.
+    }
+
+    unsafe fn take(&mut self) -> OneshotResult<T> {
+        let state = self.state();
+        let prev = (*state).state.fetch_or(TAKEN, Ordering::Relaxed);
+        assert!(prev & TAKEN == 0, "lazy future polled after completion");
+        let outcome = &*(*(*state).outcome.get()).as_ptr();
+        if !outcome.value.is_null() {
+            Ok(Ok(ptr::read(outcome.value)))
+        } else if outcome.error_code == ERROR_CANCELLED && outcome.exception.is_null() {
+            // A libunifex sender that the coroutine awaited completed with done.
+            Err(Canceled)
+        } else {
+            Ok(Err(CxxAsyncException::from_cxx(
+                outcome.error_code,
+                outcome.error_message,
+                outcome.exception,
+            )))
+        }
+    }
+
+    pub fn poll_result(&mut self, context: &mut Context) -> Poll<OneshotResult<T>> {
+        unsafe {
+            let state = self.state();
+            let mut current = (*state).state.load(Ordering::Acquire);
+            if current & STARTED == 0 {
+                // Nobody else touches the state before the coroutine runs.
+                (*state).state.store(STARTED, Ordering::Relaxed);
+                ffi::rust_start_lazy_cxx_coroutine(self.header());
+                current = (*state).state.load(Ordering::Acquire);
+            }
+            if current & (DONE | COMPLETING) != 0 {
+                return self.poll_finished(current, context);
+            }
+
+            if current & WAKER_REGISTERED != 0 {
+                if (*(*(*state).waker.get()).as_ptr()).will_wake(context.waker()) {
+                    return Poll::Pending;
+                }
+                if let Err(current) = self.update_if_running(|current| current & !WAKER_REGISTERED)
+                {
+                    return self.poll_finished(current, context);
+                }
+                ptr::drop_in_place((*(*state).waker.get()).as_mut_ptr());
+            }
+
+            (*(*state).waker.get())
+                .as_mut_ptr()
+                .write(context.waker().clone());
+            if let Err(current) = self.update_if_running(|current| current | WAKER_REGISTERED) {
+                ptr::drop_in_place((*(*state).waker.get()).as_mut_ptr());
+                return self.poll_finished(current, context);
+            }
+            Poll::Pending
+        }
+    }
+
+    // Takes the outcome once the coroutine is done with the state. If it's still completing, it's
+    // about to be, so rather than wait, we ask to be polled again.
+    unsafe fn poll_finished(
+        &mut self,
+        current: usize,
+        context: &mut Context,
+    ) -> Poll<OneshotResult<T>> {
+        if current & DONE != 0 {
+            return Poll::Ready(self.take());
+        }
+        context.waker().wake_by_ref();
+        Poll::Pending
+    }
+
+    // Applies `f` to the state word unless the coroutine has finished or is finishing. On failure,
+    // returns the state.
+    fn update_if_running<F>(&mut self, f: F) -> Result<usize, usize>
+    where
+        F: Fn(usize) -> usize,
+    {
+        unsafe {
+            (*self.state())
+                .state
+                .fetch_update(Ordering::AcqRel, Ordering::Acquire, |current| {
+                    if current & (DONE | COMPLETING) == 0 {
+                        Some(f(current))
+                    } else {
+                        None
+                    }
+                })
+        }
+    }
+}
+
+impl<T> Future for LazyCoroutine<T> {
+    type Output = OneshotResult<T>;
+    fn poll(self: Pin<&mut Self>, context: &mut Context) -> Poll<Self::Output> {
+        self.get_mut().poll_result(context)
+    }
+}
+
+impl<T> Drop for LazyCoroutine<T> {
+    fn drop(&mut self) {
+        unsafe {
+            let header = self.header();
+            let state = self.state();
+            let current = (*state).state.load(Ordering::Acquire);
+            if current & STARTED != 0 && current & DONE == 0 {
+                // Take back our waker along with announcing that we're gone, unless the coroutine
+                // finishes first. If it's completing, it has our waker already, and it frees
+                // itself once it sees that we're gone.
+                let prev =
+                    (*state)
+                        .state
+                        .fetch_update(Ordering::AcqRel, Ordering::Acquire, |current| {
+                            if current & DONE == 0 {
+                                Some((current | HANDLE_GONE) & !WAKER_REGISTERED)
+                            } else {
+                                None
+                            }
+                        });
+                if let Ok(prev) = prev {
+                    if prev & WAKER_REGISTERED != 0 {
+                        ptr::drop_in_place((*(*state).waker.get()).as_mut_ptr());
+                    }
+                    return;
+                }
+            }
+
+            // The coroutine is suspended, either before it started or at its final suspend point.
+            if (*state).state.load(Ordering::Acquire) & (DONE | TAKEN) == DONE {
+                Self::drop_value(state);
+            }
+            ffi::rust_destroy_lazy_cxx_coroutine(header);
+        }
+    }
+}
@@ -5,36 +5,49 @@
 #include "cxx_async_libunifex.h"
 #include "example_common.h"
 #include "rust/cxx.h"
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <numeric>
+#include <vector>
 #include <unifex/config.hpp>
 #include <unifex/coroutine.hpp>
 #include <unifex/execute.hpp>
 #include <unifex/inline_scheduler.hpp>
+#include <unifex/just_done.hpp>
+#include <unifex/reduce_stream.hpp>
 #include <unifex/scheduler_concepts.hpp>
 #include <unifex/sender_concepts.hpp>
 #include <unifex/static_thread_pool.hpp>
+#include <unifex/stop_when.hpp>
 #include <unifex/sync_wait.hpp>
 #include <unifex/task.hpp>
 #include <unifex/then.hpp>
+#include <unifex/timed_single_thread_context.hpp>
 #include <unifex/via.hpp>
 #include <unifex/when_all.hpp>
 
 using UnifexThreadPoolScheduler =
     decltype(unifex::static_thread_pool().get_scheduler());
 
-static unifex::task<double>
-dot_product_inner(UnifexThreadPoolScheduler &scheduler, double a[], double b[],
-                  size_t count) {
-  if (count > EXAMPLE_SPLIT_LIMIT) {
+// Runs on any scheduler: a libunifex thread pool's, or the one for the pool that
+// Rust shares with us.
+template <typename Scheduler>
+static unifex::task<double> dot_product_inner(Scheduler &scheduler, double a[],
+                                              double b[], size_t count,
+                                              size_t grain) {
+  if (count > grain) {
     size_t half_count = count / 2;
     auto taskA = [&]() -> unifex::task<double> {
       co_await unifex::schedule(scheduler);
-      co_return co_await dot_product_inner(scheduler, a, b, half_count);
+      co_return co_await dot_product_inner(scheduler, a, b, half_count, grain);
     };
     auto taskB = [&]() -> unifex::task<double> {
       co_return co_await dot_product_inner(scheduler, a + half_count,
-                                           b + half_count, count - half_count);
+                                           b + half_count, count - half_count,
+                                           grain);
     };
     auto results = co_await unifex::when_all(taskA(), taskB());
     double a = std::get<0>(std::get<0>(std::get<0>(results)));
@@ -42,14 +55,45 @@ dot_product_inner(UnifexThreadPoolScheduler &scheduler, double a[], double b[],
     co_return a + b;
   }
 
-  double sum = 0.0;
-  for (size_t i = 0; i < count; i++)
-    sum += a[i] * b[i];
-  co_return sum;
+  co_return dot_product_kernel(a, b, count);
+}
+
+template <typename Scheduler>
+static unifex::task<void> calibration_fork(Scheduler &scheduler) {
+  co_await unifex::schedule(scheduler);
+}
+
+template <typename Scheduler>
+static unifex::task<void> calibration_forks(Scheduler &scheduler) {
+  for (size_t i = 0; i < DOT_PRODUCT_CALIBRATION_FORKS; i++)
+    co_await calibration_fork(scheduler);
 }
 
-static unifex::task<double>
-dot_product_on(UnifexThreadPoolScheduler &scheduler) {
+// What a fork in `dot_product_inner` costs: a task, and a hop onto the pool.
+template <typename Scheduler>
+static unifex::task<double> fork_overhead_ns(Scheduler &scheduler) {
+  auto start = std::chrono::steady_clock::now();
+  co_await calibration_forks(scheduler);
+  co_return elapsed_ns(start) / DOT_PRODUCT_CALIBRATION_FORKS;
+}
+
+// The grain for the shared pool, calibrated by the first dot product to need
+// it. This awaits the calibration rather than blocking on it, since the caller
+// may be running on a pool worker, which blocking would tie up. Dot products
+// that start at the same time may each calibrate, which is harmless.
+static unifex::task<size_t> pool_grain(RustPoolUnifexScheduler &scheduler) {
+  static std::atomic<size_t> grain(0);
+  size_t calibrated = grain.load(std::memory_order_relaxed);
+  if (calibrated == 0) {
+    calibrated = dot_product_grain(co_await fork_overhead_ns(scheduler));
+    grain.store(calibrated, std::memory_order_relaxed);
+  }
+  co_return calibrated;
+}
+
+template <typename Scheduler>
+static unifex::task<double> dot_product_on(Scheduler &scheduler,
+                                           size_t grain) {
   Xorshift rand;
   std::vector<double> array_a, array_b;
   for (size_t i = 0; i < EXAMPLE_ARRAY_SIZE; i++) {
@@ -58,14 +102,46 @@ dot_product_on(UnifexThreadPoolScheduler &scheduler) {
   }
 
   co_return co_await dot_product_inner(scheduler, &array_a[0], &array_b[0],
-                                       array_a.size());
+                                       array_a.size(), grain);
 }
 
 rust::Box<RustOneshotReceiverF64> libunifex_dot_product() {
-  static unifex::static_thread_pool thread_pool;
-  UnifexThreadPoolScheduler scheduler = thread_pool.get_scheduler();
+  static RustPoolUnifexScheduler scheduler;
+  size_t grain = co_await pool_grain(scheduler);
   co_await unifex::schedule(scheduler);
-  co_return co_await dot_product_on(scheduler);
+  co_return co_await dot_product_on(scheduler, grain);
+}
+
+template <typename Scheduler>
+static double time_dot_product_on(Scheduler &scheduler, size_t count,
+                                  size_t grain, uint32_t iterations) {
+  if (grain == 0)
+    grain = dot_product_grain(*unifex::sync_wait(fork_overhead_ns(scheduler)));
+  std::vector<double> array_a(count, 1.0), array_b(count, 2.0);
+  auto dot_product = [&]() -> unifex::task<double> {
+    co_await unifex::schedule(scheduler);
+    co_return co_await dot_product_inner(scheduler, &array_a[0], &array_b[0],
+                                         count, grain);
+  };
+  return time_ns([&]() {
+    for (uint32_t i = 0; i < iterations; i++)
+      unifex::sync_wait(dot_product());
+  });
+}
+
+// Times `iterations` dot products of `count` elements on a libunifex pool of
+// `threads`, or on the shared pool if that's zero, splitting down to `grain`
+// elements, or to a calibrated grain if that's zero. For the scaling benchmark
+// in bench.rs.
+double libunifex_time_dot_product(size_t count, uint32_t threads, size_t grain,
+                                  uint32_t iterations) {
+  if (threads == 0) {
+    RustPoolUnifexScheduler scheduler;
+    return time_dot_product_on(scheduler, count, grain, iterations);
+  }
+  unifex::static_thread_pool thread_pool(threads);
+  UnifexThreadPoolScheduler scheduler = thread_pool.get_scheduler();
+  return time_dot_product_on(scheduler, count, grain, iterations);
 }
 
 void libunifex_call_rust_dot_product_with_coro() {
@@ -75,12 +151,9 @@ void libunifex_call_rust_dot_product_with_coro() {
 }
 
 void libunifex_call_rust_dot_product_directly() {
-  unifex::static_thread_pool pool;
-  auto executor = pool.get_scheduler();
-
   rust::Box<RustOneshotReceiverF64> oneshot_receiver = rust_dot_product();
   unifex::sync_wait(unifex::via(
-      executor, unifex::then(std::move(oneshot_receiver), [&](double result) {
+      RustPoolUnifexScheduler(), unifex::then(std::move(oneshot_receiver), [&](double result) {
         std::cout << result << std::endl;
       })));
 }
@@ -100,3 +173,95 @@ void libunifex_call_rust_not_product() {
     std::cout << error.what() << std::endl;
   }
 }
+
+rust::Box<RustOneshotReceiverString> libunifex_ping_pong(int i, int depth) {
+  std::string string(co_await rust_libunifex_ping_pong(i + 1, depth));
+  string += "pong ";
+  co_return std::move(string);
+}
+
+void libunifex_call_rust_dot_product_chunks() {
+  auto chunks = rust_stream_to_unifex_stream(rust_dot_product_chunks());
+  double result = *unifex::sync_wait(
+      unifex::reduce_stream(std::move(chunks), 0.0, std::plus<double>()));
+  std::cout << result << std::endl;
+}
+
+// Counts up forever on the shared pool, until Rust drops the receiver.
+rust::Box<RustOneshotReceiverF64> libunifex_sum_until_cancelled() {
+  LiveFrameGuard guard;
+  unifex::inplace_stop_token stop_token = co_await rust_current_stop_token();
+
+  double sum = 0.0;
+  while (!stop_token.stop_requested()) {
+    co_await unifex::schedule(RustPoolUnifexScheduler());
+    sum += 1.0;
+  }
+  co_await unifex::just_done();
+  co_return sum;
+}
+
+void libunifex_cancel_rust_pending_forever() {
+  unifex::timed_single_thread_context timer;
+  std::optional<double> result = unifex::sync_wait(unifex::stop_when(
+      rust_pending_forever(),
+      unifex::schedule_after(timer.get_scheduler(),
+                             std::chrono::milliseconds(10))));
+  if (result)
+    std::cout << *result << std::endl;
+  else
+    std::cout << "cancelled" << std::endl;
+}
+
+// The C++ half of the cross-runtime benchmarks in bench.rs.
+
+rust::Box<RustOneshotReceiverF64> libunifex_ready_value() { co_return 1.0; }
+
+rust::Box<RustOneshotReceiverF64> libunifex_pending_value() {
+  co_await unifex::schedule(RustPoolUnifexScheduler());
+  co_return 1.0;
+}
+
+// Returns NaN if the Rust future fails.
+double libunifex_await_rust(int32_t kind) {
+  try {
+    return *unifex::sync_wait(rust_bench_value(kind));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static unifex::task<double> await_rust_concurrently(int32_t kind,
+                                                    int32_t count) {
+  std::vector<rust::Box<RustOneshotReceiverF64>> receivers =
+      rust_bench_values(kind, count);
+
+  double sum = 0.0;
+  for (rust::Box<RustOneshotReceiverF64> &receiver : receivers)
+    sum += co_await std::move(receiver);
+  co_return sum;
+}
+
+// Starts `count` Rust futures before awaiting any of them.
+double libunifex_await_rust_concurrently(int32_t kind, int32_t count) {
+  try {
+    return *unifex::sync_wait(await_rust_concurrently(kind, count));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+static unifex::task<double> join_rust(int32_t kind, int32_t count) {
+  std::vector<double> results =
+      co_await rust_join_all(rust_bench_values(kind, count));
+  co_return std::accumulate(results.begin(), results.end(), 0.0);
+}
+
+// Like `libunifex_await_rust_concurrently`, but with one await for the lot.
+double libunifex_join_rust(int32_t kind, int32_t count) {
+  try {
+    return *unifex::sync_wait(join_rust(kind, count));
+  } catch (const RustAsyncError &) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+}
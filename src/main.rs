@@ -1,114 +1,294 @@
 // cxx-async/src/main.rs
 
-use crate::ffi::{RustOneshotChannelF64, RustOneshotChannelString};
+use crate::counters::{ChannelType, Counter};
+use crate::ffi::{RustOneshotChannelCxxVectorF64, RustOneshotChannelCxxVectorU8};
+use crate::ffi::{RustOneshotChannelF64, RustOneshotChannelString, RustStreamChannelF64};
+use crate::ffi::{RustOneshotChannelPod, RustOneshotChannelVecF64, RustOneshotChannelVecU8};
+use crate::inline_future::InlineFuture;
+use crate::lazy::LazyCoroutine;
+use crate::oneshot::{OneshotResult, Receiver, Sender};
+use crate::pod::CxxAsyncPod;
+use crate::pool::{CxxSpawner, Pool, PoolConfig, Priority};
+use crate::stream::{Closed, TrySendError};
 use async_recursion::async_recursion;
-use cxx::CxxString;
-use futures::channel::oneshot::{self, Canceled, Receiver, Sender};
-use futures::executor::{self, ThreadPool};
-use futures::join;
+use cxx::{CxxVector, UniquePtr};
+use futures::channel::oneshot::Canceled;
+use futures::executor;
+use futures::future::{self, poll_fn};
 use futures::task::{Spawn, SpawnExt};
+use futures::{join, pin_mut, Stream};
 use once_cell::sync::Lazy;
-use std::cell::UnsafeCell;
+use std::borrow::Cow;
 use std::error::Error;
 use std::fmt::{Debug, Display, Formatter, Result as FmtResult};
 use std::future::Future;
-use std::mem::{self, MaybeUninit};
+use std::mem::{self, ManuallyDrop};
 use std::pin::Pin;
 use std::ptr;
-use std::sync::Arc;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
 use std::task::{Context, Poll, RawWaker, RawWakerVTable, Waker};
+use std::thread;
+use std::time::{Duration, Instant};
+
+mod bench;
+mod counters;
+mod handle;
+mod inline_future;
+mod lazy;
+mod mpsc;
+mod oneshot;
+mod pod;
+mod pool;
+mod stream;
+mod stress;
+mod timer;
+mod trace;
 
 const SPLIT_LIMIT: usize = 32;
 
 const RECV_RESULT_PENDING: i32 = 0;
 const RECV_RESULT_READY: i32 = 1;
 const RECV_RESULT_ERROR: i32 = 2;
-
-#[derive(Debug)]
+const RECV_RESULT_DONE: i32 = 3;
+const RECV_RESULT_CANCELLED: i32 = 4;
+
+const SEND_RESULT_PENDING: i32 = 0;
+const SEND_RESULT_READY: i32 = 1;
+const SEND_RESULT_CLOSED: i32 = 2;
+
+// Error codes that the bridge assigns. Applications pick their own codes for everything else.
+// Keep in sync with `RUST_ERROR_*` in cxx_async.h.
+pub const ERROR_UNSPECIFIED: i32 = 0;
+pub const ERROR_CXX_EXCEPTION: i32 = -1;
+pub const ERROR_CANCELLED: i32 = -2;
+pub const ERROR_TIMED_OUT: i32 = -3;
+pub const ERROR_LAYOUT_MISMATCH: i32 = -4;
+
+// An error crossing the bridge: a code, a message, and, for errors that started as C++
+// exceptions, the exception itself, so that C++ awaiting it rethrows the original. Errors with a
+// static message, and those carrying an exception, cross in either direction without allocating.
 pub struct CxxAsyncException {
-    what: Box<str>,
+    code: i32,
+    message: Cow<'static, str>,
+    exception: Option<CxxException>,
 }
 
 impl CxxAsyncException {
     pub fn new(what: Box<str>) -> Self {
-        Self { what }
+        Self {
+            code: ERROR_UNSPECIFIED,
+            message: Cow::Owned(what.into()),
+            exception: None,
+        }
+    }
+
+    pub const fn with_code(code: i32, message: &'static str) -> Self {
+        Self {
+            code,
+            message: Cow::Borrowed(message),
+            exception: None,
+        }
+    }
+
+    pub fn code(&self) -> i32 {
+        self.code
     }
+
+    // The message, or, for a C++ exception, its `what()`.
     pub fn what(&self) -> &str {
-        &self.what
+        match self.exception {
+            Some(ref exception) => exception.what(),
+            None => &self.message,
+        }
+    }
+
+    // Takes an error that C++ sent: a code, a message with static storage (C++'s `RustError` only
+    // borrows string literals, and sends any other message inside an exception), and, unless
+    // `exception` is null, a `std::exception_ptr` to move out of.
+    unsafe fn from_cxx(code: i32, message: &str, exception: *mut u8) -> Self {
+        Self {
+            code,
+            message: Cow::Borrowed(&*(message as *const str)),
+            exception: CxxException::take(exception),
+        }
+    }
+
+    // Moves this error into the C++ `RustError` storage at `storage`.
+    unsafe fn into_cxx(self, storage: *mut u8) {
+        let (message, owned_message) = match self.message {
+            Cow::Borrowed(message) => (message, String::new()),
+            Cow::Owned(message) => ("", message),
+        };
+        let mut exception = self.exception.map_or(0, CxxException::into_raw);
+        let exception_ptr = match exception {
+            0 => ptr::null_mut(),
+            _ => &mut exception as *mut usize as *mut u8,
+        };
+        ffi::rust_construct_cxx_async_error(
+            storage,
+            self.code,
+            message,
+            owned_message,
+            exception_ptr,
+        );
+    }
+}
+
+impl Debug for CxxAsyncException {
+    fn fmt(&self, formatter: &mut Formatter) -> FmtResult {
+        formatter
+            .debug_struct("CxxAsyncException")
+            .field("code", &self.code)
+            .field("what", &self.what())
+            .finish()
     }
 }
 
 impl Display for CxxAsyncException {
     fn fmt(&self, formatter: &mut Formatter) -> FmtResult {
-        formatter.write_str(&self.what)
+        formatter.write_str(self.what())
     }
 }
 
 impl Error for CxxAsyncException {}
 
-struct CxxCoroutineAddress(UnsafeCell<*mut u8>);
+// A C++ `std::exception_ptr`, held by value. libstdc++ and libc++ both implement it as a single
+// reference-counted pointer that's null when empty, so moving one is copying its bits and
+// zeroing the source; see `RustError` in cxx_async.h.
+struct CxxException(usize);
+
+unsafe impl Send for CxxException {}
+unsafe impl Sync for CxxException {}
+
+impl CxxException {
+    unsafe fn take(exception: *mut u8) -> Option<Self> {
+        match exception.is_null() {
+            true => None,
+            false => match ptr::replace(exception as *mut usize, 0) {
+                0 => None,
+                bits => Some(CxxException(bits)),
+            },
+        }
+    }
 
-impl CxxCoroutineAddress {
-    unsafe fn into_waker(self) -> Waker {
-        return Waker::from_raw(make_raw_waker(Arc::new(self)));
+    fn into_raw(self) -> usize {
+        ManuallyDrop::new(self).0
+    }
 
-        static VTABLE: RawWakerVTable = RawWakerVTable::new(clone, wake, wake_by_ref, drop_waker);
+    fn what(&self) -> &str {
+        ffi::rust_cxx_exception_what(&self.0)
+    }
+}
 
-        fn make_raw_waker(boxed_coroutine_address: Arc<CxxCoroutineAddress>) -> RawWaker {
-            RawWaker::new(
-                Arc::into_raw(boxed_coroutine_address) as *const u8 as *const (),
-                &VTABLE,
-            )
-        }
+impl Drop for CxxException {
+    fn drop(&mut self) {
+        unsafe { ffi::rust_drop_cxx_exception(&mut self.0 as *mut usize as *mut u8) }
+    }
+}
 
-        unsafe fn clone(boxed_coroutine_address: *const ()) -> RawWaker {
-            let boxed_coroutine_address =
-                Arc::from_raw(boxed_coroutine_address as *const CxxCoroutineAddress);
-            mem::forget(boxed_coroutine_address.clone());
-            make_raw_waker(boxed_coroutine_address)
-        }
+// Creates a waker that resumes a suspended C++ coroutine.
+//
+// The waker's data pointer is the coroutine's `RustWakeTarget` (see cxx_async.h), which lives in
+// the awaiter and says whether to resume inline or on the coroutine's own executor. So creating,
+// cloning, and dropping the waker never allocates, and `will_wake` recognizes a repoll from the
+// same await. There's no reference count, so this is only sound for wakers that are woken at most
+// once; our channels guarantee that by taking the waker out of their slot before waking it.
+pub(crate) unsafe fn cxx_coroutine_waker(wake_target: *mut u8) -> Waker {
+    return Waker::from_raw(make_raw_waker(wake_target as *const ()));
+
+    unsafe fn clone(wake_target: *const ()) -> RawWaker {
+        make_raw_waker(wake_target)
+    }
 
-        unsafe fn wake(boxed_coroutine_address: *const ()) {
-            let boxed_coroutine_address =
-                Arc::from_raw(boxed_coroutine_address as *const CxxCoroutineAddress);
-            let address = boxed_coroutine_address.0.get();
-            ffi::rust_resume_cxx_coroutine(mem::replace(&mut *address, ptr::null_mut()));
-            let _ = boxed_coroutine_address;
-        }
+    unsafe fn wake(wake_target: *const ()) {
+        ffi::rust_wake_cxx_coroutine(wake_target as *mut u8);
+    }
 
-        unsafe fn wake_by_ref(boxed_coroutine_address: *const ()) {
-            let boxed_coroutine_address =
-                Arc::from_raw(boxed_coroutine_address as *const CxxCoroutineAddress);
-            let address = boxed_coroutine_address.0.get();
-            ffi::rust_resume_cxx_coroutine(mem::replace(&mut *address, ptr::null_mut()));
-            mem::forget(boxed_coroutine_address);
-        }
+    // The coroutine owns itself while it's suspended; dropping a waker without waking it means
+    // that whoever held it (the receiver) is being destroyed along with the coroutine frame.
+    unsafe fn drop_waker(_: *const ()) {}
 
-        unsafe fn drop_waker(boxed_coroutine_address: *const ()) {
-            let _ = Arc::from_raw(boxed_coroutine_address as *const CxxCoroutineAddress);
-        }
+    fn make_raw_waker(wake_target: *const ()) -> RawWaker {
+        static VTABLE: RawWakerVTable = RawWakerVTable::new(clone, wake, wake, drop_waker);
+        RawWaker::new(wake_target, &VTABLE)
     }
 }
 
-impl Drop for CxxCoroutineAddress {
-    fn drop(&mut self) {
-        unsafe {
-            let address = self.0.get();
-            ffi::rust_destroy_cxx_coroutine(mem::replace(&mut *address, ptr::null_mut()))
-        }
+// If `waker` resumes a C++ coroutine, returns its wake target instead of waking it, so that C++
+// can transfer control to the coroutine directly rather than resuming it from inside this call.
+// Wakes any other waker and returns null.
+fn into_cxx_wake_target(waker: Waker) -> *mut u8 {
+    // C++ wakers are free to make, and `will_wake` compares vtables as well as data.
+    let cxx_waker = unsafe { cxx_coroutine_waker(waker.data() as *mut u8) };
+    if waker.will_wake(&cxx_waker) {
+        return waker.data() as *mut u8;
+    }
+    waker.wake();
+    ptr::null_mut()
+}
+
+// Creates a waker that requests a stop on a C++ coroutine's stop state (see `RustStopState` in
+// cxx_async.h). The waker holds a reference to the stop state, so it may outlive the coroutine.
+pub(crate) unsafe fn cxx_stop_waker(stop_state: *mut u8) -> Waker {
+    return Waker::from_raw(clone(stop_state as *const ()));
+
+    static VTABLE: RawWakerVTable = RawWakerVTable::new(clone, wake, wake_by_ref, drop_waker);
+
+    unsafe fn clone(stop_state: *const ()) -> RawWaker {
+        ffi::rust_retain_cxx_stop_state(stop_state as *mut u8);
+        RawWaker::new(stop_state, &VTABLE)
+    }
+
+    unsafe fn wake(stop_state: *const ()) {
+        wake_by_ref(stop_state);
+        drop_waker(stop_state);
+    }
+
+    unsafe fn wake_by_ref(stop_state: *const ()) {
+        ffi::rust_request_cxx_stop(stop_state as *mut u8);
+    }
+
+    unsafe fn drop_waker(stop_state: *const ()) {
+        ffi::rust_release_cxx_stop_state(stop_state as *mut u8);
     }
 }
 
 trait CxxReceiver {
     type Output;
-    type PlainReceiver;
-    type PlainSender;
-    type CxxSender;
-    fn from_plain_receiver(plain_receiver: Self::PlainReceiver) -> Box<Self>;
+    fn from_receiver(receiver: Box<Receiver<Self::Output>>) -> Box<Self>;
+}
+
+trait CxxFuture {
+    type Output;
+    fn from_future(future: InlineFuture<Self::Output>) -> Box<Self>;
+}
+
+trait CxxStreamReceiver {
+    type Item;
+    fn from_receiver(receiver: Box<stream::Receiver<Self::Item>>) -> Box<Self>;
 }
 
 #[cxx::bridge]
 mod ffi {
+    // What the bridge has done with one channel type, summed over all threads. Only counted when
+    // built with `--features counters`; see counters.rs.
+    #[derive(Clone, Debug, Default)]
+    pub struct BridgeCounters {
+        pub channel: String,
+        pub channels: u64,
+        pub allocations: u64,
+        pub awaits: u64,
+        pub ready_awaits: u64,
+        pub polls: u64,
+        pub pending_polls: u64,
+        pub wakes: u64,
+        pub wake_to_resume_ns: u64,
+        pub errors_to_cxx: u64,
+        pub exceptions_to_rust: u64,
+        pub cancellations: u64,
+        pub destroyed_unresumed: u64,
+    }
+
     // Boilerplate for F64
     pub struct RustOneshotChannelF64 {
         pub sender: Box<RustOneshotSenderF64>,
@@ -117,14 +297,23 @@ mod ffi {
     extern "Rust" {
         type RustOneshotSenderF64;
         type RustOneshotReceiverF64;
-        unsafe fn send(self: &mut RustOneshotSenderF64, value: *const f64, error: &str);
+        unsafe fn send(
+            self: &mut RustOneshotSenderF64,
+            value: *const f64,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        ) -> *mut u8;
+        unsafe fn watch_cancel(self: &mut RustOneshotSenderF64, stop_state: *mut u8) -> bool;
         unsafe fn recv(
             self: &mut RustOneshotReceiverF64,
             maybe_result: *mut f64,
-            error: Pin<&mut CxxString>,
-            coroutine_address: *mut u8,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
         ) -> i32;
+        fn cancel(self: &RustOneshotReceiverF64);
         fn channel(self: &RustOneshotReceiverF64) -> RustOneshotChannelF64;
+        fn span(self: &RustOneshotReceiverF64) -> u64;
     }
 
     // Boilerplate for strings
@@ -135,49 +324,415 @@ mod ffi {
     extern "Rust" {
         type RustOneshotSenderString;
         type RustOneshotReceiverString;
-        unsafe fn send(self: &mut RustOneshotSenderString, value: *const String, error: &str);
+        unsafe fn send(
+            self: &mut RustOneshotSenderString,
+            value: *const String,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        ) -> *mut u8;
+        unsafe fn watch_cancel(self: &mut RustOneshotSenderString, stop_state: *mut u8) -> bool;
         unsafe fn recv(
             self: &mut RustOneshotReceiverString,
             maybe_result: *mut String,
-            error: Pin<&mut CxxString>,
-            coroutine_address: *mut u8,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
         ) -> i32;
+        fn cancel(self: &RustOneshotReceiverString);
         fn channel(self: &RustOneshotReceiverString) -> RustOneshotChannelString;
+        fn span(self: &RustOneshotReceiverString) -> u64;
+    }
+
+    // Boilerplate for Rust-owned byte buffers, which C++ sees as `rust::Vec<uint8_t>`
+    pub struct RustOneshotChannelVecU8 {
+        pub sender: Box<RustOneshotSenderVecU8>,
+        pub receiver: Box<RustOneshotReceiverVecU8>,
+    }
+    extern "Rust" {
+        type RustOneshotSenderVecU8;
+        type RustOneshotReceiverVecU8;
+        unsafe fn send(
+            self: &mut RustOneshotSenderVecU8,
+            value: *const Vec<u8>,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        ) -> *mut u8;
+        unsafe fn watch_cancel(self: &mut RustOneshotSenderVecU8, stop_state: *mut u8) -> bool;
+        unsafe fn recv(
+            self: &mut RustOneshotReceiverVecU8,
+            maybe_result: *mut Vec<u8>,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
+        ) -> i32;
+        fn cancel(self: &RustOneshotReceiverVecU8);
+        fn channel(self: &RustOneshotReceiverVecU8) -> RustOneshotChannelVecU8;
+        fn span(self: &RustOneshotReceiverVecU8) -> u64;
+    }
+
+    // Boilerplate for Rust-owned F64 buffers
+    pub struct RustOneshotChannelVecF64 {
+        pub sender: Box<RustOneshotSenderVecF64>,
+        pub receiver: Box<RustOneshotReceiverVecF64>,
+    }
+    extern "Rust" {
+        type RustOneshotSenderVecF64;
+        type RustOneshotReceiverVecF64;
+        unsafe fn send(
+            self: &mut RustOneshotSenderVecF64,
+            value: *const Vec<f64>,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        ) -> *mut u8;
+        unsafe fn watch_cancel(self: &mut RustOneshotSenderVecF64, stop_state: *mut u8) -> bool;
+        unsafe fn recv(
+            self: &mut RustOneshotReceiverVecF64,
+            maybe_result: *mut Vec<f64>,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
+        ) -> i32;
+        fn cancel(self: &RustOneshotReceiverVecF64);
+        fn channel(self: &RustOneshotReceiverVecF64) -> RustOneshotChannelVecF64;
+        fn span(self: &RustOneshotReceiverVecF64) -> u64;
+    }
+
+    // Boilerplate for C++-owned byte buffers, which C++ sends as
+    // `std::unique_ptr<std::vector<uint8_t>>`
+    pub struct RustOneshotChannelCxxVectorU8 {
+        pub sender: Box<RustOneshotSenderCxxVectorU8>,
+        pub receiver: Box<RustOneshotReceiverCxxVectorU8>,
+    }
+    extern "Rust" {
+        type RustOneshotSenderCxxVectorU8;
+        type RustOneshotReceiverCxxVectorU8;
+        unsafe fn send(
+            self: &mut RustOneshotSenderCxxVectorU8,
+            value: *const UniquePtr<CxxVector<u8>>,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        ) -> *mut u8;
+        unsafe fn watch_cancel(
+            self: &mut RustOneshotSenderCxxVectorU8,
+            stop_state: *mut u8,
+        ) -> bool;
+        unsafe fn recv(
+            self: &mut RustOneshotReceiverCxxVectorU8,
+            maybe_result: *mut UniquePtr<CxxVector<u8>>,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
+        ) -> i32;
+        fn cancel(self: &RustOneshotReceiverCxxVectorU8);
+        fn channel(self: &RustOneshotReceiverCxxVectorU8) -> RustOneshotChannelCxxVectorU8;
+        fn span(self: &RustOneshotReceiverCxxVectorU8) -> u64;
+    }
+
+    // Boilerplate for C++-owned F64 buffers
+    pub struct RustOneshotChannelCxxVectorF64 {
+        pub sender: Box<RustOneshotSenderCxxVectorF64>,
+        pub receiver: Box<RustOneshotReceiverCxxVectorF64>,
+    }
+    extern "Rust" {
+        type RustOneshotSenderCxxVectorF64;
+        type RustOneshotReceiverCxxVectorF64;
+        unsafe fn send(
+            self: &mut RustOneshotSenderCxxVectorF64,
+            value: *const UniquePtr<CxxVector<f64>>,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        ) -> *mut u8;
+        unsafe fn watch_cancel(
+            self: &mut RustOneshotSenderCxxVectorF64,
+            stop_state: *mut u8,
+        ) -> bool;
+        unsafe fn recv(
+            self: &mut RustOneshotReceiverCxxVectorF64,
+            maybe_result: *mut UniquePtr<CxxVector<f64>>,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
+        ) -> i32;
+        fn cancel(self: &RustOneshotReceiverCxxVectorF64);
+        fn channel(self: &RustOneshotReceiverCxxVectorF64) -> RustOneshotChannelCxxVectorF64;
+        fn span(self: &RustOneshotReceiverCxxVectorF64) -> u64;
+    }
+
+    // Small `Copy` values of any type, packed into two words plus the layout they were packed
+    // with. Every such type shares the one channel below; see pod.rs.
+    #[derive(Clone, Copy, Debug)]
+    pub struct RustPodValue {
+        pub lo: u64,
+        pub hi: u64,
+        pub layout: u32,
+    }
+
+    // Boilerplate for pods, once for all of them
+    pub struct RustOneshotChannelPod {
+        pub sender: Box<RustOneshotSenderPod>,
+        pub receiver: Box<RustOneshotReceiverPod>,
+    }
+    extern "Rust" {
+        type RustOneshotSenderPod;
+        type RustOneshotReceiverPod;
+        unsafe fn send(
+            self: &mut RustOneshotSenderPod,
+            value: *const RustPodValue,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        ) -> *mut u8;
+        unsafe fn watch_cancel(self: &mut RustOneshotSenderPod, stop_state: *mut u8) -> bool;
+        unsafe fn recv(
+            self: &mut RustOneshotReceiverPod,
+            maybe_result: *mut RustPodValue,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
+        ) -> i32;
+        fn cancel(self: &RustOneshotReceiverPod);
+        fn channel(self: &RustOneshotReceiverPod) -> RustOneshotChannelPod;
+        fn span(self: &RustOneshotReceiverPod) -> u64;
+    }
+
+    // An example pod: a shared struct, so that both sides agree on its layout.
+    #[derive(Clone, Copy, Debug)]
+    pub struct PodPoint {
+        pub x: f64,
+        pub y: f64,
+    }
+
+    // Boilerplate for lazily started F64 coroutines
+    extern "Rust" {
+        type RustLazyF64;
+        unsafe fn complete(
+            self: &mut RustLazyF64,
+            value: *const f64,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        ) -> *mut u8;
+    }
+
+    // Boilerplate for F64 futures that C++ polls itself
+    extern "Rust" {
+        type RustFutureF64;
+        unsafe fn recv(
+            self: &mut RustFutureF64,
+            maybe_result: *mut f64,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
+        ) -> i32;
+        fn spawn(self: &mut RustFutureF64) -> Box<RustOneshotReceiverF64>;
+    }
+
+    // Boilerplate for F64 streams
+    pub struct RustStreamChannelF64 {
+        pub sender: Box<RustStreamSenderF64>,
+        pub receiver: Box<RustStreamReceiverF64>,
+    }
+    extern "Rust" {
+        type RustStreamSenderF64;
+        type RustStreamReceiverF64;
+        unsafe fn send(
+            self: &mut RustStreamSenderF64,
+            value: *const f64,
+            wake_target: *mut u8,
+        ) -> i32;
+        fn close(self: &mut RustStreamSenderF64);
+        unsafe fn fail(
+            self: &mut RustStreamSenderF64,
+            error_code: i32,
+            error_message: &str,
+            exception: *mut u8,
+        );
+        unsafe fn recv(
+            self: &mut RustStreamReceiverF64,
+            maybe_item: *mut f64,
+            maybe_error: *mut u8,
+            wake_target: *mut u8,
+        ) -> i32;
+        fn cancel(self: &RustStreamReceiverF64);
+        fn channel(self: &RustStreamReceiverF64) -> RustStreamChannelF64;
+    }
+
+    // Boilerplate for F64 MPSC channels. Only the sending side crosses the bridge.
+    extern "Rust" {
+        type RustMpscSenderF64;
+        unsafe fn send(
+            self: &mut RustMpscSenderF64,
+            value: *mut f64,
+            result: *mut i32,
+            wake_target: *mut u8,
+        ) -> i32;
+        unsafe fn cancel_send(
+            self: &mut RustMpscSenderF64,
+            value: *mut f64,
+            result: *mut i32,
+        ) -> i32;
+        fn clone_sender(self: &RustMpscSenderF64) -> Box<RustMpscSenderF64>;
+    }
+
+    extern "Rust" {
+        unsafe fn rust_pool_post(job: *mut u8, priority: u8);
+        unsafe fn rust_run_spawned_task(task: *mut u8);
+        unsafe fn rust_arm_cxx_timer(timeout_ns: u64, target: *mut u8) -> u64;
+        fn rust_disarm_cxx_timer(timer: u64) -> bool;
+        fn rust_record_cxx_trace_event(event: u8, span: u64, related: u64);
+        fn rust_swap_cxx_trace_span(span: u64) -> u64;
     }
 
     extern "Rust" {
         fn rust_dot_product() -> Box<RustOneshotReceiverF64>;
+        unsafe fn rust_dot_product_on(executor: *mut u8) -> Box<RustOneshotReceiverF64>;
         fn rust_not_product() -> Box<RustOneshotReceiverF64>;
-        fn rust_cppcoro_ping_pong(i: i32) -> Box<RustOneshotReceiverString>;
-        fn rust_folly_ping_pong(i: i32) -> Box<RustOneshotReceiverString>;
+        fn rust_cppcoro_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString>;
+        fn rust_libunifex_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString>;
+        fn rust_folly_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString>;
+        fn rust_dot_product_chunks() -> Box<RustStreamReceiverF64>;
+        fn rust_pending_forever() -> Box<RustOneshotReceiverF64>;
+        fn rust_pong(i: i32) -> Box<RustOneshotReceiverF64>;
+        fn rust_bench_value(kind: i32) -> Box<RustOneshotReceiverF64>;
+        fn rust_dot_product_inline() -> Box<RustFutureF64>;
+        fn rust_not_product_inline() -> Box<RustFutureF64>;
+        fn rust_bench_value_inline(kind: i32) -> Box<RustFutureF64>;
+        fn rust_pod_point(x: f64, y: f64) -> Box<RustOneshotReceiverPod>;
+        fn rust_next_id() -> Box<RustOneshotReceiverPod>;
+        fn rust_bridge_counters() -> Vec<BridgeCounters>;
     }
 
     unsafe extern "C++" {
         include!("cxx_async.h");
+        include!("example_common.h");
         include!("cppcoro_example.h");
         include!("libunifex_example.h");
         include!("folly_example.h");
 
-        unsafe fn rust_resume_cxx_coroutine(address: *mut u8);
-        unsafe fn rust_destroy_cxx_coroutine(address: *mut u8);
+        unsafe fn rust_wake_cxx_coroutine(wake_target: *mut u8);
+        unsafe fn rust_start_lazy_cxx_coroutine(header: *mut u8);
+        unsafe fn rust_destroy_lazy_cxx_coroutine(header: *mut u8);
+        unsafe fn rust_construct_cxx_async_error(
+            storage: *mut u8,
+            code: i32,
+            message: &str,
+            owned_message: String,
+            exception: *mut u8,
+        );
+        fn rust_cxx_exception_what(exception: &usize) -> &str;
+        unsafe fn rust_drop_cxx_exception(exception: *mut u8);
+        unsafe fn rust_retain_cxx_stop_state(stop_state: *mut u8);
+        unsafe fn rust_release_cxx_stop_state(stop_state: *mut u8);
+        unsafe fn rust_request_cxx_stop(stop_state: *mut u8);
+        unsafe fn rust_run_cxx_pool_job(job: *mut u8);
+        unsafe fn rust_expire_cxx_timer(target: *mut u8);
+        unsafe fn rust_post_to_cxx_executor(executor: *mut u8, task: *mut u8);
+        fn rust_pin_thread_to_core(core: usize) -> bool;
+        fn cxx_bridge_counters() -> Vec<BridgeCounters>;
+
+        fn print_awaiter_sizes();
+        fn time_frame_allocations(size: usize, threads: u32, count: u32, pooled: bool) -> f64;
+        fn live_cxx_frames() -> i32;
+        fn cxx_count_allocations(enabled: bool);
+        fn cxx_allocation_count() -> u64;
+        fn cxx_dot_product_kernel(a: &[f64], b: &[f64]) -> f64;
+        fn dot_product_kernel_name() -> String;
+        fn dot_product_grain(fork_overhead_ns: f64) -> usize;
+        fn cxx_await_rust_error(kind: i32, throwing: bool) -> i32;
+        fn cxx_await_rust_then(receiver: Box<RustOneshotReceiverF64>, done: fn(f64));
+        fn cxx_block_on_rust(kind: i32) -> f64;
+        fn cxx_call_rust_dot_product_blocking();
+        fn cxx_bench_error(exception: bool) -> Box<RustOneshotReceiverF64>;
+        fn cxx_pong(i: i32) -> Box<RustOneshotReceiverF64>;
+        fn cxx_ping_pong_loop(iterations: i32) -> Box<RustOneshotReceiverF64>;
+        fn cxx_chain_link(inner: Box<RustOneshotReceiverF64>) -> Box<RustOneshotReceiverF64>;
+        fn cxx_make_vector_u8(len: usize) -> UniquePtr<CxxVector<u8>>;
+        fn cxx_echo_vec_u8(inner: Box<RustOneshotReceiverVecU8>) -> Box<RustOneshotReceiverVecU8>;
+        fn cxx_echo_vector_u8(
+            inner: Box<RustOneshotReceiverCxxVectorU8>,
+        ) -> Box<RustOneshotReceiverCxxVectorU8>;
+        fn cxx_random_vector_f64(len: usize) -> Box<RustOneshotReceiverCxxVectorF64>;
+        fn cxx_sum_vec_f64(values: Box<RustOneshotReceiverVecF64>) -> Box<RustOneshotReceiverF64>;
 
         fn cppcoro_dot_product() -> Box<RustOneshotReceiverF64>;
+        fn cppcoro_time_dot_product(
+            count: usize,
+            threads: u32,
+            grain: usize,
+            iterations: u32,
+        ) -> f64;
         fn cppcoro_call_rust_dot_product();
+        fn cppcoro_call_rust_dot_product_on_pool();
+        fn cppcoro_call_rust_dot_product_on_cppcoro_pool();
+        fn cppcoro_dot_product_lazy() -> Box<RustLazyF64>;
         fn cppcoro_not_product() -> Box<RustOneshotReceiverF64>;
+        fn cppcoro_not_product_lazy() -> Box<RustLazyF64>;
         fn cppcoro_call_rust_not_product();
-        fn cppcoro_ping_pong(i: i32) -> Box<RustOneshotReceiverString>;
+        fn cppcoro_call_rust_dot_product_inline();
+        fn cppcoro_call_rust_not_product_inline();
+        fn cppcoro_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString>;
+        fn cppcoro_dot_product_chunks() -> Box<RustStreamReceiverF64>;
+        fn cppcoro_call_rust_dot_product_chunks();
+        fn cppcoro_sum_until_cancelled() -> Box<RustOneshotReceiverF64>;
+        fn cppcoro_cancel_rust_pending_forever();
+        fn cppcoro_call_rust_pending_forever_with_deadline();
+        fn cppcoro_ready_value() -> Box<RustOneshotReceiverF64>;
+        fn cppcoro_pending_value() -> Box<RustOneshotReceiverF64>;
+        fn cppcoro_ready_value_lazy() -> Box<RustLazyF64>;
+        fn cppcoro_pending_value_lazy() -> Box<RustLazyF64>;
+        fn cppcoro_await_rust(kind: i32) -> f64;
+        fn cppcoro_await_rust_inline(kind: i32) -> f64;
+        fn cppcoro_await_rust_with_deadline(kind: i32) -> f64;
+        fn cppcoro_await_rust_at_priority(kind: i32, priority: u8) -> f64;
+        fn cppcoro_await_rust_concurrently(kind: i32, count: i32) -> f64;
+        fn cppcoro_join_rust(kind: i32, count: i32) -> f64;
+        fn cppcoro_when_all_rust(kind: i32, count: i32) -> f64;
+        fn cppcoro_produce_mpsc(sender: Box<RustMpscSenderF64>, producers: i32, items: i32);
+        fn cppcoro_pod_midpoint() -> Box<RustOneshotReceiverPod>;
 
         fn libunifex_dot_product() -> Box<RustOneshotReceiverF64>;
+        fn libunifex_time_dot_product(
+            count: usize,
+            threads: u32,
+            grain: usize,
+            iterations: u32,
+        ) -> f64;
         fn libunifex_call_rust_dot_product_with_coro();
         fn libunifex_call_rust_dot_product_directly();
         fn libunifex_not_product() -> Box<RustOneshotReceiverF64>;
         fn libunifex_call_rust_not_product();
+        fn libunifex_call_rust_dot_product_chunks();
+        fn libunifex_sum_until_cancelled() -> Box<RustOneshotReceiverF64>;
+        fn libunifex_cancel_rust_pending_forever();
+        fn libunifex_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString>;
+        fn libunifex_ready_value() -> Box<RustOneshotReceiverF64>;
+        fn libunifex_pending_value() -> Box<RustOneshotReceiverF64>;
+        fn libunifex_await_rust(kind: i32) -> f64;
+        fn libunifex_await_rust_concurrently(kind: i32, count: i32) -> f64;
+        fn libunifex_join_rust(kind: i32, count: i32) -> f64;
 
         fn folly_dot_product() -> Box<RustOneshotReceiverF64>;
+        fn folly_time_dot_product(count: usize, threads: u32, grain: usize, iterations: u32)
+            -> f64;
         fn folly_call_rust_dot_product();
+        fn folly_collect_rust_dot_products();
+        fn folly_dot_product_lazy() -> Box<RustLazyF64>;
         fn folly_not_product() -> Box<RustOneshotReceiverF64>;
+        fn folly_not_product_lazy() -> Box<RustLazyF64>;
         fn folly_call_rust_not_product();
-        fn folly_ping_pong(i: i32) -> Box<RustOneshotReceiverString>;
+        fn folly_call_rust_dot_product_inline();
+        fn folly_call_rust_not_product_inline();
+        fn folly_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString>;
+        fn folly_call_rust_dot_product_chunks();
+        fn folly_sum_until_cancelled() -> Box<RustOneshotReceiverF64>;
+        fn folly_cancel_rust_pending_forever();
+        fn folly_ready_value() -> Box<RustOneshotReceiverF64>;
+        fn folly_pending_value() -> Box<RustOneshotReceiverF64>;
+        fn folly_ready_value_lazy() -> Box<RustLazyF64>;
+        fn folly_pending_value_lazy() -> Box<RustLazyF64>;
+        fn folly_await_rust(kind: i32) -> f64;
+        fn folly_await_rust_inline(kind: i32) -> f64;
+        fn folly_await_rust_concurrently(kind: i32, count: i32) -> f64;
+        fn folly_join_rust(kind: i32, count: i32) -> f64;
+        fn folly_when_all_rust(kind: i32, count: i32) -> f64;
     }
 }
 
@@ -186,96 +741,488 @@ macro_rules! define_oneshot {
         paste::paste! {
             pub type [<RustOneshotType $name>] = Result<$ty, CxxAsyncException>;
 
-            pub struct [<RustOneshotSender $name>](Option<Sender<[<RustOneshotType $name>]>>);
+            // These wrap the zero-sized handles from `oneshot`, so their `Box`es point directly at
+            // the channel's single allocation.
+            #[repr(transparent)]
+            pub struct [<RustOneshotSender $name>](Sender<$ty>);
 
-            pub struct [<RustOneshotReceiver $name>](Receiver<[<RustOneshotType $name>]>);
+            #[repr(transparent)]
+            pub struct [<RustOneshotReceiver $name>](Receiver<$ty>);
 
             impl [<RustOneshotSender $name>] {
-                unsafe fn send(&mut self, value: *const $ty, error: &str) {
+                fn counters() -> &'static ChannelType {
+                    static CHANNEL_TYPE: ChannelType =
+                        ChannelType::new(stringify!([<RustOneshotChannel $name>]));
+                    &CHANNEL_TYPE
+                }
+
+                fn from_sender(sender: Box<Sender<$ty>>) -> Box<Self> {
+                    unsafe { Box::from_raw(Box::into_raw(sender) as *mut Self) }
+                }
+
+                // Sends `*value`, or, if that's null, the error; see `CxxAsyncException::from_cxx`.
+                // Returns the wake target of a C++ coroutine waiting on the receiver, if there is
+                // one, for the caller to resume; see `into_cxx_wake_target`.
+                unsafe fn send(&mut self,
+                               value: *const $ty,
+                               error_code: i32,
+                               error_message: &str,
+                               exception: *mut u8)
+                               -> *mut u8 {
                     let to_send;
                     if !value.is_null() {
-                        let mut staging: MaybeUninit<$ty> = MaybeUninit::uninit();
-                        ptr::copy_nonoverlapping(value, staging.as_mut_ptr(), 1);
-                        to_send = Ok(staging.assume_init());
+                        to_send = Ok(ptr::read(value));
                     } else {
-                        to_send = Err(CxxAsyncException::new(error.to_owned().into_boxed_str()));
+                        counters::count(Self::counters(), Counter::ExceptionsToRust, 1);
+                        to_send =
+                            Err(CxxAsyncException::from_cxx(error_code, error_message, exception));
                     }
 
-                    self.0.take().unwrap().send(to_send).unwrap();
+                    match self.0.send_without_waking(to_send) {
+                        Some(waker) => into_cxx_wake_target(waker),
+                        None => ptr::null_mut(),
+                    }
+                }
+
+                // Arranges for a stop to be requested on the C++ coroutine's stop state once the
+                // receiver is dropped or cancelled. Returns true if that has already happened.
+                unsafe fn watch_cancel(&mut self, stop_state: *mut u8) -> bool {
+                    let waker = cxx_stop_waker(stop_state);
+                    self.0.poll_canceled(&mut Context::from_waker(&waker)).is_ready()
                 }
             }
 
             impl [<RustOneshotReceiver $name>] {
+                // Asks the sender to stop working on the result. May be called from any thread.
+                fn cancel(&self) {
+                    self.0.request_cancel();
+                }
+
+                // The channel's trace span, for C++ to trace the coroutine that completes it.
+                fn span(&self) -> u64 {
+                    self.0.span()
+                }
+
                 fn channel(&self) -> [<RustOneshotChannel $name>] {
                     let (sender, receiver) = oneshot::channel();
                     [<RustOneshotChannel $name>] {
-                        sender: Box::new([<RustOneshotSender $name>](Some(sender))),
-                        receiver: Box::new([<RustOneshotReceiver $name>](receiver)),
+                        sender: [<RustOneshotSender $name>]::from_sender(sender),
+                        receiver: [<RustOneshotReceiver $name>]::from_receiver(receiver),
                     }
                 }
 
+                // On success, moves the result into `*maybe_result`; on failure, moves the error
+                // into the C++ `RustError` storage at `maybe_error`.
                 unsafe fn recv(&mut self,
                                maybe_result: *mut $ty,
-                               error: Pin<&mut CxxString>,
-                               coroutine_address: *mut u8)
+                               maybe_error: *mut u8,
+                               wake_target: *mut u8)
                                -> i32 {
-                    if coroutine_address.is_null() {
-                        match self.0.try_recv() {
-                            Ok(Some(Ok(result))) => {
-                                ptr::copy_nonoverlapping(&result, maybe_result, 1);
-                                mem::forget(result);
-                                return RECV_RESULT_READY
-                            }
-                            Ok(Some(Err(exception))) => {
-                                error.push_str(exception.what());
-                                return RECV_RESULT_ERROR
-                            }
-                            Err(Canceled) => {
-                                error.push_str("Cancelled (sender dropped)");
-                                return RECV_RESULT_ERROR
-                            }
-                            Ok(None) => return RECV_RESULT_PENDING,
+                    let counters = [<RustOneshotSender $name>]::counters();
+                    counters::count(counters, Counter::Polls, 1);
+                    let result = if wake_target.is_null() {
+                        self.0.try_recv()
+                    } else {
+                        let waker = cxx_coroutine_waker(wake_target);
+                        match self.0.poll_recv(&mut Context::from_waker(&waker)) {
+                            Poll::Ready(result) => Some(result),
+                            Poll::Pending => None,
                         }
-                    }
+                    };
 
-                    let waker =
-                        CxxCoroutineAddress(UnsafeCell::new(coroutine_address)).into_waker();
-                    match Pin::new(&mut self.0).poll(&mut Context::from_waker(&waker)) {
-                        Poll::Ready(Ok(Ok(result))) => {
-                            ptr::copy_nonoverlapping(&result, maybe_result, 1);
-                            mem::forget(result);
-                            return RECV_RESULT_READY
+                    match result {
+                        None => {
+                            counters::count(counters, Counter::PendingPolls, 1);
+                            RECV_RESULT_PENDING
+                        }
+                        Some(Ok(Ok(result))) => {
+                            ptr::write(maybe_result, result);
+                            RECV_RESULT_READY
                         }
-                        Poll::Ready(Ok(Err(exception))) => {
-                            error.push_str(exception.what());
-                            return RECV_RESULT_ERROR
+                        Some(Ok(Err(exception))) => {
+                            counters::count(counters, Counter::ErrorsToCxx, 1);
+                            exception.into_cxx(maybe_error);
+                            RECV_RESULT_ERROR
                         }
-                        Poll::Ready(Err(Canceled)) => {
-                            error.push_str("Cancelled (sender dropped)");
-                            return RECV_RESULT_ERROR
+                        Some(Err(Canceled)) => {
+                            counters::count(counters, Counter::Cancellations, 1);
+                            RECV_RESULT_CANCELLED
                         }
-                        Poll::Pending => return RECV_RESULT_PENDING,
                     }
                 }
             }
 
             impl Future for [<RustOneshotReceiver $name>] {
-                type Output = Result<[<RustOneshotType $name>], Canceled>;
+                type Output = OneshotResult<$ty>;
                 fn poll(mut self: Pin<&mut Self>, context: &mut Context) -> Poll<Self::Output> {
-                    match Pin::new(&mut self.0).poll(context) {
-                        Poll::Pending => Poll::Pending,
-                        Poll::Ready(value) => Poll::Ready(value),
-                    }
+                    Pin::new(&mut self.0).poll(context)
                 }
             }
 
             impl CxxReceiver for [<RustOneshotReceiver $name>] {
                 type Output = $ty;
-                type PlainReceiver = Receiver<[<RustOneshotType $name>]>;
-                type PlainSender = Sender<[<RustOneshotType $name>]>;
-                type CxxSender = [<RustOneshotSender $name>];
-                fn from_plain_receiver(plain_receiver: Self::PlainReceiver) -> Box<Self> {
-                    Box::new([<RustOneshotReceiver $name>](plain_receiver))
+                fn from_receiver(receiver: Box<Receiver<$ty>>) -> Box<Self> {
+                    // Every channel that crosses the bridge starts here. It's one allocation.
+                    let counters = [<RustOneshotSender $name>]::counters();
+                    counters::count(counters, Counter::Channels, 1);
+                    counters::count(counters, Counter::Allocations, 1);
+                    unsafe { Box::from_raw(Box::into_raw(receiver) as *mut Self) }
+                }
+            }
+        }
+    };
+}
+
+// Lets any of `$ty` cross the bridge through the pod channel; see pod.rs. Fails to compile if a
+// type doesn't fit. Invocations must say `unsafe`, since the macro can't check the rest of what
+// `CxxPod` needs: no padding, whose bytes would cross uninitialized, and for structs, a layout
+// fixed on both sides, as cxx shared structs have. Rust tuples don't have one.
+//
+// For a shared struct, list its fields, in order, with `unsafe struct Type { field: Type, ... }`
+// to have that checked too: the fields must lie back to back and fill the struct. Check the same
+// in C++ with `rust_pod_is_packed` from cxx_async.h; the same fields with no padding on either
+// side make for the same layout on both.
+macro_rules! define_pod {
+    (unsafe struct $ty:ty { $($field:ident: $field_ty:ty),* $(,)? }) => {
+        const _: () = {
+            #[allow(dead_code)]
+            fn field_types(pod: &$ty) {
+                $(let _: &$field_ty = &pod.$field;)*
+            }
+            let offsets = [$(mem::offset_of!($ty, $field)),*];
+            let sizes = [$(mem::size_of::<$field_ty>()),*];
+            let mut end = 0;
+            let mut index = 0;
+            while index < offsets.len() {
+                assert!(offsets[index] == end, concat!(stringify!($ty), " has padding"));
+                end += sizes[index];
+                index += 1;
+            }
+            assert!(end == mem::size_of::<$ty>(), concat!(stringify!($ty), " has padding"));
+        };
+        define_pod!(unsafe $ty);
+    };
+    (unsafe $($ty:ty),* $(,)?) => {
+        $(
+            const _: () = assert!(
+                mem::size_of::<$ty>() <= 16 && mem::align_of::<$ty>() <= 8,
+                concat!(stringify!($ty), " doesn't fit in a pod")
+            );
+            unsafe impl pod::CxxPod for $ty {}
+        )*
+    };
+}
+
+macro_rules! define_stream {
+    ($name:ident, $ty:ty) => {
+        paste::paste! {
+            #[repr(transparent)]
+            pub struct [<RustStreamSender $name>](stream::Sender<$ty>);
+
+            #[repr(transparent)]
+            pub struct [<RustStreamReceiver $name>](stream::Receiver<$ty>);
+
+            impl [<RustStreamSender $name>] {
+                fn counters() -> &'static ChannelType {
+                    static CHANNEL_TYPE: ChannelType =
+                        ChannelType::new(stringify!([<RustStreamChannel $name>]));
+                    &CHANNEL_TYPE
+                }
+
+                fn from_sender(sender: Box<stream::Sender<$ty>>) -> Box<Self> {
+                    unsafe { Box::from_raw(Box::into_raw(sender) as *mut Self) }
+                }
+
+                // Takes ownership of `*value` only if this returns `SEND_RESULT_READY`.
+                unsafe fn send(&mut self, value: *const $ty, wake_target: *mut u8) -> i32 {
+                    if !wake_target.is_null() {
+                        let waker = cxx_coroutine_waker(wake_target);
+                        match self.0.poll_ready(&mut Context::from_waker(&waker)) {
+                            Poll::Ready(Ok(())) => {}
+                            Poll::Ready(Err(Closed)) => return SEND_RESULT_CLOSED,
+                            Poll::Pending => return SEND_RESULT_PENDING,
+                        }
+                    }
+
+                    match self.0.try_send(ptr::read(value)) {
+                        Ok(()) => SEND_RESULT_READY,
+                        // The caller still owns the value in these cases.
+                        Err(TrySendError::Full(value)) => {
+                            let _ = ManuallyDrop::new(value);
+                            SEND_RESULT_PENDING
+                        }
+                        Err(TrySendError::Closed(value)) => {
+                            let _ = ManuallyDrop::new(value);
+                            SEND_RESULT_CLOSED
+                        }
+                    }
+                }
+
+                fn close(&mut self) {
+                    self.0.close(Ok(()));
+                }
+
+                unsafe fn fail(&mut self,
+                               error_code: i32,
+                               error_message: &str,
+                               exception: *mut u8) {
+                    counters::count(Self::counters(), Counter::ExceptionsToRust, 1);
+                    let error = CxxAsyncException::from_cxx(error_code, error_message, exception);
+                    self.0.close(Err(error));
+                }
+            }
+
+            impl [<RustStreamReceiver $name>] {
+                // Asks the sender to stop producing items. May be called from any thread.
+                fn cancel(&self) {
+                    self.0.request_cancel();
+                }
+
+                fn channel(&self) -> [<RustStreamChannel $name>] {
+                    let (sender, receiver) = stream::channel(stream::DEFAULT_CAPACITY);
+                    [<RustStreamChannel $name>] {
+                        sender: [<RustStreamSender $name>]::from_sender(sender),
+                        receiver: [<RustStreamReceiver $name>]::from_receiver(receiver),
+                    }
+                }
+
+                // Like `RustOneshotReceiver*::recv`.
+                unsafe fn recv(&mut self,
+                               maybe_item: *mut $ty,
+                               maybe_error: *mut u8,
+                               wake_target: *mut u8)
+                               -> i32 {
+                    let counters = [<RustStreamSender $name>]::counters();
+                    counters::count(counters, Counter::Polls, 1);
+                    let next = if wake_target.is_null() {
+                        self.0.try_next()
+                    } else {
+                        let waker = cxx_coroutine_waker(wake_target);
+                        self.0.poll_recv(&mut Context::from_waker(&waker))
+                    };
+
+                    match next {
+                        Poll::Ready(Some(Ok(item))) => {
+                            ptr::write(maybe_item, item);
+                            RECV_RESULT_READY
+                        }
+                        Poll::Ready(Some(Err(exception))) => {
+                            counters::count(counters, Counter::ErrorsToCxx, 1);
+                            exception.into_cxx(maybe_error);
+                            RECV_RESULT_ERROR
+                        }
+                        Poll::Ready(None) => RECV_RESULT_DONE,
+                        Poll::Pending => {
+                            counters::count(counters, Counter::PendingPolls, 1);
+                            RECV_RESULT_PENDING
+                        }
+                    }
+                }
+
+                fn poll_recv_many(&mut self, context: &mut Context, items: &mut Vec<$ty>)
+                                  -> Poll<Option<Result<usize, CxxAsyncException>>> {
+                    self.0.poll_recv_many(context, items)
+                }
+            }
+
+            impl Stream for [<RustStreamReceiver $name>] {
+                type Item = Result<$ty, CxxAsyncException>;
+                fn poll_next(mut self: Pin<&mut Self>, context: &mut Context)
+                             -> Poll<Option<Self::Item>> {
+                    Pin::new(&mut self.0).poll_next(context)
+                }
+            }
+
+            impl CxxStreamReceiver for [<RustStreamReceiver $name>] {
+                type Item = $ty;
+                fn from_receiver(receiver: Box<stream::Receiver<$ty>>) -> Box<Self> {
+                    // The channel and its ring buffer are two allocations.
+                    let counters = [<RustStreamSender $name>]::counters();
+                    counters::count(counters, Counter::Channels, 1);
+                    counters::count(counters, Counter::Allocations, 2);
+                    unsafe { Box::from_raw(Box::into_raw(receiver) as *mut Self) }
+                }
+            }
+        }
+    };
+}
+
+macro_rules! define_mpsc {
+    ($name:ident, $ty:ty) => {
+        paste::paste! {
+            #[repr(transparent)]
+            pub struct [<RustMpscSender $name>](mpsc::Sender<$ty>);
+
+            #[repr(transparent)]
+            pub struct [<RustMpscReceiver $name>](mpsc::Receiver<$ty>);
+
+            impl [<RustMpscSender $name>] {
+                // Named after the sender, since that's the type that C++ counts resumes under.
+                fn counters() -> &'static ChannelType {
+                    static CHANNEL_TYPE: ChannelType =
+                        ChannelType::new(stringify!([<RustMpscSender $name>]));
+                    &CHANNEL_TYPE
+                }
+
+                fn from_sender(sender: Box<mpsc::Sender<$ty>>) -> Box<Self> {
+                    unsafe { Box::from_raw(Box::into_raw(sender) as *mut Self) }
+                }
+
+                // See `mpsc::Sender::send`. A null `wake_target` means don't wait.
+                unsafe fn send(&mut self, value: *mut $ty, result: *mut i32, wake_target: *mut u8)
+                               -> i32 {
+                    if wake_target.is_null() {
+                        return self.0.send(value, result, None);
+                    }
+                    let waker = cxx_coroutine_waker(wake_target);
+                    let send_result = self.0.send(value, result, Some(&waker));
+                    if send_result == SEND_RESULT_PENDING {
+                        counters::count(Self::counters(), Counter::PendingPolls, 1);
+                    }
+                    send_result
+                }
+
+                // See `mpsc::Sender::cancel_send`.
+                unsafe fn cancel_send(&mut self, value: *mut $ty, result: *mut i32) -> i32 {
+                    self.0.cancel_send(value, result)
+                }
+
+                fn clone_sender(&self) -> Box<Self> {
+                    Self::from_sender(self.0.clone_sender())
+                }
+            }
+
+            impl [<RustMpscReceiver $name>] {
+                fn channel(capacity: usize)
+                           -> (Box<[<RustMpscSender $name>]>, Box<[<RustMpscReceiver $name>]>) {
+                    // The channel and its slots are two allocations.
+                    let counters = [<RustMpscSender $name>]::counters();
+                    counters::count(counters, Counter::Channels, 1);
+                    counters::count(counters, Counter::Allocations, 2);
+                    let (sender, receiver) = mpsc::channel(capacity);
+                    let receiver =
+                        unsafe { Box::from_raw(Box::into_raw(receiver) as *mut Self) };
+                    ([<RustMpscSender $name>]::from_sender(sender), receiver)
+                }
+
+                // Stops the senders; items already in the channel can still be received.
+                fn close(&self) {
+                    self.0.close();
+                }
+
+                fn poll_recv_many(&mut self, context: &mut Context, items: &mut Vec<$ty>)
+                                  -> Poll<Option<usize>> {
+                    self.0.poll_recv_many(context, items)
+                }
+            }
+
+            impl Stream for [<RustMpscReceiver $name>] {
+                type Item = $ty;
+                fn poll_next(mut self: Pin<&mut Self>, context: &mut Context)
+                             -> Poll<Option<Self::Item>> {
+                    Pin::new(&mut self.0).poll_next(context)
+                }
+            }
+        }
+    };
+}
+
+macro_rules! define_lazy {
+    ($name:ident, $ty:ty) => {
+        paste::paste! {
+            // Its `Box` points into the C++ coroutine's promise; see lazy.rs.
+            #[repr(transparent)]
+            pub struct [<RustLazy $name>](LazyCoroutine<$ty>);
+
+            impl [<RustLazy $name>] {
+                fn counters() -> &'static ChannelType {
+                    static CHANNEL_TYPE: ChannelType =
+                        ChannelType::new(stringify!([<RustLazy $name>]));
+                    &CHANNEL_TYPE
+                }
+
+                // Called by the coroutine once it finishes, with what it returned, as for
+                // `RustOneshotSender*::send`, except that the value stays in the promise until
+                // it's polled for. Wakes the waiting task; see `into_cxx_wake_target`.
+                unsafe fn complete(&mut self,
+                                   value: *const $ty,
+                                   error_code: i32,
+                                   error_message: &str,
+                                   exception: *mut u8)
+                                   -> *mut u8 {
+                    if value.is_null() {
+                        counters::count(Self::counters(), Counter::ExceptionsToRust, 1);
+                    }
+                    match self.0.complete(value as *mut $ty, error_code, error_message, exception) {
+                        Some(waker) => into_cxx_wake_target(waker),
+                        None => ptr::null_mut(),
+                    }
+                }
+            }
+
+            impl Future for [<RustLazy $name>] {
+                type Output = OneshotResult<$ty>;
+                fn poll(mut self: Pin<&mut Self>, context: &mut Context) -> Poll<Self::Output> {
+                    Pin::new(&mut self.0).poll(context)
+                }
+            }
+        }
+    };
+}
+
+macro_rules! define_future {
+    ($name:ident, $ty:ty) => {
+        paste::paste! {
+            // An unspawned future; see inline_future.rs.
+            pub struct [<RustFuture $name>](InlineFuture<$ty>);
+
+            impl [<RustFuture $name>] {
+                fn counters() -> &'static ChannelType {
+                    static CHANNEL_TYPE: ChannelType =
+                        ChannelType::new(stringify!([<RustFuture $name>]));
+                    &CHANNEL_TYPE
+                }
+
+                // Polls the future on the calling thread, as `RustOneshotReceiver*::recv` polls a
+                // receiver, except that a null `wake_target` still polls.
+                unsafe fn recv(&mut self,
+                               maybe_result: *mut $ty,
+                               maybe_error: *mut u8,
+                               wake_target: *mut u8)
+                               -> i32 {
+                    let counters = Self::counters();
+                    counters::count(counters, Counter::Polls, 1);
+                    match self.0.poll_from_cxx(wake_target) {
+                        Poll::Pending => {
+                            counters::count(counters, Counter::PendingPolls, 1);
+                            RECV_RESULT_PENDING
+                        }
+                        Poll::Ready(Ok(result)) => {
+                            ptr::write(maybe_result, result);
+                            RECV_RESULT_READY
+                        }
+                        Poll::Ready(Err(exception)) => {
+                            counters::count(counters, Counter::ErrorsToCxx, 1);
+                            exception.into_cxx(maybe_error);
+                            RECV_RESULT_ERROR
+                        }
+                    }
+                }
+
+                // Runs the future on the shared pool instead, in parallel with the caller.
+                fn spawn(&mut self) -> Box<[<RustOneshotReceiver $name>]> {
+                    self.0.take().via(&*THREAD_POOL)
+                }
+            }
+
+            impl CxxFuture for [<RustFuture $name>] {
+                type Output = $ty;
+                fn from_future(future: InlineFuture<$ty>) -> Box<Self> {
+                    // The handle and the boxed future, plus a waker later if C++ has to wait.
+                    let counters = Self::counters();
+                    counters::count(counters, Counter::Channels, 1);
+                    counters::count(counters, Counter::Allocations, 2);
+                    Box::new([<RustFuture $name>](future))
                 }
             }
         }
@@ -286,11 +1233,13 @@ trait CxxAsync {
     type Output;
     fn via<Recv, Exec>(self, executor: &Exec) -> Box<Recv>
     where
-        Recv: CxxReceiver<
-            Output = Self::Output,
-            PlainReceiver = Receiver<Result<Self::Output, CxxAsyncException>>,
-        >,
+        Recv: CxxReceiver<Output = Self::Output>,
         Exec: Spawn;
+    // Hands the future to C++ unspawned, for the awaiting coroutine to poll on its own thread. C++
+    // can still spawn it with `rust_spawn` to run it in parallel.
+    fn inline<Handle>(self) -> Box<Handle>
+    where
+        Handle: CxxFuture<Output = Self::Output>;
 }
 
 impl<Out, Fut> CxxAsync for Fut
@@ -301,33 +1250,174 @@ where
     type Output = Out;
     fn via<Recv, Exec>(self, executor: &Exec) -> Box<Recv>
     where
-        Recv: CxxReceiver<
-            Output = Self::Output,
-            PlainReceiver = Receiver<Result<Self::Output, CxxAsyncException>>,
-        >,
+        Recv: CxxReceiver<Output = Self::Output>,
         Exec: Spawn,
     {
         let (sender, receiver) = oneshot::channel();
         executor.spawn(go(sender, self)).unwrap();
-        return CxxReceiver::from_plain_receiver(receiver);
+        return CxxReceiver::from_receiver(receiver);
 
-        async fn go<Out, Fut>(sender: Sender<Result<Out, CxxAsyncException>>, fut: Fut)
+        async fn go<Out, Fut>(mut sender: Box<Sender<Out>>, fut: Fut)
         where
             Fut: Future<Output = Result<Out, CxxAsyncException>>,
             Out: Debug,
         {
-            // FIXME(pcwalton): Is it a bad idea to unwrap here?
-            sender.send(fut.await).unwrap();
+            // If the receiver goes away or cancels while the future is waiting, drop the future
+            // without finishing it. Each poll is a slice of the channel's trace span.
+            pin_mut!(fut);
+            let span = sender.span();
+            let mut awaiting = 0;
+            let result = poll_fn(|context| {
+                let outer = trace::enter(span);
+                trace::record(trace::Event::Resumed, span, awaiting);
+                trace::take_awaiting();
+                let poll = fut.as_mut().poll(context);
+                awaiting = trace::take_awaiting();
+                trace::record(trace::Event::Suspended, span, awaiting);
+                trace::enter(outer);
+                match poll {
+                    Poll::Ready(result) => Poll::Ready(Some(result)),
+                    Poll::Pending => sender.poll_canceled(context).map(|()| None),
+                }
+            })
+            .await;
+            if let Some(result) = result {
+                sender.send(result);
+            }
+        }
+    }
+
+    fn inline<Handle>(self) -> Box<Handle>
+    where
+        Handle: CxxFuture<Output = Self::Output>,
+    {
+        Handle::from_future(InlineFuture::new(Box::pin(self)))
+    }
+}
+
+trait CxxAsyncStream {
+    type Item;
+    fn via_stream<Recv, Exec>(self, executor: &Exec) -> Box<Recv>
+    where
+        Recv: CxxStreamReceiver<Item = Self::Item>,
+        Exec: Spawn;
+}
+
+impl<Item, S> CxxAsyncStream for S
+where
+    S: Stream<Item = Result<Item, CxxAsyncException>> + Send + 'static,
+    Item: Send + 'static,
+{
+    type Item = Item;
+    fn via_stream<Recv, Exec>(self, executor: &Exec) -> Box<Recv>
+    where
+        Recv: CxxStreamReceiver<Item = Self::Item>,
+        Exec: Spawn,
+    {
+        let (sender, receiver) = stream::channel(stream::DEFAULT_CAPACITY);
+        executor.spawn(go(sender, self)).unwrap();
+        return CxxStreamReceiver::from_receiver(receiver);
+
+        async fn go<Item, S>(mut sender: Box<stream::Sender<Item>>, stream: S)
+        where
+            S: Stream<Item = Result<Item, CxxAsyncException>>,
+        {
+            pin_mut!(stream);
+            loop {
+                // Only pull the next item once there's room for it, so that a slow consumer slows
+                // the stream down. If the consumer goes away or cancels, even while the stream is
+                // waiting, dropping the stream cancels it.
+                if poll_fn(|context| sender.poll_ready(context)).await.is_err() {
+                    return;
+                }
+                let next = poll_fn(|context| match stream.as_mut().poll_next(context) {
+                    Poll::Ready(next) => Poll::Ready(Some(next)),
+                    Poll::Pending => sender.poll_closed(context).map(|()| None),
+                })
+                .await;
+                match next {
+                    None => return,
+                    Some(Some(Ok(item))) => {
+                        if sender.try_send(item).is_err() {
+                            return;
+                        }
+                    }
+                    Some(Some(Err(error))) => return sender.close(Err(error)),
+                    Some(None) => return sender.close(Ok(())),
+                }
+            }
         }
     }
 }
 
+// Returns a receiver whose value is already there.
+fn ready<Recv>(value: Recv::Output) -> Box<Recv>
+where
+    Recv: CxxReceiver,
+{
+    let (mut sender, receiver) = oneshot::channel();
+    sender.send(Ok(value));
+    Recv::from_receiver(receiver)
+}
+
+fn failed<Recv>(error: CxxAsyncException) -> Box<Recv>
+where
+    Recv: CxxReceiver,
+{
+    let (mut sender, receiver) = oneshot::channel();
+    sender.send(Err(error));
+    Recv::from_receiver(receiver)
+}
+
+// Called by C++ to queue a `RustPoolJob` on the shared pool.
+unsafe fn rust_pool_post(job: *mut u8, priority: u8) {
+    THREAD_POOL.post_cxx_job(job, Priority::from_cxx(priority));
+}
+
+// Called by a C++ `RustTaskExecutor` to run a task that a `CxxSpawner` gave it.
+unsafe fn rust_run_spawned_task(task: *mut u8) {
+    pool::run_spawned_task(task);
+}
+
+// Called by C++ to put a deadline on an await; see timer.rs.
+unsafe fn rust_arm_cxx_timer(timeout_ns: u64, target: *mut u8) -> u64 {
+    timer::arm_cxx(Duration::from_nanos(timeout_ns), target)
+}
+
+fn rust_disarm_cxx_timer(timer: u64) -> bool {
+    timer::disarm(timer)
+}
+
+// Called by C++ to trace what it does with bridged coroutines; see trace.rs.
+fn rust_record_cxx_trace_event(event: u8, span: u64, related: u64) {
+    trace::record(trace::Event::from_cxx(event), span, related);
+}
+
+fn rust_swap_cxx_trace_span(span: u64) -> u64 {
+    trace::enter(span)
+}
+
 // Application code follows:
 
-static THREAD_POOL: Lazy<ThreadPool> = Lazy::new(|| ThreadPool::new().unwrap());
+// The one pool that Rust futures and, through the adapters in the cxx_async_*.h headers, C++
+// coroutines share. See pool.rs for configuring it.
+static THREAD_POOL: Lazy<Pool> = Lazy::new(|| Pool::new(PoolConfig::from_env()));
 
 define_oneshot!(F64, f64);
 define_oneshot!(String, String);
+define_oneshot!(VecU8, Vec<u8>);
+define_oneshot!(VecF64, Vec<f64>);
+define_oneshot!(CxxVectorU8, UniquePtr<CxxVector<u8>>);
+define_oneshot!(CxxVectorF64, UniquePtr<CxxVector<f64>>);
+define_oneshot!(Pod, ffi::RustPodValue);
+
+// None of these have padding. `PodPoint` is a shared struct; cppcoro_example.cpp checks it too.
+define_pod!(unsafe u32, u64, i64, f64);
+define_pod!(unsafe struct ffi::PodPoint { x: f64, y: f64 });
+define_lazy!(F64, f64);
+define_future!(F64, f64);
+define_stream!(F64, f64);
+define_mpsc!(F64, f64);
 
 struct Xorshift {
     state: u32,
@@ -358,33 +1448,59 @@ static VECTORS: Lazy<(Vec<f64>, Vec<f64>)> = Lazy::new(|| {
     (vector_a, vector_b)
 });
 
+// The leaf size for `dot_product_inner`, picked by the same policy as the C++ examples.
+static DOT_PRODUCT_GRAIN: Lazy<usize> = Lazy::new(|| ffi::dot_product_grain(split_overhead_ns()));
+
+// What a split in `dot_product_inner` costs: boxing both halves and joining them. Polls by hand,
+// since this may run on a pool worker, which `block_on` would tie up.
+fn split_overhead_ns() -> f64 {
+    #[async_recursion]
+    async fn leaf() {}
+
+    const SPLITS: u32 = 1024;
+    let mut context = Context::from_waker(futures::task::noop_waker_ref());
+    let start = Instant::now();
+    for _ in 0..SPLITS {
+        let split = async { join!(leaf(), leaf()) };
+        pin_mut!(split);
+        assert!(split.poll(&mut context).is_ready());
+    }
+    start.elapsed().as_nanos() as f64 / SPLITS as f64
+}
+
 #[async_recursion]
-async fn dot_product_inner(a: &[f64], b: &[f64]) -> f64 {
-    if a.len() > SPLIT_LIMIT {
+async fn dot_product_inner(a: &[f64], b: &[f64], grain: usize) -> f64 {
+    if a.len() > grain {
         let half_count = a.len() / 2;
         let (first, second) = join!(
-            dot_product_inner(&a[0..half_count], &b[0..half_count]),
-            dot_product_inner(&a[half_count..], &b[half_count..])
+            dot_product_inner(&a[0..half_count], &b[0..half_count], grain),
+            dot_product_inner(&a[half_count..], &b[half_count..], grain)
         );
         return first + second;
     }
 
-    let mut sum = 0.0;
-    for (&a, &b) in a.iter().zip(b.iter()) {
-        sum += a * b;
-    }
-    sum
+    ffi::cxx_dot_product_kernel(a, b)
 }
 
 fn rust_dot_product() -> Box<RustOneshotReceiverF64> {
     async fn go() -> Result<f64, CxxAsyncException> {
         let (ref vector_a, ref vector_b) = *VECTORS;
-        Ok(dot_product_inner(&vector_a, &vector_b).await)
+        Ok(dot_product_inner(&vector_a, &vector_b, *DOT_PRODUCT_GRAIN).await)
     }
 
     go().via(&*THREAD_POOL)
 }
 
+// Like `rust_dot_product`, but runs on a C++ `RustTaskExecutor` instead of the shared pool.
+unsafe fn rust_dot_product_on(executor: *mut u8) -> Box<RustOneshotReceiverF64> {
+    async fn go() -> Result<f64, CxxAsyncException> {
+        let (ref vector_a, ref vector_b) = *VECTORS;
+        Ok(dot_product_inner(&vector_a, &vector_b, *DOT_PRODUCT_GRAIN).await)
+    }
+
+    go().via(&CxxSpawner::new(executor))
+}
+
 fn rust_not_product() -> Box<RustOneshotReceiverF64> {
     async fn go() -> Result<f64, CxxAsyncException> {
         Err(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
@@ -393,34 +1509,240 @@ fn rust_not_product() -> Box<RustOneshotReceiverF64> {
     go().via(&*THREAD_POOL)
 }
 
-fn rust_cppcoro_ping_pong(i: i32) -> Box<RustOneshotReceiverString> {
-    async fn go(i: i32) -> Result<String, CxxAsyncException> {
+// Like `rust_dot_product`, but for C++ to poll on its own thread; see `CxxAsync::inline`. The
+// product is all joins, not spawns, so that runs the whole thing on the awaiting thread.
+fn rust_dot_product_inline() -> Box<RustFutureF64> {
+    async fn go() -> Result<f64, CxxAsyncException> {
+        let (ref vector_a, ref vector_b) = *VECTORS;
+        Ok(dot_product_inner(&vector_a, &vector_b, *DOT_PRODUCT_GRAIN).await)
+    }
+
+    go().inline()
+}
+
+fn rust_not_product_inline() -> Box<RustFutureF64> {
+    async fn go() -> Result<f64, CxxAsyncException> {
+        Err(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
+    }
+
+    go().inline()
+}
+
+fn rust_cppcoro_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString> {
+    async fn go(i: i32, depth: i32) -> Result<String, CxxAsyncException> {
+        Ok(format!(
+            "{}ping ",
+            if i < depth {
+                ffi::cppcoro_ping_pong(i + 1, depth).await.unwrap().unwrap()
+            } else {
+                String::new()
+            }
+        ))
+    }
+
+    go(i, depth).via(&*THREAD_POOL)
+}
+
+fn rust_folly_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString> {
+    async fn go(i: i32, depth: i32) -> Result<String, CxxAsyncException> {
         Ok(format!(
             "{}ping ",
-            if i < 8 {
-                ffi::cppcoro_ping_pong(i + 1).await.unwrap().unwrap()
+            if i < depth {
+                ffi::folly_ping_pong(i + 1, depth).await.unwrap().unwrap()
             } else {
                 String::new()
             }
         ))
     }
 
-    go(i).via(&*THREAD_POOL)
+    go(i, depth).via(&*THREAD_POOL)
 }
 
-fn rust_folly_ping_pong(i: i32) -> Box<RustOneshotReceiverString> {
-    async fn go(i: i32) -> Result<String, CxxAsyncException> {
+fn rust_libunifex_ping_pong(i: i32, depth: i32) -> Box<RustOneshotReceiverString> {
+    async fn go(i: i32, depth: i32) -> Result<String, CxxAsyncException> {
         Ok(format!(
             "{}ping ",
-            if i < 8 {
-                ffi::folly_ping_pong(i + 1).await.unwrap().unwrap()
+            if i < depth {
+                ffi::libunifex_ping_pong(i + 1, depth)
+                    .await
+                    .unwrap()
+                    .unwrap()
             } else {
                 String::new()
             }
         ))
     }
 
-    go(i).via(&*THREAD_POOL)
+    go(i, depth).via(&*THREAD_POOL)
+}
+
+// Streams the dot product of each `SPLIT_LIMIT`-sized chunk of the vectors.
+fn rust_dot_product_chunks() -> Box<RustStreamReceiverF64> {
+    let (ref vector_a, ref vector_b) = *VECTORS;
+    let chunks = vector_a
+        .chunks(SPLIT_LIMIT)
+        .zip(vector_b.chunks(SPLIT_LIMIT))
+        .map(|(a, b)| Ok(ffi::cxx_dot_product_kernel(a, b)));
+    futures::stream::iter(chunks).via_stream(&*THREAD_POOL)
+}
+
+static LIVE_RUST_FUTURES: AtomicUsize = AtomicUsize::new(0);
+
+struct LiveFutureGuard;
+
+impl LiveFutureGuard {
+    fn new() -> LiveFutureGuard {
+        LIVE_RUST_FUTURES.fetch_add(1, Ordering::SeqCst);
+        LiveFutureGuard
+    }
+}
+
+impl Drop for LiveFutureGuard {
+    fn drop(&mut self) {
+        LIVE_RUST_FUTURES.fetch_sub(1, Ordering::SeqCst);
+    }
+}
+
+// What C++ awaits on each iteration of `cxx_ping_pong_loop` in the stress tests. Half of these
+// are ready before C++ awaits them; the other half complete on the thread pool, and some of those
+// await C++ in turn.
+fn rust_pong(i: i32) -> Box<RustOneshotReceiverF64> {
+    match i % 4 {
+        0 | 2 => ready(i as f64),
+        1 => {
+            async fn go(i: i32) -> Result<f64, CxxAsyncException> {
+                Ok(ffi::cxx_pong(i).await.unwrap().unwrap())
+            }
+            go(i).via(&*THREAD_POOL)
+        }
+        _ => {
+            async fn go(i: i32) -> Result<f64, CxxAsyncException> {
+                Ok(i as f64)
+            }
+            go(i).via(&*THREAD_POOL)
+        }
+    }
+}
+
+// What C++ awaits in the cross-runtime benchmarks in bench.rs.
+fn rust_bench_value(kind: i32) -> Box<RustOneshotReceiverF64> {
+    match kind {
+        bench::BENCH_VALUE_READY => ready(1.0),
+        bench::BENCH_VALUE_READY_ERROR => {
+            failed(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
+        }
+        bench::BENCH_VALUE_CODED_ERROR => failed(CxxAsyncException::with_code(
+            bench::BENCH_ERROR_CODE,
+            "miss",
+        )),
+        bench::BENCH_VALUE_PENDING => {
+            async fn go() -> Result<f64, CxxAsyncException> {
+                Ok(1.0)
+            }
+            go().via(&*THREAD_POOL)
+        }
+        _ => rust_not_product(),
+    }
+}
+
+// Like `rust_bench_value`, but unspawned. The pending kind waits on a spawned task, so that C++
+// pays for the waker.
+fn rust_bench_value_inline(kind: i32) -> Box<RustFutureF64> {
+    match kind {
+        bench::BENCH_VALUE_READY => {
+            async fn go() -> Result<f64, CxxAsyncException> {
+                Ok(1.0)
+            }
+            go().inline()
+        }
+        bench::BENCH_VALUE_CODED_ERROR => {
+            async fn go() -> Result<f64, CxxAsyncException> {
+                Err(CxxAsyncException::with_code(
+                    bench::BENCH_ERROR_CODE,
+                    "miss",
+                ))
+            }
+            go().inline()
+        }
+        bench::BENCH_VALUE_PENDING => {
+            async fn go() -> Result<f64, CxxAsyncException> {
+                Ok(rust_bench_value(bench::BENCH_VALUE_PENDING)
+                    .await
+                    .unwrap()
+                    .unwrap())
+            }
+            go().inline()
+        }
+        _ => rust_not_product_inline(),
+    }
+}
+
+// Pods cross through the one pod channel type, with no declarations of their own beyond
+// `define_pod!`.
+fn rust_pod_point(x: f64, y: f64) -> Box<RustOneshotReceiverPod> {
+    async move { Ok(ffi::PodPoint { x, y }) }.via_pod(&*THREAD_POOL)
+}
+
+fn rust_next_id() -> Box<RustOneshotReceiverPod> {
+    static NEXT_ID: AtomicU64 = AtomicU64::new(1);
+    async { Ok(NEXT_ID.fetch_add(1, Ordering::Relaxed)) }.via_pod(&*THREAD_POOL)
+}
+
+fn rust_bridge_counters() -> Vec<ffi::BridgeCounters> {
+    counters::snapshot()
+}
+
+// Never resolves; C++ has to cancel it.
+fn rust_pending_forever() -> Box<RustOneshotReceiverF64> {
+    async fn go() -> Result<f64, CxxAsyncException> {
+        let _guard = LiveFutureGuard::new();
+        future::pending().await
+    }
+
+    go().via(&*THREAD_POOL)
+}
+
+fn wait_until(what: &str, condition: impl Fn() -> bool) {
+    let start = Instant::now();
+    while !condition() {
+        assert!(
+            start.elapsed() < Duration::from_secs(10),
+            "timed out waiting for {}",
+            what
+        );
+        thread::sleep(Duration::from_millis(1));
+    }
+    println!("{}", what);
+}
+
+// Tests cancellation in both directions: dropping a receiver stops the C++ coroutine behind it,
+// and cancelling a C++ await drops the Rust future behind it.
+fn test_cancellation(
+    sum_until_cancelled: fn() -> Box<RustOneshotReceiverF64>,
+    cancel_rust_pending_forever: fn(),
+) {
+    drop(sum_until_cancelled());
+    wait_until("C++ coroutine destroyed", || ffi::live_cxx_frames() == 0);
+
+    cancel_rust_pending_forever();
+    wait_until("Rust future dropped", || {
+        LIVE_RUST_FUTURES.load(Ordering::SeqCst) == 0
+    });
+}
+
+// Tests deadlines in both directions: whichever side runs out of time is cancelled.
+fn test_deadlines() {
+    let receiver = ffi::cppcoro_sum_until_cancelled();
+    match executor::block_on(timer::with_timeout(receiver, Duration::from_millis(10))) {
+        Ok(_) => panic!("shouldn't have finished!"),
+        Err(elapsed) => println!("{}", elapsed),
+    }
+    wait_until("C++ coroutine destroyed", || ffi::live_cxx_frames() == 0);
+
+    ffi::cppcoro_call_rust_pending_forever_with_deadline();
+    wait_until("Rust future dropped", || {
+        LIVE_RUST_FUTURES.load(Ordering::SeqCst) == 0
+    });
 }
 
 fn test_cppcoro() {
@@ -428,8 +1750,18 @@ fn test_cppcoro() {
     let receiver = ffi::cppcoro_dot_product();
     println!("{}", executor::block_on(receiver).unwrap().unwrap());
 
+    // Test Rust starting C++ async functions itself, and reading their results without a channel.
+    let lazy = ffi::cppcoro_dot_product_lazy();
+    println!("{}", executor::block_on(lazy).unwrap().unwrap());
+    match executor::block_on(ffi::cppcoro_not_product_lazy()).unwrap() {
+        Ok(_) => panic!("shouldn't have succeeded!"),
+        Err(err) => println!("{}", err.what()),
+    }
+
     // Test C++ calling Rust async functions.
     ffi::cppcoro_call_rust_dot_product();
+    ffi::cppcoro_call_rust_dot_product_on_pool();
+    ffi::cppcoro_call_rust_dot_product_on_cppcoro_pool();
 
     // Test exceptions being thrown by C++ async functions.
     let receiver = ffi::cppcoro_not_product();
@@ -441,9 +1773,34 @@ fn test_cppcoro() {
     // Test errors being thrown by Rust async functions.
     ffi::cppcoro_call_rust_not_product();
 
+    // Test C++ polling Rust futures itself instead of awaiting spawned ones.
+    ffi::cppcoro_call_rust_dot_product_inline();
+    ffi::cppcoro_call_rust_not_product_inline();
+
     // Ping-pong test.
-    let receiver = ffi::cppcoro_ping_pong(0);
+    let receiver = ffi::cppcoro_ping_pong(0, 8);
     println!("{}", executor::block_on(receiver).unwrap().unwrap());
+
+    // Test Rust consuming a C++ stream, a batch at a time.
+    let mut chunks = ffi::cppcoro_dot_product_chunks();
+    let sum = executor::block_on(async {
+        let (mut sum, mut batch) = (0.0, vec![]);
+        while let Some(result) = poll_fn(|context| chunks.poll_recv_many(context, &mut batch)).await
+        {
+            result.unwrap();
+            sum += batch.drain(..).sum::<f64>();
+        }
+        sum
+    });
+    println!("{}", sum);
+
+    // Test C++ consuming a Rust stream.
+    ffi::cppcoro_call_rust_dot_product_chunks();
+
+    test_cancellation(
+        ffi::cppcoro_sum_until_cancelled,
+        ffi::cppcoro_cancel_rust_pending_forever,
+    );
 }
 
 fn test_libunifex() {
@@ -464,6 +1821,18 @@ fn test_libunifex() {
 
     // Test errors being thrown by Rust async functions.
     ffi::libunifex_call_rust_not_product();
+
+    // Ping-pong test.
+    let receiver = ffi::libunifex_ping_pong(0, 8);
+    println!("{}", executor::block_on(receiver).unwrap().unwrap());
+
+    // Test C++ consuming a Rust stream.
+    ffi::libunifex_call_rust_dot_product_chunks();
+
+    test_cancellation(
+        ffi::libunifex_sum_until_cancelled,
+        ffi::libunifex_cancel_rust_pending_forever,
+    );
 }
 
 fn test_folly() {
@@ -471,8 +1840,17 @@ fn test_folly() {
     let receiver = ffi::folly_dot_product();
     println!("{}", executor::block_on(receiver).unwrap().unwrap());
 
+    // Test Rust starting C++ async functions itself, and reading their results without a channel.
+    let lazy = ffi::folly_dot_product_lazy();
+    println!("{}", executor::block_on(lazy).unwrap().unwrap());
+    match executor::block_on(ffi::folly_not_product_lazy()).unwrap() {
+        Ok(_) => panic!("shouldn't have succeeded!"),
+        Err(err) => println!("{}", err.what()),
+    }
+
     // Test C++ calling Rust async functions.
     ffi::folly_call_rust_dot_product();
+    ffi::folly_collect_rust_dot_products();
 
     // Test exceptions being thrown by C++ async functions.
     let receiver = ffi::folly_not_product();
@@ -484,13 +1862,147 @@ fn test_folly() {
     // Test errors being thrown by Rust async functions.
     ffi::folly_call_rust_not_product();
 
+    // Test C++ polling Rust futures itself instead of awaiting spawned ones.
+    ffi::folly_call_rust_dot_product_inline();
+    ffi::folly_call_rust_not_product_inline();
+
     // Ping-pong test.
-    let receiver = ffi::folly_ping_pong(0);
+    let receiver = ffi::folly_ping_pong(0, 8);
     println!("{}", executor::block_on(receiver).unwrap().unwrap());
+
+    // Test C++ consuming a Rust stream.
+    ffi::folly_call_rust_dot_product_chunks();
+
+    test_cancellation(
+        ffi::folly_sum_until_cancelled,
+        ffi::folly_cancel_rust_pending_forever,
+    );
+}
+
+// Test moving buffers between Rust and C++. Only ownership crosses the bridge, never the contents.
+fn test_buffers() {
+    // A C++ vector, read in place from Rust.
+    let vector = executor::block_on(ffi::cxx_random_vector_f64(16384))
+        .unwrap()
+        .unwrap();
+    println!("{}", vector.as_slice().iter().sum::<f64>());
+
+    // A Rust vector, read in place from C++.
+    let values: Vec<f64> = (0..16384).map(|i| i as f64).collect();
+    let receiver = ffi::cxx_sum_vec_f64(ready(values));
+    println!("{}", executor::block_on(receiver).unwrap().unwrap());
+
+    // Round trips hand back the very same buffers.
+    let bytes = vec![0u8; 1 << 20];
+    let address = bytes.as_ptr();
+    let bytes = executor::block_on(ffi::cxx_echo_vec_u8(ready(bytes)))
+        .unwrap()
+        .unwrap();
+    assert_eq!(bytes.as_ptr(), address);
+
+    let bytes = ffi::cxx_make_vector_u8(1 << 20);
+    let address = bytes.as_slice().as_ptr();
+    let bytes = executor::block_on(ffi::cxx_echo_vector_u8(ready(bytes)))
+        .unwrap()
+        .unwrap();
+    assert_eq!(bytes.as_slice().as_ptr(), address);
+}
+
+// Many C++ producers on their own pool feed one Rust consumer, which drains in batches.
+fn test_mpsc() {
+    const PRODUCERS: i32 = 8;
+    const ITEMS: i32 = 1000;
+
+    let (sender, mut receiver) = RustMpscReceiverF64::channel(mpsc::DEFAULT_CAPACITY);
+    let consumer = thread::spawn(move || {
+        executor::block_on(async {
+            let (mut sum, mut batch) = (0.0, vec![]);
+            while let Some(_) =
+                poll_fn(|context| receiver.poll_recv_many(context, &mut batch)).await
+            {
+                sum += batch.drain(..).sum::<f64>();
+            }
+            sum
+        })
+    });
+    ffi::cppcoro_produce_mpsc(sender, PRODUCERS, ITEMS);
+
+    let sum = consumer.join().unwrap();
+    assert_eq!(sum, (PRODUCERS * ITEMS * (ITEMS - 1) / 2) as f64);
+    println!("{}", sum);
+}
+
+fn test_pods() {
+    let id = executor::block_on(pod::recv_pod::<u64>(rust_next_id()));
+    let midpoint = pod::recv_pod::<ffi::PodPoint>(ffi::cppcoro_pod_midpoint());
+    let midpoint = executor::block_on(midpoint).unwrap().unwrap();
+    assert_eq!((midpoint.x, midpoint.y), (2.0, 4.0));
+    println!("{} ({}, {})", id.unwrap().unwrap(), midpoint.x, midpoint.y);
+
+    // Each value carries its size and alignment, so unpacking it as a type that differs in
+    // either fails.
+    let wrong = executor::block_on(pod::recv_pod::<u64>(ffi::cppcoro_pod_midpoint()));
+    match wrong {
+        Ok(Err(error)) => assert_eq!(error.code(), ERROR_LAYOUT_MISMATCH),
+        _ => panic!("unpacked a point as a u64"),
+    }
+}
+
+// Awaiting a pending Rust value from C++ allocates nothing: the waker points into the awaiter, and
+// the coroutine frame comes from the frame pool. The first round warms the pool up.
+fn test_waker_allocations() {
+    static AWAITED: AtomicU64 = AtomicU64::new(0);
+    fn done(value: f64) {
+        AWAITED.store(value.to_bits(), Ordering::SeqCst);
+    }
+
+    for round in 0..2 {
+        let (mut sender, receiver) = oneshot::channel::<f64>();
+        let receiver = RustOneshotReceiverF64::from_receiver(receiver);
+        let _counting = bench::CountAllocations::new();
+        let start = bench::allocation_count();
+        ffi::cxx_await_rust_then(receiver, done);
+        assert_eq!(AWAITED.load(Ordering::SeqCst), 0);
+        sender.send(Ok(round as f64 + 1.0));
+        let allocations = bench::allocation_count() - start;
+        assert_eq!(
+            f64::from_bits(AWAITED.swap(0, Ordering::SeqCst)),
+            round as f64 + 1.0
+        );
+        if round > 0 {
+            assert_eq!(allocations, 0, "awaiting a Rust value from C++ allocated");
+        }
+    }
+    println!("C++ awaits of Rust values don't allocate");
 }
 
 fn main() {
+    if std::env::args().nth(1).as_deref() == Some("bench") {
+        let args: Vec<String> = std::env::args().skip(2).collect();
+        bench::run(&args);
+        return;
+    }
+    if std::env::args().nth(1).as_deref() == Some("stress") {
+        stress::run();
+        return;
+    }
+
     test_cppcoro();
     test_libunifex();
     test_folly();
+    test_buffers();
+    test_deadlines();
+    test_mpsc();
+    test_pods();
+    test_waker_allocations();
+
+    // Test a plain C++ thread blocking on Rust, without a coroutine runtime.
+    ffi::cxx_call_rust_dot_product_blocking();
+
+    if cfg!(feature = "counters") {
+        counters::print_snapshot();
+    }
+    if cfg!(feature = "tracing") {
+        trace::write_chrome_trace();
+    }
 }
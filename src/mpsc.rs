@@ -0,0 +1,457 @@
+// cxx-async/src/mpsc.rs
+//
+// A bounded, lock-free multi-producer single-consumer channel, for many C++ coroutines feeding one
+// Rust consumer.
+//
+// Items go through a ring of slots, each with a sequence number that says whose turn it is, as in
+// Dmitry Vyukov's bounded queue: a producer claims a slot by advancing `tail` with a CAS, writes
+// the item, and publishes it by bumping the slot's sequence number. Only the consumer takes items
+// out, so it needs no CAS. It can drain everything published in one go (`drain_into`) and wake
+// whoever is waiting once per batch.
+//
+// A producer that finds the channel full parks its item, along with its waker and somewhere to
+// write the outcome. As the consumer makes room, it moves parked items into the channel itself,
+// oldest first, and only then wakes their producers, so a woken producer never has to try again
+// and nobody starves. Parking and unparking take a lock, but only when the channel is full; the
+// consumer checks `parked_count` first, so the fast paths stay lock-free. Outcomes are written
+// under the lock too, so a producer that gives up waiting (`cancel_send`) either gets its item back
+// or finds out what became of it.
+//
+// Like `oneshot`, the handles are zero-sized and their `Box`es point at the shared channel. Each
+// sender `Box` counts as one sender; the stream ends once every sender is gone. The channel is
+// freed by whichever handle goes away last.
+
+use crate::handle;
+use crate::stream::WakerSlot;
+use crate::{SEND_RESULT_CLOSED, SEND_RESULT_PENDING, SEND_RESULT_READY};
+use futures::Stream;
+use std::cell::UnsafeCell;
+use std::collections::VecDeque;
+use std::marker::PhantomData;
+use std::mem::{self, MaybeUninit};
+use std::pin::Pin;
+use std::ptr;
+use std::sync::atomic::{self, AtomicBool, AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::task::{Context, Poll, Waker};
+
+// Many producers fill a channel faster than one, so this is bigger than a stream's.
+pub const DEFAULT_CAPACITY: usize = 1024;
+
+struct Slot<T> {
+    // `index` when the slot is free for the item at `index`, and `index + 1` once that item is in.
+    sequence: AtomicUsize,
+    value: UnsafeCell<MaybeUninit<T>>,
+}
+
+// Keeps the producers' `tail` and the consumer's `head` off each other's cache lines.
+#[repr(align(128))]
+struct CacheAligned<T>(T);
+
+// An item whose producer is waiting for room. The item still lives with the producer.
+struct Parked<T> {
+    item: *mut T,
+    // Where to write `SEND_RESULT_READY` or `SEND_RESULT_CLOSED` before waking the producer.
+    result: *mut i32,
+    waker: Waker,
+}
+
+unsafe impl<T> Send for Parked<T> where T: Send {}
+
+struct Mpsc<T> {
+    tail: CacheAligned<AtomicUsize>,
+    // Written only by the receiver.
+    head: CacheAligned<AtomicUsize>,
+    mask: usize,
+    slots: Box<[Slot<T>]>,
+    senders: AtomicUsize,
+    // Senders plus the receiver.
+    handles: AtomicUsize,
+    closed: AtomicBool,
+    parked: Mutex<VecDeque<Parked<T>>>,
+    // How many items are parked, so that the consumer needn't take the lock to find out.
+    parked_count: AtomicUsize,
+    receiver_waker: WakerSlot,
+    // Only ever touched by the receiver. Kept around so that waking doesn't allocate.
+    to_wake: UnsafeCell<Vec<Waker>>,
+}
+
+// See `oneshot::Sender` for why these are zero-sized with an `UnsafeCell`.
+pub struct Sender<T> {
+    phantom: PhantomData<T>,
+    _cell: UnsafeCell<()>,
+}
+
+pub struct Receiver<T> {
+    phantom: PhantomData<T>,
+    _cell: UnsafeCell<()>,
+}
+
+const _: () = assert!(mem::size_of::<Sender<()>>() == 0 && mem::size_of::<Receiver<()>>() == 0);
+
+unsafe impl<T> Send for Sender<T> where T: Send {}
+unsafe impl<T> Send for Receiver<T> where T: Send {}
+impl<T> Unpin for Receiver<T> {}
+
+// Creates a channel that buffers up to `capacity` items, rounded up to a power of two, with one
+// sender. Make more with `Sender::clone_sender`.
+pub fn channel<T>(capacity: usize) -> (Box<Sender<T>>, Box<Receiver<T>>) {
+    let capacity = capacity.max(2).next_power_of_two();
+    let slots = (0..capacity)
+        .map(|index| Slot {
+            sequence: AtomicUsize::new(index),
+            value: UnsafeCell::new(MaybeUninit::uninit()),
+        })
+        .collect();
+    let mpsc = handle::expose(Box::into_raw(Box::new(Mpsc::<T> {
+        tail: CacheAligned(AtomicUsize::new(0)),
+        head: CacheAligned(AtomicUsize::new(0)),
+        mask: capacity - 1,
+        slots,
+        senders: AtomicUsize::new(1),
+        handles: AtomicUsize::new(2),
+        closed: AtomicBool::new(false),
+        parked: Mutex::new(VecDeque::new()),
+        parked_count: AtomicUsize::new(0),
+        receiver_waker: WakerSlot::new(),
+        to_wake: UnsafeCell::new(vec![]),
+    })));
+    unsafe {
+        (
+            Box::from_raw(mpsc as *mut Sender<T>),
+            Box::from_raw(mpsc as *mut Receiver<T>),
+        )
+    }
+}
+
+impl<T> Mpsc<T> {
+    // Moves `*value` into the channel if there's room. Returns false, leaving `*value` alone, if
+    // the channel is full.
+    unsafe fn try_push(&self, value: *mut T) -> bool {
+        let mut tail = self.tail.0.load(Ordering::Relaxed);
+        loop {
+            let slot = &self.slots[tail & self.mask];
+            let lag = slot.sequence.load(Ordering::Acquire).wrapping_sub(tail) as isize;
+            if lag == 0 {
+                match self.tail.0.compare_exchange_weak(
+                    tail,
+                    tail.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(_) => {
+                        (*slot.value.get()).as_mut_ptr().write(ptr::read(value));
+                        slot.sequence.store(tail.wrapping_add(1), Ordering::Release);
+                        return true;
+                    }
+                    Err(current) => tail = current,
+                }
+            } else if lag < 0 {
+                // The slot still holds the item from one lap ago.
+                return false;
+            } else {
+                // Another producer claimed the slot first.
+                tail = self.tail.0.load(Ordering::Relaxed);
+            }
+        }
+    }
+
+    // Called by the receiver only.
+    unsafe fn pop(&self) -> Option<T> {
+        let head = self.head.0.load(Ordering::Relaxed);
+        let slot = &self.slots[head & self.mask];
+        if slot.sequence.load(Ordering::Acquire) != head.wrapping_add(1) {
+            return None;
+        }
+        let value = ptr::read((*slot.value.get()).as_ptr());
+        slot.sequence
+            .store(head.wrapping_add(self.mask + 1), Ordering::Release);
+        self.head.0.store(head.wrapping_add(1), Ordering::Relaxed);
+        Some(value)
+    }
+
+    fn is_full(&self) -> bool {
+        let tail = self.tail.0.load(Ordering::Acquire);
+        let sequence = self.slots[tail & self.mask]
+            .sequence
+            .load(Ordering::Acquire);
+        (sequence.wrapping_sub(tail) as isize) < 0
+    }
+
+    // Called by the receiver, after it has made room, to move parked items into the channel and
+    // wake their producers.
+    //
+    // The receiver frees slots and then checks `parked_count`; a producer parks and then checks for
+    // room. A fence in between on each side makes sure that at least one of them notices the other.
+    unsafe fn unpark(&self) {
+        atomic::fence(Ordering::SeqCst);
+        if self.parked_count.load(Ordering::Relaxed) == 0 {
+            return;
+        }
+        let to_wake = &mut *self.to_wake.get();
+        {
+            let mut parked = self.parked.lock().unwrap();
+            while let Some(front) = parked.front() {
+                // Producers on the fast path may have taken the room first.
+                if !self.try_push(front.item) {
+                    break;
+                }
+                let front = parked.pop_front().unwrap();
+                *front.result = SEND_RESULT_READY;
+                to_wake.push(front.waker);
+            }
+            self.parked_count.store(parked.len(), Ordering::Relaxed);
+        }
+        // Outside the lock, since a producer resumed inline may send again right away.
+        for waker in to_wake.drain(..) {
+            waker.wake();
+        }
+    }
+
+    // Fails every send from now on, and wakes every parked producer with `SEND_RESULT_CLOSED`.
+    // Callable from any thread.
+    unsafe fn close(&self) {
+        if self.closed.swap(true, Ordering::AcqRel) {
+            return;
+        }
+        let parked = {
+            let mut parked = self.parked.lock().unwrap();
+            self.parked_count.store(0, Ordering::Relaxed);
+            for parked in parked.iter() {
+                *parked.result = SEND_RESULT_CLOSED;
+            }
+            mem::take(&mut *parked)
+        };
+        for parked in parked {
+            parked.waker.wake();
+        }
+    }
+
+    unsafe fn release(this: *const Mpsc<T>) {
+        if (*this).handles.fetch_sub(1, Ordering::AcqRel) != 1 {
+            return;
+        }
+        // Every sender is gone, so every claimed slot has been published.
+        let mpsc = Box::from_raw(this as *mut Mpsc<T>);
+        while mpsc.pop().is_some() {}
+    }
+}
+
+impl<T> Sender<T> {
+    fn mpsc(&self) -> *const Mpsc<T> {
+        handle::shared(self)
+    }
+
+    // Makes another sender for the same channel, for another producer to use.
+    pub fn clone_sender(&self) -> Box<Sender<T>> {
+        unsafe {
+            let mpsc = self.mpsc();
+            (*mpsc).senders.fetch_add(1, Ordering::Relaxed);
+            (*mpsc).handles.fetch_add(1, Ordering::Relaxed);
+            Box::from_raw(mpsc as *mut Sender<T>)
+        }
+    }
+
+    // Moves `*value` into the channel and returns `SEND_RESULT_READY` if there's room, or returns
+    // `SEND_RESULT_CLOSED` if the receiver has gone away. Otherwise, if `waker` is `None`, returns
+    // `SEND_RESULT_PENDING`, leaving `*value` with the caller.
+    //
+    // With a waker, a full channel parks the item instead and returns `SEND_RESULT_PENDING`. The
+    // receiver then moves `*value` into the channel once there's room, or leaves it if the
+    // receiver goes away first, and writes which it did to `*result` before waking `waker`. Until
+    // then, both have to stay put. The wake may come before this even returns, on another thread,
+    // so the caller mustn't touch either after `SEND_RESULT_PENDING`.
+    pub unsafe fn send(&mut self, value: *mut T, result: *mut i32, waker: Option<&Waker>) -> i32 {
+        let mpsc = self.mpsc();
+        loop {
+            if (*mpsc).closed.load(Ordering::Acquire) {
+                return SEND_RESULT_CLOSED;
+            }
+            if (*mpsc).try_push(value) {
+                (*mpsc).receiver_waker.wake();
+                return SEND_RESULT_READY;
+            }
+            let waker = match waker {
+                None => return SEND_RESULT_PENDING,
+                Some(waker) => waker,
+            };
+
+            {
+                let mut parked = (*mpsc).parked.lock().unwrap();
+                parked.push_back(Parked {
+                    item: value,
+                    result,
+                    waker: waker.clone(),
+                });
+                (*mpsc).parked_count.store(parked.len(), Ordering::Relaxed);
+            }
+            atomic::fence(Ordering::SeqCst);
+            if (*mpsc).is_full() && !(*mpsc).closed.load(Ordering::Acquire) {
+                return SEND_RESULT_PENDING;
+            }
+
+            // Room turned up, or the receiver went away, before the receiver could have seen us
+            // park. Take the item back and try again, unless the receiver has already taken it.
+            let mut parked = (*mpsc).parked.lock().unwrap();
+            match parked.iter().position(|parked| parked.item == value) {
+                Some(index) => {
+                    parked.remove(index);
+                    (*mpsc).parked_count.store(parked.len(), Ordering::Relaxed);
+                }
+                None => return SEND_RESULT_PENDING,
+            }
+        }
+    }
+
+    // For a producer that's going away while `send` has `*value` parked, such as a C++ coroutine
+    // destroyed mid-await. Takes the item back and returns `SEND_RESULT_PENDING`, leaving `*value`
+    // with the caller, unless the receiver has already let it in or closed the channel, in which
+    // case returns what the receiver wrote to `*result`. The receiver is then about to wake the
+    // producer, if it hasn't already.
+    pub unsafe fn cancel_send(&mut self, value: *mut T, result: *mut i32) -> i32 {
+        let mpsc = self.mpsc();
+        let mut parked = (*mpsc).parked.lock().unwrap();
+        match parked.iter().position(|parked| parked.item == value) {
+            Some(index) => {
+                parked.remove(index);
+                (*mpsc).parked_count.store(parked.len(), Ordering::Relaxed);
+                SEND_RESULT_PENDING
+            }
+            None => *result,
+        }
+    }
+
+    // Moves `value` into the channel if there's room, without waiting.
+    pub fn try_send(&mut self, value: T) -> Result<(), T> {
+        let mut value = MaybeUninit::new(value);
+        unsafe {
+            match self.send(value.as_mut_ptr(), ptr::null_mut(), None) {
+                SEND_RESULT_READY => Ok(()),
+                _ => Err(value.assume_init()),
+            }
+        }
+    }
+}
+
+impl<T> Drop for Sender<T> {
+    fn drop(&mut self) {
+        let mpsc = self.mpsc();
+        unsafe {
+            if (*mpsc).senders.fetch_sub(1, Ordering::AcqRel) == 1 {
+                // The last sender is gone, so the stream is over once it's drained.
+                (*mpsc).receiver_waker.wake();
+            }
+            Mpsc::release(mpsc);
+        }
+    }
+}
+
+impl<T> Receiver<T> {
+    fn mpsc(&self) -> *const Mpsc<T> {
+        handle::shared(self)
+    }
+
+    // Fails every send from now on. Items already sent can still be received. Unlike the other
+    // methods, this may be called from any thread while the receiver is alive.
+    pub fn close(&self) {
+        unsafe { (*self.mpsc()).close() }
+    }
+
+    pub fn try_recv(&mut self) -> Option<T> {
+        unsafe {
+            let mpsc = self.mpsc();
+            let value = (*mpsc).pop()?;
+            (*mpsc).unpark();
+            Some(value)
+        }
+    }
+
+    // Moves every item that's ready into `items`, then lets in the items of parked producers
+    // that fit in the room that made, waking those producers once, and takes those too. Returns
+    // the number of items moved, which is at most twice the capacity, so that busy producers
+    // can't keep the receiver here forever.
+    pub fn drain_into(&mut self, items: &mut Vec<T>) -> usize {
+        unsafe {
+            let mpsc = self.mpsc();
+            let start = items.len();
+            for _ in 0..2 {
+                let batch_start = items.len();
+                while items.len() - batch_start <= (*mpsc).mask {
+                    match (*mpsc).pop() {
+                        Some(value) => items.push(value),
+                        None => break,
+                    }
+                }
+                if items.len() == batch_start {
+                    break;
+                }
+                (*mpsc).unpark();
+            }
+            items.len() - start
+        }
+    }
+
+    // Returns the next item if there is one, or `None` once every sender is gone and every item
+    // has been received. Otherwise arranges for the context's waker to be woken once either
+    // happens.
+    pub fn poll_recv(&mut self, context: &mut Context) -> Poll<Option<T>> {
+        unsafe {
+            let mpsc = self.mpsc();
+            loop {
+                if let Some(value) = self.try_recv() {
+                    return Poll::Ready(Some(value));
+                }
+                // Senders publish their items before they go.
+                if (*mpsc).senders.load(Ordering::Acquire) == 0 {
+                    return Poll::Ready(self.try_recv());
+                }
+                (*mpsc).receiver_waker.register(context.waker());
+                let head = (*mpsc).head.0.load(Ordering::Relaxed);
+                let slot = &(*mpsc).slots[head & (*mpsc).mask];
+                if slot.sequence.load(Ordering::Acquire) != head.wrapping_add(1)
+                    && (*mpsc).senders.load(Ordering::Acquire) != 0
+                {
+                    return Poll::Pending;
+                }
+                if !(*mpsc).receiver_waker.unregister() {
+                    // A sender is already on its way to wake us.
+                    return Poll::Pending;
+                }
+            }
+        }
+    }
+
+    // Like `poll_recv`, but moves every ready item into `items` at once.
+    pub fn poll_recv_many(
+        &mut self,
+        context: &mut Context,
+        items: &mut Vec<T>,
+    ) -> Poll<Option<usize>> {
+        match self.poll_recv(context) {
+            Poll::Ready(Some(value)) => {
+                items.push(value);
+                Poll::Ready(Some(1 + self.drain_into(items)))
+            }
+            Poll::Ready(None) => Poll::Ready(None),
+            Poll::Pending => Poll::Pending,
+        }
+    }
+}
+
+impl<T> Stream for Receiver<T> {
+    type Item = T;
+    fn poll_next(self: Pin<&mut Self>, context: &mut Context) -> Poll<Option<T>> {
+        self.get_mut().poll_recv(context)
+    }
+}
+
+impl<T> Drop for Receiver<T> {
+    fn drop(&mut self) {
+        let mpsc = self.mpsc();
+        unsafe {
+            (*mpsc).close();
+            (*mpsc).receiver_waker.unregister();
+            Mpsc::release(mpsc);
+        }
+    }
+}
@@ -0,0 +1,430 @@
+// cxx-async/src/oneshot.rs
+//
+// A single-allocation, lock-free oneshot channel.
+//
+// The state word, the value slot, and the receiver's waker all live in one heap allocation. The
+// sender and receiver handles are zero-sized, and their `Box`es point straight at that allocation,
+// so a channel costs exactly one allocation. Because the handles are zero-sized, dropping their
+// `Box`es never frees anything; instead each side sets a "gone" bit in the state word, and whoever
+// sets the second one frees the allocation.
+//
+// Atomic read-modify-writes per round trip: one to complete the channel, one to release each side,
+// plus one to register a waker if the receiver had to wait. With the `counters` feature, each one is
+// counted (see `counters::count_atomic`), for the benchmarks to check.
+//
+// The receiver can also ask the sender to stop working on the value (`request_cancel`, and
+// implicitly by being dropped early); the sender finds out through `poll_canceled`.
+//
+// When tracing, each channel also carries the span that trace.rs files its events under.
+
+use crate::counters;
+use crate::handle;
+use crate::trace::{self, Event};
+use crate::CxxAsyncException;
+use futures::channel::oneshot::Canceled;
+use std::cell::UnsafeCell;
+use std::future::Future;
+use std::marker::PhantomData;
+use std::mem::{self, MaybeUninit};
+use std::pin::Pin;
+use std::ptr;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::task::{Context, Poll, Waker};
+
+pub type OneshotResult<T> = Result<Result<T, CxxAsyncException>, Canceled>;
+
+// The low two bits of the state word record what the sender did. Only the sender ever moves them
+// out of `STATUS_PENDING`.
+const STATUS_MASK: usize = 0b11;
+const STATUS_PENDING: usize = 0;
+const STATUS_READY: usize = 1;
+const STATUS_ERROR: usize = 2;
+const STATUS_CANCELLED: usize = 3;
+
+// Set by the receiver once `waker` holds a waker. While the status is pending, the receiver owns
+// the waker and may unregister it; once the sender completes the channel with this bit set, the
+// sender owns it and wakes it.
+const WAKER_REGISTERED: usize = 1 << 2;
+const SENDER_GONE: usize = 1 << 3;
+const RECEIVER_GONE: usize = 1 << 4;
+// Set by the receiver when it no longer wants the value.
+const CANCEL_REQUESTED: usize = 1 << 5;
+// Set by the sender once `sender_waker` holds a waker to be woken on cancellation. Whoever clears
+// it owns the waker: the receiver clears it in the same operation that sets `CANCEL_REQUESTED`.
+const SENDER_WAKER_REGISTERED: usize = 1 << 6;
+
+struct Oneshot<T> {
+    state: AtomicUsize,
+    // Only ever touched by the receiver.
+    taken: UnsafeCell<bool>,
+    waker: UnsafeCell<MaybeUninit<Waker>>,
+    sender_waker: UnsafeCell<MaybeUninit<Waker>>,
+    value: UnsafeCell<MaybeUninit<Result<T, CxxAsyncException>>>,
+    #[cfg(feature = "tracing")]
+    span: u64,
+}
+
+// The handles are only ever reached through the `Box`es that `channel()` hands out, whose
+// addresses are the address of the shared `Oneshot`. The `UnsafeCell` keeps references to them
+// from being treated as pointing to immutable memory.
+pub struct Sender<T> {
+    phantom: PhantomData<T>,
+    _cell: UnsafeCell<()>,
+}
+
+pub struct Receiver<T> {
+    phantom: PhantomData<T>,
+    _cell: UnsafeCell<()>,
+}
+
+const _: () = assert!(mem::size_of::<Sender<()>>() == 0 && mem::size_of::<Receiver<()>>() == 0);
+
+unsafe impl<T> Send for Sender<T> where T: Send {}
+unsafe impl<T> Send for Receiver<T> where T: Send {}
+impl<T> Unpin for Receiver<T> {}
+
+pub fn channel<T>() -> (Box<Sender<T>>, Box<Receiver<T>>) {
+    let oneshot = handle::expose(Box::into_raw(Box::new(Oneshot::<T> {
+        state: AtomicUsize::new(STATUS_PENDING),
+        taken: UnsafeCell::new(false),
+        waker: UnsafeCell::new(MaybeUninit::uninit()),
+        sender_waker: UnsafeCell::new(MaybeUninit::uninit()),
+        value: UnsafeCell::new(MaybeUninit::uninit()),
+        #[cfg(feature = "tracing")]
+        span: trace::new_span(),
+    })));
+    unsafe {
+        trace::record(Event::Created, (*oneshot).span(), trace::current());
+    }
+    unsafe {
+        (
+            Box::from_raw(oneshot as *mut Sender<T>),
+            Box::from_raw(oneshot as *mut Receiver<T>),
+        )
+    }
+}
+
+impl<T> Oneshot<T> {
+    #[cfg(feature = "tracing")]
+    fn span(&self) -> u64 {
+        self.span
+    }
+
+    #[cfg(not(feature = "tracing"))]
+    fn span(&self) -> u64 {
+        0
+    }
+
+    // Moves the status out of pending. Returns the receiver's waker if it's waiting, for the caller
+    // to wake. The value slot must already be initialized unless `status` is `STATUS_CANCELLED`.
+    unsafe fn complete(&self, status: usize) -> Option<Waker> {
+        trace::record(Event::Completed, self.span(), 0);
+        counters::count_atomic();
+        let prev = self.state.fetch_or(status, Ordering::AcqRel);
+        debug_assert_eq!(prev & STATUS_MASK, STATUS_PENDING);
+        if prev & RECEIVER_GONE != 0 {
+            // Nobody will ever read the value, so drop it here.
+            if status != STATUS_CANCELLED {
+                ptr::drop_in_place((*self.value.get()).as_mut_ptr());
+            }
+            None
+        } else if prev & WAKER_REGISTERED != 0 {
+            trace::record(Event::Woken, self.span(), 0);
+            Some(ptr::read((*self.waker.get()).as_ptr()))
+        } else {
+            None
+        }
+    }
+
+    // Applies `f` to the state word as long as the channel hasn't been completed. On failure,
+    // returns the completed state.
+    fn update_if_pending<F>(&self, f: F) -> Result<usize, usize>
+    where
+        F: Fn(usize) -> usize,
+    {
+        self.state
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |state| {
+                if state & STATUS_MASK == STATUS_PENDING {
+                    counters::count_atomic();
+                    Some(f(state))
+                } else {
+                    None
+                }
+            })
+    }
+
+    // Returns true if the sender's waker was still registered, in which case it's dropped; false
+    // means that the receiver has taken it.
+    unsafe fn unregister_sender_waker(&self) -> bool {
+        let unregistered = self
+            .state
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |state| {
+                if state & SENDER_WAKER_REGISTERED != 0 {
+                    counters::count_atomic();
+                    Some(state & !SENDER_WAKER_REGISTERED)
+                } else {
+                    None
+                }
+            })
+            .is_ok();
+        if unregistered {
+            ptr::drop_in_place((*self.sender_waker.get()).as_mut_ptr());
+        }
+        unregistered
+    }
+
+    unsafe fn request_cancel(&self) {
+        let prev = self
+            .state
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |state| {
+                if state & CANCEL_REQUESTED != 0 {
+                    None
+                } else {
+                    counters::count_atomic();
+                    Some((state | CANCEL_REQUESTED) & !SENDER_WAKER_REGISTERED)
+                }
+            });
+        if let Ok(prev) = prev {
+            if prev & SENDER_WAKER_REGISTERED != 0 {
+                ptr::read((*self.sender_waker.get()).as_ptr()).wake();
+            }
+        }
+    }
+
+    // Called after one side has set its "gone" bit. Frees the allocation if, as of `prev`, the
+    // other side was already gone. By then the value and waker have been consumed.
+    unsafe fn release(this: *const Oneshot<T>, prev: usize, other_gone: usize) {
+        if prev & other_gone != 0 {
+            drop(Box::from_raw(this as *mut Oneshot<T>));
+        }
+    }
+}
+
+impl<T> Sender<T> {
+    fn oneshot(&self) -> *const Oneshot<T> {
+        handle::shared(self)
+    }
+
+    // The channel's trace span, or zero when not tracing.
+    pub fn span(&self) -> u64 {
+        unsafe { (*self.oneshot()).span() }
+    }
+
+    pub fn send(&mut self, value: Result<T, CxxAsyncException>) {
+        if let Some(waker) = self.send_without_waking(value) {
+            waker.wake();
+        }
+    }
+
+    // Like `send`, but hands the receiver's waker, if it's waiting, back to the caller to wake.
+    pub fn send_without_waking(&mut self, value: Result<T, CxxAsyncException>) -> Option<Waker> {
+        let oneshot = self.oneshot();
+        let status = if value.is_ok() {
+            STATUS_READY
+        } else {
+            STATUS_ERROR
+        };
+        unsafe {
+            debug_assert_eq!(
+                (*oneshot).state.load(Ordering::Relaxed) & STATUS_MASK,
+                STATUS_PENDING
+            );
+            (*(*oneshot).value.get()).as_mut_ptr().write(value);
+            (*oneshot).complete(status)
+        }
+    }
+
+    // Resolves once the receiver has gone away or asked for the work to be cancelled.
+    pub fn poll_canceled(&mut self, context: &mut Context) -> Poll<()> {
+        unsafe {
+            let oneshot = self.oneshot();
+            let state = (*oneshot).state.load(Ordering::Acquire);
+            if state & CANCEL_REQUESTED != 0 {
+                return Poll::Ready(());
+            }
+
+            if state & SENDER_WAKER_REGISTERED != 0 {
+                if (*(*(*oneshot).sender_waker.get()).as_ptr()).will_wake(context.waker()) {
+                    return Poll::Pending;
+                }
+                if !(*oneshot).unregister_sender_waker() {
+                    return Poll::Ready(());
+                }
+            }
+
+            (*(*oneshot).sender_waker.get())
+                .as_mut_ptr()
+                .write(context.waker().clone());
+            match (*oneshot)
+                .state
+                .fetch_update(Ordering::AcqRel, Ordering::Acquire, |state| {
+                    if state & CANCEL_REQUESTED != 0 {
+                        None
+                    } else {
+                        counters::count_atomic();
+                        Some(state | SENDER_WAKER_REGISTERED)
+                    }
+                }) {
+                Ok(_) => Poll::Pending,
+                Err(_) => {
+                    ptr::drop_in_place((*(*oneshot).sender_waker.get()).as_mut_ptr());
+                    Poll::Ready(())
+                }
+            }
+        }
+    }
+}
+
+impl<T> Drop for Sender<T> {
+    fn drop(&mut self) {
+        let oneshot = self.oneshot();
+        unsafe {
+            // Only we move the status out of pending, so this check can't race.
+            let state = (*oneshot).state.load(Ordering::Relaxed);
+            if state & STATUS_MASK == STATUS_PENDING {
+                if let Some(waker) = (*oneshot).complete(STATUS_CANCELLED) {
+                    waker.wake();
+                }
+            }
+            // Only we set this bit, so if it's clear now it stays clear.
+            if state & SENDER_WAKER_REGISTERED != 0 {
+                (*oneshot).unregister_sender_waker();
+            }
+            counters::count_atomic();
+            let prev = (*oneshot).state.fetch_or(SENDER_GONE, Ordering::AcqRel);
+            Oneshot::release(oneshot, prev, RECEIVER_GONE);
+        }
+    }
+}
+
+impl<T> Receiver<T> {
+    fn oneshot(&self) -> *const Oneshot<T> {
+        handle::shared(self)
+    }
+
+    // Asks the sender to stop working on the value; the receiver then most likely gets `Canceled`.
+    // Unlike the other methods, this may be called from any thread while the receiver is alive.
+    pub fn request_cancel(&self) {
+        unsafe { (*self.oneshot()).request_cancel() }
+    }
+
+    pub fn span(&self) -> u64 {
+        unsafe { (*self.oneshot()).span() }
+    }
+
+    unsafe fn take(&mut self, state: usize) -> OneshotResult<T> {
+        let oneshot = self.oneshot();
+        match state & STATUS_MASK {
+            STATUS_CANCELLED => Err(Canceled),
+            _ => {
+                assert!(!*(*oneshot).taken.get(), "oneshot polled after completion");
+                *(*oneshot).taken.get() = true;
+                Ok(ptr::read((*(*oneshot).value.get()).as_ptr()))
+            }
+        }
+    }
+
+    // Returns the result if the sender has completed the channel, without registering a waker.
+    pub fn try_recv(&mut self) -> Option<OneshotResult<T>> {
+        unsafe {
+            let state = (*self.oneshot()).state.load(Ordering::Acquire);
+            if state & STATUS_MASK == STATUS_PENDING {
+                return None;
+            }
+            Some(self.take(state))
+        }
+    }
+
+    // Returns the result if the sender has completed the channel; otherwise arranges for the
+    // context's waker to be woken once it does.
+    //
+    // When this returns `Poll::Pending`, the registration was the last thing it touched, so the
+    // sender is free to wake the waker (and the waiter is free to drop the receiver) immediately.
+    pub fn poll_recv(&mut self, context: &mut Context) -> Poll<OneshotResult<T>> {
+        unsafe {
+            let oneshot = self.oneshot();
+            let state = (*oneshot).state.load(Ordering::Acquire);
+            if state & STATUS_MASK != STATUS_PENDING {
+                return Poll::Ready(self.take(state));
+            }
+
+            // Other bits can change under us, so these updates only fail if the sender has
+            // completed the channel.
+            if state & WAKER_REGISTERED != 0 {
+                if (*(*(*oneshot).waker.get()).as_ptr()).will_wake(context.waker()) {
+                    return Poll::Pending;
+                }
+                // Unregister the old waker so that we can replace it. If the sender completed the
+                // channel first, it has taken the old waker.
+                if let Err(state) = (*oneshot).update_if_pending(|state| state & !WAKER_REGISTERED)
+                {
+                    return Poll::Ready(self.take(state));
+                }
+                ptr::drop_in_place((*(*oneshot).waker.get()).as_mut_ptr());
+            }
+
+            (*(*oneshot).waker.get())
+                .as_mut_ptr()
+                .write(context.waker().clone());
+            match (*oneshot).update_if_pending(|state| state | WAKER_REGISTERED) {
+                Ok(_) => Poll::Pending,
+                Err(state) => {
+                    ptr::drop_in_place((*(*oneshot).waker.get()).as_mut_ptr());
+                    Poll::Ready(self.take(state))
+                }
+            }
+        }
+    }
+}
+
+impl<T> Future for Receiver<T> {
+    type Output = OneshotResult<T>;
+    fn poll(self: Pin<&mut Self>, context: &mut Context) -> Poll<Self::Output> {
+        let this = self.get_mut();
+        let result = this.poll_recv(context);
+        if result.is_pending() {
+            trace::note_awaiting(this.span());
+        }
+        result
+    }
+}
+
+impl<T> Drop for Receiver<T> {
+    fn drop(&mut self) {
+        let oneshot = self.oneshot();
+        unsafe {
+            // If nobody's going to see the value, tell the sender not to bother.
+            if (*oneshot).state.load(Ordering::Relaxed) & STATUS_MASK == STATUS_PENDING {
+                (*oneshot).request_cancel();
+            }
+
+            // If the sender hasn't completed yet, take back our waker along with announcing that
+            // we're gone, so that the sender never sees both.
+            let prev = (*oneshot)
+                .state
+                .fetch_update(Ordering::AcqRel, Ordering::Acquire, |state| {
+                    counters::count_atomic();
+                    Some(if state & STATUS_MASK == STATUS_PENDING {
+                        (state | RECEIVER_GONE) & !WAKER_REGISTERED
+                    } else {
+                        state | RECEIVER_GONE
+                    })
+                })
+                .unwrap();
+            match prev & STATUS_MASK {
+                STATUS_PENDING => {
+                    if prev & WAKER_REGISTERED != 0 {
+                        ptr::drop_in_place((*(*oneshot).waker.get()).as_mut_ptr());
+                    }
+                }
+                STATUS_READY | STATUS_ERROR => {
+                    if !*(*oneshot).taken.get() {
+                        ptr::drop_in_place((*(*oneshot).value.get()).as_mut_ptr());
+                    }
+                }
+                _ => {}
+            }
+            Oneshot::release(oneshot, prev, SENDER_GONE);
+        }
+    }
+}
@@ -0,0 +1,94 @@
+// cxx-async/src/pod.rs
+//
+// Channels for small `Copy` values of any type, without a `define_oneshot!` and a bridge block for
+// each. Every such type, a pod, crosses through the one `RustOneshotReceiverPod` channel, packed
+// into a `RustPodValue`: two words that the channel stores inline, plus the layout of the type
+// that was packed. Packing and unpacking copy those two words whatever the type, which compiles to
+// a couple of register moves rather than a copy of however many bytes through pointers.
+//
+// `define_pod!` in main.rs makes a type a pod, checking at compile time that it fits: at most 16
+// bytes, aligned to at most 8. C++ needs no declaration at all, since `rust_pod_pack` and
+// `rust_pod_unpack` in cxx_async.h check the same limits with `static_assert`. For shared structs,
+// both sides can also check at compile time that the fields leave no padding (`define_pod!`'s
+// `struct` form, and `rust_pod_is_packed`), so that they agree on the layout. Each value carries
+// the size and alignment of the type that it was packed from, and unpacking it as a type with a
+// different size or alignment fails with `ERROR_LAYOUT_MISMATCH`. That's all it catches: a type of
+// the same size and alignment, such as an `f64` unpacked as a `u64`, just reinterprets the bits.
+//
+// Rust hands a pod future to C++ with `via_pod`, and awaits a pod receiver from C++ with
+// `recv_pod`.
+
+use crate::ffi::RustPodValue;
+use crate::oneshot::OneshotResult;
+use crate::{CxxAsync, CxxAsyncException, RustOneshotReceiverPod, ERROR_LAYOUT_MISMATCH};
+use futures::task::Spawn;
+use futures::FutureExt;
+use std::future::Future;
+use std::mem;
+use std::ptr;
+
+// Implemented by `define_pod!`, which checks that the type fits.
+//
+// Safety: the type must have no padding bytes, since `pack` reads all of its bytes as words, and
+// its layout must be the same in C++.
+pub unsafe trait CxxPod: Copy + Send + 'static {
+    // Keep in sync with `rust_pod_layout` in cxx_async.h.
+    const LAYOUT: u32 = (mem::size_of::<Self>() | mem::align_of::<Self>() << 16) as u32;
+}
+
+pub fn pack<T>(value: T) -> RustPodValue
+where
+    T: CxxPod,
+{
+    let mut words = [0u64; 2];
+    unsafe {
+        ptr::write(words.as_mut_ptr() as *mut T, value);
+    }
+    RustPodValue {
+        lo: words[0],
+        hi: words[1],
+        layout: T::LAYOUT,
+    }
+}
+
+pub fn unpack<T>(value: RustPodValue) -> Result<T, CxxAsyncException>
+where
+    T: CxxPod,
+{
+    if value.layout != T::LAYOUT {
+        return Err(CxxAsyncException::with_code(
+            ERROR_LAYOUT_MISMATCH,
+            "Pod layout mismatch",
+        ));
+    }
+    let words = [value.lo, value.hi];
+    Ok(unsafe { ptr::read(words.as_ptr() as *const T) })
+}
+
+pub trait CxxAsyncPod {
+    // Like `CxxAsync::via`, for a future whose output is a pod.
+    fn via_pod<Exec>(self, executor: &Exec) -> Box<RustOneshotReceiverPod>
+    where
+        Exec: Spawn;
+}
+
+impl<T, Fut> CxxAsyncPod for Fut
+where
+    T: CxxPod,
+    Fut: Future<Output = Result<T, CxxAsyncException>> + Send + 'static,
+{
+    fn via_pod<Exec>(self, executor: &Exec) -> Box<RustOneshotReceiverPod>
+    where
+        Exec: Spawn,
+    {
+        self.map(|result| result.map(pack)).via(executor)
+    }
+}
+
+// Awaits a pod receiver, unpacking its value as a `T`.
+pub fn recv_pod<T>(receiver: Box<RustOneshotReceiverPod>) -> impl Future<Output = OneshotResult<T>>
+where
+    T: CxxPod,
+{
+    receiver.map(|result| result.map(|result| result.and_then(unpack)))
+}
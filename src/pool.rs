@@ -0,0 +1,471 @@
+// cxx-async/src/pool.rs
+//
+// A work-stealing thread pool that Rust and every C++ runtime can share, so that a process runs one
+// set of workers instead of one per runtime. Rust spawns onto it through `Spawn`, like any other
+// executor. C++ queues `RustPoolJob`s onto it (see cxx_async.h), which is how the schedulers and
+// executors in the cxx_async_*.h headers run cppcoro, libunifex and folly work here.
+//
+// Jobs run in order of `Priority`: `Pool::at` gives a spawner for each, and C++ passes one to
+// `rust_pool_submit`. So that a flood of urgent jobs can't starve the rest, every
+// `NORMAL_TURN`th time a worker looks for a job it looks at `Normal` first, and every
+// `LOW_TURN`th time at `Low`.
+//
+// The other way around, `CxxSpawner` spawns Rust futures onto a C++ `RustTaskExecutor`, so that
+// `CxxAsync::via` can target a C++ pool.
+//
+// `PoolConfig::from_env` sizes and pins a pool from the environment:
+//
+//     CXX_ASYNC_THREADS=N          Workers (default: one per CPU).
+//     CXX_ASYNC_PIN_CORES=0-3,8    Pins the Nth worker to the Nth listed core, where the platform
+//                                  allows it. Workers past the end of the list aren't pinned.
+
+use crate::ffi;
+use futures::task::{waker_ref, ArcWake, FutureObj, Spawn, SpawnError};
+use std::cell::{Cell, UnsafeCell};
+use std::collections::VecDeque;
+use std::env;
+use std::future::Future;
+use std::pin::Pin;
+use std::ptr;
+use std::sync::atomic::{self, AtomicBool, AtomicU8, AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::task::Context;
+use std::thread::{self, JoinHandle};
+
+// Keep in sync with `RustPriority` in cxx_async.h.
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(u8)]
+pub enum Priority {
+    High = 0,
+    Normal = 1,
+    Low = 2,
+}
+
+const PRIORITIES: usize = 3;
+const NORMAL_TURN: u32 = 4;
+const LOW_TURN: u32 = 16;
+
+impl Priority {
+    pub fn from_cxx(priority: u8) -> Priority {
+        match priority {
+            0 => Priority::High,
+            1 => Priority::Normal,
+            _ => Priority::Low,
+        }
+    }
+}
+
+pub struct PoolConfig {
+    pub threads: usize,
+    pub cores: Vec<usize>,
+}
+
+impl PoolConfig {
+    pub fn from_env() -> PoolConfig {
+        let threads = env::var("CXX_ASYNC_THREADS")
+            .ok()
+            .and_then(|threads| threads.parse().ok())
+            .filter(|&threads| threads > 0)
+            .unwrap_or_else(|| thread::available_parallelism().map_or(1, |threads| threads.get()));
+        // This runs when the pool first starts, from whatever first awaits something, so a typo
+        // shouldn't take the process down. Run unpinned instead.
+        let cores = env::var("CXX_ASYNC_PIN_CORES")
+            .ok()
+            .and_then(|cores| {
+                let parsed = parse_cores(&cores);
+                if parsed.is_none() {
+                    eprintln!(
+                        "cxx-async: ignoring bad CXX_ASYNC_PIN_CORES {:?}; not pinning workers",
+                        cores
+                    );
+                }
+                parsed
+            })
+            .unwrap_or_default();
+        PoolConfig { threads, cores }
+    }
+}
+
+// Parses a list of cores like `0-3,8`, or returns `None` if it's malformed.
+fn parse_cores(list: &str) -> Option<Vec<usize>> {
+    let mut cores = vec![];
+    for range in list
+        .split(',')
+        .map(str::trim)
+        .filter(|range| !range.is_empty())
+    {
+        let mut ends = range.splitn(2, '-').map(|end| end.trim().parse::<usize>());
+        match (ends.next(), ends.next()) {
+            (Some(Ok(core)), None) => cores.push(core),
+            (Some(Ok(first)), Some(Ok(last))) => cores.extend(first..=last),
+            _ => return None,
+        }
+    }
+    Some(cores)
+}
+
+// Something queued on a pool.
+enum Job {
+    Rust(Arc<Task>),
+    // The address of a C++ `RustPoolJob`.
+    Cxx(CxxJob),
+}
+
+struct CxxJob(*mut u8);
+
+unsafe impl Send for CxxJob {}
+
+impl Job {
+    fn run(self) {
+        match self {
+            Job::Rust(task) => task.run(),
+            Job::Cxx(CxxJob(job)) => unsafe { ffi::rust_run_cxx_pool_job(job) },
+        }
+    }
+}
+
+// A queue of jobs for each priority.
+struct Queues([VecDeque<Job>; PRIORITIES]);
+
+impl Queues {
+    fn new() -> Queues {
+        Queues([VecDeque::new(), VecDeque::new(), VecDeque::new()])
+    }
+}
+
+struct Shared {
+    // Jobs queued from threads outside the pool.
+    injector: Mutex<Queues>,
+    // Each worker's own jobs. A worker takes the newest of its own, which are likeliest to be warm
+    // in its cache, and steals the oldest of everyone else's.
+    locals: Vec<Mutex<Queues>>,
+    // How many jobs of each priority are queued anywhere, so that finding one can skip the
+    // priorities that have none without taking every lock.
+    queued: [AtomicUsize; PRIORITIES],
+    sleepers: AtomicUsize,
+    sleep_lock: Mutex<()>,
+    wakeup: Condvar,
+    shutdown: AtomicBool,
+}
+
+thread_local! {
+    // The pool that this thread is a worker of, if any, and which worker.
+    static WORKER: Cell<(*const Shared, usize)> = Cell::new((ptr::null(), 0));
+    // How many times this worker has looked for a job.
+    static TURN: Cell<u32> = Cell::new(0);
+}
+
+impl Shared {
+    fn push(&self, job: Job, priority: Priority) {
+        let level = priority as usize;
+        let (pool, index) = WORKER.with(Cell::get);
+        let queues = if ptr::eq(pool, self) {
+            &self.locals[index]
+        } else {
+            &self.injector
+        };
+        {
+            let mut queues = queues.lock().unwrap();
+            queues.0[level].push_back(job);
+            self.queued[level].fetch_add(1, Ordering::Relaxed);
+        }
+
+        // Pairs with the fence in `sleep`: either we see the sleeper or it sees the job.
+        atomic::fence(Ordering::SeqCst);
+        if self.sleepers.load(Ordering::Relaxed) > 0 {
+            let _guard = self.sleep_lock.lock().unwrap();
+            self.wakeup.notify_one();
+        }
+    }
+
+    fn find(&self, index: usize) -> Option<Job> {
+        let turn = TURN.with(|turn| {
+            let next = turn.get().wrapping_add(1);
+            turn.set(next);
+            next
+        });
+        let first = if turn % LOW_TURN == 0 {
+            Priority::Low
+        } else if turn % NORMAL_TURN == 0 {
+            Priority::Normal
+        } else {
+            Priority::High
+        } as usize;
+        (first..PRIORITIES)
+            .chain(0..first)
+            .find_map(|level| self.find_at(index, level))
+    }
+
+    fn find_at(&self, index: usize, level: usize) -> Option<Job> {
+        if self.queued[level].load(Ordering::Relaxed) == 0 {
+            return None;
+        }
+        let take = |queues: &Mutex<Queues>, newest: bool| {
+            let mut queues = queues.lock().unwrap();
+            let queue = &mut queues.0[level];
+            let job = if newest {
+                queue.pop_back()
+            } else {
+                queue.pop_front()
+            };
+            if job.is_some() {
+                self.queued[level].fetch_sub(1, Ordering::Relaxed);
+            }
+            job
+        };
+        if let Some(job) = take(&self.locals[index], true) {
+            return Some(job);
+        }
+        if let Some(job) = take(&self.injector, false) {
+            return Some(job);
+        }
+        let count = self.locals.len();
+        (1..count)
+            .map(|offset| (index + offset) % count)
+            .find_map(|victim| take(&self.locals[victim], false))
+    }
+
+    fn has_work(&self) -> bool {
+        self.queued
+            .iter()
+            .any(|queued| queued.load(Ordering::Relaxed) > 0)
+    }
+
+    fn sleep(&self) {
+        let guard = self.sleep_lock.lock().unwrap();
+        self.sleepers.fetch_add(1, Ordering::Relaxed);
+        atomic::fence(Ordering::SeqCst);
+        if !self.has_work() && !self.shutdown.load(Ordering::Relaxed) {
+            drop(self.wakeup.wait(guard).unwrap());
+        }
+        self.sleepers.fetch_sub(1, Ordering::Relaxed);
+    }
+
+    fn work(&self, index: usize) {
+        WORKER.with(|worker| worker.set((self, index)));
+        while !self.shutdown.load(Ordering::Acquire) {
+            match self.find(index) {
+                Some(job) => job.run(),
+                None => self.sleep(),
+            }
+        }
+    }
+}
+
+pub struct Pool {
+    shared: Arc<Shared>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl Pool {
+    pub fn new(config: PoolConfig) -> Pool {
+        let shared = Arc::new(Shared {
+            injector: Mutex::new(Queues::new()),
+            locals: (0..config.threads)
+                .map(|_| Mutex::new(Queues::new()))
+                .collect(),
+            queued: [
+                AtomicUsize::new(0),
+                AtomicUsize::new(0),
+                AtomicUsize::new(0),
+            ],
+            sleepers: AtomicUsize::new(0),
+            sleep_lock: Mutex::new(()),
+            wakeup: Condvar::new(),
+            shutdown: AtomicBool::new(false),
+        });
+        let workers = (0..config.threads)
+            .map(|index| {
+                let shared = shared.clone();
+                let core = config.cores.get(index).copied();
+                thread::Builder::new()
+                    .name(format!("cxx-async-{}", index))
+                    .spawn(move || {
+                        if let Some(core) = core {
+                            if !ffi::rust_pin_thread_to_core(core) {
+                                eprintln!(
+                                    "cxx-async: couldn't pin worker {} to core {}",
+                                    index, core
+                                );
+                            }
+                        }
+                        shared.work(index);
+                    })
+                    .unwrap()
+            })
+            .collect();
+        Pool { shared, workers }
+    }
+
+    pub fn threads(&self) -> usize {
+        self.shared.locals.len()
+    }
+
+    // Spawns futures that run at `priority`, whenever they're woken. Spawning on the pool itself
+    // is the same as `at(Priority::Normal)`.
+    pub fn at(&self, priority: Priority) -> PoolSpawner {
+        PoolSpawner {
+            shared: self.shared.clone(),
+            priority,
+        }
+    }
+
+    // Queues a C++ `RustPoolJob`, which must stay alive until it runs.
+    pub unsafe fn post_cxx_job(&self, job: *mut u8, priority: Priority) {
+        self.shared.push(Job::Cxx(CxxJob(job)), priority);
+    }
+}
+
+impl Spawn for Pool {
+    fn spawn_obj(&self, future: FutureObj<'static, ()>) -> Result<(), SpawnError> {
+        Task::spawn(future, Home::Pool(self.shared.clone(), Priority::Normal));
+        Ok(())
+    }
+}
+
+// Jobs still queued are dropped without running.
+impl Drop for Pool {
+    fn drop(&mut self) {
+        self.shared.shutdown.store(true, Ordering::Release);
+        {
+            let _guard = self.shared.sleep_lock.lock().unwrap();
+            self.shared.wakeup.notify_all();
+        }
+        for worker in self.workers.drain(..) {
+            worker.join().unwrap();
+        }
+    }
+}
+
+#[derive(Clone)]
+pub struct PoolSpawner {
+    shared: Arc<Shared>,
+    priority: Priority,
+}
+
+impl Spawn for PoolSpawner {
+    fn spawn_obj(&self, future: FutureObj<'static, ()>) -> Result<(), SpawnError> {
+        Task::spawn(future, Home::Pool(self.shared.clone(), self.priority));
+        Ok(())
+    }
+}
+
+// Spawns futures onto a C++ `RustTaskExecutor`, which must outlive them.
+#[derive(Clone, Copy)]
+pub struct CxxSpawner(*mut u8);
+
+unsafe impl Send for CxxSpawner {}
+unsafe impl Sync for CxxSpawner {}
+
+impl CxxSpawner {
+    pub unsafe fn new(executor: *mut u8) -> CxxSpawner {
+        CxxSpawner(executor)
+    }
+}
+
+impl Spawn for CxxSpawner {
+    fn spawn_obj(&self, future: FutureObj<'static, ()>) -> Result<(), SpawnError> {
+        Task::spawn(future, Home::Cxx(*self));
+        Ok(())
+    }
+}
+
+// Where a task runs whenever it's woken.
+enum Home {
+    Pool(Arc<Shared>, Priority),
+    Cxx(CxxSpawner),
+}
+
+// What a task is doing. Only the thread that moves a task from `QUEUED` to `POLLING` touches its
+// future, and nobody waits for it: a wake while it's polling just leaves `REPOLL` behind, and the
+// polling thread queues the task again once it's done.
+const IDLE: u8 = 0;
+const QUEUED: u8 = 1;
+const POLLING: u8 = 2;
+const REPOLL: u8 = 3;
+const COMPLETE: u8 = 4;
+
+// A spawned future. Waking it queues it on its home unless it's queued or polling already.
+struct Task {
+    future: UnsafeCell<Option<FutureObj<'static, ()>>>,
+    state: AtomicU8,
+    home: Home,
+}
+
+// `state` hands the future from thread to thread.
+unsafe impl Sync for Task {}
+
+impl Task {
+    fn spawn(future: FutureObj<'static, ()>, home: Home) {
+        let task = Arc::new(Task {
+            future: UnsafeCell::new(Some(future)),
+            state: AtomicU8::new(QUEUED),
+            home,
+        });
+        task.queue();
+    }
+
+    fn queue(self: Arc<Self>) {
+        match self.home {
+            Home::Pool(ref shared, priority) => shared.clone().push(Job::Rust(self), priority),
+            Home::Cxx(CxxSpawner(executor)) => unsafe {
+                ffi::rust_post_to_cxx_executor(executor, Arc::into_raw(self) as *mut u8)
+            },
+        }
+    }
+
+    fn run(self: Arc<Self>) {
+        let prev = self.state.swap(POLLING, Ordering::AcqRel);
+        debug_assert_eq!(prev, QUEUED);
+        let future = unsafe { &mut *self.future.get() };
+        let running = match future {
+            Some(running) => running,
+            None => return,
+        };
+        let waker = waker_ref(&self);
+        let mut context = Context::from_waker(&waker);
+        if Pin::new(running).poll(&mut context).is_ready() {
+            *future = None;
+            self.state.store(COMPLETE, Ordering::Release);
+            return;
+        }
+        // Woken while polling: queue again, rather than polling again here, so that a task that
+        // keeps waking itself still takes turns with the other jobs.
+        if self
+            .state
+            .compare_exchange(POLLING, IDLE, Ordering::AcqRel, Ordering::Acquire)
+            .is_err()
+        {
+            self.state.store(QUEUED, Ordering::Release);
+            self.queue();
+        }
+    }
+}
+
+impl ArcWake for Task {
+    fn wake_by_ref(arc_self: &Arc<Self>) {
+        let mut state = arc_self.state.load(Ordering::Acquire);
+        loop {
+            let next = match state {
+                IDLE => QUEUED,
+                POLLING => REPOLL,
+                _ => return,
+            };
+            match arc_self.state.compare_exchange_weak(
+                state,
+                next,
+                Ordering::AcqRel,
+                Ordering::Acquire,
+            ) {
+                Ok(_) if state == IDLE => return arc_self.clone().queue(),
+                Ok(_) => return,
+                Err(actual) => state = actual,
+            }
+        }
+    }
+}
+
+// Runs a task that `CxxSpawner` handed to C++.
+pub unsafe fn run_spawned_task(task: *mut u8) {
+    Arc::from_raw(task as *const Task).run();
+}
@@ -0,0 +1,470 @@
+// cxx-async/src/stream.rs
+//
+// A bounded, single-producer single-consumer channel for streams of values.
+//
+// Items go through a ring buffer, so a consumer that wakes up can drain everything the producer has
+// pushed in the meantime, and the producer only has to wake the consumer when it finds it waiting.
+// When the buffer is full the producer waits for the consumer to make room, which is how
+// backpressure crosses the language boundary.
+//
+// Like `oneshot`, the handles are zero-sized and their `Box`es point at the shared header, which is
+// freed by whichever side goes away last.
+
+use crate::handle;
+use crate::{CxxAsyncException, ERROR_CANCELLED};
+use futures::Stream;
+use std::cell::UnsafeCell;
+use std::hint;
+use std::marker::PhantomData;
+use std::mem::{self, MaybeUninit};
+use std::pin::Pin;
+use std::ptr;
+use std::sync::atomic::{self, AtomicUsize, Ordering};
+use std::task::{Context, Poll, Waker};
+
+pub const DEFAULT_CAPACITY: usize = 64;
+
+// The low two bits of the state word record how the sender finished. Only the sender ever moves
+// them out of `STATUS_OPEN`.
+const STATUS_MASK: usize = 0b11;
+const STATUS_OPEN: usize = 0;
+const STATUS_COMPLETE: usize = 1;
+const STATUS_ERROR: usize = 2;
+const STATUS_CANCELLED: usize = 3;
+
+// Set as soon as the receiver starts going away, so that the sender stops producing.
+const RECEIVER_CLOSED: usize = 1 << 2;
+const SENDER_GONE: usize = 1 << 3;
+const RECEIVER_GONE: usize = 1 << 4;
+
+const SLOT_EMPTY: usize = 0;
+const SLOT_REGISTERED: usize = 1;
+const SLOT_WAKING: usize = 2;
+
+// A place for one side to park its waker while it waits for the other. mpsc.rs uses it too.
+//
+// The waiting side registers and then rechecks its condition; the waking side changes the
+// condition and then checks the slot. Each pair is separated by a sequentially-consistent fence so
+// that at least one of them notices the other. Whichever side moves the slot out of registered
+// owns the waker, so it's woken at most once.
+pub(crate) struct WakerSlot {
+    state: AtomicUsize,
+    waker: UnsafeCell<MaybeUninit<Waker>>,
+}
+
+impl WakerSlot {
+    pub(crate) fn new() -> WakerSlot {
+        WakerSlot {
+            state: AtomicUsize::new(SLOT_EMPTY),
+            waker: UnsafeCell::new(MaybeUninit::uninit()),
+        }
+    }
+
+    // Called by the waiting side only. The caller must recheck its condition afterward.
+    pub(crate) unsafe fn register(&self, waker: &Waker) {
+        if self.state.load(Ordering::Acquire) == SLOT_REGISTERED {
+            if (*(*self.waker.get()).as_ptr()).will_wake(waker) {
+                return;
+            }
+            self.unregister();
+        }
+        (*self.waker.get()).as_mut_ptr().write(waker.clone());
+        self.state.store(SLOT_REGISTERED, Ordering::Release);
+        atomic::fence(Ordering::SeqCst);
+    }
+
+    // Called by the waiting side only. Returns true if the waker was still registered, in which
+    // case it's dropped; false means that the waking side has taken it and is going to wake it.
+    pub(crate) unsafe fn unregister(&self) -> bool {
+        match self.state.compare_exchange(
+            SLOT_REGISTERED,
+            SLOT_EMPTY,
+            Ordering::AcqRel,
+            Ordering::Acquire,
+        ) {
+            Ok(_) => {
+                ptr::drop_in_place((*self.waker.get()).as_mut_ptr());
+                true
+            }
+            Err(_) => {
+                // Wait for the waking side to finish reading the waker out of the slot, which is
+                // just a few instructions, so that the slot can be reused.
+                while self.state.load(Ordering::Acquire) == SLOT_WAKING {
+                    hint::spin_loop();
+                }
+                false
+            }
+        }
+    }
+
+    // Called by the waking side only, after it has changed the condition the waiter is waiting on.
+    pub(crate) unsafe fn wake(&self) {
+        atomic::fence(Ordering::SeqCst);
+        if self.state.load(Ordering::Relaxed) != SLOT_REGISTERED
+            || self
+                .state
+                .compare_exchange(
+                    SLOT_REGISTERED,
+                    SLOT_WAKING,
+                    Ordering::AcqRel,
+                    Ordering::Relaxed,
+                )
+                .is_err()
+        {
+            return;
+        }
+        let waker = ptr::read((*self.waker.get()).as_ptr());
+        self.state.store(SLOT_EMPTY, Ordering::Release);
+        waker.wake();
+    }
+}
+
+struct StreamChannel<T> {
+    state: AtomicUsize,
+    // Written only by the receiver.
+    head: AtomicUsize,
+    // Written only by the sender.
+    tail: AtomicUsize,
+    mask: usize,
+    buffer: Box<[UnsafeCell<MaybeUninit<T>>]>,
+    // Written by the sender before it sets `STATUS_ERROR`; taken by the receiver.
+    error: UnsafeCell<Option<CxxAsyncException>>,
+    // Only ever touched by the receiver.
+    finished: UnsafeCell<bool>,
+    receiver_waker: WakerSlot,
+    sender_waker: WakerSlot,
+}
+
+// See `oneshot::Sender` for why these are zero-sized with an `UnsafeCell`.
+pub struct Sender<T> {
+    phantom: PhantomData<T>,
+    _cell: UnsafeCell<()>,
+}
+
+pub struct Receiver<T> {
+    phantom: PhantomData<T>,
+    _cell: UnsafeCell<()>,
+}
+
+const _: () = assert!(mem::size_of::<Sender<()>>() == 0 && mem::size_of::<Receiver<()>>() == 0);
+
+unsafe impl<T> Send for Sender<T> where T: Send {}
+unsafe impl<T> Send for Receiver<T> where T: Send {}
+impl<T> Unpin for Receiver<T> {}
+
+pub enum TrySendError<T> {
+    Full(T),
+    Closed(T),
+}
+
+#[derive(Debug)]
+pub struct Closed;
+
+// Creates a channel that buffers up to `capacity` items, rounded up to a power of two.
+pub fn channel<T>(capacity: usize) -> (Box<Sender<T>>, Box<Receiver<T>>) {
+    let capacity = capacity.max(1).next_power_of_two();
+    let buffer = (0..capacity)
+        .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+        .collect();
+    let channel = handle::expose(Box::into_raw(Box::new(StreamChannel::<T> {
+        state: AtomicUsize::new(STATUS_OPEN),
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+        mask: capacity - 1,
+        buffer,
+        error: UnsafeCell::new(None),
+        finished: UnsafeCell::new(false),
+        receiver_waker: WakerSlot::new(),
+        sender_waker: WakerSlot::new(),
+    })));
+    unsafe {
+        (
+            Box::from_raw(channel as *mut Sender<T>),
+            Box::from_raw(channel as *mut Receiver<T>),
+        )
+    }
+}
+
+impl<T> StreamChannel<T> {
+    unsafe fn slot(&self, index: usize) -> *mut T {
+        (*self.buffer[index & self.mask].get()).as_mut_ptr()
+    }
+
+    unsafe fn close_receiver(&self) {
+        let prev = self.state.fetch_or(RECEIVER_CLOSED, Ordering::AcqRel);
+        if prev & RECEIVER_CLOSED == 0 {
+            self.sender_waker.wake();
+        }
+    }
+
+    // Called after one side has set its "gone" bit. Frees the channel if, as of `prev`, the other
+    // side was already gone.
+    unsafe fn release(this: *const StreamChannel<T>, prev: usize, other_gone: usize) {
+        if prev & other_gone == 0 {
+            return;
+        }
+        let channel = Box::from_raw(this as *mut StreamChannel<T>);
+        let (head, tail) = (
+            channel.head.load(Ordering::Relaxed),
+            channel.tail.load(Ordering::Relaxed),
+        );
+        for offset in 0..tail.wrapping_sub(head) {
+            ptr::drop_in_place(channel.slot(head.wrapping_add(offset)));
+        }
+    }
+}
+
+impl<T> Sender<T> {
+    fn channel(&self) -> *const StreamChannel<T> {
+        handle::shared(self)
+    }
+
+    // Waits until there's room for at least one item. Fails if the receiver has gone away.
+    pub fn poll_ready(&mut self, context: &mut Context) -> Poll<Result<(), Closed>> {
+        unsafe {
+            let channel = self.channel();
+            if let Some(result) = self.check_ready() {
+                return Poll::Ready(result);
+            }
+            (*channel).sender_waker.register(context.waker());
+            match self.check_ready() {
+                Some(result) if (*channel).sender_waker.unregister() => Poll::Ready(result),
+                _ => Poll::Pending,
+            }
+        }
+    }
+
+    // Resolves once the receiver has gone away or asked the sender to stop.
+    pub fn poll_closed(&mut self, context: &mut Context) -> Poll<()> {
+        unsafe {
+            let channel = self.channel();
+            if (*channel).state.load(Ordering::Acquire) & RECEIVER_CLOSED != 0 {
+                return Poll::Ready(());
+            }
+            (*channel).sender_waker.register(context.waker());
+            if (*channel).state.load(Ordering::Acquire) & RECEIVER_CLOSED != 0 {
+                (*channel).sender_waker.unregister();
+                return Poll::Ready(());
+            }
+            Poll::Pending
+        }
+    }
+
+    unsafe fn check_ready(&mut self) -> Option<Result<(), Closed>> {
+        let channel = self.channel();
+        if (*channel).state.load(Ordering::Acquire) & RECEIVER_CLOSED != 0 {
+            return Some(Err(Closed));
+        }
+        let tail = (*channel).tail.load(Ordering::Relaxed);
+        let head = (*channel).head.load(Ordering::Acquire);
+        if tail.wrapping_sub(head) <= (*channel).mask {
+            Some(Ok(()))
+        } else {
+            None
+        }
+    }
+
+    pub fn try_send(&mut self, value: T) -> Result<(), TrySendError<T>> {
+        unsafe {
+            match self.check_ready() {
+                None => return Err(TrySendError::Full(value)),
+                Some(Err(Closed)) => return Err(TrySendError::Closed(value)),
+                Some(Ok(())) => {}
+            }
+            let channel = self.channel();
+            let tail = (*channel).tail.load(Ordering::Relaxed);
+            (*channel).slot(tail).write(value);
+            (*channel)
+                .tail
+                .store(tail.wrapping_add(1), Ordering::Release);
+            (*channel).receiver_waker.wake();
+            Ok(())
+        }
+    }
+
+    // Ends the stream. Items already sent are still delivered before the end (or the error).
+    pub fn close(&mut self, result: Result<(), CxxAsyncException>) {
+        let status = match result {
+            Ok(()) => STATUS_COMPLETE,
+            Err(error) => {
+                unsafe { *(*self.channel()).error.get() = Some(error) };
+                STATUS_ERROR
+            }
+        };
+        unsafe { self.finish(status) }
+    }
+
+    unsafe fn finish(&mut self, status: usize) {
+        let channel = self.channel();
+        let prev = (*channel).state.fetch_or(status, Ordering::AcqRel);
+        debug_assert_eq!(prev & STATUS_MASK, STATUS_OPEN);
+        (*channel).receiver_waker.wake();
+    }
+}
+
+impl<T> Drop for Sender<T> {
+    fn drop(&mut self) {
+        let channel = self.channel();
+        unsafe {
+            // Only we move the status out of open, so this check can't race.
+            if (*channel).state.load(Ordering::Relaxed) & STATUS_MASK == STATUS_OPEN {
+                self.finish(STATUS_CANCELLED);
+            }
+            (*channel).sender_waker.unregister();
+            let prev = (*channel).state.fetch_or(SENDER_GONE, Ordering::AcqRel);
+            StreamChannel::release(channel, prev, RECEIVER_GONE);
+        }
+    }
+}
+
+impl<T> Receiver<T> {
+    fn channel(&self) -> *const StreamChannel<T> {
+        handle::shared(self)
+    }
+
+    // Tells the sender to stop producing items. Items already sent can still be received. Unlike
+    // the other methods, this may be called from any thread while the receiver is alive.
+    pub fn request_cancel(&self) {
+        unsafe { (*self.channel()).close_receiver() }
+    }
+
+    // Moves every item that's ready into `items`, waking the sender once if it was waiting for
+    // room. Returns the number of items moved.
+    pub fn drain_into(&mut self, items: &mut Vec<T>) -> usize {
+        unsafe {
+            let channel = self.channel();
+            let head = (*channel).head.load(Ordering::Relaxed);
+            let tail = (*channel).tail.load(Ordering::Acquire);
+            let count = tail.wrapping_sub(head);
+            if count == 0 {
+                return 0;
+            }
+            items.reserve(count);
+            for offset in 0..count {
+                items.push(ptr::read((*channel).slot(head.wrapping_add(offset))));
+            }
+            (*channel).head.store(tail, Ordering::Release);
+            (*channel).sender_waker.wake();
+            count
+        }
+    }
+
+    pub fn try_recv(&mut self) -> Option<T> {
+        unsafe {
+            let channel = self.channel();
+            let head = (*channel).head.load(Ordering::Relaxed);
+            if head == (*channel).tail.load(Ordering::Acquire) {
+                return None;
+            }
+            let value = ptr::read((*channel).slot(head));
+            (*channel)
+                .head
+                .store(head.wrapping_add(1), Ordering::Release);
+            (*channel).sender_waker.wake();
+            Some(value)
+        }
+    }
+
+    // Returns the end of the stream (`Some` with an error first if the sender failed or went away
+    // without closing) if the sender has closed the stream and every item has been received.
+    unsafe fn check_finished(&mut self) -> Option<Option<Result<T, CxxAsyncException>>> {
+        let channel = self.channel();
+        let state = (*channel).state.load(Ordering::Acquire);
+        if state & STATUS_MASK == STATUS_OPEN {
+            return None;
+        }
+        // The sender published its last item before closing, so this sees all of them.
+        if (*channel).head.load(Ordering::Relaxed) != (*channel).tail.load(Ordering::Acquire) {
+            return None;
+        }
+        if *(*channel).finished.get() {
+            return Some(None);
+        }
+        *(*channel).finished.get() = true;
+        Some(match state & STATUS_MASK {
+            STATUS_ERROR => Some(Err((*(*channel).error.get()).take().unwrap())),
+            STATUS_CANCELLED => Some(Err(CxxAsyncException::with_code(
+                ERROR_CANCELLED,
+                "Cancelled (sender dropped)",
+            ))),
+            _ => None,
+        })
+    }
+
+    // Returns the next item, an error, or the end of the stream, if any is available, without
+    // registering a waker.
+    pub fn try_next(&mut self) -> Poll<Option<Result<T, CxxAsyncException>>> {
+        if let Some(value) = self.try_recv() {
+            return Poll::Ready(Some(Ok(value)));
+        }
+        match unsafe { self.check_finished() } {
+            Some(end) => Poll::Ready(end),
+            None => Poll::Pending,
+        }
+    }
+
+    // Returns the next item, an error, or the end of the stream, if any is available; otherwise
+    // arranges for the context's waker to be woken once one is.
+    pub fn poll_recv(
+        &mut self,
+        context: &mut Context,
+    ) -> Poll<Option<Result<T, CxxAsyncException>>> {
+        unsafe {
+            loop {
+                if let Poll::Ready(next) = self.try_next() {
+                    return Poll::Ready(next);
+                }
+                let channel = self.channel();
+                (*channel).receiver_waker.register(context.waker());
+                let head = (*channel).head.load(Ordering::Relaxed);
+                if head == (*channel).tail.load(Ordering::Acquire)
+                    && (*channel).state.load(Ordering::Acquire) & STATUS_MASK == STATUS_OPEN
+                {
+                    return Poll::Pending;
+                }
+                if !(*channel).receiver_waker.unregister() {
+                    // The sender is already on its way to wake us.
+                    return Poll::Pending;
+                }
+            }
+        }
+    }
+
+    // Like `poll_recv`, but moves every ready item into `items` at once.
+    pub fn poll_recv_many(
+        &mut self,
+        context: &mut Context,
+        items: &mut Vec<T>,
+    ) -> Poll<Option<Result<usize, CxxAsyncException>>> {
+        match self.poll_recv(context) {
+            Poll::Ready(Some(Ok(value))) => {
+                items.push(value);
+                Poll::Ready(Some(Ok(1 + self.drain_into(items))))
+            }
+            Poll::Ready(Some(Err(error))) => Poll::Ready(Some(Err(error))),
+            Poll::Ready(None) => Poll::Ready(None),
+            Poll::Pending => Poll::Pending,
+        }
+    }
+}
+
+impl<T> Stream for Receiver<T> {
+    type Item = Result<T, CxxAsyncException>;
+    fn poll_next(self: Pin<&mut Self>, context: &mut Context) -> Poll<Option<Self::Item>> {
+        self.get_mut().poll_recv(context)
+    }
+}
+
+impl<T> Drop for Receiver<T> {
+    fn drop(&mut self) {
+        let channel = self.channel();
+        unsafe {
+            // Tell the sender to stop, and wake it if it's waiting, before we let go of the
+            // channel.
+            (*channel).close_receiver();
+            (*channel).receiver_waker.unregister();
+            let prev = (*channel).state.fetch_or(RECEIVER_GONE, Ordering::AcqRel);
+            StreamChannel::release(channel, prev, SENDER_GONE);
+        }
+    }
+}
@@ -0,0 +1,81 @@
+// cxx-async/src/stress.rs
+//
+// Stress tests for the handoff between C++ coroutines and Rust futures. Run with
+// `cargo run --release -- stress`.
+//
+// Each test would overflow the stack if a completion resumed its waiter from inside the
+// completing call instead of returning to a loop or transferring control symmetrically.
+
+use crate::oneshot;
+use crate::{CxxReceiver, RustOneshotReceiverF64, THREAD_POOL};
+use futures::executor;
+use futures::task::SpawnExt;
+use std::thread;
+use std::time::Instant;
+
+const PING_PONG_ITERATIONS: i32 = 1_000_000;
+const CHAIN_DEPTH: usize = 1_000_000;
+const CHAIN_THREADS: usize = 4;
+
+// Runs one C++ loop of `PING_PONG_ITERATIONS` awaits per thread, all at once.
+fn stress_ping_pong(threads: usize) {
+    let start = Instant::now();
+    let expected = (0..PING_PONG_ITERATIONS as i64).sum::<i64>() as f64;
+    let handles: Vec<_> = (0..threads)
+        .map(|_| {
+            thread::spawn(move || {
+                let receiver = crate::ffi::cxx_ping_pong_loop(PING_PONG_ITERATIONS);
+                assert_eq!(executor::block_on(receiver).unwrap().unwrap(), expected);
+            })
+        })
+        .collect();
+    for handle in handles {
+        handle.join().unwrap();
+    }
+    println!(
+        "{} threads x {} C++/Rust awaits: {:?}",
+        threads,
+        PING_PONG_ITERATIONS,
+        start.elapsed()
+    );
+}
+
+// Builds chains of `CHAIN_DEPTH` C++ coroutines, each awaiting the next through a Rust channel,
+// and completes the innermost from the thread pool.
+fn stress_chains(threads: usize) {
+    let start = Instant::now();
+    let handles: Vec<_> = (0..threads)
+        .map(|_| {
+            thread::spawn(|| {
+                let (mut sender, receiver) = oneshot::channel::<f64>();
+                let mut receiver: Box<RustOneshotReceiverF64> =
+                    CxxReceiver::from_receiver(receiver);
+                for _ in 0..CHAIN_DEPTH {
+                    receiver = crate::ffi::cxx_chain_link(receiver);
+                }
+                THREAD_POOL
+                    .spawn(async move { sender.send(Ok(0.0)) })
+                    .unwrap();
+                assert_eq!(
+                    executor::block_on(receiver).unwrap().unwrap(),
+                    CHAIN_DEPTH as f64
+                );
+            })
+        })
+        .collect();
+    for handle in handles {
+        handle.join().unwrap();
+    }
+    println!(
+        "{} chains x {} C++ coroutines: {:?}",
+        threads,
+        CHAIN_DEPTH,
+        start.elapsed()
+    );
+}
+
+pub fn run() {
+    let threads = thread::available_parallelism().map_or(4, |threads| threads.get());
+    stress_ping_pong(threads);
+    stress_chains(threads.min(CHAIN_THREADS));
+}
@@ -0,0 +1,530 @@
+// cxx-async/src/timer.rs
+//
+// Deadlines on bridged awaits, in both directions, from timer wheels that every runtime shares.
+// `with_timeout` puts a deadline on a Rust future, such as a C++ coroutine's receiver, and
+// `rust_deadline` in cxx_async.h puts one on a C++ await of a Rust receiver. Whichever side runs
+// out of time is cancelled: dropping a timed-out receiver cancels the C++ coroutine behind it, and
+// a timed-out C++ await cancels its receiver, which drops the Rust future behind it.
+//
+// The wheel ticks every millisecond and has `LEVELS` levels of `SLOTS` slots. Each slot is a
+// doubly linked list threaded through a slab of entries, so arming and disarming a timer are O(1)
+// and don't allocate once the slab has grown. A timer goes in the lowest level whose slots span
+// the time it has left. Whenever a level wraps around, the next level's current slot cascades
+// down. Timers never fire early, and fire at most about a tick late.
+//
+// There's a wheel per hardware thread, each behind its own lock, and each thread arms its timers on
+// the wheel that it was assigned the first time, so arming and disarming from different threads,
+// such as the pool's workers, don't contend. A disarm from another thread just takes that wheel's
+// lock. One thread of our own advances all the wheels, ticking only while timers are armed: pool
+// workers park indefinitely when idle, so they can't be counted on to tick, and threads outside the
+// pool, like C++ runtimes' and `block_on`'s, arm timers too.
+
+use crate::{ffi, CxxAsyncException, ERROR_TIMED_OUT};
+use futures::task::Waker;
+use once_cell::sync::Lazy;
+use std::cell::Cell;
+use std::error::Error;
+use std::fmt::{Display, Formatter, Result as FmtResult};
+use std::future::Future;
+use std::mem;
+use std::pin::Pin;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::{Condvar, Mutex, Once};
+use std::task::{Context, Poll};
+use std::thread;
+use std::time::{Duration, Instant};
+
+const SLOT_BITS: u32 = 6;
+const SLOTS: usize = 1 << SLOT_BITS;
+// With millisecond ticks, four levels span about 4.6 hours. Later deadlines wait in the top level
+// and are placed again each time they cascade.
+const LEVELS: usize = 4;
+const TICK: Duration = Duration::from_millis(1);
+
+const NIL: u32 = u32::MAX;
+
+// What an expired timer does.
+enum Action {
+    Wake(Waker),
+    // Calls `expire()` on a C++ `RustTimerTarget`.
+    Cxx(CxxTarget),
+}
+
+struct CxxTarget(*mut u8);
+
+unsafe impl Send for CxxTarget {}
+
+impl Action {
+    fn fire(self) {
+        match self {
+            Action::Wake(waker) => waker.wake(),
+            Action::Cxx(CxxTarget(target)) => unsafe { ffi::rust_expire_cxx_timer(target) },
+        }
+    }
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum EntryState {
+    Free,
+    Armed,
+    // Taken off the wheel by the timer thread, which is running its action.
+    Firing,
+}
+
+struct Entry {
+    deadline: u64,
+    // Links within the entry's slot while armed; `next` links the free list otherwise.
+    prev: u32,
+    next: u32,
+    level: u8,
+    slot: u8,
+    state: EntryState,
+    // Whether the action is `Action::Cxx`, which a disarm has to wait out if it's firing.
+    cxx: bool,
+    // Bumped whenever the entry is freed, so that stale handles don't match.
+    generation: u32,
+    action: Option<Action>,
+}
+
+struct Wheel {
+    // The last tick that the wheel has processed.
+    now: u64,
+    heads: [[u32; SLOTS]; LEVELS],
+    entries: Vec<Entry>,
+    free: u32,
+    armed: usize,
+}
+
+impl Wheel {
+    fn new() -> Wheel {
+        Wheel {
+            now: 0,
+            heads: [[NIL; SLOTS]; LEVELS],
+            entries: vec![],
+            free: NIL,
+            armed: 0,
+        }
+    }
+
+    fn allocate(&mut self) -> u32 {
+        if self.free != NIL {
+            let index = self.free;
+            self.free = self.entries[index as usize].next;
+            return index;
+        }
+        self.entries.push(Entry {
+            deadline: 0,
+            prev: NIL,
+            next: NIL,
+            level: 0,
+            slot: 0,
+            state: EntryState::Free,
+            cxx: false,
+            generation: 0,
+            action: None,
+        });
+        (self.entries.len() - 1) as u32
+    }
+
+    fn release(&mut self, index: u32) {
+        let entry = &mut self.entries[index as usize];
+        entry.state = EntryState::Free;
+        entry.generation = entry.generation.wrapping_add(1);
+        entry.action = None;
+        entry.next = self.free;
+        self.free = index;
+    }
+
+    // Puts an entry in the slot for its deadline, which must be after `now`.
+    fn link(&mut self, index: u32) {
+        let deadline = self.entries[index as usize].deadline;
+        // The highest group of bits in which the deadline differs from now picks the level.
+        let differing = 63 - (deadline ^ self.now).leading_zeros();
+        let mut level = (differing / SLOT_BITS) as usize;
+        let slot = if level < LEVELS {
+            (deadline >> (SLOT_BITS * level as u32)) as usize % SLOTS
+        } else {
+            // Too far out: park it in the last top-level slot to come around.
+            level = LEVELS - 1;
+            ((self.now >> (SLOT_BITS * level as u32)) as usize + SLOTS - 1) % SLOTS
+        };
+
+        let head = self.heads[level][slot];
+        {
+            let entry = &mut self.entries[index as usize];
+            entry.level = level as u8;
+            entry.slot = slot as u8;
+            entry.prev = NIL;
+            entry.next = head;
+        }
+        if head != NIL {
+            self.entries[head as usize].prev = index;
+        }
+        self.heads[level][slot] = index;
+    }
+
+    fn unlink(&mut self, index: u32) {
+        let (prev, next, level, slot) = {
+            let entry = &self.entries[index as usize];
+            (
+                entry.prev,
+                entry.next,
+                entry.level as usize,
+                entry.slot as usize,
+            )
+        };
+        match prev {
+            NIL => self.heads[level][slot] = next,
+            prev => self.entries[prev as usize].next = next,
+        }
+        if next != NIL {
+            self.entries[next as usize].prev = prev;
+        }
+    }
+
+    // Returns the entry's index and generation.
+    fn arm(&mut self, deadline: u64, action: Action) -> (u32, u32) {
+        let index = self.allocate();
+        assert!(index <= MAX_INDEX, "too many timers armed");
+        {
+            let entry = &mut self.entries[index as usize];
+            entry.deadline = deadline.max(self.now + 1);
+            entry.state = EntryState::Armed;
+            entry.cxx = matches!(action, Action::Cxx(_));
+            entry.action = Some(action);
+        }
+        self.link(index);
+        self.armed += 1;
+        (index, self.entries[index as usize].generation)
+    }
+
+    // Advances to tick `target`, moving the actions of expired timers into `expired`.
+    fn advance(&mut self, target: u64, expired: &mut Vec<(u32, Action)>) {
+        while self.now < target {
+            if self.armed == 0 {
+                self.now = target;
+                return;
+            }
+            self.now += 1;
+            for level in (1..LEVELS).rev() {
+                let shift = SLOT_BITS * level as u32;
+                if self.now & ((1 << shift) - 1) == 0 {
+                    let slot = (self.now >> shift) as usize % SLOTS;
+                    self.cascade(level, slot, expired);
+                }
+            }
+            self.cascade(0, self.now as usize % SLOTS, expired);
+        }
+    }
+
+    // Places every entry in a slot again, relative to the new `now`, expiring those that are due.
+    fn cascade(&mut self, level: usize, slot: usize, expired: &mut Vec<(u32, Action)>) {
+        let mut index = mem::replace(&mut self.heads[level][slot], NIL);
+        while index != NIL {
+            let next = self.entries[index as usize].next;
+            if self.entries[index as usize].deadline <= self.now {
+                let entry = &mut self.entries[index as usize];
+                entry.state = EntryState::Firing;
+                expired.push((index, entry.action.take().unwrap()));
+                self.armed -= 1;
+            } else {
+                self.link(index);
+            }
+            index = next;
+        }
+    }
+}
+
+// Handles pack the entry's index plus one, its wheel, and the low bits of its generation. They're
+// never zero, so C++ can use zero for no timer.
+const INDEX_BITS: u32 = 32;
+const WHEEL_BITS: u32 = 8;
+const MAX_INDEX: u32 = u32::MAX - 1;
+const MAX_WHEELS: usize = 1 << WHEEL_BITS;
+const GENERATION_MASK: u32 = (1 << (64 - INDEX_BITS - WHEEL_BITS)) - 1;
+
+fn handle(wheel: usize, index: u32, generation: u32) -> u64 {
+    ((generation & GENERATION_MASK) as u64) << (INDEX_BITS + WHEEL_BITS)
+        | (wheel as u64) << INDEX_BITS
+        | (index as u64 + 1)
+}
+
+fn split_handle(handle: u64) -> (usize, u32, u32) {
+    (
+        (handle >> INDEX_BITS) as usize % MAX_WHEELS,
+        (handle as u32).wrapping_sub(1),
+        (handle >> (INDEX_BITS + WHEEL_BITS)) as u32,
+    )
+}
+
+// Padded so that neighboring wheels' locks don't share a cache line.
+#[repr(align(64))]
+struct Shard {
+    wheel: Mutex<Wheel>,
+    // Wakes threads waiting for a firing timer to finish; see `disarm`.
+    fired: Condvar,
+}
+
+struct Timers {
+    shards: Vec<Shard>,
+    // Hands out wheels to threads as they first arm a timer.
+    next_shard: AtomicUsize,
+    // Set by the timer thread, with `idle` locked, before it checks the wheels one last time and
+    // waits on `armed`. Threads that arm a timer read it with their wheel locked.
+    sleeping: AtomicBool,
+    idle: Mutex<()>,
+    armed: Condvar,
+    start: Instant,
+    thread: Once,
+}
+
+static TIMERS: Lazy<Timers> = Lazy::new(|| {
+    let shards = thread::available_parallelism()
+        .map_or(1, |threads| threads.get())
+        .min(MAX_WHEELS);
+    Timers {
+        shards: (0..shards)
+            .map(|_| Shard {
+                wheel: Mutex::new(Wheel::new()),
+                fired: Condvar::new(),
+            })
+            .collect(),
+        next_shard: AtomicUsize::new(0),
+        sleeping: AtomicBool::new(false),
+        idle: Mutex::new(()),
+        armed: Condvar::new(),
+        start: Instant::now(),
+        thread: Once::new(),
+    }
+});
+
+thread_local! {
+    static ON_TIMER_THREAD: Cell<bool> = Cell::new(false);
+    // The wheel that this thread arms timers on, or `usize::MAX` until it arms one.
+    static SHARD: Cell<usize> = Cell::new(usize::MAX);
+}
+
+impl Timers {
+    // The tick that `instant` falls in, rounded down, or up for deadlines.
+    fn tick(&self, instant: Instant, round_up: bool) -> u64 {
+        let elapsed = instant.saturating_duration_since(self.start);
+        let ticks = elapsed.as_nanos() / TICK.as_nanos();
+        let partial = round_up && elapsed.as_nanos() % TICK.as_nanos() != 0;
+        ticks as u64 + partial as u64
+    }
+
+    fn shard(&self) -> usize {
+        SHARD.with(|shard| {
+            if shard.get() == usize::MAX {
+                shard.set(self.next_shard.fetch_add(1, Ordering::Relaxed) % self.shards.len());
+            }
+            shard.get()
+        })
+    }
+
+    fn arm(&'static self, deadline: Instant, action: Action) -> u64 {
+        self.thread.call_once(|| {
+            thread::Builder::new()
+                .name("cxx-async-timer".to_owned())
+                .spawn(move || self.run())
+                .unwrap();
+        });
+        let deadline = self.tick(deadline, true);
+        let shard = self.shard();
+        let mut wheel = self.shards[shard].wheel.lock().unwrap();
+        let (index, generation) = wheel.arm(deadline, action);
+        // The timer thread sets this before it checks our wheel under the lock, so either it sees
+        // our timer or we see that it's going to sleep.
+        let sleeping = self.sleeping.load(Ordering::Relaxed);
+        drop(wheel);
+        if sleeping {
+            let _idle = self.idle.lock().unwrap();
+            self.sleeping.store(false, Ordering::Relaxed);
+            self.armed.notify_one();
+        }
+        handle(shard, index, generation)
+    }
+
+    // Returns true if the timer was disarmed before it fired. If it's firing a C++ target right
+    // now on the timer thread, waits for that to finish first, so that the target is no longer in
+    // use, unless the target itself is what's disarming it. A firing waker needs no waiting out,
+    // since it refers to nothing of the caller's.
+    fn disarm(&self, timer: u64) -> bool {
+        let (shard, index, generation) = split_handle(timer);
+        let shard = &self.shards[shard];
+        let mut wheel = shard.wheel.lock().unwrap();
+        loop {
+            let entry = &wheel.entries[index as usize];
+            if entry.generation & GENERATION_MASK != generation {
+                return false;
+            }
+            match entry.state {
+                EntryState::Armed => {
+                    wheel.unlink(index);
+                    wheel.release(index);
+                    wheel.armed -= 1;
+                    return true;
+                }
+                EntryState::Firing if entry.cxx && !ON_TIMER_THREAD.with(Cell::get) => {
+                    wheel = shard.fired.wait(wheel).unwrap();
+                }
+                _ => return false,
+            }
+        }
+    }
+
+    fn run(&self) {
+        ON_TIMER_THREAD.with(|on_timer_thread| on_timer_thread.set(true));
+        let mut expired = vec![];
+        loop {
+            let now = self.tick(Instant::now(), false);
+            let mut armed = false;
+            for shard in &self.shards {
+                armed |= self.advance(shard, now, &mut expired);
+            }
+            if armed {
+                let next_tick =
+                    self.start + Duration::from_nanos((now + 1) * TICK.as_nanos() as u64);
+                thread::sleep(next_tick.saturating_duration_since(Instant::now()));
+                continue;
+            }
+
+            let idle = self.idle.lock().unwrap();
+            self.sleeping.store(true, Ordering::Relaxed);
+            if self
+                .shards
+                .iter()
+                .all(|shard| shard.wheel.lock().unwrap().armed == 0)
+            {
+                let _idle = self.armed.wait(idle).unwrap();
+            }
+            self.sleeping.store(false, Ordering::Relaxed);
+        }
+    }
+
+    // Advances a wheel to tick `now` and runs the actions of its expired timers, without the lock,
+    // since they may arm or disarm timers themselves, and then frees their entries. Returns true
+    // if the wheel still has timers armed.
+    fn advance(&self, shard: &Shard, now: u64, expired: &mut Vec<(u32, Action)>) -> bool {
+        let mut wheel = shard.wheel.lock().unwrap();
+        wheel.advance(now, expired);
+        if expired.is_empty() {
+            return wheel.armed != 0;
+        }
+        drop(wheel);
+        let mut indices = Vec::with_capacity(expired.len());
+        for (index, action) in expired.drain(..) {
+            action.fire();
+            indices.push(index);
+        }
+        let mut wheel = shard.wheel.lock().unwrap();
+        for index in indices {
+            wheel.release(index);
+        }
+        shard.fired.notify_all();
+        wheel.armed != 0
+    }
+}
+
+// A future with a deadline; see `with_timeout`.
+pub struct Timeout<F> {
+    future: F,
+    deadline: Instant,
+    // The armed timer, and the waker that it wakes.
+    timer: Option<(u64, Waker)>,
+}
+
+// What a `Timeout` resolves to once its deadline passes.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Elapsed;
+
+impl Display for Elapsed {
+    fn fmt(&self, formatter: &mut Formatter) -> FmtResult {
+        formatter.write_str("Timed out")
+    }
+}
+
+impl Error for Elapsed {}
+
+impl From<Elapsed> for CxxAsyncException {
+    fn from(_: Elapsed) -> Self {
+        CxxAsyncException::with_code(ERROR_TIMED_OUT, "Timed out")
+    }
+}
+
+// Resolves to `future`'s output, or to `Elapsed` if it doesn't finish within `timeout`. The
+// future stays inside the `Timeout`, so dropping that after it times out cancels the future.
+pub fn with_timeout<F>(future: F, timeout: Duration) -> Timeout<F>
+where
+    F: Future,
+{
+    with_deadline(future, Instant::now() + timeout)
+}
+
+pub fn with_deadline<F>(future: F, deadline: Instant) -> Timeout<F>
+where
+    F: Future,
+{
+    Timeout {
+        future,
+        deadline,
+        timer: None,
+    }
+}
+
+impl<F> Timeout<F> {
+    fn disarm(&mut self) {
+        if let Some((timer, _)) = self.timer.take() {
+            disarm(timer);
+        }
+    }
+}
+
+impl<F> Future for Timeout<F>
+where
+    F: Future,
+{
+    type Output = Result<F::Output, Elapsed>;
+
+    fn poll(self: Pin<&mut Self>, context: &mut Context) -> Poll<Self::Output> {
+        // The future is pinned along with us; nothing else is.
+        let this = unsafe { self.get_unchecked_mut() };
+        let future = unsafe { Pin::new_unchecked(&mut this.future) };
+        if let Poll::Ready(output) = future.poll(context) {
+            this.disarm();
+            return Poll::Ready(Ok(output));
+        }
+        if Instant::now() >= this.deadline {
+            this.disarm();
+            return Poll::Ready(Err(Elapsed));
+        }
+
+        match this.timer {
+            Some((_, ref waker)) if waker.will_wake(context.waker()) => {}
+            _ => {
+                this.disarm();
+                let waker = context.waker().clone();
+                let timer = TIMERS.arm(this.deadline, Action::Wake(waker.clone()));
+                this.timer = Some((timer, waker));
+            }
+        }
+        Poll::Pending
+    }
+}
+
+impl<F> Drop for Timeout<F> {
+    fn drop(&mut self) {
+        self.disarm();
+    }
+}
+
+// Arms a timer that calls `expire()` on a C++ `RustTimerTarget` once `timeout` has passed, for
+// `rust_arm_timer` in cxx_async.h. Returns the timer, which is never zero.
+pub unsafe fn arm_cxx(timeout: Duration, target: *mut u8) -> u64 {
+    TIMERS.arm(Instant::now() + timeout, Action::Cxx(CxxTarget(target)))
+}
+
+// Returns true if the timer hadn't fired yet. See `Timers::disarm`.
+pub fn disarm(timer: u64) -> bool {
+    TIMERS.disarm(timer)
+}
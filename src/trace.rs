@@ -0,0 +1,319 @@
+// cxx-async/src/trace.rs
+//
+// Optional tracing of calls as they cross the bridge, for finding where the time goes when a call
+// bounces between runtimes. Build with `--features tracing` to turn it on; without it, everything
+// here compiles to nothing.
+//
+// Every oneshot channel gets a span ID when it's created, and the span follows the call: the Rust
+// task that `CxxAsync::via` spawns and the C++ coroutine behind a `RustOneshotPromise` both run
+// under the span of the channel that they complete. Each stretch of running is a slice, from
+// `Resumed` to `Suspended`. The bridge records:
+//
+// * `Created`: a channel, and so a span, was made while `related` was running.
+// * `Resumed`, `Suspended`: the span's task or coroutine started or stopped running. `related` is
+//   the channel that woke it or that it's about to wait on, if the bridge knows.
+// * `Woken`: the span's channel completed with someone waiting on it.
+// * `Completed`: the span's channel completed.
+//
+// So the gap from `Woken` to the waiter's next `Resumed` is time spent queued in the waiter's
+// runtime. Events go into a ring buffer per thread, which keeps the last `RING_CAPACITY` events,
+// and `write_chrome_trace` writes them all out as JSON for chrome://tracing or Perfetto. C++
+// records its events through `rust_trace` in cxx_async.h.
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(u8)]
+pub enum Event {
+    Created = 0,
+    Resumed = 1,
+    Suspended = 2,
+    Woken = 3,
+    Completed = 4,
+}
+
+impl Event {
+    // Keep in sync with `RustTraceEvent` in cxx_async.h.
+    pub fn from_cxx(event: u8) -> Event {
+        match event {
+            0 => Event::Created,
+            1 => Event::Resumed,
+            2 => Event::Suspended,
+            3 => Event::Woken,
+            _ => Event::Completed,
+        }
+    }
+}
+
+#[cfg(not(feature = "tracing"))]
+mod disabled {
+    use super::Event;
+
+    #[inline(always)]
+    pub fn new_span() -> u64 {
+        0
+    }
+
+    #[inline(always)]
+    pub fn record(_: Event, _: u64, _: u64) {}
+
+    #[inline(always)]
+    pub fn current() -> u64 {
+        0
+    }
+
+    #[inline(always)]
+    pub fn enter(_: u64) -> u64 {
+        0
+    }
+
+    #[inline(always)]
+    pub fn note_awaiting(_: u64) {}
+
+    #[inline(always)]
+    pub fn take_awaiting() -> u64 {
+        0
+    }
+
+    pub fn write_chrome_trace() {}
+}
+
+#[cfg(not(feature = "tracing"))]
+pub use self::disabled::*;
+
+#[cfg(feature = "tracing")]
+pub use self::enabled::*;
+
+#[cfg(feature = "tracing")]
+mod enabled {
+    use super::Event;
+    use once_cell::sync::Lazy;
+    use std::cell::Cell;
+    use std::collections::HashSet;
+    use std::env;
+    use std::fs::File;
+    use std::io::{BufWriter, Result as IoResult, Write};
+    use std::sync::atomic::{AtomicU64, Ordering};
+    use std::sync::{Arc, Mutex};
+    use std::thread;
+    use std::time::Instant;
+
+    // About 2 MiB per thread once full.
+    const RING_CAPACITY: usize = 1 << 16;
+
+    #[derive(Clone, Copy)]
+    struct Record {
+        ns: u64,
+        span: u64,
+        related: u64,
+        event: Event,
+    }
+
+    // Only the owning thread writes its ring, so the lock is uncontended except while exporting.
+    struct Ring {
+        thread: String,
+        records: Mutex<RingRecords>,
+    }
+
+    struct RingRecords {
+        records: Vec<Record>,
+        // Where the next record goes once `records` is full.
+        next: usize,
+    }
+
+    static EPOCH: Lazy<Instant> = Lazy::new(Instant::now);
+    static NEXT_SPAN: AtomicU64 = AtomicU64::new(1);
+    // Rings outlive their threads, so that their events still get exported.
+    static RINGS: Lazy<Mutex<Vec<Arc<Ring>>>> = Lazy::new(|| Mutex::new(vec![]));
+
+    thread_local! {
+        static RING: Arc<Ring> = {
+            let ring = Arc::new(Ring {
+                thread: thread::current().name().unwrap_or("unnamed").to_owned(),
+                records: Mutex::new(RingRecords { records: vec![], next: 0 }),
+            });
+            RINGS.lock().unwrap().push(ring.clone());
+            ring
+        };
+        // The span running on this thread, or zero.
+        static CURRENT: Cell<u64> = Cell::new(0);
+        // The channel that a Rust task's last poll left it waiting on.
+        static AWAITING: Cell<u64> = Cell::new(0);
+    }
+
+    pub fn new_span() -> u64 {
+        NEXT_SPAN.fetch_add(1, Ordering::Relaxed)
+    }
+
+    pub fn record(event: Event, span: u64, related: u64) {
+        let record = Record {
+            ns: EPOCH.elapsed().as_nanos() as u64,
+            span,
+            related,
+            event,
+        };
+        let _ = RING.try_with(|ring| {
+            let mut records = ring.records.lock().unwrap();
+            if records.records.len() < RING_CAPACITY {
+                records.records.push(record);
+            } else {
+                let next = records.next;
+                records.records[next] = record;
+                records.next = (next + 1) % RING_CAPACITY;
+            }
+        });
+    }
+
+    pub fn current() -> u64 {
+        CURRENT.try_with(Cell::get).unwrap_or(0)
+    }
+
+    // Makes `span` the one running on this thread, returning the one that was.
+    pub fn enter(span: u64) -> u64 {
+        CURRENT
+            .try_with(|current| current.replace(span))
+            .unwrap_or(0)
+    }
+
+    // Called by a Rust receiver that's about to return `Pending`.
+    pub fn note_awaiting(channel: u64) {
+        let _ = AWAITING.try_with(|awaiting| awaiting.set(channel));
+    }
+
+    pub fn take_awaiting() -> u64 {
+        AWAITING
+            .try_with(|awaiting| awaiting.replace(0))
+            .unwrap_or(0)
+    }
+
+    // Writes every thread's events to the file named by `CXX_ASYNC_TRACE`, or else to
+    // `cxx-async-trace.json`.
+    pub fn write_chrome_trace() {
+        let path =
+            env::var("CXX_ASYNC_TRACE").unwrap_or_else(|_| "cxx-async-trace.json".to_owned());
+        match File::create(&path).and_then(|file| export_chrome(&mut BufWriter::new(file))) {
+            Ok(()) => println!("wrote trace to {}", path),
+            Err(error) => eprintln!("couldn't write trace to {}: {}", path, error),
+        }
+    }
+
+    // Writes the trace in the Chrome trace event format. Each slice is a duration event named
+    // after its span. Flow arrows link each span's creation to its first slice, and each wake to
+    // the slice that it resumed.
+    pub fn export_chrome<W>(out: &mut W) -> IoResult<()>
+    where
+        W: Write,
+    {
+        let rings = RINGS.lock().unwrap().clone();
+        // Flow starts have to come before their ends, whichever thread they're on.
+        let mut records = vec![];
+        for (tid, ring) in rings.iter().enumerate() {
+            let ring_records = ring.records.lock().unwrap();
+            let (older, newer) = ring_records.records.split_at(ring_records.next);
+            records.extend(newer.iter().chain(older).map(|&record| (tid, record)));
+        }
+        records.sort_by_key(|&(_, record)| record.ns);
+
+        writeln!(out, "{{\"traceEvents\":[")?;
+        let mut first = true;
+        let mut separator = |out: &mut W| -> IoResult<()> {
+            if !first {
+                writeln!(out, ",")?;
+            }
+            first = false;
+            Ok(())
+        };
+
+        for (tid, ring) in rings.iter().enumerate() {
+            separator(out)?;
+            write!(
+                out,
+                "{{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":{},\
+                 \"args\":{{\"name\":\"{}\"}}}}",
+                tid,
+                ring.thread.replace('\\', "\\\\").replace('"', "\\\"")
+            )?;
+        }
+
+        // Flow IDs: `2 * span` for creation, `2 * span + 1` for wakes.
+        let mut started = HashSet::new();
+        for (tid, record) in records {
+            let Record {
+                ns,
+                span,
+                related,
+                event,
+            } = record;
+            let ts = ns as f64 / 1000.0;
+            let common = format!("\"pid\":1,\"tid\":{},\"ts\":{:.3}", tid, ts);
+            separator(out)?;
+            match event {
+                Event::Created => {
+                    write!(
+                        out,
+                        "{{\"ph\":\"i\",\"s\":\"t\",\"name\":\"created {}\",{},\
+                         \"args\":{{\"span\":{},\"parent\":{}}}}},\n\
+                         {{\"ph\":\"s\",\"cat\":\"call\",\"name\":\"call\",\"id\":{},{}}}",
+                        span,
+                        common,
+                        span,
+                        related,
+                        2 * span,
+                        common
+                    )?;
+                }
+                Event::Resumed => {
+                    write!(
+                        out,
+                        "{{\"ph\":\"B\",\"cat\":\"bridge\",\"name\":\"span {}\",{},\
+                         \"args\":{{\"span\":{},\"woken_by\":{}}}}}",
+                        span, common, span, related
+                    )?;
+                    if started.insert(span) {
+                        write!(
+                            out,
+                            ",\n{{\"ph\":\"f\",\"bp\":\"e\",\"cat\":\"call\",\"name\":\"call\",\
+                             \"id\":{},{}}}",
+                            2 * span,
+                            common
+                        )?;
+                    }
+                    if related != 0 {
+                        write!(
+                            out,
+                            ",\n{{\"ph\":\"f\",\"bp\":\"e\",\"cat\":\"wake\",\"name\":\"wake\",\
+                             \"id\":{},{}}}",
+                            2 * related + 1,
+                            common
+                        )?;
+                    }
+                }
+                Event::Suspended => {
+                    write!(
+                        out,
+                        "{{\"ph\":\"E\",{},\"args\":{{\"awaiting\":{}}}}}",
+                        common, related
+                    )?;
+                }
+                Event::Woken => {
+                    write!(
+                        out,
+                        "{{\"ph\":\"i\",\"s\":\"t\",\"name\":\"woken {}\",{}}},\n\
+                         {{\"ph\":\"s\",\"cat\":\"wake\",\"name\":\"wake\",\"id\":{},{}}}",
+                        span,
+                        common,
+                        2 * span + 1,
+                        common
+                    )?;
+                }
+                Event::Completed => {
+                    write!(
+                        out,
+                        "{{\"ph\":\"i\",\"s\":\"t\",\"name\":\"completed {}\",{}}}",
+                        span, common
+                    )?;
+                }
+            }
+        }
+        writeln!(out, "\n]}}")?;
+        out.flush()
+    }
+}